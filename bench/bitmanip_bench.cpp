@@ -0,0 +1,159 @@
+#include "cpu.h"
+#include "config.h"
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+
+// Runs each kernel as a guest loop twice, once written with base RV64IM
+// instructions and once with Zba/Zbb/Zbs, and reports the host time per
+// loop iteration and the share of base instructions that ran as fused pairs.
+// Both versions must leave the same result in a1.
+
+static constexpr uint32_t OP = 0x33;
+static constexpr uint32_t OP_IMM = 0x13;
+static constexpr uint32_t OP_32 = 0x3b;
+static constexpr uint32_t BRANCH = 0x63;
+
+// Registers
+static constexpr uint32_t zero = 0, t0 = 5, t1 = 6, a0 = 10, a1 = 11, a2 = 12;
+static constexpr uint32_t s4 = 20, s5 = 21, s6 = 22, s7 = 23;
+
+static uint32_t R(uint32_t funct7, uint32_t rs2, uint32_t rs1, uint32_t funct3, uint32_t rd, uint32_t opcode = OP)
+{
+  return (funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+
+static uint32_t I(uint32_t imm, uint32_t rs1, uint32_t funct3, uint32_t rd, uint32_t opcode = OP_IMM)
+{
+  return ((imm & 0xfff) << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+
+static uint32_t Bne(uint32_t rs1, uint32_t rs2, int32_t offset)
+{
+  const uint32_t imm = static_cast<uint32_t>(offset);
+  return (((imm >> 12) & 1) << 31) | (((imm >> 5) & 0x3f) << 25) | (rs2 << 20) | (rs1 << 15) | (1 << 12)
+       | (((imm >> 1) & 0xf) << 8) | (((imm >> 11) & 1) << 7) | BRANCH;
+}
+
+static uint32_t Add(uint32_t rd, uint32_t rs1, uint32_t rs2) { return R(0x00, rs2, rs1, 0b000, rd); }
+static uint32_t Sub(uint32_t rd, uint32_t rs1, uint32_t rs2) { return R(0x20, rs2, rs1, 0b000, rd); }
+static uint32_t And(uint32_t rd, uint32_t rs1, uint32_t rs2) { return R(0x00, rs2, rs1, 0b111, rd); }
+static uint32_t Or(uint32_t rd, uint32_t rs1, uint32_t rs2) { return R(0x00, rs2, rs1, 0b110, rd); }
+static uint32_t Mul(uint32_t rd, uint32_t rs1, uint32_t rs2) { return R(0x01, rs2, rs1, 0b000, rd); }
+static uint32_t Addi(uint32_t rd, uint32_t rs1, int32_t imm) { return I(imm, rs1, 0b000, rd); }
+static uint32_t Slli(uint32_t rd, uint32_t rs1, uint32_t shamt) { return I(shamt, rs1, 0b001, rd); }
+static uint32_t Srli(uint32_t rd, uint32_t rs1, uint32_t shamt) { return I(shamt, rs1, 0b101, rd); }
+static uint32_t Andi(uint32_t rd, uint32_t rs1, int32_t imm) { return I(imm, rs1, 0b111, rd); }
+static uint32_t Ori(uint32_t rd, uint32_t rs1, int32_t imm) { return I(imm, rs1, 0b110, rd); }
+
+static uint32_t Cpop(uint32_t rd, uint32_t rs1) { return I(0x602, rs1, 0b001, rd); }
+static uint32_t Rori(uint32_t rd, uint32_t rs1, uint32_t shamt) { return I(0x600 | shamt, rs1, 0b101, rd); }
+static uint32_t Sh3add(uint32_t rd, uint32_t rs1, uint32_t rs2) { return R(0x10, rs2, rs1, 0b110, rd); }
+static uint32_t Bseti(uint32_t rd, uint32_t rs1, uint32_t shamt) { return I(0x280 | shamt, rs1, 0b001, rd); }
+static uint32_t AddUw(uint32_t rd, uint32_t rs1, uint32_t rs2) { return R(0x04, rs2, rs1, 0b000, rd, OP_32); }
+
+typedef struct Kernel
+{
+  const char* name;
+  std::vector<uint32_t> base;
+  std::vector<uint32_t> bitmanip;
+} Kernel;
+
+static constexpr uint64_t iterations = 2000000;
+
+// Returns nanoseconds per iteration, the loop body is followed by the counter
+// decrement and the backwards branch. fused is the share of retired instructions
+// that were half of a fused pair.
+static double RunLoop(const std::vector<uint32_t>& body, uint64_t& result, double& fused)
+{
+  const int32_t length = static_cast<int32_t>(body.size());
+  std::vector<uint32_t> program(body.begin(), body.end());
+  program.insert(program.end(), {Addi(a2, a2, -1), Bne(a2, zero, -4 * (length + 1)), 0x0000006f}); // j .
+
+  auto binary = std::make_shared<std::vector<uint8_t>>(program.size() * 4);
+  std::memcpy(binary->data(), program.data(), binary->size());
+  CPU cpu(binary, KERNBASE);
+  cpu.SetReg(a0, 0x0123456789abcdef);
+  cpu.SetReg(a2, iterations);
+  cpu.SetReg(s4, 0x5555555555555555);
+  cpu.SetReg(s5, 0x3333333333333333);
+  cpu.SetReg(s6, 0x0f0f0f0f0f0f0f0f);
+  cpu.SetReg(s7, 0x0101010101010101);
+
+  const auto start = std::chrono::steady_clock::now();
+  const uint64_t executed = cpu.RunBlocks(iterations * (length + 2));
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  result = cpu.GetReg(a1);
+  const auto& pairs = cpu.GetBlocks().GetStats().fused;
+  fused = 2.0 * std::accumulate(pairs.begin(), pairs.end(), uint64_t {0}) / executed;
+  return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+int main()
+{
+  const std::vector<Kernel> kernels = {
+    {
+      "popcount",
+      {
+        Srli(t0, a0, 1), And(t0, t0, s4), Sub(t1, a0, t0),
+        Srli(t0, t1, 2), And(t0, t0, s5), And(t1, t1, s5), Add(t1, t1, t0),
+        Srli(t0, t1, 4), Add(t1, t1, t0), And(t1, t1, s6),
+        Mul(t1, t1, s7), Srli(t1, t1, 56), Add(a1, a1, t1), Addi(a0, a0, 1),
+      },
+      {
+        Cpop(t1, a0), Add(a1, a1, t1), Addi(a0, a0, 1),
+      },
+    },
+    {
+      "rotate",
+      {
+        Srli(t0, a0, 13), Slli(t1, a0, 51), Or(a0, t0, t1), Add(a1, a1, a0),
+      },
+      {
+        Rori(a0, a0, 13), Add(a1, a1, a0),
+      },
+    },
+    {
+      "index+bitset",
+      {
+        Andi(t0, a2, 0xff), Slli(t0, t0, 3), Add(t0, t0, s6), Ori(t1, zero, 1), Slli(t1, t1, 40), Or(t0, t0, t1),
+        Add(a1, a1, t0),
+      },
+      {
+        Andi(t0, a2, 0xff), Sh3add(t0, t0, s6), Bseti(t0, t0, 40), Add(a1, a1, t0),
+      },
+    },
+    {
+      "zext.w",
+      {
+        Slli(t0, a0, 32), Srli(t0, t0, 32), Add(a1, a1, t0), Addi(a0, a0, 1),
+      },
+      {
+        AddUw(a1, a0, a1), Addi(a0, a0, 1),
+      },
+    },
+  };
+
+  std::cout << std::left << std::setw(16) << "kernel" << std::right << std::setw(12) << "base ns" << std::setw(12)
+            << "zb ns" << std::setw(10) << "speedup" << std::setw(10) << "fused" << std::endl;
+  int status = 0;
+  for(const Kernel& kernel : kernels)
+  {
+    uint64_t base_result, bitmanip_result;
+    double fused, bitmanip_fused;
+    const double base = RunLoop(kernel.base, base_result, fused);
+    const double bitmanip = RunLoop(kernel.bitmanip, bitmanip_result, bitmanip_fused);
+    std::cout << std::left << std::setw(16) << kernel.name << std::right << std::fixed << std::setprecision(2)
+              << std::setw(12) << base << std::setw(12) << bitmanip << std::setw(9) << base / bitmanip << "x"
+              << std::setw(9) << std::setprecision(0) << fused * 100 << "%";
+    if(base_result != bitmanip_result)
+    {
+      std::cout << "  result mismatch";
+      status = 1;
+    }
+    std::cout << std::endl;
+  }
+  return status;
+}
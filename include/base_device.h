@@ -2,6 +2,8 @@
 #define BASE_DEVICE_H
 
 #include <cstdint>
+#include <cstddef>
+#include <vector>
 
 class BaseDevice
 {
@@ -17,6 +19,10 @@ class BaseDevice
     virtual constexpr uint64_t GetSize() = 0;
     virtual constexpr bool IsValidAddr(uint64_t addr) = 0;
 
+    // Device register state for checkpoints, stateless devices keep the defaults
+    virtual void SaveState(std::vector<uint8_t>& out) {}
+    virtual void RestoreState(const uint8_t* data, size_t size) {}
+
 };
 
 #endif
@@ -0,0 +1,167 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <cstdint>
+#include <array>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "config.h"
+#include "fusion.h"
+#include "memory_map.h"
+#include "mmu.h"
+
+// Translated block cache
+// A block is a run of decoded instructions from one guest page that ends at the
+// first branch, jump, SYSTEM instruction or FENCE.I, or at the end of the page.
+// Blocks are keyed by virtual pc and privilege mode. An exit whose target is known
+// when the block is built, the target of a JAL, both ways of a branch or the
+// fall-through of a block cut short, is linked to its successor the first time it
+// is taken, so code that stays in cached blocks never goes back to the lookup.
+//
+// Translation changes (satp writes, SFENCE.VMA) only bump the generation. A block
+// from an older generation is not entered through a link, and the lookup checks
+// its page still translates the same before running it again, so blocks survive
+// address space switches that leave them mapped. FENCE.I drops the blocks on
+// pages written since the last one, unlinking them from both ends; the dirty
+// pages come from the memory map's epochs.
+//
+// Loads and stores in a block are specialized on the paging mode it was built
+// under, a block is only revalidated while that mode holds.
+//
+// Blocks count which exit they leave through. When a block has run
+// TRACE_HOT_THRESHOLD times it becomes the head of a trace: the chain of linked
+// blocks along each one's dominant exit, on the head's page, up to the block
+// that leads back to the head or whose direction is not biased enough. The trace
+// replaces the head in the cache and runs as one block. Each branch inside it is
+// a guard, if it goes the other way the trace is left there through a side exit
+// and the run loop looks up the block at that pc.
+
+class CPU;
+typedef void (*ExecuteFunction)(const uint32_t instruction, CPU& cpu);
+
+typedef struct BlockInstruction
+{
+  ExecuteFunction execute;
+  FusedFunction fused; // runs this instruction and the next together, nullptr if they do not fuse
+  uint32_t bits;       // compressed instructions are stored expanded
+  uint8_t len;
+  Fusion fusion;
+} BlockInstruction;
+
+constexpr uint64_t no_exit = ~0ULL;
+
+// A branch inside a trace, after code[0, end) the pc must be pc or the trace is left
+typedef struct TraceGuard
+{
+  uint32_t end;
+  uint64_t pc;
+} TraceGuard;
+
+typedef struct Block
+{
+  uint64_t pc;
+  uint64_t physical_page; // page number
+  PrivilegeMode priv;
+  Translation translation; // loads and stores are specialized on it
+  uint64_t generation;
+  std::vector<BlockInstruction> code;
+  std::array<uint64_t, 2> exit_pc {no_exit, no_exit}; // jump or taken branch target, fall-through
+  std::array<Block*, 2> link {nullptr, nullptr};
+  std::vector<Block*> predecessors;                    // blocks linked to this one
+  std::array<uint32_t, 2> taken {0, 0};                // times each exit was left through
+  std::vector<TraceGuard> guards;                      // side exits, in code order
+  bool trace = false;
+} Block;
+
+typedef struct BlockStats
+{
+  uint64_t built = 0;
+  uint64_t invalidated = 0;
+  uint64_t lookups = 0; // block transitions through the lookup
+  uint64_t chained = 0; // block transitions through a link
+  std::array<uint64_t, FUSION_KINDS> fused {}; // pairs executed fused, by Fusion
+  uint64_t traces = 0;             // traces formed
+  uint64_t trace_blocks = 0;       // blocks joined into them
+  uint64_t trace_instructions = 0;
+  uint64_t trace_runs = 0;         // times a trace was entered
+  uint64_t side_exits = 0;         // times one was left through a guard
+} BlockStats;
+
+class BlockCache
+{
+  public:
+
+    BlockCache() = default;
+    BlockCache(const BlockCache&) = delete;
+    BlockCache& operator=(const BlockCache&) = delete;
+
+    // nullptr if there is no block for pc, the caller checks its generation
+    Block* Find(uint64_t pc, PrivilegeMode priv)
+    {
+      stats.lookups++;
+      Block* block = recent[Slot(pc)];
+      if(block != nullptr && block->pc == pc && block->priv == priv)
+      {
+        return block;
+      }
+      const auto& blocks = by_pc[priv];
+      const auto it = blocks.find(pc);
+      if(it == blocks.end())
+      {
+        return nullptr;
+      }
+      recent[Slot(pc)] = it->second.get();
+      return it->second.get();
+    }
+    Block* Insert(std::unique_ptr<Block> block);
+    // Exit exit of from now leads straight to to
+    void Link(Block& from, int exit, Block& to);
+
+    uint64_t GetGeneration() const { return generation; }
+    void NewGeneration() { generation++; }
+
+    // Counts the exit head was left through and, once head is hot, replaces it with
+    // a trace. Returns the trace, nullptr if head stays. Only while no block runs.
+    Block* Profile(Block& head, int exit)
+    {
+      head.taken[exit]++;
+      if(head.trace || head.taken[0] + head.taken[1] != TRACE_HOT_THRESHOLD)
+      {
+        return nullptr;
+      }
+      return FormTrace(head);
+    }
+
+    // Only while no block runs
+    void Remove(Block* block);
+    void Flush();
+
+    // FENCE.I, the blocks on written pages are dropped by SyncCode once the
+    // running block has returned
+    void RequestSync() { sync_requested = true; }
+    bool SyncRequested() const { return sync_requested; }
+    void SyncCode(MemoryMap& memory);
+
+    const BlockStats& GetStats() const { return stats; }
+    void CountChained() { stats.chained++; }
+    void CountFused(Fusion kind) { stats.fused[static_cast<size_t>(kind)]++; }
+    void CountTraceRun() { stats.trace_runs++; }
+    void CountSideExit() { stats.side_exits++; }
+
+  private:
+
+    static uint64_t Slot(uint64_t pc) { return (pc >> 1) & (BLOCK_TABLE_SIZE - 1); }
+    Block* FormTrace(Block& head);
+
+    std::array<std::unordered_map<uint64_t, std::unique_ptr<Block>>, 4> by_pc; // by privilege mode, then pc
+    std::unordered_map<uint64_t, std::vector<Block*>> by_page;                  // by physical page
+    std::array<Block*, BLOCK_TABLE_SIZE> recent {};                             // direct-mapped in front of by_pc
+    uint64_t generation = 1;
+    bool sync_requested = false;
+    uint64_t code_epoch = 0; // memory map epoch of the last FENCE.I, held from the first one
+    BlockStats stats;
+
+};
+
+#endif
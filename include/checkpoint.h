@@ -0,0 +1,71 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <cstdint>
+#include <string>
+#include "cpu.h"
+
+// Versioned machine checkpoints
+//
+// File layout, all fields little-endian:
+//   CheckpointHeader
+//   Region table   : CheckpointRegion for every RAM and ROM region of the memory map
+//   CPU section    : XLEN, pc, privilege mode, regs, MMU paging mode, MMU privilege mode,
+//                    root page table, then (csr, value) pairs for every non-zero csr
+//   Device section : (base address, state size, state) for every MMIO device
+//   RAM index      : CheckpointPage for every non-zero guest page, in address order
+//   RAM data       : page-aligned, raw pages or one zlib stream per page
+//
+// Raw RAM data is mmapped copy-on-write on restore, so resuming costs only the pages
+// the guest touches afterwards. Compressed RAM data is inflated page by page.
+// Restoring replaces the machine's memory map with the regions of the checkpoint.
+
+constexpr char CHECKPOINT_MAGIC[8] = {'R', 'R', 'E', 'M', 'U', 'C', 'K', 'P'};
+constexpr uint32_t CHECKPOINT_VERSION = 6;
+
+enum CheckpointFlags : uint32_t
+{
+  ckpt_compressed = 1 << 0
+};
+
+enum CheckpointRegionFlags : uint64_t
+{
+  ckpt_read_only = 1 << 0
+};
+
+typedef struct CheckpointHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;
+  uint64_t regions_offset;
+  uint64_t region_count;
+  uint64_t page_size;
+  uint64_t cpu_offset;
+  uint64_t cpu_size;
+  uint64_t devices_offset;
+  uint64_t devices_size;
+  uint64_t index_offset;
+  uint64_t page_count;
+  uint64_t data_offset;
+} CheckpointHeader;
+
+typedef struct CheckpointRegion
+{
+  uint64_t base;
+  uint64_t size;
+  uint64_t flags;
+} CheckpointRegion;
+
+typedef struct CheckpointPage
+{
+  uint64_t page_number;   // physical address / page_size
+  uint64_t offset;        // file offset of the page data
+  uint64_t size;          // stored size, page_size when raw
+} CheckpointPage;
+
+// Both throw std::runtime_error on failure
+void SaveCheckpoint(CPU& cpu, const std::string& path, bool compress);
+void RestoreCheckpoint(CPU& cpu, const std::string& path);
+
+#endif
@@ -1,7 +1,33 @@
 #ifndef CLINT_H
 #define CLINT_H
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <functional>
 #include <base_device.h>
+#include "config.h"
+
+// Core-local interruptor of a single hart, registers at the SiFive/QEMU virt offsets.
+// mtime follows the host clock at TIMEBASE_FREQ, or in instruction-count mode
+// advances one tick per retired instruction so runs are reproducible. The CLINT
+// never polls, the hart asks for the time when its deadline comes up and is told
+// about every guest write through the listener.
+
+enum class TimeMode
+{
+  HostClock,
+  InstructionCount
+};
+
+enum CLINT_REG : uint64_t
+{
+  clint_msip = 0x0,
+  clint_mtimecmp = 0x4000,
+  clint_mtime = 0xbff8
+};
+
+constexpr uint64_t mtimecmp_disarmed = ~0ULL; // reset value, never reached
 
 template <uint64_t base_addr_mem, uint64_t size_mem>
 class CLINT : public BaseDevice
@@ -10,18 +36,166 @@ class CLINT : public BaseDevice
 
     CLINT() = default;
 
-    void Load(uint64_t addr, int size, uint64_t& data) override {};
-    void Store(uint64_t addr, int size, uint64_t data) override {};
+    void Load(uint64_t addr, int size, uint64_t& data) override;
+    void Store(uint64_t addr, int size, uint64_t data) override;
 
     constexpr uint64_t GetBaseAddr() override { return base_addr; }
     constexpr uint64_t GetSize() override { return size; }
     constexpr bool IsValidAddr(uint64_t addr) override { return addr >= base_addr && addr < base_addr + size; }
 
+    void SaveState(std::vector<uint8_t>& out) override
+    {
+      const uint64_t state[] = {GetTime(), mtimecmp, msip};
+      const auto* bytes = reinterpret_cast<const uint8_t*>(state);
+      out.insert(out.end(), bytes, bytes + sizeof(state));
+    }
+    void RestoreState(const uint8_t* data, size_t size) override
+    {
+      uint64_t state[3] = {0, mtimecmp_disarmed, 0};
+      std::memcpy(state, data, std::min(size, sizeof(state)));
+      SetTime(state[0]);
+      mtimecmp = state[1];
+      msip = state[2];
+      Notify();
+    }
+
+    // instret is the hart's retired instruction counter, the time base in
+    // instruction-count mode. on_write runs after every guest store.
+    void Connect(const uint64_t* instret, std::function<void()> on_write)
+    {
+      const uint64_t now = GetTime();
+      instret_counter = instret;
+      listener = std::move(on_write);
+      SetTime(now);
+    }
+
+    TimeMode GetTimeMode() const { return time_mode; }
+    void SetTimeMode(TimeMode mode)
+    {
+      const uint64_t now = GetTime();
+      time_mode = mode;
+      SetTime(now);
+      Notify();
+    }
+
+    uint64_t GetTime() const
+    {
+      if(time_mode == TimeMode::InstructionCount)
+      {
+        return time_base + (Instret() - instret_base);
+      }
+      return time_base + std::chrono::duration_cast<Ticks>(std::chrono::steady_clock::now() - host_base).count();
+    }
+    void SetTime(uint64_t time)
+    {
+      time_base = time;
+      instret_base = Instret();
+      host_base = std::chrono::steady_clock::now();
+    }
+    // Instruction-count mode, skips time the hart would spend idle
+    void AdvanceTime(uint64_t ticks) { time_base += ticks; }
+
+    uint64_t GetTimecmp() const { return mtimecmp; }
+    bool TimerPending() const { return GetTime() >= mtimecmp; }
+    bool SoftwarePending() const { return (msip & 1) != 0; }
+
+    // Host clock mode, the point at which mtime reaches timecmp, mtimecmp or a hart's stimecmp
+    std::chrono::steady_clock::time_point HostDeadline(uint64_t timecmp) const
+    {
+      const uint64_t now = GetTime();
+      if(now >= timecmp)
+      {
+        return std::chrono::steady_clock::now();
+      }
+      // Anything further than a few years away is as good as never
+      const uint64_t remaining = timecmp - now;
+      if(timecmp == mtimecmp_disarmed || remaining > (1ULL << 50))
+      {
+        return std::chrono::steady_clock::time_point::max();
+      }
+      return std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(Ticks(remaining));
+    }
+
   private:
 
+    using Ticks = std::chrono::duration<uint64_t, std::ratio<1, TIMEBASE_FREQ>>;
+
+    uint64_t Instret() const { return instret_counter != nullptr ? *instret_counter : 0; }
+    void Notify()
+    {
+      if(listener)
+      {
+        listener();
+      }
+    }
+
     static constexpr uint64_t base_addr = base_addr_mem;
     static constexpr uint64_t size = size_mem;
 
+    uint64_t msip = 0;
+    uint64_t mtimecmp = mtimecmp_disarmed;
+    TimeMode time_mode = TimeMode::HostClock;
+    uint64_t time_base = 0;
+    uint64_t instret_base = 0;
+    std::chrono::steady_clock::time_point host_base = std::chrono::steady_clock::now();
+    const uint64_t* instret_counter = nullptr;
+    std::function<void()> listener;
+
 };
 
+// Registers accept naturally aligned accesses of up to their own width, so RV32
+// style split accesses to mtime and mtimecmp work too. Other offsets read as zero.
+template <uint64_t base_addr_mem, uint64_t size_mem>
+void CLINT<base_addr_mem, size_mem>::Load(uint64_t addr, int size, uint64_t& data)
+{
+  const uint64_t offset = addr - base_addr;
+  uint64_t reg = 0;
+  uint64_t reg_offset = 0;
+  if(offset < clint_msip + 4)
+  {
+    reg = msip;
+    reg_offset = offset - clint_msip;
+  }
+  else if(offset >= clint_mtimecmp && offset < clint_mtimecmp + 8)
+  {
+    reg = mtimecmp;
+    reg_offset = offset - clint_mtimecmp;
+  }
+  else if(offset >= clint_mtime && offset < clint_mtime + 8)
+  {
+    reg = GetTime();
+    reg_offset = offset - clint_mtime;
+  }
+  const uint64_t mask = size == 8 ? ~0ULL : (1ULL << (size * 8)) - 1;
+  data = (reg >> (reg_offset * 8)) & mask;
+}
+
+template <uint64_t base_addr_mem, uint64_t size_mem>
+void CLINT<base_addr_mem, size_mem>::Store(uint64_t addr, int size, uint64_t data)
+{
+  const uint64_t offset = addr - base_addr;
+  const uint64_t mask = size == 8 ? ~0ULL : (1ULL << (size * 8)) - 1;
+  auto merge = [&](uint64_t reg, uint64_t reg_offset) {
+    const uint64_t shift = reg_offset * 8;
+    return (reg & ~(mask << shift)) | ((data & mask) << shift);
+  };
+  if(offset < clint_msip + 4)
+  {
+    msip = merge(msip, offset - clint_msip) & 1;
+  }
+  else if(offset >= clint_mtimecmp && offset < clint_mtimecmp + 8)
+  {
+    mtimecmp = merge(mtimecmp, offset - clint_mtimecmp);
+  }
+  else if(offset >= clint_mtime && offset < clint_mtime + 8)
+  {
+    SetTime(merge(GetTime(), offset - clint_mtime));
+  }
+  else
+  {
+    return;
+  }
+  Notify();
+}
+
 #endif
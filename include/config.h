@@ -8,12 +8,33 @@
 constexpr int N_REG = 32;
 constexpr int N_CSR = 4096;
 
+// Emulator constants
+constexpr int DECODE_CACHE_SIZE = 1024; // entries, power of two
+constexpr int TLB_SIZE = 256; // 4 KB page entries, power of two
+constexpr int WALK_CACHE_SIZE = 32; // page table pointers per level, power of two
+constexpr int PMP_ENTRIES = 64;
+constexpr int BLOCK_MAX_INSTRUCTIONS = 64; // instructions per translated block
+constexpr int BLOCK_TABLE_SIZE = 512; // direct-mapped block lookup entries, power of two
+constexpr uint32_t TRACE_HOT_THRESHOLD = 64; // block executions before a trace is formed from it
+constexpr uint32_t TRACE_BIAS_PERCENT = 90; // share of a branch's runs its trace direction must take
+constexpr int TRACE_MAX_INSTRUCTIONS = 512; // instructions per trace
+constexpr uint64_t TIMER_POLL_INTERVAL = 1024; // instructions between host clock reads
+
+// Vector register length in bits, set with cmake -DVLEN=256
+#ifdef VLEN_BITS
+constexpr int VLEN = VLEN_BITS;
+#else
+constexpr int VLEN = 128;
+#endif
+
 // xv6 constants
 
 // Memory constants
 constexpr uint64_t KERNBASE = 0x80000000;
 constexpr uint64_t MEMORY_SIZE = (1024 * 1024 * 128); // 128 MB
 constexpr int PAGE_SIZE = 4096;
+constexpr uint64_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+constexpr int PHYS_ADDR_BITS = 40; // guest memory regions must end below 1 TB
 
 // UART constants
 constexpr uint64_t UART_BASE = 0x10000000;
@@ -26,6 +47,7 @@ constexpr uint64_t VIRTIO_SIZE = 0x1000;
 // CLINT constants
 constexpr uint64_t CLINT_BASE = 0x2000000;
 constexpr uint64_t CLINT_SIZE = 0x10000;
+constexpr uint64_t TIMEBASE_FREQ = 10000000; // mtime ticks per second with the host clock
 
 // PLIC constants
 constexpr uint64_t PLIC_BASE = 0xc000000;
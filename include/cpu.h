@@ -1,37 +1,75 @@
 #ifndef CPU_H
 #define CPU_H
 
+#include <cstddef>
 #include <cstdint>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
+#include <span>
 #include <string>
+#include <unordered_map>
 #include "mmu.h"
+#include "block_cache.h"
 #include "config.h"
 #include "trap.h"
+#include "vector.h"
 
 enum CSR : uint16_t
 {
+  // Floating-point CSRs
+  fflags = 0x001,
+  frm = 0x002,
+  fcsr = 0x003,
+  // Vector CSRs
+  vstart = 0x008,
+  vxsat = 0x009,
+  vxrm = 0x00a,
+  vcsr = 0x00f,
+  vl = 0xc20,
+  vtype = 0xc21,
+  vlenb = 0xc22,
+  // Counters, the h CSRs hold the upper halves on RV32. Suffixed to stay clear of ::time.
+  time_csr = 0xc01,
+  timeh_csr = 0xc81,
   // Supervisor CSRs
   sstatus = 0x100,
   sie = 0x104,
   stvec = 0x105,
+  scounteren = 0x106,
+  senvcfg = 0x10a,
   sscratch = 0x140,
   sepc = 0x141,
   scause = 0x142,
   stval = 0x143,
   sip = 0x144,
+  stimecmp = 0x14d,
+  stimecmph = 0x15d,
   satp = 0x180,
   // Machine CSRs
   mstatus = 0x300,
+  misa = 0x301,
   medeleg = 0x302,
   mideleg = 0x303,
   mie = 0x304,
   mtvec = 0x305,
+  mcounteren = 0x306,
+  menvcfg = 0x30a,
+  menvcfgh = 0x31a,
   mscratch = 0x340,
   mepc = 0x341,
   mcause = 0x342,
   mtval = 0x343,
   mip = 0x344,
+  pmpcfg0 = 0x3a0,
+  pmpaddr0 = 0x3b0,
+  mvendorid = 0xf11,
+  marchid = 0xf12,
+  mimpid = 0xf13,
+  mhartid = 0xf14,
 };
 
 // Machine Interrupt Register (MIP)
@@ -45,58 +83,255 @@ enum MIP : uint64_t
   meip = 1ULL << 11
 };
 
+// Machine Status Register (mstatus) fields
+enum MSTATUS : uint64_t
+{
+  mstatus_sie = 1ULL << 1,
+  mstatus_mie = 1ULL << 3,
+  mstatus_spie = 1ULL << 5,
+  mstatus_mpie = 1ULL << 7,
+  mstatus_spp = 1ULL << 8,
+  mstatus_mpp = 3ULL << 11,
+  mstatus_mprv = 1ULL << 17,
+  mstatus_sum = 1ULL << 18,
+  mstatus_mxr = 1ULL << 19,
+  mstatus_tvm = 1ULL << 20,
+  mstatus_tw = 1ULL << 21,
+  mstatus_uxl = 3ULL << 32,
+  mstatus_sxl = 3ULL << 34,
+  mstatus_xlen64 = (2ULL << 32) | (2ULL << 34), // UXL = SXL = 64 bits, read-only
+  mstatus_vs = 3ULL << 9,
+  mstatus_vs_initial = 1ULL << 9,
+  mstatus_fs = 3ULL << 13,
+  mstatus_fs_initial = 1ULL << 13,
+  mstatus_sd = 1ULL << 63
+};
+
+// Environment configuration and counter enable fields
+constexpr uint64_t menvcfg_stce = 1ULL << 63; // Sstc, stimecmp drives STIP
+constexpr uint64_t counteren_tm = 1ULL << 1;  // time and, from M-mode, stimecmp
+
 // Forward declarations for structs used in the CPU class
 typedef struct Instruction Instruction;
 typedef struct InstructionFields InstructionFields;
 
+// Decode cache entry, compressed instructions are stored expanded to 32 bits
+typedef struct DecodedInstruction
+{
+  uint32_t raw;
+  uint32_t bits;
+  const Instruction* inst;
+} DecodedInstruction;
+
+// Architectural state touched by every instruction. pc, privilege mode, the CSRs
+// read by the interrupt check and the timer deadline share the first cache line;
+// the registers are 256 bytes and fill the four lines after it.
+typedef struct alignas(64) HotState
+{
+  uint64_t pc = 0;
+  uint64_t mstatus = 0; // sstatus is a view of it
+  uint64_t mie = 0;
+  uint64_t mip = 0;
+  uint64_t satp = 0;
+  uint64_t instret = 0;        // retired instructions, mtime in instruction-count mode
+  uint64_t timer_deadline = 1; // instret at which the CLINT is consulted next
+  PrivilegeMode priv_mode = MACHINE;
+  uint8_t inst_len = 4;
+  std::atomic<bool> check_interrupts = true; // set by every event that can make an interrupt takeable
+  alignas(64) std::array<uint64_t, N_REG> regs {};
+} HotState;
+
+static_assert(offsetof(HotState, regs) == 64, "the per-instruction fields of HotState must fit its first cache line");
+static_assert(sizeof(HotState) == 5 * 64, "HotState must span exactly five cache lines");
+
 class CPU
 {
   public:
 
     CPU(const std::shared_ptr<std::vector<uint8_t>> binary) :
-    pc(KERNBASE),
-    priv_mode(PrivilegeMode::MACHINE),
     mmu(MMU(binary))
-    {}
+    {
+      hot.pc = KERNBASE;
+      ConfigureXlen();
+      vec.vtype = vtype_vill;
+      mmu.GetClint().Connect(&hot.instret, [this] { UpdateTimer(); });
+    }
 
-    CPU(const std::shared_ptr<std::vector<uint8_t>> binary, const uint64_t entry_point) :
-    pc(entry_point),
-    priv_mode(PrivilegeMode::MACHINE),
-    mmu(MMU(binary))
-    {}
+    // xlen is 32 or 64, throws std::runtime_error otherwise
+    CPU(const std::shared_ptr<std::vector<uint8_t>> binary, const uint64_t entry_point, const uint64_t ram_size = MEMORY_SIZE,
+        const bool huge_pages = true, const int xlen = 64) :
+    xlen(xlen),
+    mmu(MMU(binary, ram_size, huge_pages))
+    {
+      hot.pc = entry_point;
+      ConfigureXlen();
+      vec.vtype = vtype_vill;
+      mmu.GetClint().Connect(&hot.instret, [this] { UpdateTimer(); });
+    }
 
+    int GetXlen() const { return xlen; }
     uint32_t Fetch();
     const Instruction& Decode(uint32_t instruction);
+    const DecodedInstruction& DecodeCached(uint32_t raw);
     void Step();
     void Run();
+    // Runs through the block cache until max_instructions have retired, the hart is
+    // asked to stop or tohost is written, returns the instructions retired. Traps,
+    // interrupts and the timer are handled between instructions exactly as in Step.
+    uint64_t RunBlocks(uint64_t max_instructions);
+    // Makes the running or next RunBlocks return after the current instruction, safe
+    // from any thread and wakes a hart parked in WaitForInterrupt
+    void RequestStop();
+    // RunBlocks returns once the word at this host address is odd, the HTIF exit convention
+    void SetTohost(const uint8_t* host) { tohost = host; }
+    BlockCache& GetBlocks() { return blocks; }
 
-    void HandleTrap(trap_value tval);
+    void HandleTrap(trap_value trap, uint64_t tval = 0);
     void HandleInterrupts();
 
     void UpdatePagingMode(uint64_t satp);
+    // Hands the pmpcfg and pmpaddr CSRs to the MMU, after every write to one
+    void UpdatePmp();
 
-    inline void Store(uint64_t addr, int size, uint64_t data) { mmu.Store(addr, size, data); }
-    inline void Load(uint64_t addr, int size, uint64_t& data) { mmu.Load(addr, size, data); }
+    template<Translation translation = Translation::Dynamic>
+    void Store(uint64_t addr, int size, uint64_t data) { mmu.Store<translation>(addr, size, data); }
+    template<Translation translation = Translation::Dynamic>
+    void Load(uint64_t addr, int size, uint64_t& data) { mmu.Load<translation>(addr, size, data); }
 
-    PrivilegeMode GetMode() const { return priv_mode; }
-    void SetMode(PrivilegeMode mode) { priv_mode = mode; }
+    PrivilegeMode GetMode() const { return hot.priv_mode; }
+    void SetMode(PrivilegeMode mode) { hot.priv_mode = mode; UpdateAccessControl(); RequestInterruptCheck(); }
+    // Hands the privilege and the MPRV, SUM and MXR bits to the MMU, after every change to either
+    void UpdateAccessControl();
+
+    uint64_t GetPc() const { return hot.pc; }
+    // Length of the instruction being executed, pc already points past it
+    uint64_t GetInstLen() const { return hot.inst_len; }
+    void SetPc(uint64_t addr) { hot.pc = addr; }
+    // Instructions retired since reset
+    uint64_t GetInstret() const { return hot.instret; }
+
+    uint64_t GetReg(int reg) const { return hot.regs[reg]; }
+    void SetReg(int reg, uint64_t val) { hot.regs[reg] = val; }
+
+    // LR/SC reservation, one address per hart
+    void SetReservation(uint64_t addr) { reservation = addr; }
+    // True if addr is reserved, the reservation is dropped either way
+    bool TakeReservation(uint64_t addr)
+    {
+      const bool held = reservation == addr;
+      reservation = no_reservation;
+      return held;
+    }
+
+    // Emulator-side CSR access, see csr.cpp. Views and side effects apply but
+    // privilege checks and WARL masks do not.
+    uint64_t GetCsr(int csr) const;
+    void SetCsr(int csr, uint64_t val);
+    // Zicsr access from guest code, traps on missing CSRs, insufficient privilege
+    // and writes to read-only CSRs. Only writes when write is set.
+    uint64_t GuestReadCsr(int csr, bool write);
+    void GuestWriteCsr(int csr, uint64_t val);
+    // Backing store of CSRs without a read or write hook, the hot ones live in
+    // HotState and the rest in a sparse table as few are ever written
+    uint64_t ReadCsrStorage(int csr) const
+    {
+      if(const uint64_t* slot = HotCsr(csr))
+      {
+        return *slot;
+      }
+      const auto it = cold_csrs.find(csr);
+      return it == cold_csrs.end() ? 0 : it->second;
+    }
+    void WriteCsrStorage(int csr, uint64_t val)
+    {
+      if(val == 0 && HotCsr(csr) == nullptr)
+      {
+        cold_csrs.erase(csr); // absent entries read as zero
+      }
+      else
+      {
+        Csr(csr) = val;
+      }
+    }
+    void RequestInterruptCheck() { hot.check_interrupts.store(true, std::memory_order_relaxed); }
 
-    uint64_t GetPc() const { return pc; }
-    void SetPc(uint64_t addr) { pc = addr; }
+    // Interrupt lines driven by devices, safe to call from any thread. Raised
+    // lines read as set in mip until lowered and wake a hart parked in
+    // WaitForInterrupt.
+    void RaiseInterrupt(uint64_t mip_bits);
+    void LowerInterrupt(uint64_t mip_bits);
+    uint64_t GetInterruptLines() const { return irq_lines.load(); }
+    uint64_t GetPendingInterrupts() const { return hot.mip | GetInterruptLines(); }
+    // Blocks the calling thread until an interrupt enabled in mie is pending, a
+    // stop is requested or the deadline passes
+    void WaitForInterrupt(std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
+    // Drives MTIP and MSIP from the CLINT, and STIP from stimecmp under Sstc, and
+    // picks the next instret to look again
+    void UpdateTimer();
+    // Arms stimecmp if menvcfg.STCE is set, after a write to either
+    void UpdateSupervisorTimer();
+    // WFI, parks the hart until it has an interrupt to take. In instruction-count
+    // mode mtime skips ahead to the timer deadline instead.
+    void Idle();
+    // Without parking WFI only raises the idle flag, for embedders that schedule
+    // the hart themselves and must get their thread back
+    void SetParkOnIdle(bool enable) { park_on_idle = enable; }
+    bool TakeIdle()
+    {
+      const bool was_idle = idled;
+      idled = false;
+      return was_idle;
+    }
 
-    uint64_t GetReg(int reg) const { return regs[reg]; }
-    void SetReg(int reg, uint64_t val) { regs[reg] = val; }
+    // F and D state, FS only becomes dirty on the first write so integer code never touches it
+    uint64_t GetFReg(int reg) const { return fregs[reg]; }
+    void SetFReg(int reg, uint64_t val) { fregs[reg] = val; MarkFpDirty(); }
+    void RequireFp() const
+    {
+      if((hot.mstatus & mstatus_fs) == 0)
+      {
+        throw CPUTrapException(trap_value::IllegalInstruction);
+      }
+    }
+    void MarkFpDirty()
+    {
+      if((hot.mstatus & mstatus_fs) != mstatus_fs)
+      {
+        hot.mstatus |= mstatus_fs | mstatus_sd;
+      }
+    }
+    uint64_t GetFrm() const { return frm_val; }
+    void SetFrm(uint64_t val) { frm_val = val & 0x7; MarkFpDirty(); }
+    uint64_t GetFflags() const { return fflags_val; }
+    void SetFflags(uint64_t val) { fflags_val = val & 0x1f; MarkFpDirty(); }
+    // ORs host exception flags into fflags, see FflagsScope in fpu.h
+    void AccrueHostFlags(uint32_t host); // fpu.cpp
 
-    uint64_t GetCsr(int csr) const { return csrs[csr]; }
-    void SetCsr(int csr, uint64_t val)
+    // V state, VS follows the same Off/Initial/Dirty protocol as FS
+    VectorState& GetVector() { return vec; }
+    const VectorState& GetVector() const { return vec; }
+    void RequireVector() const
+    {
+      if((hot.mstatus & mstatus_vs) == 0)
+      {
+        throw CPUTrapException(trap_value::IllegalInstruction);
+      }
+    }
+    void MarkVectorDirty()
     {
-      csrs[csr] = val;
-      if(csr == CSR::satp)
+      if((hot.mstatus & mstatus_vs) != mstatus_vs)
       {
-        UpdatePagingMode(val);
+        hot.mstatus |= mstatus_vs | mstatus_sd;
       }
     }
 
+    // Debugger support, see gdb_stub.h
+    MMU& GetMMU() { return mmu; }
+    const MMU& GetMMU() const { return mmu; }
+    void SetDebugHalt(bool enable) { halt_on_ebreak = enable; }
+    bool IsDebugHalted() const { return debug_halted; }
+    void ClearDebugHalt() { debug_halted = false; }
+
     int RunInstruction(uint32_t instruction_bits); // For testing
     void DumpRegs(); // For testing
     void DumpCsrs(); // For testing
@@ -105,13 +340,66 @@ class CPU
 
   private:
 
-    const uint64_t xlen = 64;  // hardcoded 64-bit
-    uint64_t pc;
-    std::array<uint64_t, N_REG> regs {0};
-    std::array<uint64_t, N_CSR> csrs {0};
-    PrivilegeMode priv_mode;
-    uint64_t& reg_zero = regs[0];
+    static constexpr uint64_t no_reservation = ~0ULL;
+
+    // Picks the decode tables and compressed expansion for xlen, they are fixed for
+    // the life of the hart so no handler looks at XLEN while running
+    void ConfigureXlen();
+    Block* LookupBlock(Block*& from);
+    Block* BuildBlock();
+    int ExecuteBlock(const Block& block);
+    bool ExecuteRange(const BlockInstruction*& op, const BlockInstruction* end);
+
+    const uint64_t* HotCsr(int csr) const
+    {
+      switch(csr)
+      {
+        case CSR::mstatus:
+          return &hot.mstatus;
+        case CSR::mie:
+          return &hot.mie;
+        case CSR::mip:
+          return &hot.mip;
+        case CSR::satp:
+          return &hot.satp;
+        default:
+          return nullptr;
+      }
+    }
+    uint64_t& Csr(int csr)
+    {
+      if(const uint64_t* slot = HotCsr(csr))
+      {
+        return *const_cast<uint64_t*>(slot);
+      }
+      return cold_csrs[csr];
+    }
+
+    HotState hot;
+    const int xlen = 64;
+    std::span<const std::span<const Instruction>> decode_tables;
+    uint32_t (*expand_compressed)(uint16_t instruction) = nullptr;
+    uint64_t reservation = no_reservation;
+    std::unordered_map<uint16_t, uint64_t> cold_csrs;
+    std::array<uint64_t, N_REG> fregs {0};
+    uint64_t fflags_val = 0;
+    uint64_t frm_val = 0;
+    VectorState vec {};
     MMU mmu;
+    bool halt_on_ebreak = false;
+    bool debug_halted = false;
+    bool park_on_idle = true;
+    bool idled = false;
+    std::array<DecodedInstruction, DECODE_CACHE_SIZE> decode_cache {};
+    BlockCache blocks;
+    uint64_t run_limit = UINT64_MAX; // instret at which RunBlocks returns
+    uint64_t stimecmp = mtimecmp_disarmed; // compared against mtime only while Sstc is enabled
+    const uint8_t* tohost = nullptr;
+    std::atomic<bool> stop_requested {false};
+    // Written by device threads, kept off the hart's hot lines
+    alignas(64) std::atomic<uint64_t> irq_lines {0};
+    std::mutex irq_mutex;
+    std::condition_variable irq_wakeup;
 };
 
 typedef struct Instruction
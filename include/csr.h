@@ -0,0 +1,41 @@
+#ifndef CSR_H
+#define CSR_H
+
+#include <cstdint>
+
+// Control and status register descriptors
+// Every implemented CSR has one entry in a table built at compile time (csr.cpp).
+// Access privilege and read-only status come from the CSR number itself, the
+// descriptor adds the WARL write mask and optional hooks for CSRs that are views
+// of other state (sstatus, sie, sip, fcsr, ...) or whose writes have side effects
+// (satp switches the paging mode, mstatus/mie/mip re-arm the interrupt check,
+// pmpcfg/pmpaddr reprogram PMP).
+// CSRs without a descriptor raise an illegal instruction exception when accessed
+// by guest code.
+
+class CPU;
+
+// Descriptor flags
+constexpr uint8_t csr_fp = 1 << 0;     // needs mstatus.FS != Off
+constexpr uint8_t csr_vector = 1 << 1; // needs mstatus.VS != Off
+constexpr uint8_t csr_rv32 = 1 << 2;   // only exists on RV32 harts
+constexpr uint8_t csr_time = 1 << 3;   // needs the TM counter enables, and menvcfg.STCE for stimecmp
+
+typedef struct CsrDescriptor
+{
+  uint16_t addr = 0;
+  uint64_t write_mask = 0;
+  uint8_t flags = 0;
+  uint64_t (*read)(const CPU& cpu) = nullptr;     // nullptr reads the backing store
+  void (*write)(CPU& cpu, uint64_t val) = nullptr; // nullptr writes the backing store
+} CsrDescriptor;
+
+// nullptr if the CSR is not implemented
+const CsrDescriptor* FindCsr(int csr);
+
+// Lowest privilege level that may access a CSR, encoded in bits 9:8
+constexpr int CsrPrivilege(int csr) { return (csr >> 8) & 0x3; }
+// CSRs with bits 11:10 set are read-only
+constexpr bool CsrReadOnly(int csr) { return ((csr >> 10) & 0x3) == 0x3; }
+
+#endif
@@ -1,5 +1,11 @@
 #include <cstdint>
-#include <vector>
-#include <memory>
+#include <string>
+#include "memory_map.h"
 
-std::vector<uint8_t> LoadELF64(const std::string& file, uint64_t& entry_point);
\ No newline at end of file
+// Loads the PT_LOAD segments of a 32- or 64-bit RISC-V ELF into guest memory and
+// returns the entry point, throws std::runtime_error on failure
+uint64_t LoadELF(const std::string& file, MemoryMap& memory);
+// 32 or 64, the XLEN of the hart the ELF is built for, throws like LoadELF
+int ELFXlen(const std::string& file);
+// Looks up a symbol in the ELF symbol table, returns false if the file has no such symbol
+bool FindELFSymbol(const std::string& file, const std::string& name, uint64_t& value);
@@ -0,0 +1,224 @@
+#ifndef FPU_H
+#define FPU_H
+
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <type_traits>
+#include "cpu.h"
+#include "trap.h"
+
+// Host floating point environment and FP register access, shared by the F/D and V units
+
+// HOST FPU
+
+#if defined(__SSE2__)
+#include <xmmintrin.h>
+
+// MXCSR exception flags and rounding control
+constexpr uint32_t host_invalid = 1 << 0;
+constexpr uint32_t host_divbyzero = 1 << 2;
+constexpr uint32_t host_overflow = 1 << 3;
+constexpr uint32_t host_underflow = 1 << 4;
+constexpr uint32_t host_inexact = 1 << 5;
+constexpr uint32_t host_flags = 0x3f;
+constexpr uint32_t host_rounding = 0x6000;
+// Indexed by the RISC-V rounding mode, RMM has no host equivalent and rounds ties to even
+constexpr uint32_t host_round_modes[] = {0x0000, 0x6000, 0x2000, 0x4000, 0x0000};
+
+inline uint32_t GetHostFlags() { return _mm_getcsr() & host_flags; }
+inline void SetHostFlags(uint32_t flags) { _mm_setcsr((_mm_getcsr() & ~host_flags) | flags); }
+inline uint32_t GetHostRounding() { return _mm_getcsr() & host_rounding; }
+inline void SetHostRounding(uint32_t mode) { _mm_setcsr((_mm_getcsr() & ~host_rounding) | mode); }
+
+#else
+#include <cfenv>
+
+constexpr uint32_t host_invalid = FE_INVALID;
+constexpr uint32_t host_divbyzero = FE_DIVBYZERO;
+constexpr uint32_t host_overflow = FE_OVERFLOW;
+constexpr uint32_t host_underflow = FE_UNDERFLOW;
+constexpr uint32_t host_inexact = FE_INEXACT;
+constexpr uint32_t host_round_modes[] = {FE_TONEAREST, FE_TOWARDZERO, FE_DOWNWARD, FE_UPWARD, FE_TONEAREST};
+
+inline uint32_t GetHostFlags() { return fetestexcept(FE_ALL_EXCEPT); }
+inline void SetHostFlags(uint32_t flags) { feclearexcept(FE_ALL_EXCEPT); feraiseexcept(flags); }
+inline uint32_t GetHostRounding() { return fegetround(); }
+inline void SetHostRounding(uint32_t mode) { fesetround(mode); }
+
+#endif
+
+inline void RaiseInvalid() { SetHostFlags(GetHostFlags() | host_invalid); }
+
+// Keeps the compiler from moving an operation out of its rounding mode scope
+template<typename T>
+inline T Barrier(T val)
+{
+  if constexpr (std::is_floating_point_v<T>)
+  {
+#if defined(__SSE2__)
+    asm volatile("" : "+x"(val) : : "memory");
+#else
+    asm volatile("" : "+m"(val) : : "memory");
+#endif
+  }
+  else
+  {
+    asm volatile("" : "+r"(val) : : "memory");
+  }
+  return val;
+}
+
+// Selects the host rounding mode for one instruction, rm 7 is the dynamic mode in frm
+class RoundingScope
+{
+  public:
+
+    RoundingScope(const CPU& cpu, uint32_t rm)
+    {
+      const uint64_t mode = (rm == 7) ? cpu.GetFrm() : rm;
+      if(mode > 4)
+      {
+        throw CPUTrapException(trap_value::IllegalInstruction);
+      }
+      if(mode != 0)
+      {
+        saved = GetHostRounding();
+        SetHostRounding(host_round_modes[mode]);
+        switched = true;
+      }
+    }
+
+    ~RoundingScope()
+    {
+      if(switched)
+      {
+        SetHostRounding(saved);
+      }
+    }
+
+  private:
+
+    uint32_t saved = 0;
+    bool switched = false;
+
+};
+
+// Collects the host exception flags one guest instruction raises into fflags. The
+// host flags are cleared on entry, so floating point work the emulator did since
+// the last FP instruction, hash table load factors and the like, never leaks in.
+class FflagsScope
+{
+  public:
+
+    explicit FflagsScope(CPU& cpu) : cpu(cpu)
+    {
+      if(GetHostFlags() != 0)
+      {
+        SetHostFlags(0);
+      }
+    }
+
+    ~FflagsScope()
+    {
+      if(const uint32_t host = GetHostFlags(); host != 0)
+      {
+        cpu.AccrueHostFlags(host);
+      }
+    }
+
+  private:
+
+    CPU& cpu;
+
+};
+
+// REGISTER ACCESS
+
+template<typename T> struct FpTraits;
+
+template<> struct FpTraits<float>
+{
+  using Bits = uint32_t;
+  static constexpr Bits canonical_nan = 0x7fc00000;
+  static constexpr Bits quiet_bit = 1U << 22;
+  static constexpr Bits sign_bit = 1U << 31;
+};
+
+template<> struct FpTraits<double>
+{
+  using Bits = uint64_t;
+  static constexpr Bits canonical_nan = 0x7ff8000000000000;
+  static constexpr Bits quiet_bit = 1ULL << 51;
+  static constexpr Bits sign_bit = 1ULL << 63;
+};
+
+constexpr uint64_t nan_box = 0xffffffff00000000;
+
+// Single precision values are NaN-boxed, a badly boxed value reads as the canonical NaN
+template<typename T>
+inline typename FpTraits<T>::Bits ReadFBits(const CPU& cpu, int reg)
+{
+  const uint64_t val = cpu.GetFReg(reg);
+  if constexpr (std::is_same_v<T, float>)
+  {
+    return ((val & nan_box) == nan_box) ? static_cast<uint32_t>(val) : FpTraits<float>::canonical_nan;
+  }
+  else
+  {
+    return val;
+  }
+}
+
+template<typename T>
+inline T ReadF(const CPU& cpu, int reg)
+{
+  return std::bit_cast<T>(ReadFBits<T>(cpu, reg));
+}
+
+template<typename T>
+inline void WriteFBits(CPU& cpu, int reg, typename FpTraits<T>::Bits bits)
+{
+  if constexpr (std::is_same_v<T, float>)
+  {
+    cpu.SetFReg(reg, nan_box | bits);
+  }
+  else
+  {
+    cpu.SetFReg(reg, bits);
+  }
+}
+
+// Arithmetic results never carry NaN payloads
+template<typename T>
+inline void WriteF(CPU& cpu, int reg, T val)
+{
+  WriteFBits<T>(cpu, reg, std::isnan(val) ? FpTraits<T>::canonical_nan : std::bit_cast<typename FpTraits<T>::Bits>(val));
+}
+
+template<typename T>
+inline bool IsSignaling(T val)
+{
+  return std::isnan(val) && (std::bit_cast<typename FpTraits<T>::Bits>(val) & FpTraits<T>::quiet_bit) == 0;
+}
+
+// RISC-V minimum and maximum, a single NaN operand is ignored and -0 orders below +0
+template<typename T>
+inline T MinMax(T a, T b, bool max)
+{
+  if(IsSignaling(a) || IsSignaling(b))
+  {
+    RaiseInvalid();
+  }
+  if(std::isnan(a) || std::isnan(b))
+  {
+    return std::isnan(a) ? b : a;
+  }
+  if(a == b)
+  {
+    return (std::signbit(a) != max) ? a : b;
+  }
+  return ((a < b) != max) ? a : b;
+}
+
+#endif
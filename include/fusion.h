@@ -0,0 +1,46 @@
+#ifndef FUSION_H
+#define FUSION_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Macro-op fusion
+// Compilers emit fixed pairs of instructions for one operation: LUI+ADDI(W) for a
+// 32-bit constant, AUIPC+JALR for a far call, AUIPC+LW/LD for a PC-relative load,
+// SLLI+SRLI for a zero extension or field extract, and SLT(I)(U)+BEQZ/BNEZ for a
+// compare and branch. The block builder looks for them in decoded code and runs
+// each pair through one fused handler instead of two dispatches.
+//
+// A pair is only fused when the second instruction consumes the register the first
+// writes. The first half never traps, so a trap in the second finds the first
+// retired and the pc on the second exactly as if they had run one at a time. Both
+// instructions stay in the block, the run loop executes them separately when the
+// timer deadline falls between them.
+
+class CPU;
+typedef void (*FusedFunction)(const uint32_t first, const uint32_t second, CPU& cpu);
+
+enum class Fusion : uint8_t
+{
+  None,
+  LoadImmediate,  // LUI + ADDI/ADDIW
+  FarCall,        // AUIPC + JALR
+  PcRelativeLoad, // AUIPC + LW/LD
+  ShiftPair,      // SLLI + SRLI
+  CompareBranch,  // SLT/SLTU/SLTI/SLTIU + BEQ/BNE against zero
+  Count
+};
+
+constexpr size_t FUSION_KINDS = static_cast<size_t>(Fusion::Count);
+
+typedef struct FusedPair
+{
+  FusedFunction execute;
+  Fusion kind;
+} FusedPair;
+
+// Both instructions decoded, compressed ones expanded. execute is nullptr if they do not fuse.
+FusedPair MatchFusion(uint32_t first, uint32_t second);
+const char* FusionName(Fusion kind);
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef GDB_STUB_H
+#define GDB_STUB_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include "cpu.h"
+
+// GDB Remote Serial Protocol server
+// Software and hardware breakpoints are implemented by patching the guest code
+// with EBREAK (C.EBREAK for 2-byte kinds). The CPU halts on EBREAK while a debugger
+// is attached, so CPU::Step never looks at the breakpoint set.
+
+class GDBStub
+{
+  public:
+
+    GDBStub(CPU& cpu) : cpu(cpu) {}
+    ~GDBStub();
+
+    bool ListenTcp(uint16_t port);
+    bool ListenUnix(const std::string& path);
+
+    // Accepts one connection and serves it until GDB detaches or kills the target.
+    // True if GDB detached, the guest then keeps running without the debugger.
+    bool Serve();
+
+    // One packet of the session without the connection, reply is what goes back
+    // and empty for an unsupported packet. False once GDB detached or killed the
+    // target, only a detach is answered. Public so tests can drive the protocol.
+    bool HandlePacket(const std::string& packet, std::string& reply);
+
+  private:
+
+    typedef struct Breakpoint
+    {
+      int kind;
+      uint32_t original;
+    } Breakpoint;
+
+    // Connection
+    bool ReadPacket(std::string& packet);
+    void WritePacket(const std::string& packet);
+    bool InterruptRequested();
+
+    // Packet handlers
+    std::string ReadRegisters();
+    std::string WriteRegisters(const std::string& args);
+    std::string ReadRegister(const std::string& args);
+    std::string WriteRegister(const std::string& args);
+    std::string ReadMemory(const std::string& args);
+    std::string WriteMemory(const std::string& args);
+    std::string InsertBreakpoint(const std::string& args);
+    std::string RemoveBreakpoint(const std::string& args);
+    std::string Query(const std::string& packet);
+
+    // Execution control
+    std::string Resume(bool single_step);
+    void StepOverBreakpoint();
+    bool PatchBreakpoint(uint64_t addr, int kind, uint32_t& original);
+    bool RestoreBreakpoint(uint64_t addr, const Breakpoint& bp);
+
+    uint64_t GetRegister(int reg) const;
+    void SetRegister(int reg, uint64_t val);
+
+    CPU& cpu;
+    int listen_fd = -1;
+    int conn_fd = -1;
+    std::string unix_path;
+    bool no_ack = false;
+    bool detached = false;
+    std::map<uint64_t, Breakpoint> breakpoints;
+
+};
+
+#endif
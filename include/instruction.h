@@ -0,0 +1,157 @@
+#ifndef INSTRUCTION_H
+#define INSTRUCTION_H
+
+#include <cstdint>
+#include <span>
+#include <type_traits>
+#include "cpu.h"
+#include "trap.h"
+
+// instruction mask helpers, shared by the instruction tables
+
+template<int start, int end>
+constexpr uint32_t mask(uint32_t instruction)
+{
+  return (instruction >> start) & ((1 << (end - start + 1)) - 1);
+}
+
+template<int start, int end, int dest>
+constexpr uint32_t mask_and_shift(uint32_t instruction)
+{
+  return ((instruction >> start) & ((1 << (end - start + 1)) - 1)) << dest;
+}
+
+template<uint64_t start, uint64_t end>
+constexpr uint64_t mask(uint64_t instruction)
+{
+  return (instruction >> start) & ((1ULL << (end - start + 1ULL)) - 1ULL);
+}
+
+template<uint64_t start, uint64_t end, uint64_t dest>
+constexpr uint64_t mask_and_shift(uint64_t instruction)
+{
+  return ((instruction >> start) & ((1ULL << (end - start + 1ULL)) - 1ULL)) << dest;
+}
+
+inline constexpr auto sign_extend_12b = [](auto imm) -> int32_t {
+  int32_t sign_extended_imm = (imm & 0x800) ? (imm | 0xfffff000) : imm;
+  return sign_extended_imm;
+};
+
+inline constexpr auto sign_extend_13b = [](auto imm) -> int32_t {
+  int32_t sign_extended_imm = (imm & 0x1000) ? (imm | 0xffffe000) : imm;
+  return sign_extended_imm;
+};
+
+inline constexpr auto sign_extend_21b = [](auto imm) -> int32_t {
+  int32_t sign_extended_imm = (imm & 0x00100000) ? (imm | 0xffe00000) : imm;
+  return sign_extended_imm;
+};
+
+// XLEN-wide integer types. Registers of an RV32 hart hold their 32-bit values
+// sign-extended, so comparisons and logic work unchanged, while addresses and
+// the pc are zero-extended.
+template<int xlen>
+using UnsignedXlen = std::conditional_t<xlen == 32, uint32_t, uint64_t>;
+template<int xlen>
+using SignedXlen = std::conditional_t<xlen == 32, int32_t, int64_t>;
+
+// Register value of an XLEN-bit result
+template<int xlen>
+constexpr uint64_t xlen_value(uint64_t val)
+{
+  return static_cast<int64_t>(static_cast<SignedXlen<xlen>>(val));
+}
+
+// Address or pc formed from an XLEN-bit value
+template<int xlen>
+constexpr uint64_t xlen_address(uint64_t val)
+{
+  return static_cast<UnsignedXlen<xlen>>(val);
+}
+
+template<char format>
+InstructionFields parse_instruction(const uint32_t instruction)
+{
+  throw CPUTrapException(trap_value::IllegalInstruction);
+}
+
+template<>
+inline InstructionFields parse_instruction<'R'>(const uint32_t instruction)
+{
+  return InstructionFields{.opcode = mask<0, 6>(instruction),
+                           .rd     = mask<7, 11>(instruction),
+                           .funct3 = mask<12, 14>(instruction),
+                           .rs1    = mask<15, 19>(instruction),
+                           .rs2    = mask<20, 24>(instruction),
+                           .funct7 = mask<25, 31>(instruction),
+                           .imm = 0};
+}
+
+template<>
+inline InstructionFields parse_instruction<'I'>(const uint32_t instruction)
+{
+  return InstructionFields{.opcode = mask<0, 6>(instruction),
+                           .rd     = mask<7, 11>(instruction),
+                           .funct3 = mask<12, 14>(instruction),
+                           .rs1    = mask<15, 19>(instruction),
+                           .rs2    = 0,
+                           .funct7 = 0,
+                           .imm = mask<20, 31>(instruction)};
+}
+
+template<>
+inline InstructionFields parse_instruction<'S'>(const uint32_t instruction)
+{
+  return InstructionFields{.opcode = mask<0, 6>(instruction),
+                           .rd     = 0,
+                           .funct3 = mask<12, 14>(instruction),
+                           .rs1    = mask<15, 19>(instruction),
+                           .rs2    = mask<20, 24>(instruction),
+                           .funct7 = 0,
+                           .imm = mask<7, 11>(instruction) | mask_and_shift<25, 31, 5>(instruction)};
+}
+
+template<>
+inline InstructionFields parse_instruction<'B'>(const uint32_t instruction)
+{
+  return InstructionFields{.opcode = mask<0, 6>(instruction),
+                           .rd     = 0,
+                           .funct3 = mask<12, 14>(instruction),
+                           .rs1    = mask<15, 19>(instruction),
+                           .rs2    = mask<20, 24>(instruction),
+                           .funct7 = 0,
+                           .imm = mask_and_shift<7, 7, 11>(instruction) | mask_and_shift<8, 11, 1>(instruction)
+                                | mask_and_shift<25, 30, 5>(instruction) | mask_and_shift<31, 31, 12>(instruction)};
+}
+
+template<>
+inline InstructionFields parse_instruction<'U'>(const uint32_t instruction)
+{
+  return InstructionFields{.opcode = mask<0, 6>(instruction),
+                           .rd     = mask<7, 11>(instruction),
+                           .funct3 = 0,
+                           .rs1    = 0,
+                           .rs2    = 0,
+                           .funct7 = 0,
+                           .imm    = mask_and_shift<12, 31, 12>(instruction)};
+}
+
+template<>
+inline InstructionFields parse_instruction<'J'>(const uint32_t instruction)
+{
+  return InstructionFields{.opcode = mask<0, 6>(instruction),
+                           .rd     = mask<7, 11>(instruction),
+                           .funct3 = 0,
+                           .rs1    = 0,
+                           .rs2    = 0,
+                           .funct7 = 0,
+                           .imm = mask_and_shift<21, 30, 1>(instruction) | mask_and_shift<20, 20, 11>(instruction)
+                                | mask_and_shift<12, 19, 12>(instruction) | mask_and_shift<31, 31, 20>(instruction)};
+}
+
+// Extension instruction tables, searched by CPU::Decode after the base tables on RV64 harts
+extern const std::span<const Instruction> fd_instructions;
+extern const std::span<const Instruction> bitmanip_instructions;
+
+#endif
@@ -0,0 +1,141 @@
+#ifndef MACHINE_H
+#define MACHINE_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "cpu.h"
+#include "config.h"
+
+// Embedding API
+// A MachineBuilder describes a guest at runtime, its RAM size, ROMs, images and
+// host-implemented devices, and builds a Machine that the host runs in slices with
+// RunFor. Machines share no state, so any number of them can run concurrently on a
+// thread pool as long as each is driven by one thread at a time. A machine costs
+// its CPU state, a few tens of KB, plus the 4 KB guest pages it touches.
+//
+// A guest exits by writing an odd value to tohost (exit code value >> 1, the
+// riscv-tests and HTIF convention), noticed at the end of the block that wrote
+// it, or through a host hook calling Machine::Exit.
+
+class Machine;
+
+enum class StopReason
+{
+  Budget, // ran the requested number of instructions
+  Exit,   // the guest exited
+  Idle    // the guest executed WFI with nothing pending, resume it once something is
+};
+
+typedef struct RunResult
+{
+  uint64_t executed;
+  StopReason reason;
+} RunResult;
+
+typedef std::function<uint64_t(Machine& machine, uint64_t offset, int size)> MachineLoadHook;
+typedef std::function<void(Machine& machine, uint64_t offset, int size, uint64_t data)> MachineStoreHook;
+typedef std::function<void(Machine& machine, uint64_t code)> MachineExitHook;
+
+class Machine
+{
+  public:
+
+    // Runs up to instructions instructions on the calling thread
+    RunResult RunFor(uint64_t instructions);
+
+    // Ends the run after the current instruction, callable from device hooks
+    void Exit(uint64_t code)
+    {
+      exited = true;
+      exit_code = code;
+      cpu.RequestStop();
+    }
+    bool HasExited() const { return exited; }
+    uint64_t GetExitCode() const { return exit_code; }
+
+    CPU& GetCpu() { return cpu; }
+    MemoryMap& GetMemory() { return cpu.GetMMU().GetMemory(); }
+
+  private:
+
+    friend class MachineBuilder;
+
+    Machine(uint64_t ram_size, bool huge_pages, int xlen) :
+    cpu(std::make_shared<std::vector<uint8_t>>(), KERNBASE, ram_size, huge_pages, xlen) {}
+
+    void CheckTohost();
+
+    CPU cpu;
+    const uint8_t* tohost = nullptr; // host address of the exit word, nullptr when not watched
+    MachineExitHook on_exit;
+    bool exited = false;
+    bool exit_reported = false;
+    uint64_t exit_code = 0;
+
+};
+
+class MachineBuilder
+{
+  public:
+
+    // RAM at KERNBASE, MEMORY_SIZE unless set
+    MachineBuilder& Ram(uint64_t size) { ram_size = size; return *this; }
+    // Backs RAM with 2 MB host pages, faster for large guests but a touched page costs 2 MB
+    MachineBuilder& HugePages(bool enable) { huge_pages = enable; return *this; }
+    MachineBuilder& Rom(uint64_t base, uint64_t size) { roms.emplace_back(base, size); return *this; }
+    // Copies bytes into guest memory at addr, ROM included
+    MachineBuilder& Image(uint64_t addr, std::vector<uint8_t> bytes) { images.emplace_back(addr, std::move(bytes)); return *this; }
+    // Loads an ELF, its entry point, tohost symbol and class apply unless set explicitly
+    MachineBuilder& Elf(const std::string& file) { elf = file; return *this; }
+    // RV32 or RV64 hart, 64 unless set or taken from the ELF
+    MachineBuilder& Xlen(int bits) { xlen = bits; has_xlen = true; return *this; }
+    MachineBuilder& Entry(uint64_t pc) { entry = pc; has_entry = true; return *this; }
+    MachineBuilder& Tohost(uint64_t addr) { tohost = addr; has_tohost = true; return *this; }
+    // MMIO region served by the host, either hook may be empty to fault that access type
+    MachineBuilder& Device(uint64_t base, uint64_t size, MachineLoadHook load, MachineStoreHook store)
+    {
+      devices.push_back(DeviceHooks{.base = base, .size = size, .load = std::move(load), .store = std::move(store)});
+      return *this;
+    }
+    // mtime counts instructions instead of following the host clock
+    MachineBuilder& InstructionCount(bool enable) { instruction_count = enable; return *this; }
+    // By default WFI makes RunFor return Idle, with parking it blocks the thread instead
+    MachineBuilder& ParkOnIdle(bool enable) { park_on_idle = enable; return *this; }
+    MachineBuilder& OnExit(MachineExitHook hook) { on_exit = std::move(hook); return *this; }
+
+    // Throws std::runtime_error if the description does not fit together
+    std::unique_ptr<Machine> Build() const;
+
+  private:
+
+    typedef struct DeviceHooks
+    {
+      uint64_t base;
+      uint64_t size;
+      MachineLoadHook load;
+      MachineStoreHook store;
+    } DeviceHooks;
+
+    uint64_t ram_size = MEMORY_SIZE;
+    bool huge_pages = false;
+    std::vector<std::pair<uint64_t, uint64_t>> roms;
+    std::vector<std::pair<uint64_t, std::vector<uint8_t>>> images;
+    std::string elf;
+    uint64_t entry = KERNBASE;
+    bool has_entry = false;
+    uint64_t tohost = 0;
+    bool has_tohost = false;
+    int xlen = 64;
+    bool has_xlen = false;
+    std::vector<DeviceHooks> devices;
+    bool instruction_count = false;
+    bool park_on_idle = false;
+    MachineExitHook on_exit;
+
+};
+
+#endif
@@ -0,0 +1,206 @@
+#ifndef MEMORY_MAP_H
+#define MEMORY_MAP_H
+
+#include <cstdint>
+#include <array>
+#include <cstring>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <utility>
+#include <sys/mman.h>
+#include <vector>
+#include "config.h"
+#include "ram.h"
+
+// Guest physical memory map
+// Any number of RAM and ROM regions at page-aligned addresses. Physical addresses
+// resolve to host memory through a page directory walked like a page table: one
+// entry per GB, below it one entry per 2 MB chunk, which is either a leaf for a
+// chunk a region covers entirely or a table of 4 KB leaves for a partial one.
+// Lookups cost at most three loads however large or sparse the map is. Addresses
+// outside every region resolve to nullptr and go to the MMIO devices.
+//
+// Every store through the map sets the page's bit in a dirty bitmap. Closing an
+// epoch moves the set bits into a per-epoch page list, so code caches and
+// checkpoints can ask which pages changed since any epoch still in the history.
+// The bitmap words written in the epoch are listed as well, so closing it costs
+// the pages written and not the size of the map.
+
+// One bit per physical page up to PHYS_ADDR_BITS, backed by a lazily populated
+// mapping so only the words covering written pages take host memory
+class PageBitmap
+{
+  public:
+
+    PageBitmap()
+    {
+      void* addr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if(addr == MAP_FAILED)
+      {
+        throw std::runtime_error("Could not allocate page bitmap");
+      }
+      words = static_cast<uint64_t*>(addr);
+    }
+    PageBitmap(PageBitmap&& other) noexcept : words(other.words) { other.words = nullptr; }
+    PageBitmap& operator=(PageBitmap&& other) noexcept
+    {
+      std::swap(words, other.words);
+      return *this;
+    }
+    ~PageBitmap()
+    {
+      if(words != nullptr)
+      {
+        munmap(words, bytes);
+      }
+    }
+
+    void Set(uint64_t page) { words[page >> 6] |= 1ULL << (page & 63); }
+    bool Test(uint64_t page) const { return (words[page >> 6] >> (page & 63)) & 1; }
+    uint64_t Word(uint64_t index) const { return words[index]; }
+    uint64_t& Word(uint64_t index) { return words[index]; }
+    void Reset() { madvise(words, bytes, MADV_DONTNEED); }
+
+  private:
+
+    static constexpr uint64_t bytes = (1ULL << (PHYS_ADDR_BITS - 12)) / 8;
+    uint64_t* words = nullptr;
+
+};
+
+class MemoryMap
+{
+  public:
+
+    MemoryMap() = default;
+    MemoryMap(MemoryMap&&) = default;
+    MemoryMap& operator=(MemoryMap&&) = default;
+
+    // Throws std::runtime_error for misaligned or overlapping regions, see RAM for huge_pages
+    RAM& AddRegion(uint64_t base, uint64_t size, bool read_only = false, bool huge_pages = true);
+    // Drops every region
+    void Clear();
+
+    std::vector<RAM>& GetRegions() { return regions; }
+    // nullptr if addr is not memory
+    RAM* FindRegion(uint64_t addr);
+
+    // Host address backing addr, nullptr if it is not memory or if write is set and it is ROM
+    uint8_t* HostAddress(uint64_t addr, bool write) const
+    {
+      const uint64_t gigabyte = addr >> 30;
+      if(gigabyte >= directory.size() || directory[gigabyte] == nullptr)
+      {
+        return nullptr;
+      }
+      uintptr_t entry = (*directory[gigabyte])[(addr >> 21) & 0x1ff];
+      uint64_t offset = addr & (HUGE_PAGE_SIZE - 1);
+      if(entry & entry_table)
+      {
+        entry = (*reinterpret_cast<const Table*>(entry & ~entry_flags))[(addr >> 12) & 0x1ff];
+        offset = addr & (PAGE_SIZE - 1);
+      }
+      if(entry == 0 || (write && (entry & entry_read_only)))
+      {
+        return nullptr;
+      }
+      return reinterpret_cast<uint8_t*>(entry & ~entry_flags) + offset;
+    }
+
+    // Both return false if the access is not entirely inside one region, loads
+    // and stores of 1, 2, 4 or 8 bytes only
+    bool Load(uint64_t addr, int size, uint64_t& data) const
+    {
+      const uint8_t* host = Resolve(addr, size, false);
+      if(host == nullptr)
+      {
+        return false;
+      }
+      data = 0;
+      std::memcpy(&data, host, size);
+      return true;
+    }
+    bool Store(uint64_t addr, int size, uint64_t data)
+    {
+      uint8_t* host = Resolve(addr, size, true);
+      if(host == nullptr)
+      {
+        return false;
+      }
+      std::memcpy(host, &data, size);
+      SetDirty(addr >> 12);
+      SetDirty((addr + size - 1) >> 12);
+      return true;
+    }
+
+    // Copies an image into guest memory, ROM included, throws if it is not all memory
+    void Write(uint64_t addr, const uint8_t* src, uint64_t len);
+
+    // Dirty page tracking, for writes that bypass Store such as bulk copies through HostAddress
+    void MarkDirty(uint64_t addr, uint64_t len);
+    uint64_t GetEpoch() const { return epoch; }
+    // Closes the current epoch, later writes belong to the next one. Returns the new epoch.
+    uint64_t AdvanceEpoch();
+    // Physical page numbers written since the start of epoch since, in ascending order.
+    // Epochs dropped from the history count as having written every page written before.
+    std::vector<uint64_t> DirtyPages(uint64_t since) const;
+    bool IsDirty(uint64_t addr, uint64_t since) const;
+    // Each client that queries since an epoch holds it. The page lists are kept from
+    // the oldest held epoch on and dropped below it, all of them while none is held.
+    void HoldEpoch(uint64_t since);
+    void ReleaseEpoch(uint64_t since);
+
+  private:
+
+    // Directory entries hold host addresses, which are page aligned, tagged in their low bits
+    static constexpr uintptr_t entry_table = 1 << 0;     // points to a Table of 4 KB leaves
+    static constexpr uintptr_t entry_read_only = 1 << 1;
+    static constexpr uintptr_t entry_flags = entry_table | entry_read_only;
+    typedef std::array<uintptr_t, 512> Table;
+
+    uint8_t* Resolve(uint64_t addr, int size, bool write) const
+    {
+      if(size > 8 || (size & (size - 1)) != 0)
+      {
+        return nullptr;
+      }
+      uint8_t* host = HostAddress(addr, write);
+      // Regions are contiguous in the host, an access that crosses a page only needs its last byte checked
+      if(host != nullptr && (addr & (PAGE_SIZE - 1)) + size > PAGE_SIZE && HostAddress(addr + size - 1, write) != host + size - 1)
+      {
+        return nullptr;
+      }
+      return host;
+    }
+    void MapRange(uint64_t addr, uint64_t size, uint8_t* host, uintptr_t flags);
+    // The first page of a bitmap word to be written in an epoch records the word,
+    // so closing the epoch only visits the words it dirtied
+    void SetDirty(uint64_t page)
+    {
+      uint64_t& word = dirty.Word(page >> 6);
+      if(word == 0)
+      {
+        dirty_words.push_back(page >> 6);
+      }
+      word |= 1ULL << (page & 63);
+    }
+    // Forgets the page lists no held epoch needs
+    void DropHistory();
+    // Bitmap words that can hold pages of a region
+    uint64_t BitmapWords() const { return directory.size() << (30 - 12 - 6); }
+
+    std::vector<RAM> regions;
+    std::vector<std::unique_ptr<Table>> directory; // by GB, then by 2 MB chunk
+    std::vector<std::unique_ptr<Table>> tables;    // 4 KB leaves of partially covered chunks
+    PageBitmap dirty;                               // pages written in the current epoch
+    std::vector<uint64_t> dirty_words;              // indices of the non-zero words of dirty
+    PageBitmap written;                             // pages written in any closed epoch
+    std::vector<std::vector<uint64_t>> history;     // pages written in each epoch from first_epoch
+    std::multiset<uint64_t> held;                   // epochs clients still query since
+    uint64_t first_epoch = 0;
+    uint64_t epoch = 0;
+
+};
+
+#endif
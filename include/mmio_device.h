@@ -0,0 +1,59 @@
+#ifndef MMIO_DEVICE_H
+#define MMIO_DEVICE_H
+
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include "base_device.h"
+#include "trap.h"
+
+// Device implemented by the host through callbacks, for embedders that model
+// their own peripherals. Accesses reach the callbacks with the offset from the
+// device base, a missing callback makes that access type an access fault.
+
+typedef std::function<uint64_t(uint64_t offset, int size)> MmioLoadHook;
+typedef std::function<void(uint64_t offset, int size, uint64_t data)> MmioStoreHook;
+
+class MmioDevice : public BaseDevice
+{
+  public:
+
+    MmioDevice(uint64_t base, uint64_t length, MmioLoadHook load, MmioStoreHook store) :
+    base_addr(base),
+    size(length),
+    on_load(std::move(load)),
+    on_store(std::move(store))
+    {
+    }
+
+    void Load(uint64_t addr, int size, uint64_t& data) override
+    {
+      if(!on_load)
+      {
+        throw CPUTrapException(trap_value::LoadAccessFault);
+      }
+      data = on_load(addr - base_addr, size);
+    }
+    void Store(uint64_t addr, int size, uint64_t data) override
+    {
+      if(!on_store)
+      {
+        throw CPUTrapException(trap_value::StoreAMOAccessFault);
+      }
+      on_store(addr - base_addr, size, data);
+    }
+
+    constexpr uint64_t GetBaseAddr() override { return base_addr; }
+    constexpr uint64_t GetSize() override { return size; }
+    constexpr bool IsValidAddr(uint64_t addr) override { return addr >= base_addr && addr - base_addr < size; }
+
+  private:
+
+    uint64_t base_addr;
+    uint64_t size;
+    MmioLoadHook on_load;
+    MmioStoreHook on_store;
+
+};
+
+#endif
@@ -6,11 +6,15 @@
 #include <array>
 #include <memory>
 #include "config.h"
-#include "ram.h"
+#include "memory_map.h"
 #include "uart.h"
 #include "virtio.h"
 #include "clint.h"
 #include "plic.h"
+#include "mmio_device.h"
+#include "pmp.h"
+#include "tlb.h"
+#include "trap.h"
 
 typedef enum AccessType
 {
@@ -28,22 +32,32 @@ typedef enum PagingMode
     Sv57,
 } PagingMode;
 
-typedef struct Sv39PageTableEntry
+// Page table entry bits. TLB entries keep a leaf's R, W, X, U, A and D bits in
+// their PTE positions and add pte_supervisor for pages without U and
+// pte_mxr_readable, which loads need instead of R while MXR is set, so every
+// permission check is a mask compare against MMU::required.
+enum PTE : uint16_t
 {
-    uint8_t v : 1;
-    uint8_t r : 1;
-    uint8_t w : 1;
-    uint8_t x : 1;
-    uint8_t u : 1;
-    uint8_t g : 1;
-    uint8_t a : 1;
-    uint8_t d : 1;
-    uint8_t rsw : 2;
-    uint16_t ppn0 : 9;
-    uint16_t ppn1 : 9;
-    uint32_t ppn2 : 26;
-    uint16_t reserved : 10;
-} Sv39PageTableEntry;
+  pte_valid = 1 << 0,
+  pte_read = 1 << 1,
+  pte_write = 1 << 2,
+  pte_execute = 1 << 3,
+  pte_user = 1 << 4,
+  pte_global = 1 << 5,
+  pte_accessed = 1 << 6,
+  pte_dirty = 1 << 7,
+  pte_supervisor = 1 << 8,
+  pte_mxr_readable = 1 << 9
+};
+
+// Debugger watchpoint over [addr, addr + len)
+typedef struct Watchpoint
+{
+    uint64_t addr;
+    uint64_t len;
+    bool on_load;
+    bool on_store;
+} Watchpoint;
 
 typedef enum
 {
@@ -52,6 +66,15 @@ typedef enum
   MACHINE = 0x3
 } PrivilegeMode;
 
+// How an access finds its physical address. Dynamic checks the paging mode on
+// every access; Bare is for code that only runs while paging and PMP are off,
+// such as blocks, which are rebuilt when that changes.
+enum class Translation
+{
+  Dynamic,
+  Bare
+};
+
 // Acts as the MMU and bus for the CPU
 // Connects the devices and maps them in virtual memory
 // Devices are represented as BaseDevice objects
@@ -60,34 +83,206 @@ class MMU
 {
   public:
 
-    MMU(const std::shared_ptr<std::vector<uint8_t>>& binary) :
+    // RAM of ram_size at KERNBASE holding binary, more regions can be added through GetMemory
+    MMU(const std::shared_ptr<std::vector<uint8_t>>& binary, uint64_t ram_size = MEMORY_SIZE, bool huge_pages = true) :
     paging_mode(PagingMode::Bare),
     privilege_mode(PrivilegeMode::MACHINE),
-    page_size(PAGE_SIZE),
-    ram(RAM<KERNBASE, MEMORY_SIZE>(binary)) {}
+    data_privilege_mode(PrivilegeMode::MACHINE)
+    {
+      memory.AddRegion(KERNBASE, ram_size, false, huge_pages).Write(0, binary->data(), binary->size());
+      SetAccessControl(MACHINE, MACHINE, false, false);
+    }
+
+    // Memory is reached inline, anything else goes to the devices
+    template<Translation translation = Translation::Dynamic>
+    void Load(uint64_t addr, int size, uint64_t& data)
+    {
+      if(watch_enabled)
+      {
+        CheckWatchpoints(addr, size, AccessType::Load);
+      }
+      const uint64_t physical_addr = Translate<translation, AccessType::Load>(addr);
+      if(!memory.Load(physical_addr, size, data))
+      {
+        LoadDevice(physical_addr, size, data);
+      }
+    }
+    template<Translation translation = Translation::Dynamic>
+    void Store(uint64_t addr, int size, uint64_t data)
+    {
+      if(watch_enabled)
+      {
+        CheckWatchpoints(addr, size, AccessType::Store);
+      }
+      const uint64_t physical_addr = Translate<translation, AccessType::Store>(addr);
+      if(!memory.Store(physical_addr, size, data))
+      {
+        StoreDevice(physical_addr, size, data);
+      }
+    }
+    // Instructions are only fetched from memory
+    template<Translation translation = Translation::Dynamic>
+    void Fetch(uint64_t addr, int size, uint64_t& data)
+    {
+      if(!memory.Load(Translate<translation, AccessType::Execute>(addr), size, data))
+      {
+        throw CPUTrapException(trap_value::InstructionAccessFault);
+      }
+    }
 
-    void Load(uint64_t addr, int size, uint64_t& data);
-    void Store(uint64_t addr, int size, uint64_t data);
+    // Throws the page or access fault of the access type
+    template<Translation translation = Translation::Dynamic, AccessType type = AccessType::Load>
+    uint64_t Translate(uint64_t virtual_addr)
+    {
+      if constexpr(translation == Translation::Bare)
+      {
+        return virtual_addr;
+      }
+      else
+      {
+        if(physical[type])
+        {
+          if(!pmp.IsActive())
+          {
+            return virtual_addr;
+          }
+          // The TLB holds translations of S/U-mode addresses while paging is on
+          if(paging_mode != Bare)
+          {
+            return CheckPhysical(virtual_addr, type);
+          }
+        }
+        uint64_t physical_addr;
+        if(tlb.Lookup(virtual_addr, required[type], physical_addr))
+        {
+          return physical_addr;
+        }
+        return Walk(virtual_addr, type);
+      }
+    }
+    uint64_t Translate(uint64_t virtual_addr, AccessType type);
+    // The translation the current paging mode allows code to be specialized on, bare
+    // accesses are only unchecked while PMP is off
+    Translation GetTranslation() const
+    {
+      return paging_mode == Bare && !pmp.IsActive() ? Translation::Bare : Translation::Dynamic;
+    }
 
-    uint64_t Translate(uint64_t virtual_addr);
-    Sv39PageTableEntry ParsePageTableEntry(uint64_t pte);
+    // Host address of the start of the guest page holding addr, nullptr unless it is memory the access may use
+    uint8_t* GetHostPage(uint64_t addr, AccessType type);
 
-    void SetPagingMode(PagingMode mode) { paging_mode = mode; }
-    void SetRootPageTable(uint64_t page_table) { root_page_table = page_table; }
-    void SetPrivilegeMode(PrivilegeMode mode) { privilege_mode = mode; }
+    void SetPagingMode(PagingMode mode)
+    {
+      paging_mode = mode;
+      UpdatePhysical();
+      FlushTlb();
+    }
+    void SetRootPageTable(uint64_t page_table) { root_page_table = page_table; FlushTlb(); }
+    void SetPmp(const std::array<uint8_t, PMP_ENTRIES>& cfg, const std::array<uint64_t, PMP_ENTRIES>& addr)
+    {
+      pmp.Update(cfg, addr);
+      FlushTlb();
+    }
+    // mode fetches, data_mode loads and stores, which differ under MPRV. sum and
+    // mxr are the mstatus bits. Cached translations stay valid, each TLB hit is
+    // checked against the new permissions.
+    void SetAccessControl(PrivilegeMode mode, PrivilegeMode data_mode, bool sum, bool mxr);
+
+    PagingMode GetPagingMode() const { return paging_mode; }
+    uint64_t GetRootPageTable() const { return root_page_table; }
+    PrivilegeMode GetPrivilegeMode() const { return privilege_mode; }
+
+    // SFENCE.VMA, with an address it only drops the leaf translations of the address
+    void FlushTlb() { tlb.Flush(); walk_cache.Flush(); }
+    void FlushTlb(uint64_t virtual_addr)
+    {
+      tlb.Flush(virtual_addr);
+      if(paging_mode == Sv32) // both 2 MB halves of a megapage may be cached
+      {
+        tlb.Flush(virtual_addr ^ HUGE_PAGE_SIZE);
+      }
+      else if(paging_mode >= Sv48) // leaves above 1 GB are cached as the gigapages that were used
+      {
+        tlb.FlushGigapages();
+      }
+    }
+
+    // Devices added at runtime are looked up after memory and the built-in devices.
+    // Throws std::runtime_error if the device overlaps memory or another device.
+    void AddDevice(std::unique_ptr<BaseDevice> device);
+
+    // Checkpoint support
+    MemoryMap& GetMemory() { return memory; }
+    std::vector<BaseDevice*> GetDevices() { return {&uart, &virtio, &clint, &plic}; }
+    CLINT<CLINT_BASE, CLINT_SIZE>& GetClint() { return clint; }
+    const CLINT<CLINT_BASE, CLINT_SIZE>& GetClint() const { return clint; }
+
+    // Watchpoints are only looked up while at least one is armed
+    void AddWatchpoint(uint64_t addr, uint64_t len, bool on_load, bool on_store);
+    bool RemoveWatchpoint(uint64_t addr, uint64_t len, bool on_load, bool on_store);
+    // The address of the last access that hit a watchpoint and the watchpoint it hit
+    bool TakeWatchHit(uint64_t& addr, Watchpoint& watchpoint);
+
+    // Debugger access to memory at addresses as the hart fetches them. The page
+    // tables are walked without permission checks, A/D updates or filling the
+    // TLB, watchpoints are not checked and devices are never reached, so
+    // read-only memory can take breakpoints. Returns the bytes copied, which
+    // stop at the first unmapped page.
+    uint64_t DebugRead(uint64_t addr, uint8_t* dst, uint64_t len) const;
+    uint64_t DebugWrite(uint64_t addr, const uint8_t* src, uint64_t len);
 
   private:
 
+    void CheckWatchpoints(uint64_t addr, int size, AccessType type);
+    // Throw an access fault if no device is at physical_addr
+    void LoadDevice(uint64_t physical_addr, int size, uint64_t& data);
+    void StoreDevice(uint64_t physical_addr, int size, uint64_t data);
+    // Page table walk on a TLB miss, fills the TLB
+    uint64_t Walk(uint64_t virtual_addr, AccessType type);
+    template<PagingMode mode>
+    uint64_t Walk(uint64_t virtual_addr, AccessType type);
+    template<PagingMode mode, int level>
+    uint64_t ResumeWalk(uint64_t virtual_addr, AccessType type);
+    template<PagingMode mode, int level>
+    uint64_t WalkLevel(uint64_t virtual_addr, uint64_t table_addr, uint8_t* table, AccessType type);
+    template<typename T>
+    bool UpdateAccessedDirty(uint64_t pte_addr, T pte, T bits, AccessType type);
+    // Bare accesses while PMP is active, cached as identity 4 KB TLB entries
+    uint64_t MapPhysical(uint64_t physical_addr, AccessType type);
+    // M-mode accesses while paging is on, checked against PMP alone on every access
+    uint64_t CheckPhysical(uint64_t physical_addr, AccessType type) const;
+    void UpdatePhysical();
+    // Translation for the debugger, false if addr is not mapped
+    bool DebugTranslate(uint64_t virtual_addr, uint64_t& physical_addr) const;
+    // The PMP grant for the block of 1 << shift bytes at physical_addr, throws the access fault if it denies the access
+    uint16_t CheckPmp(uint64_t physical_addr, int shift, AccessType type, bool& uniform) const;
+    // Page table reads and A/D writes are checked as S-mode accesses
+    void CheckTablePmp(uint64_t physical_addr, uint16_t grant, AccessType type) const;
+
     PagingMode paging_mode;
     PrivilegeMode privilege_mode;
-    int page_size;
-    uint64_t root_page_table;
+    PrivilegeMode data_privilege_mode;
+    // Per AccessType, true if the access skips translation: in M-mode, including
+    // M-mode loads and stores without MPRV, and whenever paging is off
+    std::array<bool, 3> physical {};
+    // PTE bits a TLB entry needs for each AccessType
+    std::array<uint16_t, 3> required {};
+    uint64_t root_page_table = 0;
+    Tlb tlb;
+    PageWalkCache walk_cache;
+    Pmp pmp;
+    std::vector<Watchpoint> watchpoints;
+    bool watch_enabled = false;
+    bool watch_hit = false;
+    uint64_t watch_hit_addr = 0;
+    Watchpoint watch_hit_point {};
     // Devices
-    RAM<KERNBASE, MEMORY_SIZE> ram;
+    MemoryMap memory;
     UART<UART_BASE, UART_SIZE> uart;
     VIRTIO<VIRTIO_BASE, VIRTIO_SIZE> virtio;
     CLINT<CLINT_BASE, CLINT_SIZE> clint;
     PLIC<PLIC_BASE, PLIC_SIZE> plic;
+    std::vector<std::unique_ptr<BaseDevice>> devices;
 
 };
 
@@ -0,0 +1,75 @@
+#ifndef PMP_H
+#define PMP_H
+
+#include <array>
+#include <cstdint>
+#include <vector>
+#include "config.h"
+
+// Physical memory protection
+// The pmpcfg and pmpaddr CSRs are decoded into address ranges when one is
+// written, and the MMU asks for the permissions of whole pages so it can keep
+// them in TLB entries next to the page table bits. Accesses to a page no range
+// splits are then checked by the TLB hit alone, the ranges are only searched on
+// a miss. While every entry is OFF nothing is restricted, as if the hart had no
+// PMP, so guests that never configure it run unchanged.
+
+// pmpcfg fields
+enum PMP_CFG : uint8_t
+{
+  pmpcfg_r = 1 << 0,
+  pmpcfg_w = 1 << 1,
+  pmpcfg_x = 1 << 2,
+  pmpcfg_a = 3 << 3,
+  pmpcfg_l = 1 << 7
+};
+
+enum PMP_MODE : uint8_t
+{
+  pmp_off = 0,
+  pmp_tor = 1,
+  pmp_na4 = 2,
+  pmp_napot = 3
+};
+
+// Permissions granted to S/U-mode and to M-mode, as TLB entry flags above the PTE bits
+enum PMP_GRANT : uint16_t
+{
+  pmp_read = 1 << 10,
+  pmp_write = 1 << 11,
+  pmp_execute = 1 << 12,
+  pmp_machine_read = 1 << 13,
+  pmp_machine_write = 1 << 14,
+  pmp_machine_execute = 1 << 15,
+  pmp_all = 0xfc00
+};
+
+typedef struct PmpRegion
+{
+  uint64_t base;
+  uint64_t end; // exclusive
+  uint8_t cfg;
+} PmpRegion;
+
+class Pmp
+{
+  public:
+
+    // One pmpcfg byte and pmpaddr value per entry
+    void Update(const std::array<uint8_t, PMP_ENTRIES>& cfg, const std::array<uint64_t, PMP_ENTRIES>& addr);
+    bool IsActive() const { return active; }
+
+    // PMP_GRANT flags at addr. uniform tells if they hold for the whole naturally
+    // aligned block of 1 << shift bytes around it.
+    uint16_t Grant(uint64_t addr, int shift, bool& uniform) const;
+
+  private:
+
+    static uint16_t GrantOf(const PmpRegion* region);
+
+    bool active = false;
+    std::vector<PmpRegion> regions; // enabled entries by priority, the ones that match nothing left out
+
+};
+
+#endif
@@ -2,40 +2,161 @@
 #define RAM_H
 
 #include <cstdint>
-#include <array>
 #include <memory>
-#include <iostream>
 #include <cstring>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
 #include "base_device.h"
+#include "config.h"
 #include "trap.h"
 
-template <uint64_t base_addr_mem, uint64_t size_mem>
+// One RAM or ROM region of the physical memory map, see memory_map.h
 class RAM : public BaseDevice
 {
   public:
 
-    RAM(const std::shared_ptr<std::vector<uint8_t>>& binary) : mem()
+    // Regions that are a whole number of 2 MB pages come from the hugetlbfs pool
+    // when it has room for them, reserved at once so a short pool fails here rather
+    // than on a later page fault. Otherwise they are a lazily populated anonymous
+    // mapping, untouched guest pages cost no host memory, 2 MB aligned in the host
+    // and advised for transparent huge pages so the host faults them in 2 MB at a time.
+    // Without huge_pages the host backs the region with 4 KB pages only, so a guest
+    // that touches little memory costs little.
+    RAM(uint64_t base, uint64_t length, bool rom = false, bool huge_pages = true) :
+    base_addr(base),
+    size(length),
+    read_only(rom)
     {
-      std::copy(binary->begin(), binary->end(), mem.begin());
+      if(size == 0 || base_addr % PAGE_SIZE != 0 || size % PAGE_SIZE != 0)
+      {
+        throw std::runtime_error("Memory regions must be page aligned");
+      }
+      if(huge_pages && size % HUGE_PAGE_SIZE == 0)
+      {
+        void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(addr != MAP_FAILED)
+        {
+          mem = static_cast<uint8_t*>(addr);
+          hugetlb = true;
+          return;
+        }
+      }
+      const bool huge = huge_pages && size >= HUGE_PAGE_SIZE;
+      const uint64_t reserved = huge ? size + HUGE_PAGE_SIZE : size;
+      void* addr = mmap(nullptr, reserved, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if(addr == MAP_FAILED)
+      {
+        throw std::runtime_error("Could not allocate guest RAM");
+      }
+      mem = static_cast<uint8_t*>(addr);
+      if(huge)
+      {
+        uint8_t* aligned = reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(mem) + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+        if(aligned != mem)
+        {
+          munmap(mem, aligned - mem);
+        }
+        munmap(aligned + size, mem + reserved - (aligned + size));
+        mem = aligned;
+        madvise(mem, size, MADV_HUGEPAGE);
+      }
+      else
+      {
+        madvise(mem, size, MADV_NOHUGEPAGE);
+      }
+    }
+
+    RAM(RAM&& other) noexcept :
+    mem(other.mem), base_addr(other.base_addr), size(other.size), read_only(other.read_only), hugetlb(other.hugetlb)
+    {
+      other.mem = nullptr;
+    }
+    RAM(const RAM&) = delete;
+    RAM& operator=(const RAM&) = delete;
+
+    ~RAM()
+    {
+      if(mem != nullptr)
+      {
+        munmap(mem, size);
+      }
     }
 
     void Load(uint64_t addr, int size, uint64_t& data) override;
     void Store(uint64_t addr, int size, uint64_t data) override;
 
-    constexpr uint64_t GetBaseAddr() override { return base_addr; }
-    constexpr uint64_t GetSize() override { return size; }
-    constexpr bool IsValidAddr(uint64_t addr) override { return addr >= base_addr && addr < base_addr + size; }
+    uint64_t GetBaseAddr() override { return base_addr; }
+    uint64_t GetSize() override { return size; }
+    bool IsValidAddr(uint64_t addr) override { return addr >= base_addr && addr - base_addr < size; }
+
+    uint8_t* GetHostMemory() { return mem; }
+    bool IsReadOnly() const { return read_only; }
+    bool IsHugeTlb() const { return hugetlb; }
+
+    // Drops every page, the guest sees zeroed memory again
+    void Reset()
+    {
+      if(madvise(mem, size, MADV_DONTNEED) != 0)
+      {
+        std::memset(mem, 0, size);
+      }
+    }
+
+    // Copies an image to offset, ignoring read-only so ROMs can be loaded. All-zero
+    // pages are skipped to keep them unmaterialized.
+    void Write(uint64_t offset, const uint8_t* src, uint64_t len)
+    {
+      if(offset > size || len > size - offset)
+      {
+        throw std::runtime_error("Image does not fit in guest memory");
+      }
+      for(uint64_t done = 0; done < len;)
+      {
+        const uint64_t n = std::min<uint64_t>(PAGE_SIZE - (offset + done) % PAGE_SIZE, len - done);
+        const uint8_t* start = src + done;
+        if(std::any_of(start, start + n, [](uint8_t b) { return b != 0; }))
+        {
+          std::memcpy(mem + offset + done, start, n);
+        }
+        done += n;
+      }
+    }
+
+    // Maps [file_offset, file_offset + len) of fd copy-on-write over guest offset ram_offset.
+    // Huge TLB pages cannot be partly replaced by a file mapping, those read the range in.
+    void MapFile(int fd, uint64_t file_offset, uint64_t ram_offset, uint64_t len)
+    {
+      if(ram_offset + len > size)
+      {
+        throw std::runtime_error("Could not map RAM image");
+      }
+      if(hugetlb)
+      {
+        if(pread(fd, mem + ram_offset, len, file_offset) != static_cast<ssize_t>(len))
+        {
+          throw std::runtime_error("Could not read RAM image");
+        }
+      }
+      else if(mmap(mem + ram_offset, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, file_offset) == MAP_FAILED)
+      {
+        throw std::runtime_error("Could not map RAM image");
+      }
+    }
 
   private:
 
-    std::array<uint8_t, size_mem> mem;
-    static constexpr uint64_t base_addr = base_addr_mem;
-    static constexpr uint64_t size = size_mem;
+    uint8_t* mem = nullptr;
+    uint64_t base_addr;
+    uint64_t size;
+    bool read_only;
+    bool hugetlb = false;
 
 };
 
-template<uint64_t base_addr_mem, uint64_t size_mem>
-void RAM<base_addr_mem, size_mem>::Load(uint64_t addr, int size, uint64_t& data)
+inline void RAM::Load(uint64_t addr, int size, uint64_t& data)
 {
   auto index = addr - base_addr;
   switch(size)
@@ -57,10 +178,13 @@ void RAM<base_addr_mem, size_mem>::Load(uint64_t addr, int size, uint64_t& data)
   }
 }
 
-template<uint64_t base_addr_mem, uint64_t size_mem>
-void RAM<base_addr_mem, size_mem>::Store(uint64_t addr, int size, uint64_t data)
+inline void RAM::Store(uint64_t addr, int size, uint64_t data)
 {
   auto index = addr - base_addr;
+  if(read_only)
+  {
+    throw CPUTrapException(trap_value::StoreAMOAccessFault);
+  }
   switch(size)
   {
     case 1:
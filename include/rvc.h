@@ -0,0 +1,18 @@
+#ifndef RVC_H
+#define RVC_H
+
+#include <cstdint>
+
+// RV32C and RV64C compressed instructions
+// Every 16-bit instruction is expanded into its 32-bit equivalent, so the regular
+// handlers execute it. The CPU records the real instruction length for pc-relative math.
+// The two differ in a few encodings, C.JAL on RV32 is C.ADDIW on RV64, and the
+// doubleword loads and stores are single-precision ones on RV32, which has no F here.
+
+constexpr bool IsCompressed(uint32_t instruction) { return (instruction & 0x3) != 0x3; }
+
+// Throws CPUTrapException(IllegalInstruction) for reserved encodings, xlen is 32 or 64
+template<int xlen = 64>
+uint32_t ExpandCompressed(uint16_t instruction);
+
+#endif
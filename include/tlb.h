@@ -0,0 +1,159 @@
+#ifndef TLB_H
+#define TLB_H
+
+#include <cstdint>
+#include <array>
+#include "config.h"
+
+// Translation lookaside buffer
+// One direct-mapped array per leaf size, so a 2 MB megapage or 1 GB gigapage
+// takes a single entry however much of it the guest touches. Lookups probe the
+// 4 KB array first, a kernel that maps RAM with superpages misses there and hits
+// in the small superpage arrays, which stay resident in the host cache.
+// Entries are not tagged with an ASID, satp writes flush everything. Each keeps
+// the leaf's permission bits (see PTE in mmu.h), a hit that lacks one the access
+// needs counts as a miss and the walk raises the fault.
+
+typedef struct TlbEntry
+{
+  uint64_t vpn = ~0ULL; // virtual address >> page shift, ~0 when empty
+  uint64_t ppn = 0;     // physical address >> page shift
+  uint16_t flags = 0;   // PTE bits of the leaf
+} TlbEntry;
+
+class Tlb
+{
+  public:
+
+    // required are the flags the access needs
+    bool Lookup(uint64_t virtual_addr, uint16_t required, uint64_t& physical_addr) const
+    {
+      return Probe<0>(pages, virtual_addr, required, physical_addr)
+             || Probe<1>(megapages, virtual_addr, required, physical_addr)
+             || Probe<2>(gigapages, virtual_addr, required, physical_addr);
+    }
+
+    // level is the page table level of the leaf: 0 for 4 KB, 1 for 2 MB and 2 or more for 1 GB pages
+    void Insert(uint64_t virtual_addr, uint64_t physical_addr, int level, uint16_t flags)
+    {
+      switch(level)
+      {
+        case 0:
+          Fill<0>(pages, virtual_addr, physical_addr, flags);
+          break;
+        case 1:
+          Fill<1>(megapages, virtual_addr, physical_addr, flags);
+          break;
+        default:
+          Fill<2>(gigapages, virtual_addr, physical_addr, flags);
+          break;
+      }
+    }
+
+    void Flush()
+    {
+      pages.fill(TlbEntry{});
+      megapages.fill(TlbEntry{});
+      gigapages.fill(TlbEntry{});
+    }
+
+    // Drops the entry of every size that could translate virtual_addr
+    void Flush(uint64_t virtual_addr)
+    {
+      Drop<0>(pages, virtual_addr);
+      Drop<1>(megapages, virtual_addr);
+      Drop<2>(gigapages, virtual_addr);
+    }
+
+    void FlushGigapages() { gigapages.fill(TlbEntry{}); }
+
+  private:
+
+    template<int level>
+    static constexpr int shift = 12 + 9 * level;
+
+    template<int level, size_t N>
+    static bool Probe(const std::array<TlbEntry, N>& set, uint64_t virtual_addr, uint16_t required,
+                      uint64_t& physical_addr)
+    {
+      const uint64_t vpn = virtual_addr >> shift<level>;
+      const TlbEntry& entry = set[vpn & (N - 1)];
+      if(entry.vpn != vpn || (entry.flags & required) != required)
+      {
+        return false;
+      }
+      physical_addr = (entry.ppn << shift<level>) | (virtual_addr & ((1ULL << shift<level>) - 1));
+      return true;
+    }
+
+    template<int level, size_t N>
+    static void Fill(std::array<TlbEntry, N>& set, uint64_t virtual_addr, uint64_t physical_addr, uint16_t flags)
+    {
+      const uint64_t vpn = virtual_addr >> shift<level>;
+      set[vpn & (N - 1)] = TlbEntry{.vpn = vpn, .ppn = physical_addr >> shift<level>, .flags = flags};
+    }
+
+    template<int level, size_t N>
+    static void Drop(std::array<TlbEntry, N>& set, uint64_t virtual_addr)
+    {
+      const uint64_t vpn = virtual_addr >> shift<level>;
+      if(set[vpn & (N - 1)].vpn == vpn)
+      {
+        set[vpn & (N - 1)] = TlbEntry{};
+      }
+    }
+
+    std::array<TlbEntry, TLB_SIZE> pages {};
+    std::array<TlbEntry, TLB_SIZE / 8> megapages {};
+    std::array<TlbEntry, TLB_SIZE / 32> gigapages {};
+
+};
+
+// Page walk cache
+// Remembers the tables below the root that walks went through, by the virtual
+// address bits that selected them, so a TLB miss usually reads only the leaf
+// entry. Tables are kept as host addresses and read in place. The entries are
+// non-leaf PTEs, which SFENCE.VMA with an address does not order, only a full
+// fence or a satp write drops them.
+
+typedef struct WalkCacheEntry
+{
+  uint64_t prefix = ~0ULL; // virtual address >> shift of the level above the table, ~0 when empty
+  uint64_t table_addr = 0; // physical
+  uint8_t* table = nullptr;
+} WalkCacheEntry;
+
+class PageWalkCache
+{
+  public:
+
+    // Tables below the root of an Sv57 walk
+    static constexpr int LEVELS = 4;
+
+    // The table at level that prefix selects, nullptr if it is not cached
+    const WalkCacheEntry* Lookup(int level, uint64_t prefix) const
+    {
+      const WalkCacheEntry& entry = sets[level][prefix & (WALK_CACHE_SIZE - 1)];
+      return entry.prefix == prefix ? &entry : nullptr;
+    }
+
+    void Insert(int level, uint64_t prefix, uint64_t table_addr, uint8_t* table)
+    {
+      sets[level][prefix & (WALK_CACHE_SIZE - 1)] = WalkCacheEntry{.prefix = prefix, .table_addr = table_addr, .table = table};
+    }
+
+    void Flush()
+    {
+      for(auto& set : sets)
+      {
+        set.fill(WalkCacheEntry{});
+      }
+    }
+
+  private:
+
+    std::array<std::array<WalkCacheEntry, WALK_CACHE_SIZE>, LEVELS> sets {};
+
+};
+
+#endif
@@ -4,8 +4,8 @@
 #include <iostream>
 #include <stdexcept>
 
+// mcause and scause hold it at bit XLEN - 1, see CPU::HandleTrap
 static constexpr uint64_t interrupt_bit = 0x8000000000000000;
-// static constexpr uint32_t interrupt_bit = 0x80000000; if xlen is 32 bit TODO(jrola): implement
 
 enum trap_value : uint64_t
 {
@@ -37,7 +37,9 @@ enum trap_value : uint64_t
 class CPUTrapException : public std::exception
 {
   public:
-    CPUTrapException(const trap_value trap) : trap(trap) {}
+    // tval is the value written to mtval or stval, the faulting address for
+    // page faults and misaligned accesses and 0 otherwise
+    CPUTrapException(const trap_value trap, uint64_t tval = 0) : trap(trap), tval(tval) {}
     virtual const char* what() const noexcept override
     {
       switch(trap)
@@ -93,8 +95,10 @@ class CPUTrapException : public std::exception
       }
     }
     trap_value GetTrap() const { return trap; }
+    uint64_t GetTval() const { return tval; }
   private:
     const trap_value trap;
+    const uint64_t tval;
 };
 
 #endif
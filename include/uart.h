@@ -2,6 +2,9 @@
 #define UART_H
 
 #include <thread>
+#include <array>
+#include <cstring>
+#include <algorithm>
 #include "base_device.h"
 #include "config.h"
 
@@ -42,6 +45,12 @@ class UART : public BaseDevice
     constexpr uint64_t GetSize() override { return size; }
     constexpr bool IsValidAddr(uint64_t addr) override { return addr >= base_addr && addr < base_addr + size; }
 
+    void SaveState(std::vector<uint8_t>& out) override { out.insert(out.end(), buffer.begin(), buffer.end()); }
+    void RestoreState(const uint8_t* data, size_t size) override
+    {
+      std::memcpy(buffer.data(), data, std::min(size, buffer.size()));
+    }
+
   private:
 
     static constexpr uint64_t base_addr = base_addr_mem;
@@ -0,0 +1,33 @@
+#ifndef VECTOR_H
+#define VECTOR_H
+
+#include <cstdint>
+#include <span>
+#include "config.h"
+
+// RVV 1.0 vector unit
+// Registers are stored back to back in one aligned block, so a register group of
+// any LMUL is a single run of bytes that the host SIMD kernels can stream over.
+
+constexpr int VLENB = VLEN / 8;
+constexpr int ELEN = 64;
+
+static_assert(VLEN >= 128 && VLEN <= 1024 && (VLEN & (VLEN - 1)) == 0, "VLEN must be a power of two from 128 to 1024");
+
+// vtype fields
+constexpr uint64_t vtype_vill = 1ULL << 63;
+
+typedef struct VectorState
+{
+  alignas(64) uint8_t regs[N_REG * VLENB];
+  uint64_t vl;
+  uint64_t vtype;
+  uint64_t vstart;
+  uint64_t vxrm;
+  uint64_t vxsat;
+} VectorState;
+
+typedef struct Instruction Instruction;
+extern const std::span<const Instruction> vector_instructions;
+
+#endif
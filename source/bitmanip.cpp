@@ -0,0 +1,376 @@
+#include "cpu.h"
+#include "instruction.h"
+#include <algorithm>
+#include <bit>
+
+// Zba, Zbb and Zbs extensions
+//
+// Each instruction replaces a sequence of several base instructions, so the
+// handlers are kept to a single host operation where one exists. Counting and
+// byte reversal go through compiler builtins, which lower to lzcnt, tzcnt,
+// popcnt and bswap when the host target has them (see the NATIVE option).
+
+static inline uint64_t Zext32(uint64_t val)
+{
+  return val & 0xffffffff;
+}
+
+static inline uint64_t Sext32(uint64_t val)
+{
+  return static_cast<int64_t>(static_cast<int32_t>(val));
+}
+
+static inline uint64_t CountLeadingZeros(uint64_t val)
+{
+  return val ? __builtin_clzll(val) : 64;
+}
+
+static inline uint64_t CountTrailingZeros(uint64_t val)
+{
+  return val ? __builtin_ctzll(val) : 64;
+}
+
+static inline uint64_t CountLeadingZerosWord(uint64_t val)
+{
+  const uint32_t word = static_cast<uint32_t>(val);
+  return word ? __builtin_clz(word) : 32;
+}
+
+static inline uint64_t CountTrailingZerosWord(uint64_t val)
+{
+  const uint32_t word = static_cast<uint32_t>(val);
+  return word ? __builtin_ctz(word) : 32;
+}
+
+// Sets every byte that has any bit set to 0xff
+static inline uint64_t OrCombineBytes(uint64_t val)
+{
+  constexpr uint64_t low7 = 0x7f7f7f7f7f7f7f7f;
+  const uint64_t high = (((val & low7) + low7) | val) & ~low7;
+  return (high >> 7) * 0xff;
+}
+
+// Register-register form, rd = op(rs1, rs2)
+template<uint64_t (*op)(uint64_t, uint64_t)>
+static void RegisterOp(const uint32_t instruction, CPU& cpu)
+{
+  const InstructionFields fields = parse_instruction<'R'>(instruction);
+  cpu.SetReg(fields.rd, op(cpu.GetReg(fields.rs1), cpu.GetReg(fields.rs2)));
+}
+
+// Shift-immediate form, rd = op(rs1, shamt)
+template<uint64_t (*op)(uint64_t, uint64_t)>
+static void ImmediateOp(const uint32_t instruction, CPU& cpu)
+{
+  const InstructionFields fields = parse_instruction<'I'>(instruction);
+  cpu.SetReg(fields.rd, op(cpu.GetReg(fields.rs1), fields.imm & 0x3f));
+}
+
+// Single-source form, rd = op(rs1)
+template<uint64_t (*op)(uint64_t)>
+static void UnaryOp(const uint32_t instruction, CPU& cpu)
+{
+  const InstructionFields fields = parse_instruction<'I'>(instruction);
+  cpu.SetReg(fields.rd, op(cpu.GetReg(fields.rs1)));
+}
+
+static const Instruction bitmanip_table[] = {
+  // Zba
+  // ----------------------------------------
+  {
+    .name = "SH1ADD",
+    .format = 'R',
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x20002033,
+    .execute = RegisterOp<[](uint64_t a, uint64_t b) { return b + (a << 1); }>
+  },
+  {
+    .name = "SH2ADD",
+    .format = 'R',
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x20004033,
+    .execute = RegisterOp<[](uint64_t a, uint64_t b) { return b + (a << 2); }>
+  },
+  {
+    .name = "SH3ADD",
+    .format = 'R',
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x20006033,
+    .execute = RegisterOp<[](uint64_t a, uint64_t b) { return b + (a << 3); }>
+  },
+  {
+    .name = "ADD.UW",
+    .format = 'R',
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x0800003b,
+    .execute = RegisterOp<[](uint64_t a, uint64_t b) { return b + Zext32(a); }>
+  },
+  {
+    .name = "SH1ADD.UW",
+    .format = 'R',
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x2000203b,
+    .execute = RegisterOp<[](uint64_t a, uint64_t b) { return b + (Zext32(a) << 1); }>
+  },
+  {
+    .name = "SH2ADD.UW",
+    .format = 'R',
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x2000403b,
+    .execute = RegisterOp<[](uint64_t a, uint64_t b) { return b + (Zext32(a) << 2); }>
+  },
+  {
+    .name = "SH3ADD.UW",
+    .format = 'R',
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x2000603b,
+    .execute = RegisterOp<[](uint64_t a, uint64_t b) { return b + (Zext32(a) << 3); }>
+  },
+  {
+    .name = "SLLI.UW",
+    .format = 'I',
+    .mask_field = 0xfc00707f,
+    .instruction_matcher = 0x0800101b,
+    .execute = ImmediateOp<[](uint64_t a, uint64_t shamt) { return Zext32(a) << shamt; }>
+  },
+  // Zbb
+  // ----------------------------------------
+  {
+    .name = "ANDN",
+    .format = 'R',
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x40007033,
+    .execute = RegisterOp<[](uint64_t a, uint64_t b) { return a & ~b; }>
+  },
+  {
+    .name = "ORN",
+    .format = 'R',
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x40006033,
+    .execute = RegisterOp<[](uint64_t a, uint64_t b) { return a | ~b; }>
+  },
+  {
+    .name = "XNOR",
+    .format = 'R',
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x40004033,
+    .execute = RegisterOp<[](uint64_t a, uint64_t b) { return ~(a ^ b); }>
+  },
+  {
+    .name = "CLZ",
+    .format = 'I',
+    .mask_field = 0xfff0707f,
+    .instruction_matcher = 0x60001013,
+    .execute = UnaryOp<CountLeadingZeros>
+  },
+  {
+    .name = "CLZW",
+    .format = 'I',
+    .mask_field = 0xfff0707f,
+    .instruction_matcher = 0x6000101b,
+    .execute = UnaryOp<CountLeadingZerosWord>
+  },
+  {
+    .name = "CTZ",
+    .format = 'I',
+    .mask_field = 0xfff0707f,
+    .instruction_matcher = 0x60101013,
+    .execute = UnaryOp<CountTrailingZeros>
+  },
+  {
+    .name = "CTZW",
+    .format = 'I',
+    .mask_field = 0xfff0707f,
+    .instruction_matcher = 0x6010101b,
+    .execute = UnaryOp<CountTrailingZerosWord>
+  },
+  {
+    .name = "CPOP",
+    .format = 'I',
+    .mask_field = 0xfff0707f,
+    .instruction_matcher = 0x60201013,
+    .execute = UnaryOp<[](uint64_t a) -> uint64_t { return __builtin_popcountll(a); }>
+  },
+  {
+    .name = "CPOPW",
+    .format = 'I',
+    .mask_field = 0xfff0707f,
+    .instruction_matcher = 0x6020101b,
+    .execute = UnaryOp<[](uint64_t a) -> uint64_t { return __builtin_popcount(static_cast<uint32_t>(a)); }>
+  },
+  {
+    .name = "MAX",
+    .format = 'R',
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x0a006033,
+    .execute = RegisterOp<[](uint64_t a, uint64_t b) -> uint64_t {
+      return std::max(static_cast<int64_t>(a), static_cast<int64_t>(b));
+    }>
+  },
+  {
+    .name = "MAXU",
+    .format = 'R',
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x0a007033,
+    .execute = RegisterOp<[](uint64_t a, uint64_t b) { return std::max(a, b); }>
+  },
+  {
+    .name = "MIN",
+    .format = 'R',
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x0a004033,
+    .execute = RegisterOp<[](uint64_t a, uint64_t b) -> uint64_t {
+      return std::min(static_cast<int64_t>(a), static_cast<int64_t>(b));
+    }>
+  },
+  {
+    .name = "MINU",
+    .format = 'R',
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x0a005033,
+    .execute = RegisterOp<[](uint64_t a, uint64_t b) { return std::min(a, b); }>
+  },
+  {
+    .name = "SEXT.B",
+    .format = 'I',
+    .mask_field = 0xfff0707f,
+    .instruction_matcher = 0x60401013,
+    .execute = UnaryOp<[](uint64_t a) -> uint64_t { return static_cast<int64_t>(static_cast<int8_t>(a)); }>
+  },
+  {
+    .name = "SEXT.H",
+    .format = 'I',
+    .mask_field = 0xfff0707f,
+    .instruction_matcher = 0x60501013,
+    .execute = UnaryOp<[](uint64_t a) -> uint64_t { return static_cast<int64_t>(static_cast<int16_t>(a)); }>
+  },
+  {
+    .name = "ZEXT.H",
+    .format = 'I',
+    .mask_field = 0xfff0707f,
+    .instruction_matcher = 0x0800403b,
+    .execute = UnaryOp<[](uint64_t a) { return a & 0xffff; }>
+  },
+  {
+    .name = "ROL",
+    .format = 'R',
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x60001033,
+    .execute = RegisterOp<[](uint64_t a, uint64_t b) { return std::rotl(a, b & 0x3f); }>
+  },
+  {
+    .name = "ROLW",
+    .format = 'R',
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x6000103b,
+    .execute = RegisterOp<[](uint64_t a, uint64_t b) {
+      return Sext32(std::rotl(static_cast<uint32_t>(a), b & 0x1f));
+    }>
+  },
+  {
+    .name = "ROR",
+    .format = 'R',
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x60005033,
+    .execute = RegisterOp<[](uint64_t a, uint64_t b) { return std::rotr(a, b & 0x3f); }>
+  },
+  {
+    .name = "RORI",
+    .format = 'I',
+    .mask_field = 0xfc00707f,
+    .instruction_matcher = 0x60005013,
+    .execute = ImmediateOp<[](uint64_t a, uint64_t shamt) { return std::rotr(a, shamt); }>
+  },
+  {
+    .name = "RORIW",
+    .format = 'I',
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x6000501b,
+    .execute = ImmediateOp<[](uint64_t a, uint64_t shamt) {
+      return Sext32(std::rotr(static_cast<uint32_t>(a), shamt & 0x1f));
+    }>
+  },
+  {
+    .name = "RORW",
+    .format = 'R',
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x6000503b,
+    .execute = RegisterOp<[](uint64_t a, uint64_t b) {
+      return Sext32(std::rotr(static_cast<uint32_t>(a), b & 0x1f));
+    }>
+  },
+  {
+    .name = "ORC.B",
+    .format = 'I',
+    .mask_field = 0xfff0707f,
+    .instruction_matcher = 0x28705013,
+    .execute = UnaryOp<OrCombineBytes>
+  },
+  {
+    .name = "REV8",
+    .format = 'I',
+    .mask_field = 0xfff0707f,
+    .instruction_matcher = 0x6b805013,
+    .execute = UnaryOp<[](uint64_t a) -> uint64_t { return __builtin_bswap64(a); }>
+  },
+  // Zbs
+  // ----------------------------------------
+  {
+    .name = "BCLR",
+    .format = 'R',
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x48001033,
+    .execute = RegisterOp<[](uint64_t a, uint64_t b) { return a & ~(uint64_t{1} << (b & 0x3f)); }>
+  },
+  {
+    .name = "BCLRI",
+    .format = 'I',
+    .mask_field = 0xfc00707f,
+    .instruction_matcher = 0x48001013,
+    .execute = ImmediateOp<[](uint64_t a, uint64_t shamt) { return a & ~(uint64_t{1} << shamt); }>
+  },
+  {
+    .name = "BEXT",
+    .format = 'R',
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x48005033,
+    .execute = RegisterOp<[](uint64_t a, uint64_t b) { return (a >> (b & 0x3f)) & 1; }>
+  },
+  {
+    .name = "BEXTI",
+    .format = 'I',
+    .mask_field = 0xfc00707f,
+    .instruction_matcher = 0x48005013,
+    .execute = ImmediateOp<[](uint64_t a, uint64_t shamt) { return (a >> shamt) & 1; }>
+  },
+  {
+    .name = "BINV",
+    .format = 'R',
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x68001033,
+    .execute = RegisterOp<[](uint64_t a, uint64_t b) { return a ^ (uint64_t{1} << (b & 0x3f)); }>
+  },
+  {
+    .name = "BINVI",
+    .format = 'I',
+    .mask_field = 0xfc00707f,
+    .instruction_matcher = 0x68001013,
+    .execute = ImmediateOp<[](uint64_t a, uint64_t shamt) { return a ^ (uint64_t{1} << shamt); }>
+  },
+  {
+    .name = "BSET",
+    .format = 'R',
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x28001033,
+    .execute = RegisterOp<[](uint64_t a, uint64_t b) { return a | (uint64_t{1} << (b & 0x3f)); }>
+  },
+  {
+    .name = "BSETI",
+    .format = 'I',
+    .mask_field = 0xfc00707f,
+    .instruction_matcher = 0x28001013,
+    .execute = ImmediateOp<[](uint64_t a, uint64_t shamt) { return a | (uint64_t{1} << shamt); }>
+  }
+};
+
+const std::span<const Instruction> bitmanip_instructions = bitmanip_table;
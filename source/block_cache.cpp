@@ -0,0 +1,173 @@
+#include "block_cache.h"
+#include <algorithm>
+
+Block* BlockCache::Insert(std::unique_ptr<Block> block)
+{
+  Block* inserted = block.get();
+  auto& slot = by_pc[inserted->priv][inserted->pc];
+  if(slot != nullptr)
+  {
+    Remove(slot.get());
+  }
+  by_pc[inserted->priv][inserted->pc] = std::move(block);
+  by_page[inserted->physical_page].push_back(inserted);
+  recent[Slot(inserted->pc)] = inserted;
+  stats.built++;
+  return inserted;
+}
+
+void BlockCache::Link(Block& from, int exit, Block& to)
+{
+  if(from.link[exit] != nullptr)
+  {
+    auto& old = from.link[exit]->predecessors;
+    old.erase(std::find(old.begin(), old.end(), &from));
+  }
+  from.link[exit] = &to;
+  to.predecessors.push_back(&from);
+}
+
+void BlockCache::Remove(Block* block)
+{
+  for(Block* successor : block->link)
+  {
+    if(successor != nullptr)
+    {
+      auto& predecessors = successor->predecessors;
+      predecessors.erase(std::find(predecessors.begin(), predecessors.end(), block));
+    }
+  }
+  for(Block* predecessor : block->predecessors)
+  {
+    for(Block*& link : predecessor->link)
+    {
+      if(link == block)
+      {
+        link = nullptr;
+      }
+    }
+  }
+  auto& page = by_page[block->physical_page];
+  page.erase(std::find(page.begin(), page.end(), block));
+  if(page.empty())
+  {
+    by_page.erase(block->physical_page);
+  }
+  if(recent[Slot(block->pc)] == block)
+  {
+    recent[Slot(block->pc)] = nullptr;
+  }
+  stats.invalidated++;
+  by_pc[block->priv].erase(block->pc);
+}
+
+void BlockCache::Flush()
+{
+  for(auto& blocks : by_pc)
+  {
+    stats.invalidated += blocks.size();
+    blocks.clear();
+  }
+  by_page.clear();
+  recent.fill(nullptr);
+  sync_requested = false;
+}
+
+void BlockCache::SyncCode(MemoryMap& memory)
+{
+  sync_requested = false;
+  std::vector<uint64_t> written;
+  for(const auto& [page, blocks] : by_page)
+  {
+    if(memory.IsDirty(page << 12, code_epoch))
+    {
+      written.push_back(page);
+    }
+  }
+  for(const uint64_t page : written)
+  {
+    // Copied, Remove edits the page's list
+    const std::vector<Block*> blocks = by_page[page];
+    for(Block* block : blocks)
+    {
+      Remove(block);
+    }
+  }
+  // The cache holds the epoch it last synced at, the history before it belongs to other clients
+  const uint64_t next = memory.AdvanceEpoch();
+  memory.HoldEpoch(next);
+  if(code_epoch != 0)
+  {
+    memory.ReleaseEpoch(code_epoch);
+  }
+  code_epoch = next;
+}
+
+// The exit a trace follows out of block, -1 if it has no static exit or its
+// branch is not biased enough to be worth a guard
+static int TraceExit(const Block& block)
+{
+  if(block.exit_pc[0] == no_exit)
+  {
+    return block.exit_pc[1] == no_exit ? -1 : 1;
+  }
+  if(block.exit_pc[1] == no_exit)
+  {
+    return 0;
+  }
+  const uint64_t total = static_cast<uint64_t>(block.taken[0]) + block.taken[1];
+  const int exit = block.taken[0] >= block.taken[1] ? 0 : 1;
+  const bool biased = total >= TRACE_HOT_THRESHOLD / 2 && block.taken[exit] * 100ULL >= total * TRACE_BIAS_PERCENT;
+  return biased ? exit : -1;
+}
+
+Block* BlockCache::FormTrace(Block& head)
+{
+  std::vector<Block*> path = {&head};
+  std::vector<int> exits;
+  size_t length = head.code.size();
+  while(true)
+  {
+    Block* block = path.back();
+    const int exit = TraceExit(*block);
+    Block* next = exit < 0 ? nullptr : block->link[exit];
+    if(next == nullptr || next->trace || next->generation != generation || next->priv != head.priv
+       || next->translation != head.translation
+       || next->physical_page != head.physical_page || length + next->code.size() > TRACE_MAX_INSTRUCTIONS
+       || std::find(path.begin(), path.end(), next) != path.end())
+    {
+      break;
+    }
+    exits.push_back(exit);
+    path.push_back(next);
+    length += next->code.size();
+  }
+  if(path.size() < 2)
+  {
+    return nullptr;
+  }
+
+  auto trace = std::make_unique<Block>();
+  trace->pc = head.pc;
+  trace->physical_page = head.physical_page;
+  trace->priv = head.priv;
+  trace->translation = head.translation;
+  trace->generation = generation;
+  trace->trace = true;
+  trace->code.reserve(length);
+  for(size_t i = 0; i < path.size(); i++)
+  {
+    trace->code.insert(trace->code.end(), path[i]->code.begin(), path[i]->code.end());
+    const bool branch = path[i]->exit_pc[0] != no_exit && path[i]->exit_pc[1] != no_exit;
+    if(i + 1 < path.size() && branch)
+    {
+      trace->guards.push_back(TraceGuard{.end = static_cast<uint32_t>(trace->code.size()), .pc = path[i]->exit_pc[exits[i]]});
+    }
+  }
+  trace->exit_pc = path.back()->exit_pc;
+  stats.traces++;
+  stats.trace_blocks += path.size();
+  stats.trace_instructions += length;
+  // Replaces head, whose predecessors link to the trace once they are taken again
+  return Insert(std::move(trace));
+}
@@ -0,0 +1,417 @@
+#include "checkpoint.h"
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+// serialization helpers
+
+template<typename T>
+static void Put(std::vector<uint8_t>& out, const T& val)
+{
+  const size_t offset = out.size();
+  out.resize(offset + sizeof(T));
+  std::memcpy(out.data() + offset, &val, sizeof(T));
+}
+
+template<typename T>
+static T Get(const uint8_t*& in, const uint8_t* end)
+{
+  if(in + sizeof(T) > end)
+  {
+    throw std::runtime_error("Truncated checkpoint");
+  }
+  T val;
+  std::memcpy(&val, in, sizeof(T));
+  in += sizeof(T);
+  return val;
+}
+
+static uint64_t AlignUp(uint64_t val, uint64_t align)
+{
+  return (val + align - 1) & ~(align - 1);
+}
+
+static bool IsZeroPage(const uint8_t* page)
+{
+  const auto* words = reinterpret_cast<const uint64_t*>(page);
+  for(int i = 0; i < PAGE_SIZE / 8; i++)
+  {
+    if(words[i] != 0)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// SAVE
+
+static std::vector<uint8_t> SaveCpu(CPU& cpu)
+{
+  std::vector<uint8_t> out;
+  MMU& mmu = cpu.GetMMU();
+  Put<uint32_t>(out, cpu.GetXlen());
+  Put<uint64_t>(out, cpu.GetPc());
+  Put<uint32_t>(out, cpu.GetMode());
+  for(int i = 0; i < N_REG; i++)
+  {
+    Put<uint64_t>(out, cpu.GetReg(i));
+  }
+  for(int i = 0; i < N_REG; i++)
+  {
+    Put<uint64_t>(out, cpu.GetFReg(i));
+  }
+  Put<uint32_t>(out, cpu.GetFflags());
+  Put<uint32_t>(out, cpu.GetFrm());
+  const VectorState& vec = cpu.GetVector();
+  Put<uint32_t>(out, VLENB);
+  out.insert(out.end(), vec.regs, vec.regs + sizeof(vec.regs));
+  Put<uint64_t>(out, vec.vl);
+  Put<uint64_t>(out, vec.vtype);
+  Put<uint64_t>(out, vec.vstart);
+  Put<uint64_t>(out, vec.vxrm);
+  Put<uint64_t>(out, vec.vxsat);
+  Put<uint32_t>(out, mmu.GetPagingMode());
+  Put<uint32_t>(out, mmu.GetPrivilegeMode());
+  Put<uint64_t>(out, mmu.GetRootPageTable());
+
+  // Stored values only, views such as mip would otherwise carry the device lines
+  // and sstatus would duplicate mstatus
+  std::vector<uint8_t> csrs;
+  uint32_t csr_count = 0;
+  for(int i = 0; i < N_CSR; i++)
+  {
+    if(cpu.ReadCsrStorage(i) != 0)
+    {
+      Put<uint16_t>(csrs, i);
+      Put<uint64_t>(csrs, cpu.ReadCsrStorage(i));
+      csr_count++;
+    }
+  }
+  Put<uint32_t>(out, csr_count);
+  out.insert(out.end(), csrs.begin(), csrs.end());
+  return out;
+}
+
+static std::vector<uint8_t> SaveDevices(CPU& cpu)
+{
+  std::vector<uint8_t> out;
+  const auto devices = cpu.GetMMU().GetDevices();
+  Put<uint32_t>(out, devices.size());
+  for(BaseDevice* device : devices)
+  {
+    std::vector<uint8_t> state;
+    device->SaveState(state);
+    Put<uint64_t>(out, device->GetBaseAddr());
+    Put<uint64_t>(out, state.size());
+    out.insert(out.end(), state.begin(), state.end());
+  }
+  return out;
+}
+
+void SaveCheckpoint(CPU& cpu, const std::string& path, bool compress)
+{
+  MemoryMap& memory = cpu.GetMMU().GetMemory();
+
+  CheckpointHeader header {};
+  std::memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+  header.version = CHECKPOINT_VERSION;
+  header.flags = compress ? static_cast<uint32_t>(ckpt_compressed) : 0;
+  header.page_size = PAGE_SIZE;
+
+  std::vector<CheckpointRegion> regions;
+  for(RAM& region : memory.GetRegions())
+  {
+    regions.push_back(CheckpointRegion{.base = region.GetBaseAddr(), .size = region.GetSize(),
+                                       .flags = region.IsReadOnly() ? static_cast<uint64_t>(ckpt_read_only) : 0});
+  }
+  const std::vector<uint8_t> cpu_state = SaveCpu(cpu);
+  const std::vector<uint8_t> device_state = SaveDevices(cpu);
+
+  // Sparse RAM, only pages ever written that are not zero again are stored
+  std::vector<CheckpointPage> index;
+  std::vector<std::vector<uint8_t>> compressed;
+  for(const uint64_t page_number : memory.DirtyPages(0))
+  {
+    const uint8_t* data = memory.HostAddress(page_number * PAGE_SIZE, false);
+    if(IsZeroPage(data))
+    {
+      continue;
+    }
+    uint64_t stored_size = PAGE_SIZE;
+    if(compress)
+    {
+      uLongf len = compressBound(PAGE_SIZE);
+      std::vector<uint8_t> buf(len);
+      if(compress2(buf.data(), &len, data, PAGE_SIZE, Z_BEST_SPEED) != Z_OK)
+      {
+        throw std::runtime_error("Could not compress RAM page");
+      }
+      buf.resize(len);
+      stored_size = len;
+      compressed.push_back(std::move(buf));
+    }
+    index.push_back(CheckpointPage{.page_number = page_number, .offset = 0, .size = stored_size});
+  }
+
+  header.regions_offset = sizeof(CheckpointHeader);
+  header.region_count = regions.size();
+  header.cpu_offset = header.regions_offset + regions.size() * sizeof(CheckpointRegion);
+  header.cpu_size = cpu_state.size();
+  header.devices_offset = header.cpu_offset + header.cpu_size;
+  header.devices_size = device_state.size();
+  header.index_offset = header.devices_offset + header.devices_size;
+  header.page_count = index.size();
+  header.data_offset = AlignUp(header.index_offset + index.size() * sizeof(CheckpointPage), PAGE_SIZE);
+
+  // Raw pages stay page-aligned so they can be mapped directly
+  uint64_t offset = header.data_offset;
+  for(auto& page : index)
+  {
+    page.offset = offset;
+    offset += compress ? page.size : PAGE_SIZE;
+  }
+
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if(!out.is_open())
+  {
+    throw std::runtime_error("Could not open checkpoint file");
+  }
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char*>(regions.data()), regions.size() * sizeof(CheckpointRegion));
+  out.write(reinterpret_cast<const char*>(cpu_state.data()), cpu_state.size());
+  out.write(reinterpret_cast<const char*>(device_state.data()), device_state.size());
+  out.write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(CheckpointPage));
+  const std::vector<char> padding(header.data_offset - out.tellp(), 0);
+  out.write(padding.data(), padding.size());
+  for(size_t i = 0; i < index.size(); i++)
+  {
+    if(compress)
+    {
+      out.write(reinterpret_cast<const char*>(compressed[i].data()), compressed[i].size());
+    }
+    else
+    {
+      out.write(reinterpret_cast<const char*>(memory.HostAddress(index[i].page_number * PAGE_SIZE, false)), PAGE_SIZE);
+    }
+  }
+  if(!out.good())
+  {
+    throw std::runtime_error("Could not write checkpoint file");
+  }
+}
+
+// RESTORE
+
+static void RestoreCpu(CPU& cpu, const uint8_t* in, const uint8_t* end)
+{
+  MMU& mmu = cpu.GetMMU();
+  if(Get<uint32_t>(in, end) != static_cast<uint32_t>(cpu.GetXlen()))
+  {
+    throw std::runtime_error("Checkpoint XLEN does not match this machine");
+  }
+  cpu.SetPc(Get<uint64_t>(in, end));
+  cpu.SetMode(static_cast<PrivilegeMode>(Get<uint32_t>(in, end)));
+  for(int i = 0; i < N_REG; i++)
+  {
+    cpu.SetReg(i, Get<uint64_t>(in, end));
+  }
+  for(int i = 0; i < N_REG; i++)
+  {
+    cpu.SetFReg(i, Get<uint64_t>(in, end));
+  }
+  cpu.SetFflags(Get<uint32_t>(in, end));
+  cpu.SetFrm(Get<uint32_t>(in, end));
+  VectorState& vec = cpu.GetVector();
+  if(Get<uint32_t>(in, end) != VLENB)
+  {
+    throw std::runtime_error("Checkpoint vector length does not match this machine");
+  }
+  if(in + sizeof(vec.regs) > end)
+  {
+    throw std::runtime_error("Truncated checkpoint");
+  }
+  std::memcpy(vec.regs, in, sizeof(vec.regs));
+  in += sizeof(vec.regs);
+  vec.vl = Get<uint64_t>(in, end);
+  vec.vtype = Get<uint64_t>(in, end);
+  vec.vstart = Get<uint64_t>(in, end);
+  vec.vxrm = Get<uint64_t>(in, end);
+  vec.vxsat = Get<uint64_t>(in, end);
+  const auto paging_mode = static_cast<PagingMode>(Get<uint32_t>(in, end));
+  Get<uint32_t>(in, end); // the MMU privilege follows the CPU mode restored above
+  const uint64_t root_page_table = Get<uint64_t>(in, end);
+
+  // The stored values go back without their write hooks, which would refuse
+  // locked PMP entries and latch lines into mip, the derived state is rebuilt once
+  for(int i = 0; i < N_CSR; i++)
+  {
+    cpu.WriteCsrStorage(i, 0);
+  }
+  const uint32_t csr_count = Get<uint32_t>(in, end);
+  for(uint32_t i = 0; i < csr_count; i++)
+  {
+    const uint16_t csr = Get<uint16_t>(in, end);
+    const uint64_t val = Get<uint64_t>(in, end);
+    if(csr >= N_CSR)
+    {
+      throw std::runtime_error("Invalid CSR in checkpoint");
+    }
+    cpu.WriteCsrStorage(csr, val);
+  }
+  cpu.UpdateAccessControl();
+  cpu.UpdatePmp();
+  cpu.UpdateSupervisorTimer();
+  cpu.RequestInterruptCheck();
+
+  // The MMU state is saved on its own and authoritative over satp
+  mmu.SetPagingMode(paging_mode);
+  mmu.SetRootPageTable(root_page_table);
+}
+
+static void RestoreDevices(CPU& cpu, const uint8_t* in, const uint8_t* end)
+{
+  const auto devices = cpu.GetMMU().GetDevices();
+  const uint32_t count = Get<uint32_t>(in, end);
+  for(uint32_t i = 0; i < count; i++)
+  {
+    const uint64_t base_addr = Get<uint64_t>(in, end);
+    const uint64_t size = Get<uint64_t>(in, end);
+    if(in + size > end)
+    {
+      throw std::runtime_error("Truncated checkpoint");
+    }
+    for(BaseDevice* device : devices)
+    {
+      if(device->GetBaseAddr() == base_addr)
+      {
+        device->RestoreState(in, size);
+      }
+    }
+    in += size;
+  }
+}
+
+static void RestoreRam(CPU& cpu, int fd, const CheckpointHeader& header, const uint8_t* file, uint64_t file_size)
+{
+  MemoryMap& memory = cpu.GetMMU().GetMemory();
+  const uint8_t* in = file + header.regions_offset;
+  const uint8_t* end = file + file_size;
+
+  memory.Clear();
+  cpu.GetBlocks().Flush();
+  cpu.GetMMU().FlushTlb(); // the walk cache holds host addresses
+  for(uint64_t i = 0; i < header.region_count; i++)
+  {
+    const auto region = Get<CheckpointRegion>(in, end);
+    memory.AddRegion(region.base, region.size, region.flags & ckpt_read_only);
+  }
+
+  in = file + header.index_offset;
+  std::vector<CheckpointPage> index(header.page_count);
+  for(auto& page : index)
+  {
+    page = Get<CheckpointPage>(in, end);
+    if(memory.FindRegion(page.page_number * PAGE_SIZE) == nullptr || page.offset + page.size > file_size)
+    {
+      throw std::runtime_error("Corrupt checkpoint RAM index");
+    }
+  }
+
+  if(header.flags & ckpt_compressed)
+  {
+    for(const auto& page : index)
+    {
+      uLongf len = PAGE_SIZE;
+      uint8_t* dest = memory.HostAddress(page.page_number * PAGE_SIZE, false);
+      memory.MarkDirty(page.page_number * PAGE_SIZE, PAGE_SIZE);
+      if(uncompress(dest, &len, file + page.offset, page.size) != Z_OK || len != PAGE_SIZE)
+      {
+        throw std::runtime_error("Corrupt checkpoint RAM page");
+      }
+    }
+    return;
+  }
+
+  // Map runs of pages that are contiguous in the guest, in the file and in one region with one mmap each
+  size_t i = 0;
+  while(i < index.size())
+  {
+    RAM* region = memory.FindRegion(index[i].page_number * PAGE_SIZE);
+    size_t j = i + 1;
+    while(j < index.size() && index[j].page_number == index[j - 1].page_number + 1
+          && index[j].offset == index[j - 1].offset + PAGE_SIZE && region->IsValidAddr(index[j].page_number * PAGE_SIZE))
+    {
+      j++;
+    }
+    region->MapFile(fd, index[i].offset, index[i].page_number * PAGE_SIZE - region->GetBaseAddr(), (j - i) * PAGE_SIZE);
+    memory.MarkDirty(index[i].page_number * PAGE_SIZE, (j - i) * PAGE_SIZE);
+    i = j;
+  }
+}
+
+void RestoreCheckpoint(CPU& cpu, const std::string& path)
+{
+  const int fd = open(path.c_str(), O_RDONLY);
+  if(fd < 0)
+  {
+    throw std::runtime_error("Could not open checkpoint file");
+  }
+  struct stat st;
+  if(fstat(fd, &st) < 0 || static_cast<uint64_t>(st.st_size) < sizeof(CheckpointHeader))
+  {
+    close(fd);
+    throw std::runtime_error("Not a checkpoint file");
+  }
+  const uint64_t file_size = st.st_size;
+  void* addr = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(addr == MAP_FAILED)
+  {
+    close(fd);
+    throw std::runtime_error("Could not map checkpoint file");
+  }
+  const auto* file = static_cast<const uint8_t*>(addr);
+
+  try
+  {
+    CheckpointHeader header;
+    std::memcpy(&header, file, sizeof(header));
+    if(std::memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0)
+    {
+      throw std::runtime_error("Not a checkpoint file");
+    }
+    if(header.version != CHECKPOINT_VERSION)
+    {
+      throw std::runtime_error("Unsupported checkpoint version");
+    }
+    if(header.page_size != PAGE_SIZE)
+    {
+      throw std::runtime_error("Checkpoint memory layout does not match this machine");
+    }
+    if(header.regions_offset + header.region_count * sizeof(CheckpointRegion) > file_size
+       || header.cpu_offset + header.cpu_size > file_size || header.devices_offset + header.devices_size > file_size
+       || header.index_offset + header.page_count * sizeof(CheckpointPage) > file_size)
+    {
+      throw std::runtime_error("Truncated checkpoint");
+    }
+    RestoreCpu(cpu, file + header.cpu_offset, file + header.cpu_offset + header.cpu_size);
+    RestoreDevices(cpu, file + header.devices_offset, file + header.devices_offset + header.devices_size);
+    cpu.UpdateTimer(); // rebuilds the timer and software interrupt lines from the restored CLINT
+    RestoreRam(cpu, fd, header, file, file_size);
+  }
+  catch(...)
+  {
+    munmap(addr, file_size);
+    close(fd);
+    throw;
+  }
+  // RAM mappings stay valid after the descriptor and the file view are gone
+  munmap(addr, file_size);
+  close(fd);
+}
@@ -1,135 +1,148 @@
 #include "cpu.h"
+#include "instruction.h"
+#include "rvc.h"
+#include <algorithm>
+#include <bit>
 #include <iostream>
+#include <limits>
 #include <map>
+#include <stdexcept>
 
-// TODO(jrola): MISSING EXTENSIONS to G (F, D, Zicsr, Zifencei)
-//              MISSING INSTRUCTIONS IN RV32I: FENCE, EBREAK
-
-// instruction mask helpers
-
-template<int start, int end>
-static constexpr uint32_t mask(uint32_t instruction)
+// Integer loads and stores, the Dynamic instantiations are in the instruction
+// tables and the block builder swaps in the Bare ones
+template<typename T, int xlen, Translation translation = Translation::Dynamic>
+static void LoadOp(const uint32_t instruction, CPU& cpu)
 {
-  return (instruction >> start) & ((1 << (end - start + 1)) - 1);
+  const InstructionFields fields = parse_instruction<'I'>(instruction);
+  uint64_t data;
+  cpu.Load<translation>(xlen_address<xlen>(cpu.GetReg(fields.rs1) + sign_extend_12b(fields.imm)), sizeof(T), data);
+  cpu.SetReg(fields.rd, static_cast<int64_t>(static_cast<T>(data)));
 }
 
-template<int start, int end, int dest>
-static constexpr uint32_t mask_and_shift(uint32_t instruction)
+template<typename T, int xlen, Translation translation = Translation::Dynamic>
+static void StoreOp(const uint32_t instruction, CPU& cpu)
 {
-  return ((instruction >> start) & ((1 << (end - start + 1)) - 1)) << dest;
+  const InstructionFields fields = parse_instruction<'S'>(instruction);
+  cpu.Store<translation>(xlen_address<xlen>(cpu.GetReg(fields.rs1) + sign_extend_12b(fields.imm)), sizeof(T),
+                         cpu.GetReg(fields.rs2));
 }
 
-template<uint64_t start, uint64_t end>
-static constexpr uint64_t mask(uint64_t instruction)
+typedef struct SpecializedHandler
 {
-  return (instruction >> start) & ((1ULL << (end - start + 1ULL)) - 1ULL);
-}
+  ExecuteFunction dynamic;
+  ExecuteFunction bare;
+} SpecializedHandler;
 
-template<uint64_t start, uint64_t end, uint64_t dest>
-static constexpr uint64_t mask_and_shift(uint64_t instruction)
+template<typename T, int xlen>
+constexpr SpecializedHandler LoadHandlers()
 {
-  return ((instruction >> start) & ((1ULL << (end - start + 1ULL)) - 1ULL)) << dest;
+  return {LoadOp<T, xlen>, LoadOp<T, xlen, Translation::Bare>};
 }
 
-constexpr auto sign_extend_12b = [](auto imm) -> int32_t {
-  int32_t sign_extended_imm = (imm & 0x800) ? (imm | 0xfffff000) : imm;
-  return sign_extended_imm;
-};
-
-constexpr auto sign_extend_13b = [](auto imm) -> int32_t {
-  int32_t sign_extended_imm = (imm & 0x1000) ? (imm | 0xffffe000) : imm;
-  return sign_extended_imm;
-};
-
-constexpr auto sign_extend_20b = [](auto imm) -> int32_t {
-  int32_t sign_extended_imm = (imm & 0x00080000) ? (imm | 0xfff00000) : imm;
-  return sign_extended_imm;
-};
-
-template<char format>
-InstructionFields parse_instruction(const uint32_t instruction)
+template<typename T, int xlen>
+constexpr SpecializedHandler StoreHandlers()
 {
-  throw CPUTrapException(trap_value::IllegalInstruction);
+  return {StoreOp<T, xlen>, StoreOp<T, xlen, Translation::Bare>};
 }
 
-template<>
-InstructionFields parse_instruction<'R'>(const uint32_t instruction)
-{
-  return InstructionFields{.opcode = mask<0, 6>(instruction),
-                           .rd     = mask<7, 11>(instruction),
-                           .funct3 = mask<12, 14>(instruction),
-                           .rs1    = mask<15, 19>(instruction),
-                           .rs2    = mask<20, 24>(instruction),
-                           .funct7 = mask<25, 31>(instruction),
-                           .imm = 0};
-}
+static const SpecializedHandler specialized_handlers[] = {
+  LoadHandlers<int8_t, 64>(), LoadHandlers<int16_t, 64>(), LoadHandlers<int32_t, 64>(), LoadHandlers<uint8_t, 64>(),
+  LoadHandlers<uint16_t, 64>(), LoadHandlers<uint32_t, 64>(), LoadHandlers<uint64_t, 64>(),
+  StoreHandlers<uint8_t, 64>(), StoreHandlers<uint16_t, 64>(), StoreHandlers<uint32_t, 64>(), StoreHandlers<uint64_t, 64>(),
+  LoadHandlers<int8_t, 32>(), LoadHandlers<int16_t, 32>(), LoadHandlers<int32_t, 32>(), LoadHandlers<uint8_t, 32>(),
+  LoadHandlers<uint16_t, 32>(),
+  StoreHandlers<uint8_t, 32>(), StoreHandlers<uint16_t, 32>(), StoreHandlers<uint32_t, 32>(),
+};
 
-template<>
-InstructionFields parse_instruction<'I'>(const uint32_t instruction)
+// The handler to run execute with while translation is known, execute itself if it has no variants
+static ExecuteFunction Specialize(ExecuteFunction execute, Translation translation)
 {
-  return InstructionFields{.opcode = mask<0, 6>(instruction),
-                           .rd     = mask<7, 11>(instruction),
-                           .funct3 = mask<12, 14>(instruction),
-                           .rs1    = mask<15, 19>(instruction),
-                           .rs2    = 0,
-                           .funct7 = 0,
-                           .imm = mask<20, 31>(instruction)};
+  if(translation == Translation::Dynamic)
+  {
+    return execute;
+  }
+  for(const SpecializedHandler& handler : specialized_handlers)
+  {
+    if(handler.dynamic == execute)
+    {
+      return handler.bare;
+    }
+  }
+  return execute;
 }
 
-template<>
-InstructionFields parse_instruction<'S'>(const uint32_t instruction)
-{
-  return InstructionFields{.opcode = mask<0, 6>(instruction),
-                           .rd     = 0,
-                           .funct3 = mask<12, 14>(instruction),
-                           .rs1    = mask<15, 19>(instruction),
-                           .rs2    = mask<20, 24>(instruction),
-                           .funct7 = 0,
-                           .imm = mask<7, 11>(instruction) | mask_and_shift<25, 31, 5>(instruction)};
-}
+// Double-width products for the high multiplies
+__extension__ typedef __int128 int128_t;
+__extension__ typedef unsigned __int128 uint128_t;
+template<int xlen>
+using SignedWide = std::conditional_t<xlen == 32, int64_t, int128_t>;
+template<int xlen>
+using UnsignedWide = std::conditional_t<xlen == 32, uint64_t, uint128_t>;
 
-template<>
-InstructionFields parse_instruction<'B'>(const uint32_t instruction)
+// LR/SC and AMOs on words (T 32 bits) or doublewords, rd gets the old value sign-extended
+template<typename T, int xlen>
+static void LoadReserved(const uint32_t instruction, CPU& cpu)
 {
-  return InstructionFields{.opcode = mask<0, 6>(instruction),
-                           .rd     = 0,
-                           .funct3 = mask<12, 14>(instruction),
-                           .rs1    = mask<15, 19>(instruction),
-                           .rs2    = mask<20, 24>(instruction),
-                           .funct7 = 0,
-                           .imm = mask_and_shift<7, 7, 11>(instruction) | mask_and_shift<8, 11, 1>(instruction)
-                                | mask_and_shift<25, 30, 5>(instruction) | mask_and_shift<31, 31, 12>(instruction)};
+  const InstructionFields fields = parse_instruction<'R'>(instruction);
+  const uint64_t addr = xlen_address<xlen>(cpu.GetReg(fields.rs1));
+  if(addr % sizeof(T) != 0)
+  {
+    throw CPUTrapException(trap_value::LoadAddressMisaligned, addr);
+  }
+  uint64_t data;
+  cpu.Load(addr, sizeof(T), data);
+  cpu.SetReservation(addr);
+  cpu.SetReg(fields.rd, static_cast<int64_t>(static_cast<std::make_signed_t<T>>(data)));
 }
 
-template<>
-InstructionFields parse_instruction<'U'>(const uint32_t instruction)
+template<typename T, int xlen>
+static void StoreConditional(const uint32_t instruction, CPU& cpu)
 {
-  return InstructionFields{.opcode = mask<0, 6>(instruction),
-                           .rd     = mask<7, 11>(instruction),
-                           .funct3 = 0,
-                           .rs1    = 0,
-                           .rs2    = 0,
-                           .funct7 = 0,
-                           .imm    = mask_and_shift<12, 31, 12>(instruction)};
+  const InstructionFields fields = parse_instruction<'R'>(instruction);
+  const uint64_t addr = xlen_address<xlen>(cpu.GetReg(fields.rs1));
+  if(addr % sizeof(T) != 0)
+  {
+    throw CPUTrapException(trap_value::StoreAMOAddressMisaligned, addr);
+  }
+  if(!cpu.TakeReservation(addr))
+  {
+    cpu.SetReg(fields.rd, 1);
+    return;
+  }
+  cpu.Store(addr, sizeof(T), cpu.GetReg(fields.rs2));
+  cpu.SetReg(fields.rd, 0);
 }
 
-template<>
-InstructionFields parse_instruction<'J'>(const uint32_t instruction)
+template<typename T, int xlen, T (*op)(T, T)>
+static void AmoOp(const uint32_t instruction, CPU& cpu)
 {
-  return InstructionFields{.opcode = mask<0, 6>(instruction),
-                           .rd     = mask<7, 11>(instruction),
-                           .funct3 = 0,
-                           .rs1    = 0,
-                           .rs2    = 0,
-                           .funct7 = 0,
-                           .imm = mask_and_shift<21, 30, 1>(instruction) | mask_and_shift<20, 20, 11>(instruction)
-                                | mask_and_shift<12, 19, 12>(instruction) | mask_and_shift<31, 31, 20>(instruction)};
+  const InstructionFields fields = parse_instruction<'R'>(instruction);
+  const uint64_t addr = xlen_address<xlen>(cpu.GetReg(fields.rs1));
+  if(addr % sizeof(T) != 0)
+  {
+    throw CPUTrapException(trap_value::StoreAMOAddressMisaligned, addr);
+  }
+  uint64_t data;
+  cpu.Load(addr, sizeof(T), data);
+  const T old = static_cast<T>(data);
+  cpu.Store(addr, sizeof(T), static_cast<uint64_t>(op(old, static_cast<T>(cpu.GetReg(fields.rs2)))));
+  cpu.SetReg(fields.rd, static_cast<int64_t>(static_cast<std::make_signed_t<T>>(old)));
 }
 
+template<typename T> static T AmoSwap(T old, T val) { return val; }
+template<typename T> static T AmoAdd(T old, T val) { return old + val; }
+template<typename T> static T AmoXor(T old, T val) { return old ^ val; }
+template<typename T> static T AmoAnd(T old, T val) { return old & val; }
+template<typename T> static T AmoOr(T old, T val) { return old | val; }
+template<typename T> static T AmoMin(T old, T val) { return std::min(old, val); }
+template<typename T> static T AmoMax(T old, T val) { return std::max(old, val); }
 
-const static Instruction instructions[] = {
+// The base integer ISA, Zicsr, Zifencei, M and A, instantiated once per XLEN.
+// RV64 harts add the RV64-only instructions and the extension tables.
+template<int xlen>
+static const Instruction base_instructions[] = {
   // RV32I Privileged
-  // INSTRUCTIONS IN RV32I Privileged: SRET, MRET
+  // INSTRUCTIONS IN RV32I Privileged: SRET, MRET, SFENCE.VMA
   {
     .name = "SRET",
     .format = 'R',
@@ -137,6 +150,7 @@ const static Instruction instructions[] = {
     .instruction_matcher = 0x10200073,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       cpu.SetPc(cpu.GetCsr(sepc));
+      cpu.SetCsr(mstatus, cpu.GetCsr(mstatus) & ~mstatus_mprv);
       cpu.SetMode(((cpu.GetCsr(sstatus) >> 8) & 1) ? SUPERVISOR : USER);
       cpu.SetCsr(sstatus, ((cpu.GetCsr(sstatus) >> 5) & 1)
                           ? cpu.GetCsr(sstatus) | (1 << 1)
@@ -153,7 +167,11 @@ const static Instruction instructions[] = {
     .execute = [](const uint32_t instruction, CPU& cpu) {
       cpu.SetPc(cpu.GetCsr(mepc));
       uint64_t mpp = (cpu.GetCsr(mstatus) >> 11) & 3;
-      cpu.SetMode(mpp == 2 ? MACHINE : (mpp == 1 ? SUPERVISOR : USER));
+      if(mpp != MACHINE)
+      {
+        cpu.SetCsr(mstatus, cpu.GetCsr(mstatus) & ~mstatus_mprv);
+      }
+      cpu.SetMode(mpp == MACHINE ? MACHINE : (mpp == SUPERVISOR ? SUPERVISOR : USER));
       cpu.SetCsr(mstatus, ((cpu.GetCsr(mstatus) >> 7) & 1)
                           ? cpu.GetCsr(mstatus) | (1 << 3)
                           : cpu.GetCsr(mstatus) & ~(1 << 3));
@@ -161,6 +179,30 @@ const static Instruction instructions[] = {
       cpu.SetCsr(mstatus, cpu.GetCsr(mstatus) & ~(3 << 11));
     }
   },
+  {
+    .name = "SFENCE.VMA",
+    .format = 'R',
+    .mask_field = 0xfe007fff,
+    .instruction_matcher = 0x12000073,
+    .execute = [](const uint32_t instruction, CPU& cpu) {
+      const InstructionFields fields = parse_instruction<'R'>(instruction);
+      const bool trapped = cpu.GetMode() == PrivilegeMode::SUPERVISOR && (cpu.GetCsr(CSR::mstatus) & mstatus_tvm);
+      if(cpu.GetMode() == PrivilegeMode::USER || trapped)
+      {
+        throw CPUTrapException(trap_value::IllegalInstruction);
+      }
+      // No ASID tagging, rs2 is ignored
+      if(fields.rs1 == 0)
+      {
+        cpu.GetMMU().FlushTlb();
+      }
+      else
+      {
+        cpu.GetMMU().FlushTlb(xlen_address<xlen>(cpu.GetReg(fields.rs1)));
+      }
+      cpu.GetBlocks().NewGeneration();
+    }
+  },
   // RV32I Privileged
   // ----------------------------------------
   // RV32I
@@ -185,7 +227,7 @@ const static Instruction instructions[] = {
     .instruction_matcher = 0x00000017,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'U'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetPc() + static_cast<uint64_t>(fields.imm) - 4);
+      cpu.SetReg(fields.rd, xlen_value<xlen>(cpu.GetPc() + static_cast<int32_t>(fields.imm) - cpu.GetInstLen()));
     }
   },
   {
@@ -195,8 +237,8 @@ const static Instruction instructions[] = {
     .instruction_matcher = 0x0000006f,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'J'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetPc());   // PC is incremented by 4 after instruction fetch, no need to add 4
-      cpu.SetPc(cpu.GetPc() + sign_extend_20b(fields.imm) - 4);  // -4 because PC is incremented by 4 after instruction fetch
+      cpu.SetReg(fields.rd, xlen_value<xlen>(cpu.GetPc()));   // PC already points past the instruction after fetch
+      cpu.SetPc(xlen_address<xlen>(cpu.GetPc() + sign_extend_21b(fields.imm) - cpu.GetInstLen()));  // offset is relative to the instruction itself
     }
   },
   {
@@ -206,8 +248,9 @@ const static Instruction instructions[] = {
     .instruction_matcher = 0x00000067,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'I'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetPc());   // PC is incremented by 4 after instruction fetch, no need to add 4
-      cpu.SetPc((cpu.GetReg(fields.rs1) + sign_extend_12b(fields.imm)) & ~1);
+      const uint64_t target = xlen_address<xlen>(cpu.GetReg(fields.rs1) + sign_extend_12b(fields.imm)) & ~1ULL;
+      cpu.SetReg(fields.rd, xlen_value<xlen>(cpu.GetPc()));   // PC already points past the instruction after fetch
+      cpu.SetPc(target);
     }
   },
   {
@@ -219,7 +262,7 @@ const static Instruction instructions[] = {
       const InstructionFields fields = parse_instruction<'B'>(instruction);
       if(cpu.GetReg(fields.rs1) == cpu.GetReg(fields.rs2))
       {
-        cpu.SetPc(cpu.GetPc() + sign_extend_13b(fields.imm) - 4);
+        cpu.SetPc(xlen_address<xlen>(cpu.GetPc() + sign_extend_13b(fields.imm) - cpu.GetInstLen()));
       }
     }
   },
@@ -232,7 +275,7 @@ const static Instruction instructions[] = {
       const InstructionFields fields = parse_instruction<'B'>(instruction);
       if(cpu.GetReg(fields.rs1) != cpu.GetReg(fields.rs2))
       {
-        cpu.SetPc(cpu.GetPc() + sign_extend_13b(fields.imm) - 4);
+        cpu.SetPc(xlen_address<xlen>(cpu.GetPc() + sign_extend_13b(fields.imm) - cpu.GetInstLen()));
       }
     }
   },
@@ -245,7 +288,7 @@ const static Instruction instructions[] = {
       const InstructionFields fields = parse_instruction<'B'>(instruction);
       if(static_cast<int64_t>(cpu.GetReg(fields.rs1)) < static_cast<int64_t>(cpu.GetReg(fields.rs2)))
       {
-        cpu.SetPc(cpu.GetPc() + sign_extend_13b(fields.imm) - 4);
+        cpu.SetPc(xlen_address<xlen>(cpu.GetPc() + sign_extend_13b(fields.imm) - cpu.GetInstLen()));
       }
     }
   },
@@ -258,7 +301,7 @@ const static Instruction instructions[] = {
       const InstructionFields fields = parse_instruction<'B'>(instruction);
       if(static_cast<int64_t>(cpu.GetReg(fields.rs1)) >= static_cast<int64_t>(cpu.GetReg(fields.rs2)))
       {
-        cpu.SetPc(cpu.GetPc() + sign_extend_13b(fields.imm) - 4);
+        cpu.SetPc(xlen_address<xlen>(cpu.GetPc() + sign_extend_13b(fields.imm) - cpu.GetInstLen()));
       }
     }
   },
@@ -271,7 +314,7 @@ const static Instruction instructions[] = {
       const InstructionFields fields = parse_instruction<'B'>(instruction);
       if(cpu.GetReg(fields.rs1) < cpu.GetReg(fields.rs2))
       {
-        cpu.SetPc(cpu.GetPc() + sign_extend_13b(fields.imm) - 4);
+        cpu.SetPc(xlen_address<xlen>(cpu.GetPc() + sign_extend_13b(fields.imm) - cpu.GetInstLen()));
       }
     }
   },
@@ -284,7 +327,7 @@ const static Instruction instructions[] = {
       const InstructionFields fields = parse_instruction<'B'>(instruction);
       if(cpu.GetReg(fields.rs1) >= cpu.GetReg(fields.rs2))
       {
-        cpu.SetPc(cpu.GetPc() + sign_extend_13b(fields.imm) - 4);
+        cpu.SetPc(xlen_address<xlen>(cpu.GetPc() + sign_extend_13b(fields.imm) - cpu.GetInstLen()));
       }
     }
   },
@@ -293,101 +336,56 @@ const static Instruction instructions[] = {
     .format = 'I',
 		.mask_field = 0x0000707f,
 		.instruction_matcher = 0x00000003,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'I'>(instruction);
-      const uint64_t addr = cpu.GetReg(fields.rs1) + fields.imm;
-      uint64_t data;
-      cpu.Load(addr, 1, data);
-      cpu.SetReg(fields.rd, static_cast<int8_t>(data));
-    }
+    .execute = LoadOp<int8_t, xlen>
   },
   {
     .name = "LH",
     .format = 'I',
     .mask_field = 0x0000707f,
     .instruction_matcher = 0x00001003,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'I'>(instruction);
-      const uint64_t addr = cpu.GetReg(fields.rs1) + fields.imm;
-      uint64_t data;
-      cpu.Load(addr, 2, data);
-      cpu.SetReg(fields.rd, static_cast<int16_t>(data));
-    }
+    .execute = LoadOp<int16_t, xlen>
   },
   {
     .name = "LW",
     .format = 'I',
     .mask_field = 0x0000707f,
     .instruction_matcher = 0x00002003,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'I'>(instruction);
-      const uint64_t addr = cpu.GetReg(fields.rs1) + fields.imm;
-      uint64_t data;
-      cpu.Load(addr, 4, data);
-      cpu.SetReg(fields.rd, static_cast<int32_t>(data));
-    }
+    .execute = LoadOp<int32_t, xlen>
   },
   {
     .name = "LBU",
     .format = 'I',
     .mask_field = 0x0000707f,
     .instruction_matcher = 0x00004003,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'I'>(instruction);
-      const uint64_t addr = cpu.GetReg(fields.rs1) + fields.imm;
-      uint64_t data;
-      cpu.Load(addr, 1, data);
-      cpu.SetReg(fields.rd, data);
-    }
+    .execute = LoadOp<uint8_t, xlen>
   },
   {
     .name = "LHU",
     .format = 'I',
     .mask_field = 0x0000707f,
     .instruction_matcher = 0x00005003,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'I'>(instruction);
-      const uint64_t addr = cpu.GetReg(fields.rs1) + fields.imm;
-      uint64_t data;
-      cpu.Load(addr, 2, data);
-      cpu.SetReg(fields.rd, data);
-    }
+    .execute = LoadOp<uint16_t, xlen>
   },
   {
     .name = "SB",
     .format = 'S',
     .mask_field = 0x0000707f,
     .instruction_matcher = 0x00000023,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'S'>(instruction);
-      const uint64_t addr = cpu.GetReg(fields.rs1) + fields.imm;
-      uint64_t data = cpu.GetReg(fields.rs2);
-      cpu.Store(addr, 1, data);
-    }
+    .execute = StoreOp<uint8_t, xlen>
   },
   {
     .name = "SH",
     .format = 'S',
     .mask_field = 0x0000707f,
     .instruction_matcher = 0x00001023,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'S'>(instruction);
-      const uint64_t addr = cpu.GetReg(fields.rs1) + fields.imm;
-      uint64_t data = cpu.GetReg(fields.rs2);
-      cpu.Store(addr, 2, data);
-    }
+    .execute = StoreOp<uint16_t, xlen>
   },
   {
     .name = "SW",
     .format = 'S',
     .mask_field = 0x0000707f,
     .instruction_matcher = 0x00002023,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'S'>(instruction);
-      const uint64_t addr = cpu.GetReg(fields.rs1) + fields.imm;
-      uint64_t data = cpu.GetReg(fields.rs2);
-      cpu.Store(addr, 4, data);
-    }
+    .execute = StoreOp<uint32_t, xlen>
   },
 
   {
@@ -397,7 +395,7 @@ const static Instruction instructions[] = {
   .instruction_matcher = 0x00000013,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'I'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) + sign_extend_12b(fields.imm));
+      cpu.SetReg(fields.rd, xlen_value<xlen>(cpu.GetReg(fields.rs1) + sign_extend_12b(fields.imm)));
     }
   },
   {
@@ -407,7 +405,7 @@ const static Instruction instructions[] = {
     .instruction_matcher = 0x00002013,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'I'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) < fields.imm);
+      cpu.SetReg(fields.rd, static_cast<int64_t>(cpu.GetReg(fields.rs1)) < sign_extend_12b(fields.imm));
     }
   },
   {
@@ -417,7 +415,7 @@ const static Instruction instructions[] = {
     .instruction_matcher = 0x00003013,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'I'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) < fields.imm);
+      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) < static_cast<uint64_t>(static_cast<int64_t>(sign_extend_12b(fields.imm))));
     }
   },
   {
@@ -427,7 +425,7 @@ const static Instruction instructions[] = {
     .instruction_matcher = 0x00004013,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'I'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) ^ fields.imm);
+      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) ^ static_cast<int64_t>(sign_extend_12b(fields.imm)));
     }
   },
   {
@@ -437,7 +435,7 @@ const static Instruction instructions[] = {
     .instruction_matcher = 0x00006013,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'I'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) | fields.imm);
+      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) | static_cast<int64_t>(sign_extend_12b(fields.imm)));
     }
   },
   {
@@ -447,37 +445,37 @@ const static Instruction instructions[] = {
     .instruction_matcher = 0x00007013,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'I'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) & fields.imm);
+      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) & sign_extend_12b(fields.imm));
     }
   },
   {
     .name = "SLLI",
     .format = 'I',
-    .mask_field = 0xfc00707f,
+    .mask_field = xlen == 32 ? 0xfe00707f : 0xfc00707f, // shamt[5] is reserved on RV32
     .instruction_matcher = 0x00001013,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'I'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) << fields.imm);
+      cpu.SetReg(fields.rd, xlen_value<xlen>(cpu.GetReg(fields.rs1) << (fields.imm & (xlen - 1))));
     }
   },
   {
     .name = "SRLI",
     .format = 'I',
-    .mask_field = 0xfc00707f,
+    .mask_field = xlen == 32 ? 0xfe00707f : 0xfc00707f,
     .instruction_matcher = 0x00005013,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'I'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) >> fields.imm);
+      cpu.SetReg(fields.rd, xlen_value<xlen>(xlen_address<xlen>(cpu.GetReg(fields.rs1)) >> (fields.imm & (xlen - 1))));
     }
   },
   {
     .name = "SRAI",
     .format = 'I',
-    .mask_field = 0xfc00707f,
+    .mask_field = xlen == 32 ? 0xfe00707f : 0xfc00707f,
     .instruction_matcher = 0x40005013,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'I'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) >> fields.imm);
+      cpu.SetReg(fields.rd, static_cast<SignedXlen<xlen>>(cpu.GetReg(fields.rs1)) >> (fields.imm & (xlen - 1)));
     }
   },
   {
@@ -487,7 +485,7 @@ const static Instruction instructions[] = {
     .instruction_matcher = 0x00000033,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'R'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) + cpu.GetReg(fields.rs2));
+      cpu.SetReg(fields.rd, xlen_value<xlen>(cpu.GetReg(fields.rs1) + cpu.GetReg(fields.rs2)));
     }
   },
   {
@@ -497,7 +495,7 @@ const static Instruction instructions[] = {
     .instruction_matcher = 0x40000033,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'R'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) - cpu.GetReg(fields.rs2));
+      cpu.SetReg(fields.rd, xlen_value<xlen>(cpu.GetReg(fields.rs1) - cpu.GetReg(fields.rs2)));
     }
   },
   {
@@ -507,7 +505,7 @@ const static Instruction instructions[] = {
     .instruction_matcher = 0x00001033,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'R'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) << cpu.GetReg(fields.rs2));
+      cpu.SetReg(fields.rd, xlen_value<xlen>(cpu.GetReg(fields.rs1) << (cpu.GetReg(fields.rs2) & (xlen - 1))));
     }
   },
   {
@@ -517,7 +515,7 @@ const static Instruction instructions[] = {
     .instruction_matcher = 0x00002033,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'R'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) < cpu.GetReg(fields.rs2));
+      cpu.SetReg(fields.rd, static_cast<int64_t>(cpu.GetReg(fields.rs1)) < static_cast<int64_t>(cpu.GetReg(fields.rs2)));
     }
   },
   {
@@ -547,7 +545,7 @@ const static Instruction instructions[] = {
     .instruction_matcher = 0x00005033,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'R'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) >> cpu.GetReg(fields.rs2));
+      cpu.SetReg(fields.rd, xlen_value<xlen>(xlen_address<xlen>(cpu.GetReg(fields.rs1)) >> (cpu.GetReg(fields.rs2) & (xlen - 1))));
     }
   },
   {
@@ -557,7 +555,7 @@ const static Instruction instructions[] = {
     .instruction_matcher = 0x40005033,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'R'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) >> cpu.GetReg(fields.rs2));
+      cpu.SetReg(fields.rd, static_cast<SignedXlen<xlen>>(cpu.GetReg(fields.rs1)) >> (cpu.GetReg(fields.rs2) & (xlen - 1)));
     }
   },
   {
@@ -583,7 +581,7 @@ const static Instruction instructions[] = {
   {
     .name = "FENCE",
     .format = 'I',
-    .mask_field = 0xffffffff,
+    .mask_field = 0x0000707f,
     .instruction_matcher = 0x0000000f,
     .execute = [](const uint32_t instruction, CPU& cpu) {
     }
@@ -614,153 +612,34 @@ const static Instruction instructions[] = {
     .mask_field = 0xffffffff,
     .instruction_matcher = 0x00100073,
     .execute = [](const uint32_t instruction, CPU& cpu) {
-      // TODO(jrola): Maybe implement
-    }
-  },
-  // RV32I
-  // ----------------------------------------
-  // RV64I
-  // INSTRUCTIONS IN RV64I: LWU, LD, SD,
-  //                        ADDIW, SLLIW, SRLIW, SRAIW, ADDW, SUBW, SLLW, SRLW, SRAW
-  {
-    .name = "LWU",
-    .format = 'I',
-    .mask_field = 0x0000707f,
-    .instruction_matcher = 0x00006003,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'I'>(instruction);
-      const uint64_t addr = cpu.GetReg(fields.rs1) + fields.imm;
-      uint64_t data;
-      cpu.Load(addr, 4, data);
-      cpu.SetReg(fields.rd, data);
-    }
-  },
-  {
-    .name = "LD",
-    .format = 'I',
-    .mask_field = 0x0000707f,
-    .instruction_matcher = 0x00003003,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'I'>(instruction);
-      const uint64_t addr = cpu.GetReg(fields.rs1) + fields.imm;
-      uint64_t data;
-      cpu.Load(addr, 8, data);
-      cpu.SetReg(fields.rd, data);
-    }
-  },
-  {
-    .name = "SD",
-    .format = 'S',
-    .mask_field = 0x0000707f,
-    .instruction_matcher = 0x00003023,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'S'>(instruction);
-      const uint64_t addr = cpu.GetReg(fields.rs1) + fields.imm;
-      uint64_t data = cpu.GetReg(fields.rs2);
-      cpu.Store(addr, 8, data);
+      throw CPUTrapException(trap_value::Breakpoint);
     }
   },
   {
-    .name = "ADDIW",
+    .name = "WFI",
     .format = 'I',
-    .mask_field = 0x0000707f,
-    .instruction_matcher = 0x0000001b,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'I'>(instruction);
-      cpu.SetReg(fields.rd, static_cast<int64_t>(static_cast<int32_t>(cpu.GetReg(fields.rs1) + sign_extend_12b(fields.imm))));
-    }
-  },
-  {
-    .name = "SLLIW",
-    .format = 'R',
-    .mask_field = 0xfe00707f,
-    .instruction_matcher = 0x0000101b,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'R'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) << fields.imm);
-    }
-  },
-  {
-    .name = "SRLIW",
-    .format = 'R',
-    .mask_field = 0xfc00707f,
-    .instruction_matcher = 0x0000501b,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'R'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) >> fields.imm);
-    }
-  },
-  {
-    .name = "SRAIW",
-    .format = 'R',
-    .mask_field = 0xfc00707f,
-    .instruction_matcher = 0x4000501b,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'R'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) >> fields.imm);
-    }
-  },
-  {
-    .name = "ADDW",
-    .format = 'R',
-    .mask_field = 0xfe00707f,
-    .instruction_matcher = 0x0000003b,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'R'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) + cpu.GetReg(fields.rs2));
-    }
-  },
-  {
-    .name = "SUBW",
-    .format = 'R',
-    .mask_field = 0xfe00707f,
-    .instruction_matcher = 0x4000003b,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'R'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) - cpu.GetReg(fields.rs2));
-    }
-  },
-  {
-    .name = "SLLW",
-    .format = 'R',
-    .mask_field = 0xfe00707f,
-    .instruction_matcher = 0x0000103b,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'R'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) << cpu.GetReg(fields.rs2));
-    }
-  },
-  {
-    .name = "SRLW",
-    .format = 'R',
-    .mask_field = 0xfe00707f,
-    .instruction_matcher = 0x0000503b,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'R'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) >> cpu.GetReg(fields.rs2));
-    }
-  },
-  {
-    .name = "SRAW",
-    .format = 'R',
-    .mask_field = 0xfe00707f,
-    .instruction_matcher = 0x4000503b,
+    .mask_field = 0xffffffff,
+    .instruction_matcher = 0x10500073,
     .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'R'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) >> cpu.GetReg(fields.rs2));
+      if(cpu.GetMode() != PrivilegeMode::MACHINE && (cpu.GetCsr(CSR::mstatus) & mstatus_tw))
+      {
+        throw CPUTrapException(trap_value::IllegalInstruction);
+      }
+      cpu.Idle();
     }
   },
-  // RV64I
+  // RV32I
   // ----------------------------------------
   // RV32/RV64 Zifencei
   // INSTRUCTIONS IN RV32/RV64 Zifencei: FENCE.I
   {
     .name = "FENCE.I",
     .format = 'I',
-    .mask_field = 0x0000007f,
-    .instruction_matcher = 0x0000000f,
+    .mask_field = 0x0000707f,
+    .instruction_matcher = 0x0000100f,
     .execute = [](const uint32_t instruction, CPU& cpu) {
-      // not implemented
+      // Decoded blocks are the only instruction cache, drop the ones on written pages
+      cpu.GetBlocks().RequestSync();
     }
   },
   // RV32/RV64 Zifencei
@@ -774,9 +653,9 @@ const static Instruction instructions[] = {
     .instruction_matcher = 0x00001073,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'I'>(instruction);
-      uint32_t csr = cpu.GetCsr(fields.imm);
-      cpu.SetCsr(fields.imm, cpu.GetReg(fields.rs1));
-      cpu.SetReg(fields.rd, csr);
+      const uint64_t csr = cpu.GuestReadCsr(fields.imm, true);
+      cpu.GuestWriteCsr(fields.imm, xlen_address<xlen>(cpu.GetReg(fields.rs1)));
+      cpu.SetReg(fields.rd, xlen_value<xlen>(csr));
     }
   },
   {
@@ -786,9 +665,12 @@ const static Instruction instructions[] = {
     .instruction_matcher = 0x00002073,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'I'>(instruction);
-      uint32_t csr = cpu.GetCsr(fields.imm);
-      cpu.SetCsr(fields.imm, csr | cpu.GetReg(fields.rs1));
-      cpu.SetReg(fields.rd, csr);
+      const uint64_t csr = cpu.GuestReadCsr(fields.imm, fields.rs1 != 0);
+      if(fields.rs1 != 0)
+      {
+        cpu.GuestWriteCsr(fields.imm, csr | xlen_address<xlen>(cpu.GetReg(fields.rs1)));
+      }
+      cpu.SetReg(fields.rd, xlen_value<xlen>(csr));
     }
   },
   {
@@ -798,9 +680,12 @@ const static Instruction instructions[] = {
     .instruction_matcher = 0x00003073,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'I'>(instruction);
-      uint32_t csr = cpu.GetCsr(fields.imm);
-      cpu.SetCsr(fields.imm, csr & ~cpu.GetReg(fields.rs1));
-      cpu.SetReg(fields.rd, csr);
+      const uint64_t csr = cpu.GuestReadCsr(fields.imm, fields.rs1 != 0);
+      if(fields.rs1 != 0)
+      {
+        cpu.GuestWriteCsr(fields.imm, csr & ~xlen_address<xlen>(cpu.GetReg(fields.rs1)));
+      }
+      cpu.SetReg(fields.rd, xlen_value<xlen>(csr));
     }
   },
   {
@@ -810,9 +695,9 @@ const static Instruction instructions[] = {
     .instruction_matcher = 0x00005073,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'I'>(instruction);
-      uint32_t csr = cpu.GetCsr(fields.imm);
-      cpu.SetCsr(fields.imm, fields.rs1);
-      cpu.SetReg(fields.rd, csr);
+      const uint64_t csr = cpu.GuestReadCsr(fields.imm, true);
+      cpu.GuestWriteCsr(fields.imm, fields.rs1);
+      cpu.SetReg(fields.rd, xlen_value<xlen>(csr));
     }
   },
   {
@@ -822,9 +707,12 @@ const static Instruction instructions[] = {
     .instruction_matcher = 0x00006073,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'I'>(instruction);
-      uint32_t csr = cpu.GetCsr(fields.imm);
-      cpu.SetCsr(fields.imm, csr | fields.rs1);
-      cpu.SetReg(fields.rd, csr);
+      const uint64_t csr = cpu.GuestReadCsr(fields.imm, fields.rs1 != 0);
+      if(fields.rs1 != 0)
+      {
+        cpu.GuestWriteCsr(fields.imm, csr | fields.rs1);
+      }
+      cpu.SetReg(fields.rd, xlen_value<xlen>(csr));
     }
   },
   {
@@ -834,9 +722,12 @@ const static Instruction instructions[] = {
     .instruction_matcher = 0x00007073,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'I'>(instruction);
-      uint32_t csr = cpu.GetCsr(fields.imm);
-      cpu.SetCsr(fields.imm, csr & ~fields.rs1);
-      cpu.SetReg(fields.rd, csr);
+      const uint64_t csr = cpu.GuestReadCsr(fields.imm, fields.rs1 != 0);
+      if(fields.rs1 != 0)
+      {
+        cpu.GuestWriteCsr(fields.imm, csr & ~static_cast<uint64_t>(fields.rs1));
+      }
+      cpu.SetReg(fields.rd, xlen_value<xlen>(csr));
     }
   },
   // RV32/RV64 Zicsr
@@ -850,7 +741,7 @@ const static Instruction instructions[] = {
     .instruction_matcher = 0x02000033,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'R'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) * cpu.GetReg(fields.rs2));
+      cpu.SetReg(fields.rd, xlen_value<xlen>(cpu.GetReg(fields.rs1) * cpu.GetReg(fields.rs2)));
     }
   },
   {
@@ -860,7 +751,9 @@ const static Instruction instructions[] = {
     .instruction_matcher = 0x02001033,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'R'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) * cpu.GetReg(fields.rs2));
+      const SignedWide<xlen> product = static_cast<SignedWide<xlen>>(static_cast<SignedXlen<xlen>>(cpu.GetReg(fields.rs1)))
+                                     * static_cast<SignedXlen<xlen>>(cpu.GetReg(fields.rs2));
+      cpu.SetReg(fields.rd, xlen_value<xlen>(product >> xlen));
     }
   },
   {
@@ -870,7 +763,9 @@ const static Instruction instructions[] = {
     .instruction_matcher = 0x02002033,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'R'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) * cpu.GetReg(fields.rs2));
+      const SignedWide<xlen> product = static_cast<SignedWide<xlen>>(static_cast<SignedXlen<xlen>>(cpu.GetReg(fields.rs1)))
+                                     * static_cast<SignedWide<xlen>>(xlen_address<xlen>(cpu.GetReg(fields.rs2)));
+      cpu.SetReg(fields.rd, xlen_value<xlen>(product >> xlen));
     }
   },
   {
@@ -880,7 +775,9 @@ const static Instruction instructions[] = {
     .instruction_matcher = 0x02003033,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'R'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) * cpu.GetReg(fields.rs2));
+      const UnsignedWide<xlen> product = static_cast<UnsignedWide<xlen>>(xlen_address<xlen>(cpu.GetReg(fields.rs1)))
+                                       * xlen_address<xlen>(cpu.GetReg(fields.rs2));
+      cpu.SetReg(fields.rd, xlen_value<xlen>(product >> xlen));
     }
   },
   {
@@ -890,14 +787,14 @@ const static Instruction instructions[] = {
     .instruction_matcher = 0x02004033,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'R'>(instruction);
-      const int64_t dividend = static_cast<int64_t>(cpu.GetReg(fields.rs1));
-      const int64_t divisor = static_cast<int64_t>(cpu.GetReg(fields.rs2));
+      const SignedXlen<xlen> dividend = static_cast<SignedXlen<xlen>>(cpu.GetReg(fields.rs1));
+      const SignedXlen<xlen> divisor = static_cast<SignedXlen<xlen>>(cpu.GetReg(fields.rs2));
       if(divisor == 0)
       {
         cpu.SetReg(fields.rd, -1);
         return;
       }
-      else if (dividend == INT64_MIN && divisor == -1)
+      else if (dividend == std::numeric_limits<SignedXlen<xlen>>::min() && divisor == -1)
       {
         cpu.SetReg(fields.rd, dividend);
         return;
@@ -912,14 +809,14 @@ const static Instruction instructions[] = {
     .instruction_matcher = 0x02005033,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'R'>(instruction);
-      const uint64_t dividend = cpu.GetReg(fields.rs1);
-      const uint64_t divisor = cpu.GetReg(fields.rs2);
+      const UnsignedXlen<xlen> dividend = cpu.GetReg(fields.rs1);
+      const UnsignedXlen<xlen> divisor = cpu.GetReg(fields.rs2);
       if(divisor == 0)
       {
         cpu.SetReg(fields.rd, -1);
         return;
       }
-      cpu.SetReg(fields.rd, dividend / divisor);
+      cpu.SetReg(fields.rd, xlen_value<xlen>(dividend / divisor));
     }
   },
   {
@@ -929,14 +826,14 @@ const static Instruction instructions[] = {
     .instruction_matcher = 0x02006033,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'R'>(instruction);
-      const int64_t dividend = static_cast<int64_t>(cpu.GetReg(fields.rs1));
-      const int64_t divisor = static_cast<int64_t>(cpu.GetReg(fields.rs2));
+      const SignedXlen<xlen> dividend = static_cast<SignedXlen<xlen>>(cpu.GetReg(fields.rs1));
+      const SignedXlen<xlen> divisor = static_cast<SignedXlen<xlen>>(cpu.GetReg(fields.rs2));
       if(divisor == 0)
       {
         cpu.SetReg(fields.rd, dividend);
         return;
       }
-      else if (dividend == INT64_MIN && divisor == -1)
+      else if (dividend == std::numeric_limits<SignedXlen<xlen>>::min() && divisor == -1)
       {
         cpu.SetReg(fields.rd, 0);
         return;
@@ -951,241 +848,311 @@ const static Instruction instructions[] = {
     .instruction_matcher = 0x02007033,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'R'>(instruction);
-      const uint64_t dividend = cpu.GetReg(fields.rs1);
-      const uint64_t divisor = cpu.GetReg(fields.rs2);
+      const UnsignedXlen<xlen> dividend = cpu.GetReg(fields.rs1);
+      const UnsignedXlen<xlen> divisor = cpu.GetReg(fields.rs2);
       if(divisor == 0)
       {
-        cpu.SetReg(fields.rd, dividend);
+        cpu.SetReg(fields.rd, xlen_value<xlen>(dividend));
         return;
       }
-      cpu.SetReg(fields.rd, dividend % divisor);
+      cpu.SetReg(fields.rd, xlen_value<xlen>(dividend % divisor));
     }
   },
   // RV32M
   // ----------------------------------------
-  // RV64M
-  // INSTRUCTION IN RV64M: MULW, DIVW, DIVUW, REMW, REMUW
+  // RV32A
+  // INSTRUCTIONS IN RV32A: LR.W, SC.W, AMOSWAP.W, AMOADD.W,
+  //                        AMOXOR.W, AMOAND.W, AMOOR.W,
+  //                        AMOMIN.W, AMOMAX.W, AMOMINU.W, AMOMAXU.W
   {
-    .name = "MULW",
+    .name = "LR.W",
     .format = 'R',
-    .mask_field = 0xfe00707f,
-    .instruction_matcher = 0x0200003b,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'R'>(instruction);
-      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) * cpu.GetReg(fields.rs2));
-    }
+    .mask_field = 0xf9f0707f,
+    .instruction_matcher = 0x1000202f,
+    .execute = LoadReserved<int32_t, xlen>
   },
   {
-    .name = "DIVW",
+    .name = "SC.W",
     .format = 'R',
-    .mask_field = 0xfe00707f,
-    .instruction_matcher = 0x0200403b,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'R'>(instruction);
-      const int32_t dividend = static_cast<int32_t>(cpu.GetReg(fields.rs1));
-      const int32_t divisor = static_cast<int32_t>(cpu.GetReg(fields.rs2));
-      if(divisor == 0)
-      {
-        cpu.SetReg(fields.rd, -1);
-        return;
-      }
-      else if(dividend == INT32_MIN && divisor == -1)
-      {
-        cpu.SetReg(fields.rd, dividend);
-        return;
-      }
-      cpu.SetReg(fields.rd, dividend / divisor);
-    }
+    .mask_field = 0xf800707f,
+    .instruction_matcher = 0x1800202f,
+    .execute = StoreConditional<int32_t, xlen>
   },
   {
-    .name = "DIVUW",
+    .name = "AMOSWAP.W",
     .format = 'R',
-    .mask_field = 0xfe00707f,
-    .instruction_matcher = 0x0200503b,
+    .mask_field = 0xf800707f,
+    .instruction_matcher = 0x0800202f,
+    .execute = AmoOp<int32_t, xlen, AmoSwap<int32_t>>
+  },
+  {
+    .name = "AMOADD.W",
+    .format = 'R',
+    .mask_field = 0xf800707f,
+    .instruction_matcher = 0x0000202f,
+    .execute = AmoOp<int32_t, xlen, AmoAdd<int32_t>>
+  },
+  {
+    .name = "AMOXOR.W",
+    .format = 'R',
+    .mask_field = 0xf800707f,
+    .instruction_matcher = 0x2000202f,
+    .execute = AmoOp<int32_t, xlen, AmoXor<int32_t>>
+  },
+  {
+    .name = "AMOAND.W",
+    .format = 'R',
+    .mask_field = 0xf800707f,
+    .instruction_matcher = 0x6000202f,
+    .execute = AmoOp<int32_t, xlen, AmoAnd<int32_t>>
+  },
+  {
+    .name = "AMOOR.W",
+    .format = 'R',
+    .mask_field = 0xf800707f,
+    .instruction_matcher = 0x4000202f,
+    .execute = AmoOp<int32_t, xlen, AmoOr<int32_t>>
+  },
+  {
+    .name = "AMOMIN.W",
+    .format = 'R',
+    .mask_field = 0xf800707f,
+    .instruction_matcher = 0x8000202f,
+    .execute = AmoOp<int32_t, xlen, AmoMin<int32_t>>
+  },
+  {
+    .name = "AMOMAX.W",
+    .format = 'R',
+    .mask_field = 0xf800707f,
+    .instruction_matcher = 0xa000202f,
+    .execute = AmoOp<int32_t, xlen, AmoMax<int32_t>>
+  },
+  {
+    .name = "AMOMINU.W",
+    .format = 'R',
+    .mask_field = 0xf800707f,
+    .instruction_matcher = 0xc000202f,
+    .execute = AmoOp<uint32_t, xlen, AmoMin<uint32_t>>
+  },
+  {
+    .name = "AMOMAXU.W",
+    .format = 'R',
+    .mask_field = 0xf800707f,
+    .instruction_matcher = 0xe000202f,
+    .execute = AmoOp<uint32_t, xlen, AmoMax<uint32_t>>
+  },
+  // RV32A
+  // ----------------------------------------
+};
+
+const static Instruction rv64_instructions[] = {
+  // RV64I
+  // INSTRUCTIONS IN RV64I: LWU, LD, SD,
+  //                        ADDIW, SLLIW, SRLIW, SRAIW, ADDW, SUBW, SLLW, SRLW, SRAW
+  {
+    .name = "LWU",
+    .format = 'I',
+    .mask_field = 0x0000707f,
+    .instruction_matcher = 0x00006003,
+    .execute = LoadOp<uint32_t, 64>
+  },
+  {
+    .name = "LD",
+    .format = 'I',
+    .mask_field = 0x0000707f,
+    .instruction_matcher = 0x00003003,
+    .execute = LoadOp<uint64_t, 64>
+  },
+  {
+    .name = "SD",
+    .format = 'S',
+    .mask_field = 0x0000707f,
+    .instruction_matcher = 0x00003023,
+    .execute = StoreOp<uint64_t, 64>
+  },
+  {
+    .name = "ADDIW",
+    .format = 'I',
+    .mask_field = 0x0000707f,
+    .instruction_matcher = 0x0000001b,
     .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'R'>(instruction);
-      const uint32_t dividend = static_cast<uint32_t>(cpu.GetReg(fields.rs1));
-      const uint32_t divisor = static_cast<uint32_t>(cpu.GetReg(fields.rs2));
-      if(divisor == 0)
-      {
-        cpu.SetReg(fields.rd, -1);
-        return;
-      }
-      cpu.SetReg(fields.rd, dividend / divisor);
+      const InstructionFields fields = parse_instruction<'I'>(instruction);
+      cpu.SetReg(fields.rd, static_cast<int64_t>(static_cast<int32_t>(cpu.GetReg(fields.rs1) + sign_extend_12b(fields.imm))));
     }
   },
   {
-    .name = "REMW",
+    .name = "SLLIW",
     .format = 'R',
     .mask_field = 0xfe00707f,
-    .instruction_matcher = 0x0200603b,
+    .instruction_matcher = 0x0000101b,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'R'>(instruction);
-      const int32_t dividend = static_cast<int32_t>(cpu.GetReg(fields.rs1));
-      const int32_t divisor = static_cast<int32_t>(cpu.GetReg(fields.rs2));
-      if(divisor == 0)
-      {
-        cpu.SetReg(fields.rd, dividend);
-        return;
-      }
-      else if (dividend == INT32_MIN && divisor == -1)
-      {
-        cpu.SetReg(fields.rd, 0);
-        return;
-      }
-      cpu.SetReg(fields.rd, dividend % divisor);
+      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) << fields.imm);
     }
   },
   {
-    .name = "REMUW",
+    .name = "SRLIW",
     .format = 'R',
-    .mask_field = 0xfe00707f,
-    .instruction_matcher = 0x0200703b,
+    .mask_field = 0xfc00707f,
+    .instruction_matcher = 0x0000501b,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'R'>(instruction);
-      const uint32_t dividend = static_cast<uint32_t>(cpu.GetReg(fields.rs1));
-      const uint32_t divisor = static_cast<uint32_t>(cpu.GetReg(fields.rs2));
-      if(divisor == 0)
-      {
-        cpu.SetReg(fields.rd, dividend);
-        return;
-      }
-      cpu.SetReg(fields.rd, dividend % divisor);
+      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) >> fields.imm);
     }
   },
-  // RV64M
-  // ----------------------------------------
-  // RV32A
-  // INSTRUCTIONS IN RV32A: LR.W, SC.W, AMOSWAP.W, AMOADD.W,
-  //                        AMOXOR.W, AMOAND.W, AMOOR.W,
-  //                        AMOMIN.W, AMOMAX.W, AMOMINU.W, AMOMAXU.W
   {
-    .name = "LR.W",
+    .name = "SRAIW",
     .format = 'R',
-    .mask_field = 0xf9f0707f,
-    .instruction_matcher = 0x1000202f,
+    .mask_field = 0xfc00707f,
+    .instruction_matcher = 0x4000501b,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'R'>(instruction);
-      uint64_t data;
-      cpu.Load(fields.rs1, 4, data);
-      cpu.SetReg(fields.rd, data);
-      // TODO(jrola): reservation set
+      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) >> fields.imm);
     }
   },
   {
-    .name = "SC.W",
+    .name = "ADDW",
     .format = 'R',
-    .mask_field = 0xf800707f,
-    .instruction_matcher = 0x1800202f,
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x0000003b,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'R'>(instruction);
-      uint64_t data = cpu.GetReg(fields.rs2);
-      cpu.Store(fields.rs1, 4, data);
-      cpu.SetReg(fields.rd, 0);
-      // TODO(jrola): reservation set
+      cpu.SetReg(fields.rd, static_cast<int32_t>(cpu.GetReg(fields.rs1) + cpu.GetReg(fields.rs2)));
     }
   },
   {
-    .name = "AMOSWAP.W",
+    .name = "SUBW",
     .format = 'R',
-    .mask_field = 0xf800707f,
-    .instruction_matcher = 0x0800202f,
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x4000003b,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'R'>(instruction);
-      uint64_t data = cpu.GetReg(fields.rs1);
-      cpu.SetReg(cpu.GetReg(fields.rs1), cpu.GetReg(fields.rs2));
-      cpu.SetReg(fields.rd, data);
+      cpu.SetReg(fields.rd, static_cast<int32_t>(cpu.GetReg(fields.rs1) - cpu.GetReg(fields.rs2)));
     }
   },
   {
-    .name = "AMOADD.W",
+    .name = "SLLW",
     .format = 'R',
-    .mask_field = 0xf800707f,
-    .instruction_matcher = 0x0000202f,
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x0000103b,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'R'>(instruction);
-      uint64_t data = cpu.GetReg(fields.rs1);
-      cpu.SetReg(cpu.GetReg(fields.rs1), data + cpu.GetReg(fields.rs2));
+      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) << cpu.GetReg(fields.rs2));
     }
   },
   {
-    .name = "AMOXOR.W",
+    .name = "SRLW",
     .format = 'R',
-    .mask_field = 0xf800707f,
-    .instruction_matcher = 0x2000202f,
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x0000503b,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'R'>(instruction);
-      uint64_t data = cpu.GetReg(fields.rs1);
-      cpu.SetReg(cpu.GetReg(fields.rs1), data ^ cpu.GetReg(fields.rs2));
+      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) >> cpu.GetReg(fields.rs2));
     }
   },
   {
-    .name = "AMOAND.W",
+    .name = "SRAW",
     .format = 'R',
-    .mask_field = 0xf800707f,
-    .instruction_matcher = 0x6000202f,
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x4000503b,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'R'>(instruction);
-      uint64_t data = cpu.GetReg(fields.rs1);
-      cpu.SetReg(cpu.GetReg(fields.rs1), data & cpu.GetReg(fields.rs2));
+      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) >> cpu.GetReg(fields.rs2));
     }
   },
+  // RV64I
+  // ----------------------------------------
+  // RV64M
+  // INSTRUCTION IN RV64M: MULW, DIVW, DIVUW, REMW, REMUW
   {
-    .name = "AMOOR.W",
+    .name = "MULW",
     .format = 'R',
-    .mask_field = 0xf800707f,
-    .instruction_matcher = 0x4000202f,
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x0200003b,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'R'>(instruction);
-      uint64_t data = cpu.GetReg(fields.rs1);
-      cpu.SetReg(cpu.GetReg(fields.rs1), data | cpu.GetReg(fields.rs2));
+      cpu.SetReg(fields.rd, cpu.GetReg(fields.rs1) * cpu.GetReg(fields.rs2));
     }
   },
   {
-    .name = "AMOMIN.W",
+    .name = "DIVW",
     .format = 'R',
-    .mask_field = 0xf800707f,
-    .instruction_matcher = 0x8000202f,
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x0200403b,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'R'>(instruction);
-      uint64_t data = cpu.GetReg(fields.rs1);
-      cpu.SetReg(cpu.GetReg(fields.rs1), std::min(data, cpu.GetReg(fields.rs2)));
+      const int32_t dividend = static_cast<int32_t>(cpu.GetReg(fields.rs1));
+      const int32_t divisor = static_cast<int32_t>(cpu.GetReg(fields.rs2));
+      if(divisor == 0)
+      {
+        cpu.SetReg(fields.rd, -1);
+        return;
+      }
+      else if(dividend == INT32_MIN && divisor == -1)
+      {
+        cpu.SetReg(fields.rd, dividend);
+        return;
+      }
+      cpu.SetReg(fields.rd, dividend / divisor);
     }
   },
   {
-    .name = "AMOMAX.W",
+    .name = "DIVUW",
     .format = 'R',
-    .mask_field = 0xf800707f,
-    .instruction_matcher = 0xa000202f,
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x0200503b,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'R'>(instruction);
-      uint64_t data = cpu.GetReg(fields.rs1);
-      cpu.SetReg(cpu.GetReg(fields.rs1), std::max(data, cpu.GetReg(fields.rs2)));
+      const uint32_t dividend = static_cast<uint32_t>(cpu.GetReg(fields.rs1));
+      const uint32_t divisor = static_cast<uint32_t>(cpu.GetReg(fields.rs2));
+      if(divisor == 0)
+      {
+        cpu.SetReg(fields.rd, -1);
+        return;
+      }
+      cpu.SetReg(fields.rd, dividend / divisor);
     }
   },
   {
-    .name = "AMOMINU.W",
+    .name = "REMW",
     .format = 'R',
-    .mask_field = 0xf800707f,
-    .instruction_matcher = 0xc000202f,
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x0200603b,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'R'>(instruction);
-      uint64_t data = cpu.GetReg(fields.rs1);
-      cpu.SetReg(cpu.GetReg(fields.rs1), std::min(data, cpu.GetReg(fields.rs2)));
+      const int32_t dividend = static_cast<int32_t>(cpu.GetReg(fields.rs1));
+      const int32_t divisor = static_cast<int32_t>(cpu.GetReg(fields.rs2));
+      if(divisor == 0)
+      {
+        cpu.SetReg(fields.rd, dividend);
+        return;
+      }
+      else if (dividend == INT32_MIN && divisor == -1)
+      {
+        cpu.SetReg(fields.rd, 0);
+        return;
+      }
+      cpu.SetReg(fields.rd, dividend % divisor);
     }
   },
   {
-    .name = "AMOMAXU.W",
+    .name = "REMUW",
     .format = 'R',
-    .mask_field = 0xf800707f,
-    .instruction_matcher = 0xe000202f,
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x0200703b,
     .execute = [](const uint32_t instruction, CPU& cpu) {
       const InstructionFields fields = parse_instruction<'R'>(instruction);
-      uint64_t data = cpu.GetReg(fields.rs1);
-      cpu.SetReg(cpu.GetReg(fields.rs1), std::max(data, cpu.GetReg(fields.rs2)));
+      const uint32_t dividend = static_cast<uint32_t>(cpu.GetReg(fields.rs1));
+      const uint32_t divisor = static_cast<uint32_t>(cpu.GetReg(fields.rs2));
+      if(divisor == 0)
+      {
+        cpu.SetReg(fields.rd, dividend);
+        return;
+      }
+      cpu.SetReg(fields.rd, dividend % divisor);
     }
   },
-  // RV32A
+  // RV64M
   // ----------------------------------------
   // RV64A
   // INSTRUCTIONS IN RV64A: LR.D, SC.D, AMOSWAP.D, AMOADD.D,
@@ -1195,169 +1162,199 @@ const static Instruction instructions[] = {
     .format = 'R',
     .mask_field = 0xf9f0707f,
     .instruction_matcher = 0x1000302f,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'R'>(instruction);
-      uint64_t data;
-      cpu.Load(fields.rs1, 8, data);
-      cpu.SetReg(fields.rd, data);
-      // TODO(jrola): reservation set
-    }
+    .execute = LoadReserved<int64_t, 64>
   },
   {
     .name = "SC.D",
     .format = 'R',
     .mask_field = 0xf800707f,
     .instruction_matcher = 0x1800302f,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'R'>(instruction);
-      uint64_t data = cpu.GetReg(fields.rs2);
-      cpu.Store(fields.rs1, 8, data);
-      cpu.SetReg(fields.rd, 0);
-      // TODO(jrola): reservation set
-    }
+    .execute = StoreConditional<int64_t, 64>
   },
   {
     .name = "AMOSWAP.D",
     .format = 'R',
     .mask_field = 0xf800707f,
     .instruction_matcher = 0x0800302f,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'R'>(instruction);
-      uint64_t data = cpu.GetReg(fields.rs1);
-      cpu.SetReg(fields.rd, data);
-      cpu.SetReg(fields.rs1, cpu.GetReg(fields.rs2));
-    }
+    .execute = AmoOp<int64_t, 64, AmoSwap<int64_t>>
   },
   {
     .name = "AMOADD.D",
     .format = 'R',
     .mask_field = 0xf800707f,
     .instruction_matcher = 0x0000302f,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'R'>(instruction);
-      uint64_t data = cpu.GetReg(fields.rs1);
-      cpu.SetReg(fields.rd, data);
-      cpu.SetReg(fields.rs1, data + cpu.GetReg(fields.rs2));
-    }
+    .execute = AmoOp<int64_t, 64, AmoAdd<int64_t>>
   },
   {
     .name = "AMOXOR.D",
     .format = 'R',
     .mask_field = 0xf800707f,
     .instruction_matcher = 0x2000302f,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'R'>(instruction);
-      uint64_t data = cpu.GetReg(fields.rs1);
-      cpu.SetReg(fields.rd, data);
-      cpu.SetReg(fields.rs1, data ^ cpu.GetReg(fields.rs2));
-    }
+    .execute = AmoOp<int64_t, 64, AmoXor<int64_t>>
   },
   {
     .name = "AMOAND.D",
     .format = 'R',
     .mask_field = 0xf800707f,
     .instruction_matcher = 0x6000302f,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'R'>(instruction);
-      uint64_t data = cpu.GetReg(fields.rs1);
-      cpu.SetReg(fields.rd, data);
-      cpu.SetReg(fields.rs1, data & cpu.GetReg(fields.rs2));
-    }
+    .execute = AmoOp<int64_t, 64, AmoAnd<int64_t>>
   },
   {
     .name = "AMOOR.D",
     .format = 'R',
     .mask_field = 0xf800707f,
     .instruction_matcher = 0x4000302f,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'R'>(instruction);
-      uint64_t data = cpu.GetReg(fields.rs1);
-      cpu.SetReg(fields.rd, data);
-      cpu.SetReg(fields.rs1, data | cpu.GetReg(fields.rs2));
-    }
+    .execute = AmoOp<int64_t, 64, AmoOr<int64_t>>
   },
   {
     .name = "AMOMIN.D",
     .format = 'R',
     .mask_field = 0xf800707f,
     .instruction_matcher = 0x8000302f,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'R'>(instruction);
-      uint64_t data = cpu.GetReg(fields.rs1);
-      cpu.SetReg(cpu.GetReg(fields.rs1), std::min(data, cpu.GetReg(fields.rs2)));
-    }
+    .execute = AmoOp<int64_t, 64, AmoMin<int64_t>>
   },
   {
     .name = "AMOMAX.D",
     .format = 'R',
     .mask_field = 0xf800707f,
     .instruction_matcher = 0xa000302f,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'R'>(instruction);
-      uint64_t data = cpu.GetReg(fields.rs1);
-      cpu.SetReg(cpu.GetReg(fields.rs1), std::max(data, cpu.GetReg(fields.rs2)));
-    }
+    .execute = AmoOp<int64_t, 64, AmoMax<int64_t>>
   },
   {
     .name = "AMOMINU.D",
     .format = 'R',
     .mask_field = 0xf800707f,
     .instruction_matcher = 0xc000302f,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'R'>(instruction);
-      uint64_t data = cpu.GetReg(fields.rs1);
-      cpu.SetReg(cpu.GetReg(fields.rs1), std::min(data, cpu.GetReg(fields.rs2)));
-    }
+    .execute = AmoOp<uint64_t, 64, AmoMin<uint64_t>>
   },
   {
     .name = "AMOMAXU.D",
     .format = 'R',
     .mask_field = 0xf800707f,
     .instruction_matcher = 0xe000302f,
-    .execute = [](const uint32_t instruction, CPU& cpu) {
-      const InstructionFields fields = parse_instruction<'R'>(instruction);
-      uint64_t data = cpu.GetReg(fields.rs1);
-      cpu.SetReg(cpu.GetReg(fields.rs1), std::max(data, cpu.GetReg(fields.rs2)));
-    }
+    .execute = AmoOp<uint64_t, 64, AmoMax<uint64_t>>
   }
   //RV64A
   // ----------------------------
 };
 
+// Decode searches the tables of the hart's XLEN in order
+static const std::span<const Instruction> rv64_tables[] = {
+  base_instructions<64>,
+  rv64_instructions,
+  fd_instructions,
+  bitmanip_instructions,
+  vector_instructions,
+};
+
+static const std::span<const Instruction> rv32_tables[] = {
+  base_instructions<32>,
+};
+
+void CPU::ConfigureXlen()
+{
+  switch(xlen)
+  {
+    case 32:
+      decode_tables = rv32_tables;
+      expand_compressed = ExpandCompressed<32>;
+      hot.mstatus = 0; // no F or V
+      break;
+    case 64:
+      decode_tables = rv64_tables;
+      expand_compressed = ExpandCompressed<64>;
+      hot.mstatus = mstatus_fs_initial | mstatus_vs_initial | mstatus_xlen64;
+      break;
+    default:
+      throw std::runtime_error("XLEN must be 32 or 64");
+  }
+}
+
 const Instruction& CPU::Decode(uint32_t instruction)
 {
-  for(const auto& i : instructions)
+  for(const auto& table : decode_tables)
   {
-    if ((instruction & i.mask_field) == i.instruction_matcher)
+    for(const auto& i : table)
     {
-      return i;
+      if ((instruction & i.mask_field) == i.instruction_matcher)
+      {
+        return i;
+      }
     }
   }
   throw CPUTrapException(trap_value::IllegalInstruction);
 }
 
+// Compressed instructions are expanded here, once per distinct encoding
+const DecodedInstruction& CPU::DecodeCached(uint32_t raw)
+{
+  DecodedInstruction& entry = decode_cache[(raw ^ (raw >> 12)) & (DECODE_CACHE_SIZE - 1)];
+  if(entry.inst == nullptr || entry.raw != raw)
+  {
+    const uint32_t bits = IsCompressed(raw) ? expand_compressed(raw) : raw;
+    entry = DecodedInstruction{.raw = raw, .bits = bits, .inst = &Decode(bits)};
+  }
+  return entry;
+}
+
+// Returns the raw instruction, 16-bit for compressed ones, and advances pc by its length
 uint32_t CPU::Fetch()
 {
   uint64_t inst;
-  Load(pc, 4, inst);
-  pc += 4;
+  // A 32-bit instruction can straddle a page boundary, only then fetch it in two halves
+  if((hot.pc & (PAGE_SIZE - 1)) != PAGE_SIZE - 2)
+  {
+    mmu.Fetch(hot.pc, 4, inst);
+  }
+  else
+  {
+    mmu.Fetch(hot.pc, 2, inst);
+    if(!IsCompressed(inst))
+    {
+      uint64_t upper;
+      mmu.Fetch(hot.pc + 2, 2, upper);
+      inst |= upper << 16;
+    }
+  }
+  if(IsCompressed(inst))
+  {
+    hot.inst_len = 2;
+    inst &= 0xffff;
+  }
+  else
+  {
+    hot.inst_len = 4;
+  }
+  hot.pc += hot.inst_len;
   return inst;
 }
 
 void CPU::Step()
 {
-  reg_zero = 0;   // zero out register 0, can't be made const
-  const uint32_t instruction = Fetch();
-  const Instruction& inst = Decode(instruction);
+  hot.regs[0] = 0;   // zero out register 0, can't be made const
+  hot.inst_len = 0;  // a fetch fault points at pc itself
   try
   {
-    inst.execute(instruction, *this);
+    const uint32_t instruction = Fetch();
+    const DecodedInstruction& decoded = DecodeCached(instruction);
+    decoded.inst->execute(decoded.bits, *this);
   }
   catch (const CPUTrapException& e)
   {
-    HandleTrap(e.GetTrap());
+    HandleTrap(e.GetTrap(), e.GetTval());
+    if(debug_halted)
+    {
+      return;
+    }
+  }
+  if(++hot.instret >= hot.timer_deadline)
+  {
+    UpdateTimer();
+  }
+  if(hot.check_interrupts)
+  {
+    HandleInterrupts();
   }
-  HandleInterrupts();
 }
 
 void CPU::Run()
@@ -1366,7 +1363,7 @@ void CPU::Run()
   {
     try
     {
-      Step();
+      RunBlocks(UINT64_MAX);
     }
     catch(const CPUTrapException& e)
     {
@@ -1375,111 +1372,569 @@ void CPU::Run()
   }
 }
 
+uint64_t CPU::RunBlocks(uint64_t max_instructions)
+{
+  const uint64_t start = hot.instret;
+  run_limit = start + std::min(max_instructions, UINT64_MAX - start);
+  hot.timer_deadline = std::min(hot.timer_deadline, run_limit);
+  Block* block = nullptr;
+  // A block left through an exit without a usable link, linked to whatever runs next
+  Block* from = nullptr;
+  int from_exit = 0;
+  while(hot.instret < run_limit)
+  {
+    if(stop_requested.load(std::memory_order_relaxed))
+    {
+      stop_requested.store(false, std::memory_order_relaxed);
+      break;
+    }
+    if(tohost != nullptr && (*tohost & 1))
+    {
+      break;
+    }
+    if(blocks.SyncRequested())
+    {
+      blocks.SyncCode(mmu.GetMemory());
+      block = nullptr;
+      from = nullptr;
+    }
+    if(block == nullptr)
+    {
+      block = LookupBlock(from);
+      if(block == nullptr)
+      {
+        // Code outside memory, across a page boundary, or not decodable
+        Step();
+        from = nullptr;
+        continue;
+      }
+      if(from != nullptr)
+      {
+        blocks.Link(*from, from_exit, *block);
+      }
+    }
+
+    const int exit = ExecuteBlock(*block);
+    from = nullptr;
+    if(exit < 0)
+    {
+      block = nullptr;
+      continue;
+    }
+    if(blocks.Profile(*block, exit) != nullptr)
+    {
+      // block was hot and has been replaced by the trace it heads
+      block = nullptr;
+      continue;
+    }
+    Block* next = block->link[exit];
+    if(next != nullptr && next->generation == blocks.GetGeneration())
+    {
+      blocks.CountChained();
+      block = next;
+      continue;
+    }
+    from = block;
+    from_exit = exit;
+    block = nullptr;
+  }
+  run_limit = UINT64_MAX;
+  return hot.instret - start;
+}
+
+// A block from an older generation is revalidated by translating its pc again.
+// from is cleared if it is the block that turns out stale.
+Block* CPU::LookupBlock(Block*& from)
+{
+  Block* block = blocks.Find(hot.pc, hot.priv_mode);
+  if(block != nullptr && block->generation != blocks.GetGeneration())
+  {
+    uint64_t physical_pc = 0;
+    bool mapped = true;
+    try
+    {
+      physical_pc = mmu.Translate(hot.pc, AccessType::Execute);
+    }
+    catch(const CPUTrapException& e)
+    {
+      mapped = false;
+    }
+    if(mapped && (physical_pc >> 12) == block->physical_page && block->translation == mmu.GetTranslation())
+    {
+      block->generation = blocks.GetGeneration();
+      return block;
+    }
+    if(block == from)
+    {
+      from = nullptr;
+    }
+    blocks.Remove(block);
+    block = nullptr;
+  }
+  if(block == nullptr)
+  {
+    block = BuildBlock();
+  }
+  return block;
+}
+
+// Decodes from pc to the end of the block, nullptr if not even the first
+// instruction can be, Step then raises whatever fault that is
+Block* CPU::BuildBlock()
+{
+  uint64_t physical_pc;
+  try
+  {
+    physical_pc = mmu.Translate(hot.pc, AccessType::Execute);
+  }
+  catch(const CPUTrapException& e)
+  {
+    return nullptr;
+  }
+  const uint8_t* page = mmu.GetMemory().HostAddress(physical_pc & ~static_cast<uint64_t>(PAGE_SIZE - 1), false);
+  if(page == nullptr)
+  {
+    return nullptr;
+  }
+
+  auto block = std::make_unique<Block>();
+  block->pc = hot.pc;
+  block->physical_page = physical_pc >> 12;
+  block->priv = hot.priv_mode;
+  block->translation = mmu.GetTranslation();
+  block->generation = blocks.GetGeneration();
+  uint64_t offset = physical_pc & (PAGE_SIZE - 1);
+  uint64_t pc = hot.pc;
+  bool ended = false;
+  while(!ended && block->code.size() < BLOCK_MAX_INSTRUCTIONS && offset + 2 <= PAGE_SIZE)
+  {
+    uint32_t raw = 0;
+    std::memcpy(&raw, page + offset, 2);
+    const uint8_t len = IsCompressed(raw) ? 2 : 4;
+    if(offset + len > PAGE_SIZE)
+    {
+      break;
+    }
+    std::memcpy(&raw, page + offset, len);
+    const DecodedInstruction* decoded;
+    try
+    {
+      decoded = &DecodeCached(raw);
+    }
+    catch(const CPUTrapException& e)
+    {
+      break;
+    }
+    block->code.push_back(BlockInstruction{.execute = Specialize(decoded->inst->execute, block->translation),
+                                           .fused = nullptr, .bits = decoded->bits, .len = len, .fusion = Fusion::None});
+
+    const uint32_t bits = decoded->bits;
+    switch(bits & 0x7f)
+    {
+      case 0x63: // branches
+        block->exit_pc[0] = pc + sign_extend_13b(parse_instruction<'B'>(bits).imm);
+        block->exit_pc[1] = pc + len;
+        ended = true;
+        break;
+      case 0x6f: // JAL
+        block->exit_pc[0] = pc + sign_extend_21b(parse_instruction<'J'>(bits).imm);
+        ended = true;
+        break;
+      case 0x67: // JALR
+      case 0x73: // SYSTEM, may trap, return or change the translation
+        ended = true;
+        break;
+      case 0x0f: // FENCE.I
+        ended = ((bits >> 12) & 7) == 1;
+        break;
+      default:
+        break;
+    }
+    pc += len;
+    offset += len;
+  }
+  if(block->code.empty())
+  {
+    return nullptr;
+  }
+  // The fused handlers implement RV64 semantics
+  for(size_t i = 0; xlen == 64 && i + 1 < block->code.size(); i++)
+  {
+    BlockInstruction& first = block->code[i];
+    const FusedPair pair = MatchFusion(first.bits, block->code[i + 1].bits);
+    if(pair.execute != nullptr)
+    {
+      first.fused = pair.execute;
+      first.fusion = pair.kind;
+      i++;
+    }
+  }
+  if(!ended)
+  {
+    block->exit_pc[1] = pc;
+  }
+  return blocks.Insert(std::move(block));
+}
+
+// Runs op up to end, false if an instruction needs the run loop to look at the
+// hart before going on: the budget ran out or an interrupt is pending. A trap
+// propagates to ExecuteBlock.
+bool CPU::ExecuteRange(const BlockInstruction*& op, const BlockInstruction* end)
+{
+  for(; op != end; op++)
+  {
+    hot.regs[0] = 0;
+    // A fused pair retires its first half without a timer check in between
+    if(op->fused != nullptr && hot.instret + 1 < hot.timer_deadline)
+    {
+      const BlockInstruction& second = op[1];
+      hot.pc += op->len + second.len;
+      hot.inst_len = second.len;
+      hot.instret++;
+      blocks.CountFused(op->fusion);
+      op->fused(op->bits, second.bits, *this);
+      op++;
+    }
+    else
+    {
+      hot.pc += op->len;
+      hot.inst_len = op->len;
+      op->execute(op->bits, *this);
+    }
+    if(++hot.instret >= hot.timer_deadline)
+    {
+      UpdateTimer();
+      if(hot.instret >= run_limit)
+      {
+        return false;
+      }
+    }
+    if(hot.check_interrupts)
+    {
+      HandleInterrupts();
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns the exit the block left through, -1 if it left early, through a trace's
+// side exit or through an exit that was not known when it was built
+int CPU::ExecuteBlock(const Block& block)
+{
+  if(block.trace)
+  {
+    blocks.CountTraceRun();
+  }
+  try
+  {
+    // Fused pairs never straddle a guard, the branch before one is always the last of its block
+    const BlockInstruction* op = block.code.data();
+    for(const TraceGuard& guard : block.guards)
+    {
+      if(!ExecuteRange(op, block.code.data() + guard.end))
+      {
+        return -1;
+      }
+      if(hot.pc != guard.pc)
+      {
+        blocks.CountSideExit();
+        return -1;
+      }
+    }
+    if(!ExecuteRange(op, block.code.data() + block.code.size()))
+    {
+      return -1;
+    }
+  }
+  catch(const CPUTrapException& e)
+  {
+    HandleTrap(e.GetTrap(), e.GetTval());
+    if(++hot.instret >= hot.timer_deadline)
+    {
+      UpdateTimer();
+    }
+    return -1;
+  }
+  if(hot.pc == block.exit_pc[0])
+  {
+    return 0;
+  }
+  return hot.pc == block.exit_pc[1] ? 1 : -1;
+}
+
+void CPU::UpdateAccessControl()
+{
+  // MPRV makes M-mode loads and stores use the permissions of the mode in MPP
+  const auto mpp = static_cast<PrivilegeMode>((hot.mstatus & mstatus_mpp) >> 11);
+  const PrivilegeMode data_mode = (hot.priv_mode == MACHINE && (hot.mstatus & mstatus_mprv)) ? mpp : hot.priv_mode;
+  mmu.SetAccessControl(hot.priv_mode, data_mode, hot.mstatus & mstatus_sum, hot.mstatus & mstatus_mxr);
+}
+
 void CPU::UpdatePagingMode(const uint64_t satp_val)
 {
   if(xlen == 64)
   {
-    mmu.SetPagingMode(mask<63, 63>(satp_val) ? PagingMode::Sv39 : PagingMode::Bare);
+    // MODE 8, 9 and 10, the satp write hook refuses the others
+    const uint64_t mode = mask<60, 63>(satp_val);
+    mmu.SetPagingMode(mode == 0 ? PagingMode::Bare : static_cast<PagingMode>(PagingMode::Sv39 + (mode - 8)));
     mmu.SetRootPageTable(mask<0, 43>(satp_val));
   }
   else
   {
-    throw CPUTrapException(trap_value::InstructionPageFault);
+    mmu.SetPagingMode(mask<31, 31>(satp_val) ? PagingMode::Sv32 : PagingMode::Bare);
+    mmu.SetRootPageTable(mask<0, 21>(satp_val));
   }
+  blocks.NewGeneration();
 }
 
-void CPU::HandleTrap(const trap_value tval)
+void CPU::HandleTrap(const trap_value trap, const uint64_t tval)
 {
-  const uint64_t trap_pc = pc -4;
+  // Interrupts are taken between instructions, exceptions point at the faulting one
+  const uint64_t trap_pc = (trap & interrupt_bit) ? hot.pc : hot.pc - hot.inst_len;
   const PrivilegeMode trap_priv_mode = GetMode();
-  const uint64_t cause = tval;
+  const uint64_t cause = trap;
+  // The interrupt flag is bit XLEN - 1 of mcause and scause
+  const uint64_t cause_value = (cause & ~interrupt_bit) | ((cause & interrupt_bit) >> (64 - xlen));
 
-  if((trap_priv_mode == SUPERVISOR || trap_priv_mode == USER) && (((csrs[medeleg] >> (cause & ~interrupt_bit)) & 1) != 0))
+  // With a debugger attached EBREAK stops the hart in place instead of trapping,
+  // so software breakpoints are just patched instructions with no cost in Step
+  if(trap == Breakpoint && halt_on_ebreak)
+  {
+    hot.pc = trap_pc;
+    debug_halted = true;
+    return;
+  }
+
+  const uint64_t delegated = (cause & interrupt_bit) ? Csr(mideleg) : Csr(medeleg);
+  if((trap_priv_mode == SUPERVISOR || trap_priv_mode == USER) && (((delegated >> (cause & ~interrupt_bit)) & 1) != 0))
   {
     SetMode(SUPERVISOR);
     if((cause & interrupt_bit) != 0)
     {
-      uint64_t vec = (csrs[stvec] & 1) ? (4 * cause) : 0;
-      pc = (csrs[stvec] & ~1) + vec;
+      uint64_t vec = (Csr(stvec) & 1) ? (4 * cause) : 0;
+      hot.pc = (Csr(stvec) & ~1) + vec;
     }
     else
     {
-      pc = csrs[stvec] & ~1;
+      hot.pc = Csr(stvec) & ~1;
     }
-    csrs[sepc] = trap_pc & ~1;
-    csrs[scause] = cause;
-    csrs[stval] = 0;
-    csrs[sstatus] = ((csrs[sstatus] >> 1) & 1) ? csrs[sstatus] | (1 << 5) : csrs[sstatus] & ~(1 << 5);
-    csrs[sstatus] = csrs[sstatus] & ~(1 << 1);
+    Csr(sepc) = trap_pc & ~1;
+    Csr(scause) = cause_value;
+    Csr(stval) = tval;
+    hot.mstatus = ((hot.mstatus >> 1) & 1) ? hot.mstatus | (1 << 5) : hot.mstatus & ~(1 << 5);
+    hot.mstatus = hot.mstatus & ~(1 << 1);
     if (trap_priv_mode == USER) {
-        csrs[sstatus] = csrs[sstatus] & ~(1 << 8);
+        hot.mstatus = hot.mstatus & ~(1 << 8);
     } else {
-        csrs[sstatus] = csrs[sstatus] | (1 << 8);
+        hot.mstatus = hot.mstatus | (1 << 8);
     }
   }
   else
   {
-    priv_mode = MACHINE;
-
     if ((cause & interrupt_bit) != 0) {
-        const uint64_t vec = (csrs[mtvec] & 1) ? 4 * cause : 0;
-        pc = (csrs[mtvec] & ~1) + vec;
+        const uint64_t vec = (Csr(mtvec) & 1) ? 4 * cause : 0;
+        hot.pc = (Csr(mtvec) & ~1) + vec;
     } else {
-        pc = csrs[mtvec] & ~1;
-    }
-    csrs[mepc] = trap_pc & ~1;
-    csrs[mcause] = cause;
-    csrs[mtval] = 0;
-    csrs[mstatus] =   ((csrs[mstatus] >> 3) & 1)
-                      ? csrs[mstatus] | (1 << 7)
-                      : csrs[mstatus] & ~(1 << 7);
-    csrs[mstatus] = csrs[mstatus] & ~(1 << 3);
-    csrs[mstatus] = csrs[mstatus] & ~(3 << 11);
+        hot.pc = Csr(mtvec) & ~1;
+    }
+    Csr(mepc) = trap_pc & ~1;
+    Csr(mcause) = cause_value;
+    Csr(mtval) = tval;
+    hot.mstatus =   ((hot.mstatus >> 3) & 1)
+                      ? hot.mstatus | (1 << 7)
+                      : hot.mstatus & ~(1 << 7);
+    hot.mstatus = hot.mstatus & ~(1 << 3);
+    hot.mstatus = (hot.mstatus & ~mstatus_mpp) | (static_cast<uint64_t>(trap_priv_mode) << 11);
+    // After MPP, which MPRV makes the mode of the handler's loads and stores
+    SetMode(MACHINE);
+  }
+  RequestInterruptCheck();
+}
+
+// Interrupt causes from highest to lowest priority
+static constexpr trap_value interrupt_priority[] = {
+  MachineExternalInterrupt, MachineSoftwareInterrupt, MachineTimerInterrupt,
+  SupervisorExternalInterrupt, SupervisorSoftwareInterrupt, SupervisorTimerInterrupt,
+};
+
+// Packs the pending bits in priority order and scans for the first one set
+static trap_value HighestPriorityInterrupt(uint64_t pending)
+{
+  uint32_t packed = 0;
+  for(const trap_value cause : interrupt_priority)
+  {
+    packed = (packed << 1) | ((pending >> (cause & ~interrupt_bit)) & 1);
   }
+  return interrupt_priority[std::countl_zero(packed) - (32 - std::size(interrupt_priority))];
 }
 
-static const std::map<MIP, void (*)(CPU& cpu)> interrupt_handlers =
+// Only runs when check_interrupts is set. Clearing the flag before sampling the
+// lines means a device raising one concurrently always leaves it set again.
+void CPU::HandleInterrupts()
 {
-  {MIP::meip, [](CPU& cpu){ cpu.SetCsr(mip, cpu.GetCsr(mip) & ~MIP::meip);
-                            cpu.HandleTrap(MachineExternalInterrupt); }},
+  hot.check_interrupts.store(false);
+  const uint64_t pending = GetPendingInterrupts() & hot.mie;
+  if(pending == 0)
+  {
+    return;
+  }
 
-  {MIP::msip, [](CPU& cpu){ cpu.SetCsr(mip, cpu.GetCsr(mip) & ~MIP::msip);
-                            cpu.HandleTrap(MachineSoftwareInterrupt); }},
+  // Interrupts for M-mode are taken in any lower mode or with MIE set, delegated
+  // ones only below M-mode and with SIE set in S-mode. M-mode ones go first.
+  const uint64_t delegated = ReadCsrStorage(CSR::mideleg);
+  const PrivilegeMode mode = GetMode();
+  const bool machine_enabled = mode != MACHINE || (hot.mstatus & mstatus_mie) != 0;
+  const bool supervisor_enabled = mode == USER || (mode == SUPERVISOR && (hot.mstatus & mstatus_sie) != 0);
+  uint64_t takeable = machine_enabled ? pending & ~delegated : 0;
+  if(takeable == 0 && supervisor_enabled)
+  {
+    takeable = pending & delegated;
+  }
+  if(takeable != 0)
+  {
+    HandleTrap(HighestPriorityInterrupt(takeable));
+  }
+}
 
-  {MIP::mtip, [](CPU& cpu){ cpu.SetCsr(mip, cpu.GetCsr(mip) & ~MIP::mtip);
-                            cpu.HandleTrap(MachineTimerInterrupt); }},
+void CPU::RaiseInterrupt(uint64_t mip_bits)
+{
+  irq_lines.fetch_or(mip_bits);
+  {
+    // Setting the flag under the lock pairs with the waiter's predicate check
+    std::lock_guard<std::mutex> lock(irq_mutex);
+    hot.check_interrupts.store(true);
+  }
+  irq_wakeup.notify_all();
+}
 
-  {MIP::seip, [](CPU& cpu){ cpu.SetCsr(mip, cpu.GetCsr(mip) & ~MIP::seip);
-                            cpu.HandleTrap(SupervisorExternalInterrupt);}},
+void CPU::RequestStop()
+{
+  {
+    // Under the lock for the same reason as in RaiseInterrupt
+    std::lock_guard<std::mutex> lock(irq_mutex);
+    stop_requested.store(true, std::memory_order_relaxed);
+    RequestInterruptCheck();
+  }
+  irq_wakeup.notify_all();
+}
 
-  {MIP::ssip, [](CPU& cpu){ cpu.SetCsr(mip, cpu.GetCsr(mip) & ~MIP::ssip);
-                            cpu.HandleTrap(SupervisorSoftwareInterrupt); }},
+void CPU::LowerInterrupt(uint64_t mip_bits)
+{
+  irq_lines.fetch_and(~mip_bits);
+}
 
-  {MIP::stip, [](CPU& cpu){ cpu.SetCsr(mip, cpu.GetCsr(mip) & ~MIP::stip);
-                            cpu.HandleTrap(SupervisorTimerInterrupt); }},
-};
+void CPU::WaitForInterrupt(std::chrono::steady_clock::time_point deadline)
+{
+  // Only device lines and stop requests change while parked, and both are set under the lock
+  std::unique_lock<std::mutex> lock(irq_mutex);
+  auto wake = [this] {
+    return stop_requested.load(std::memory_order_relaxed) || (GetPendingInterrupts() & hot.mie) != 0;
+  };
+  if(deadline == std::chrono::steady_clock::time_point::max())
+  {
+    irq_wakeup.wait(lock, wake);
+  }
+  else
+  {
+    irq_wakeup.wait_until(lock, deadline, wake);
+  }
+}
 
-void CPU::HandleInterrupts()
+void CPU::UpdateTimer()
 {
-  if(GetMode() == MACHINE && ((csrs[mstatus] >> 3) & 1) == 0)
+  auto& clint = mmu.GetClint();
+  const uint64_t now = clint.GetTime();
+  const uint64_t timecmp = clint.GetTimecmp();
+  uint64_t wanted = 0;
+  if(now >= timecmp)
   {
-    return;
+    wanted |= MIP::mtip;
   }
-  if(GetMode() == SUPERVISOR && ((csrs[sstatus] >> 1) & 1) == 0)
+  if(now >= stimecmp)
   {
-    return;
+    wanted |= MIP::stip;
+  }
+  if(clint.SoftwarePending())
+  {
+    wanted |= MIP::msip;
+  }
+  const uint64_t changed = (GetInterruptLines() & (MIP::mtip | MIP::stip | MIP::msip)) ^ wanted;
+  if(changed & wanted)
+  {
+    RaiseInterrupt(changed & wanted);
+  }
+  if(changed & ~wanted)
+  {
+    LowerInterrupt(changed & ~wanted);
   }
 
-  const uint64_t pending = csrs[mie] & csrs[mip];
-  for(const auto &handler : interrupt_handlers)
+  // Due or disarmed timers only change on a CLINT or CSR write, which calls back in here
+  uint64_t next = mtimecmp_disarmed;
+  for(const uint64_t deadline : {timecmp, stimecmp})
   {
-    if(pending & handler.first)
+    if(deadline > now)
     {
-      handler.second(*this);
-      break;
+      next = std::min(next, deadline);
     }
   }
-  return;
+  if(next == mtimecmp_disarmed)
+  {
+    hot.timer_deadline = UINT64_MAX;
+  }
+  else if(clint.GetTimeMode() == TimeMode::InstructionCount)
+  {
+    hot.timer_deadline = hot.instret + std::min(next - now, UINT64_MAX - hot.instret);
+  }
+  else
+  {
+    hot.timer_deadline = hot.instret + TIMER_POLL_INTERVAL;
+  }
+  hot.timer_deadline = std::min(hot.timer_deadline, run_limit);
+}
+
+void CPU::UpdateSupervisorTimer()
+{
+  const bool sstc = (ReadCsrStorage(CSR::menvcfg) & menvcfg_stce) != 0;
+  stimecmp = sstc ? ReadCsrStorage(CSR::stimecmp) : mtimecmp_disarmed;
+  UpdateTimer();
+}
+
+void CPU::Idle()
+{
+  // Under the debugger the hart never parks, so GDB can always stop it
+  if(halt_on_ebreak)
+  {
+    return;
+  }
+  UpdateTimer();
+  auto& clint = mmu.GetClint();
+  // The nearer of the comparators whose interrupt mie enables
+  const uint64_t timecmp = std::min((hot.mie & MIP::mtip) != 0 ? clint.GetTimecmp() : mtimecmp_disarmed,
+                                    (hot.mie & MIP::stip) != 0 ? stimecmp : mtimecmp_disarmed);
+  const bool timer_armed = timecmp != mtimecmp_disarmed;
+  if(clint.GetTimeMode() == TimeMode::InstructionCount && timer_armed)
+  {
+    if((GetPendingInterrupts() & hot.mie) == 0)
+    {
+      // Nothing happens on this hart before the deadline, so skip straight to it
+      clint.AdvanceTime(timecmp - clint.GetTime());
+      UpdateTimer();
+    }
+    return;
+  }
+  if(!park_on_idle)
+  {
+    idled = (GetPendingInterrupts() & hot.mie) == 0;
+    if(idled)
+    {
+      RequestStop();
+    }
+    return;
+  }
+  const bool host_timer = timer_armed && clint.GetTimeMode() == TimeMode::HostClock;
+  WaitForInterrupt(host_timer ? clint.HostDeadline(timecmp) : std::chrono::steady_clock::time_point::max());
+  UpdateTimer();
 }
 
 // DEBUG FUNCTIONS
@@ -1525,10 +1980,11 @@ int CPU::RunInstruction(uint32_t instruction)
 {
   Instruction inst = Decode(instruction);
   CPU::DumpInstruction(inst);
+  hot.inst_len = 4;
+  hot.pc += 4;
   inst.execute(instruction, *this);
 //  CPU::DumpInstructionFields(parse_instruction<inst.format>(instruction, inst.format));
   CPU::DumpRegs();
-  pc += 4;
   return 0;
 }
 
@@ -1537,7 +1993,7 @@ void CPU::DumpRegs()
   std::cout << "--- REGISTERS ---" << std::endl;
   for (int i = 0; i < N_REG; i++)
   {
-    std::cout << RegisterNames.at(i) << ": " << std::hex << regs[i] << std::endl;
+    std::cout << RegisterNames.at(i) << ": " << std::hex << hot.regs[i] << std::endl;
   }
 }
 
@@ -1545,7 +2001,7 @@ void CPU::DumpCsrs()
 {
   for (int i = 0; i < N_CSR; i++)
   {
-    std::cout << "csr" << i << ": " << std::hex << csrs[i] << std::endl;
+    std::cout << "csr" << i << ": " << std::hex << ReadCsrStorage(i) << std::endl;
   }
 }
 
@@ -1556,7 +2012,7 @@ void CPU::DumpInstruction(const Instruction& inst)
   std::cout << "format: " << inst.format << std::endl;
   std::cout << "mask_field: " << std::hex << inst.mask_field << std::endl;
   std::cout << "instruction_matcher: " << std::hex << inst.instruction_matcher << std::endl;
-  std::cout << "pc: " << std::hex << pc << std::endl;
+  std::cout << "pc: " << std::hex << hot.pc << std::endl;
 }
 
 void CPU::DumpInstructionFields(InstructionFields inst)
@@ -0,0 +1,462 @@
+#include "csr.h"
+#include "cpu.h"
+#include <array>
+#include <utility>
+
+// CSR descriptor table
+// The table is a constexpr array and so is the 4096-entry index into it, so a
+// lookup is two loads and the write masks and hooks are visible to the
+// compiler at every call site in this file.
+
+// Bits of mstatus visible and writable through sstatus
+static constexpr uint64_t sstatus_view = 0x80000003000de762;
+static constexpr uint64_t sstatus_writable = 0xc6722;
+static constexpr uint64_t mstatus_writable = 0x7e7faa;
+// Interrupts this hart implements and the ones software may set in mip
+static constexpr uint64_t interrupts = MIP::ssip | MIP::msip | MIP::stip | MIP::mtip | MIP::seip | MIP::meip;
+static constexpr uint64_t supervisor_interrupts = MIP::ssip | MIP::stip | MIP::seip;
+// Every exception except environment calls from M-mode may be delegated
+static constexpr uint64_t delegable_exceptions = 0xb3ff;
+// RV64 with A, C, D, F, I, M, S, U and V
+static constexpr uint64_t misa_value = 0x800000000034112d;
+// RV32 with A, C, I, M, S and U
+static constexpr uint64_t misa_rv32 = 0x40141105;
+static constexpr uint64_t satp_mode_bare = 0;
+static constexpr uint64_t satp_mode_sv39 = 8;
+static constexpr uint64_t satp_mode_sv57 = 10;
+static constexpr uint64_t pmpaddr_mask = (1ULL << 54) - 1;
+
+static void WriteMstatus(CPU& cpu, uint64_t val)
+{
+  // MPP is WARL, the reserved encoding 2 keeps the previous mode
+  if((val & mstatus_mpp) == (2ULL << 11))
+  {
+    val = (val & ~mstatus_mpp) | (cpu.ReadCsrStorage(CSR::mstatus) & mstatus_mpp);
+  }
+  // UXL and SXL are read-only, RV32 has neither them nor the F and V state
+  val &= ~(mstatus_uxl | mstatus_sxl | mstatus_sd);
+  val = cpu.GetXlen() == 64 ? val | mstatus_xlen64 : val & ~(mstatus_fs | mstatus_vs);
+  if((val & mstatus_fs) == mstatus_fs || (val & mstatus_vs) == mstatus_vs)
+  {
+    val |= mstatus_sd;
+  }
+  cpu.WriteCsrStorage(CSR::mstatus, val);
+  cpu.UpdateAccessControl();
+  cpu.RequestInterruptCheck();
+}
+
+// RV32 harts see a 64-bit CSR as its low half and the high half in its h
+// partner, RV64 harts see all of it in the first and have no h partner
+template<uint64_t (*value)(const CPU&)>
+static uint64_t ReadLow(const CPU& cpu)
+{
+  return cpu.GetXlen() == 32 ? value(cpu) & 0xffffffff : value(cpu);
+}
+template<uint64_t (*value)(const CPU&)>
+static uint64_t ReadHigh(const CPU& cpu)
+{
+  return cpu.GetXlen() == 32 ? value(cpu) >> 32 : 0;
+}
+template<CSR csr, void (*write)(CPU&, uint64_t)>
+static void WriteLow(CPU& cpu, uint64_t val)
+{
+  write(cpu, cpu.GetXlen() == 32 ? (cpu.ReadCsrStorage(csr) & ~0xffffffffULL) | (val & 0xffffffff) : val);
+}
+template<CSR csr, void (*write)(CPU&, uint64_t)>
+static void WriteHigh(CPU& cpu, uint64_t val)
+{
+  write(cpu, (cpu.ReadCsrStorage(csr) & 0xffffffff) | (val << 32));
+}
+
+template<CSR csr>
+static uint64_t Stored(const CPU& cpu)
+{
+  return cpu.ReadCsrStorage(csr);
+}
+
+static uint64_t Time(const CPU& cpu)
+{
+  return cpu.GetMMU().GetClint().GetTime();
+}
+
+static void WriteMenvcfg(CPU& cpu, uint64_t val)
+{
+  cpu.WriteCsrStorage(CSR::menvcfg, val);
+  // Under Sstc STIP only follows stimecmp
+  if((val & menvcfg_stce) != 0)
+  {
+    cpu.WriteCsrStorage(CSR::mip, cpu.ReadCsrStorage(CSR::mip) & ~MIP::stip);
+  }
+  cpu.UpdateSupervisorTimer();
+}
+
+static void WriteStimecmp(CPU& cpu, uint64_t val)
+{
+  cpu.WriteCsrStorage(CSR::stimecmp, val);
+  cpu.UpdateSupervisorTimer();
+}
+
+// Stores and re-arms the interrupt check
+template<CSR csr>
+static void WriteInterruptState(CPU& cpu, uint64_t val)
+{
+  cpu.WriteCsrStorage(csr, val);
+  cpu.RequestInterruptCheck();
+}
+
+static constexpr CsrDescriptor base_csrs[] = {
+  // Floating-point
+  {
+    .addr = CSR::fflags, .write_mask = 0x1f, .flags = csr_fp,
+    .read = [](const CPU& cpu) -> uint64_t { return cpu.GetFflags(); },
+    .write = [](CPU& cpu, uint64_t val) { cpu.SetFflags(val); }
+  },
+  {
+    .addr = CSR::frm, .write_mask = 0x7, .flags = csr_fp,
+    .read = [](const CPU& cpu) -> uint64_t { return cpu.GetFrm(); },
+    .write = [](CPU& cpu, uint64_t val) { cpu.SetFrm(val); }
+  },
+  {
+    .addr = CSR::fcsr, .write_mask = 0xff, .flags = csr_fp,
+    .read = [](const CPU& cpu) -> uint64_t { return (cpu.GetFrm() << 5) | cpu.GetFflags(); },
+    .write = [](CPU& cpu, uint64_t val) { cpu.SetFrm(val >> 5); cpu.SetFflags(val); }
+  },
+  // Vector
+  {
+    .addr = CSR::vstart, .write_mask = VLEN - 1, .flags = csr_vector,
+    .read = [](const CPU& cpu) -> uint64_t { return cpu.GetVector().vstart; },
+    .write = [](CPU& cpu, uint64_t val) { cpu.GetVector().vstart = val & (VLEN - 1); cpu.MarkVectorDirty(); }
+  },
+  {
+    .addr = CSR::vxsat, .write_mask = 0x1, .flags = csr_vector,
+    .read = [](const CPU& cpu) -> uint64_t { return cpu.GetVector().vxsat; },
+    .write = [](CPU& cpu, uint64_t val) { cpu.GetVector().vxsat = val & 0x1; cpu.MarkVectorDirty(); }
+  },
+  {
+    .addr = CSR::vxrm, .write_mask = 0x3, .flags = csr_vector,
+    .read = [](const CPU& cpu) -> uint64_t { return cpu.GetVector().vxrm; },
+    .write = [](CPU& cpu, uint64_t val) { cpu.GetVector().vxrm = val & 0x3; cpu.MarkVectorDirty(); }
+  },
+  {
+    .addr = CSR::vcsr, .write_mask = 0x7, .flags = csr_vector,
+    .read = [](const CPU& cpu) -> uint64_t { return (cpu.GetVector().vxrm << 1) | cpu.GetVector().vxsat; },
+    .write = [](CPU& cpu, uint64_t val) {
+      cpu.GetVector().vxrm = (val >> 1) & 0x3;
+      cpu.GetVector().vxsat = val & 0x1;
+      cpu.MarkVectorDirty();
+    }
+  },
+  // Read-only, only vset{i}vl{i} changes vl and vtype
+  {
+    .addr = CSR::vl, .flags = csr_vector,
+    .read = [](const CPU& cpu) -> uint64_t { return cpu.GetVector().vl; },
+    .write = [](CPU& cpu, uint64_t val) {}
+  },
+  {
+    .addr = CSR::vtype, .flags = csr_vector,
+    .read = [](const CPU& cpu) -> uint64_t { return cpu.GetVector().vtype; },
+    .write = [](CPU& cpu, uint64_t val) {}
+  },
+  {
+    .addr = CSR::vlenb, .flags = csr_vector,
+    .read = [](const CPU& cpu) -> uint64_t { return VLENB; },
+    .write = [](CPU& cpu, uint64_t val) {}
+  },
+  // Counters
+  {.addr = CSR::time_csr, .flags = csr_time, .read = ReadLow<Time>, .write = [](CPU& cpu, uint64_t val) {}},
+  {
+    .addr = CSR::timeh_csr, .flags = csr_rv32 | csr_time, .read = ReadHigh<Time>,
+    .write = [](CPU& cpu, uint64_t val) {}
+  },
+  // Supervisor, sstatus, sie and sip are views of their machine counterparts
+  {
+    .addr = CSR::sstatus, .write_mask = sstatus_writable,
+    .read = [](const CPU& cpu) -> uint64_t { return cpu.ReadCsrStorage(CSR::mstatus) & sstatus_view; },
+    .write = [](CPU& cpu, uint64_t val) {
+      WriteMstatus(cpu, (cpu.ReadCsrStorage(CSR::mstatus) & ~sstatus_writable) | (val & sstatus_writable));
+    }
+  },
+  {
+    .addr = CSR::sie, .write_mask = supervisor_interrupts,
+    .read = [](const CPU& cpu) -> uint64_t {
+      return cpu.ReadCsrStorage(CSR::mie) & cpu.ReadCsrStorage(CSR::mideleg);
+    },
+    .write = [](CPU& cpu, uint64_t val) {
+      const uint64_t delegated = cpu.ReadCsrStorage(CSR::mideleg);
+      WriteInterruptState<CSR::mie>(cpu, (cpu.ReadCsrStorage(CSR::mie) & ~delegated) | (val & delegated));
+    }
+  },
+  {.addr = CSR::stvec, .write_mask = ~0x2ULL},
+  {.addr = CSR::scounteren, .write_mask = 0x7},
+  {.addr = CSR::senvcfg},
+  {.addr = CSR::sscratch, .write_mask = ~0ULL},
+  {.addr = CSR::sepc, .write_mask = ~0x1ULL},
+  {.addr = CSR::scause, .write_mask = ~0ULL},
+  {.addr = CSR::stval, .write_mask = ~0ULL},
+  {
+    .addr = CSR::sip, .write_mask = MIP::ssip,
+    .read = [](const CPU& cpu) -> uint64_t {
+      return cpu.GetPendingInterrupts() & cpu.ReadCsrStorage(CSR::mideleg);
+    },
+    .write = [](CPU& cpu, uint64_t val) {
+      const uint64_t writable = cpu.ReadCsrStorage(CSR::mideleg) & MIP::ssip;
+      WriteInterruptState<CSR::mip>(cpu, (cpu.ReadCsrStorage(CSR::mip) & ~writable) | (val & writable));
+    }
+  },
+  // Sstc
+  {
+    .addr = CSR::stimecmp, .write_mask = ~0ULL, .flags = csr_time,
+    .read = ReadLow<Stored<CSR::stimecmp>>, .write = WriteLow<CSR::stimecmp, WriteStimecmp>
+  },
+  {
+    .addr = CSR::stimecmph, .write_mask = 0xffffffff, .flags = csr_rv32 | csr_time,
+    .read = ReadHigh<Stored<CSR::stimecmp>>, .write = WriteHigh<CSR::stimecmp, WriteStimecmp>
+  },
+  {
+    .addr = CSR::satp, .write_mask = ~0ULL,
+    .write = [](CPU& cpu, uint64_t val) {
+      // Writes selecting an unsupported mode have no effect, RV32 supports both of its modes
+      const uint64_t mode = val >> 60;
+      if(cpu.GetXlen() == 64 && mode != satp_mode_bare && (mode < satp_mode_sv39 || mode > satp_mode_sv57))
+      {
+        return;
+      }
+      cpu.WriteCsrStorage(CSR::satp, val);
+      cpu.UpdatePagingMode(val);
+    }
+  },
+  // Machine
+  {.addr = CSR::mstatus, .write_mask = mstatus_writable, .write = WriteMstatus},
+  {
+    .addr = CSR::misa,
+    .read = [](const CPU& cpu) -> uint64_t { return cpu.GetXlen() == 32 ? misa_rv32 : misa_value; },
+    .write = [](CPU& cpu, uint64_t val) {}
+  },
+  {.addr = CSR::medeleg, .write_mask = delegable_exceptions},
+  {.addr = CSR::mideleg, .write_mask = supervisor_interrupts, .write = WriteInterruptState<CSR::mideleg>},
+  {.addr = CSR::mie, .write_mask = interrupts, .write = WriteInterruptState<CSR::mie>},
+  {.addr = CSR::mtvec, .write_mask = ~0x2ULL},
+  {.addr = CSR::mcounteren, .write_mask = 0x7},
+  {
+    .addr = CSR::menvcfg, .write_mask = menvcfg_stce,
+    .read = ReadLow<Stored<CSR::menvcfg>>, .write = WriteLow<CSR::menvcfg, WriteMenvcfg>
+  },
+  {
+    .addr = CSR::menvcfgh, .write_mask = menvcfg_stce >> 32, .flags = csr_rv32,
+    .read = ReadHigh<Stored<CSR::menvcfg>>, .write = WriteHigh<CSR::menvcfg, WriteMenvcfg>
+  },
+  {.addr = CSR::mscratch, .write_mask = ~0ULL},
+  {.addr = CSR::mepc, .write_mask = ~0x1ULL},
+  {.addr = CSR::mcause, .write_mask = ~0ULL},
+  {.addr = CSR::mtval, .write_mask = ~0ULL},
+  // Device lines are ORed in on read, software only sets supervisor bits. Bits
+  // whose line is raised keep their stored value so a read-modify-write does
+  // not latch the line, and so does STIP under Sstc.
+  {
+    .addr = CSR::mip, .write_mask = supervisor_interrupts,
+    .read = [](const CPU& cpu) -> uint64_t { return cpu.GetPendingInterrupts(); },
+    .write = [](CPU& cpu, uint64_t val) {
+      const uint64_t sstc = (cpu.ReadCsrStorage(CSR::menvcfg) & menvcfg_stce) != 0 ? uint64_t{MIP::stip} : 0;
+      const uint64_t lines = cpu.GetInterruptLines() | sstc;
+      WriteInterruptState<CSR::mip>(cpu, (val & ~lines) | (cpu.ReadCsrStorage(CSR::mip) & lines));
+    }
+  },
+  {.addr = CSR::mvendorid},
+  {.addr = CSR::marchid},
+  {.addr = CSR::mimpid},
+  {.addr = CSR::mhartid},
+};
+
+// pmpcfg0..15 and pmpaddr0..63 are appended, the odd pmpcfg registers only exist on RV32
+static constexpr int n_pmpcfg = PMP_ENTRIES / 4;
+static constexpr int n_pmpaddr = PMP_ENTRIES;
+static constexpr uint8_t pmpcfg_writable = pmpcfg_l | pmpcfg_a | pmpcfg_x | pmpcfg_w | pmpcfg_r;
+
+// Entries per pmpcfg register, RV64 packs eight into each even one
+static int PmpCfgEntries(const CPU& cpu)
+{
+  return cpu.GetXlen() / 8;
+}
+
+static uint8_t PmpCfg(const CPU& cpu, int entry)
+{
+  const int per_register = PmpCfgEntries(cpu);
+  const int csr = CSR::pmpcfg0 + (entry / per_register) * (per_register / 4);
+  return (cpu.ReadCsrStorage(csr) >> (8 * (entry % per_register))) & 0xff;
+}
+
+// pmpcfg and pmpaddr are WARL. Locked entries ignore writes, as does the pmpaddr
+// below a locked TOR entry, and R = 0 with W = 1 is reserved.
+template<int csr>
+static void WritePmp(CPU& cpu, uint64_t val)
+{
+  if constexpr(csr < CSR::pmpaddr0)
+  {
+    const uint64_t previous = cpu.ReadCsrStorage(csr);
+    uint64_t result = 0;
+    for(int i = 0; i < PmpCfgEntries(cpu); i++)
+    {
+      uint8_t cfg = (previous >> (8 * i)) & 0xff;
+      if((cfg & pmpcfg_l) == 0)
+      {
+        cfg = (val >> (8 * i)) & pmpcfg_writable;
+        cfg &= (cfg & pmpcfg_r) ? 0xff : ~pmpcfg_w;
+      }
+      result |= static_cast<uint64_t>(cfg) << (8 * i);
+    }
+    cpu.WriteCsrStorage(csr, result);
+  }
+  else
+  {
+    constexpr int entry = csr - CSR::pmpaddr0;
+    const bool next_locked_tor = entry + 1 < PMP_ENTRIES
+                                 && (PmpCfg(cpu, entry + 1) & (pmpcfg_l | pmpcfg_a)) == (pmpcfg_l | (pmp_tor << 3));
+    if((PmpCfg(cpu, entry) & pmpcfg_l) != 0 || next_locked_tor)
+    {
+      return;
+    }
+    cpu.WriteCsrStorage(csr, cpu.GetXlen() == 32 ? val & 0xffffffff : val);
+  }
+  cpu.UpdatePmp();
+}
+
+template<size_t... i>
+static constexpr auto PmpCfgHooks(std::index_sequence<i...>)
+{
+  return std::array{&WritePmp<CSR::pmpcfg0 + i>...};
+}
+template<size_t... i>
+static constexpr auto PmpAddrHooks(std::index_sequence<i...>)
+{
+  return std::array{&WritePmp<CSR::pmpaddr0 + i>...};
+}
+
+static constexpr auto csr_table = [] {
+  std::array<CsrDescriptor, std::size(base_csrs) + n_pmpcfg + n_pmpaddr> table {};
+  size_t n = 0;
+  for(const CsrDescriptor& desc : base_csrs)
+  {
+    table[n++] = desc;
+  }
+  constexpr auto cfg_hooks = PmpCfgHooks(std::make_index_sequence<n_pmpcfg>());
+  constexpr auto addr_hooks = PmpAddrHooks(std::make_index_sequence<n_pmpaddr>());
+  for(int i = 0; i < n_pmpcfg; i++)
+  {
+    table[n++] = {.addr = static_cast<uint16_t>(CSR::pmpcfg0 + i), .write_mask = ~0ULL,
+                  .flags = (i & 1) != 0 ? csr_rv32 : uint8_t{0}, .write = cfg_hooks[i]};
+  }
+  for(int i = 0; i < n_pmpaddr; i++)
+  {
+    table[n++] = {.addr = static_cast<uint16_t>(CSR::pmpaddr0 + i), .write_mask = pmpaddr_mask,
+                  .write = addr_hooks[i]};
+  }
+  return table;
+}();
+
+static constexpr uint8_t no_csr = 0xff;
+static_assert(csr_table.size() < no_csr, "CSR index entries are 8 bits");
+
+static constexpr auto csr_index = [] {
+  std::array<uint8_t, N_CSR> index {};
+  index.fill(no_csr);
+  for(size_t i = 0; i < csr_table.size(); i++)
+  {
+    index[csr_table[i].addr] = static_cast<uint8_t>(i);
+  }
+  return index;
+}();
+
+const CsrDescriptor* FindCsr(int csr)
+{
+  if(csr < 0 || csr >= N_CSR || csr_index[csr] == no_csr)
+  {
+    return nullptr;
+  }
+  return &csr_table[csr_index[csr]];
+}
+
+uint64_t CPU::GetCsr(int csr) const
+{
+  const CsrDescriptor* desc = FindCsr(csr);
+  return (desc != nullptr && desc->read != nullptr) ? desc->read(*this) : ReadCsrStorage(csr);
+}
+
+void CPU::SetCsr(int csr, uint64_t val)
+{
+  const CsrDescriptor* desc = FindCsr(csr);
+  if(desc != nullptr && desc->write != nullptr)
+  {
+    desc->write(*this, val);
+  }
+  else
+  {
+    WriteCsrStorage(csr, val);
+  }
+}
+
+// Below M-mode time needs mcounteren.TM, and scounteren.TM as well in U-mode.
+// S-mode reaches stimecmp with mcounteren.TM and menvcfg.STCE.
+static void RequireTimeAccess(const CPU& cpu, int csr)
+{
+  if(cpu.GetMode() == MACHINE)
+  {
+    return;
+  }
+  bool allowed = (cpu.ReadCsrStorage(CSR::mcounteren) & counteren_tm) != 0;
+  if(csr == CSR::stimecmp || csr == CSR::stimecmph)
+  {
+    allowed = allowed && (cpu.ReadCsrStorage(CSR::menvcfg) & menvcfg_stce) != 0;
+  }
+  else if(cpu.GetMode() == USER)
+  {
+    allowed = allowed && (cpu.ReadCsrStorage(CSR::scounteren) & counteren_tm) != 0;
+  }
+  if(!allowed)
+  {
+    throw CPUTrapException(trap_value::IllegalInstruction);
+  }
+}
+
+uint64_t CPU::GuestReadCsr(int csr, bool write)
+{
+  const CsrDescriptor* desc = FindCsr(csr);
+  if(desc == nullptr || GetMode() < CsrPrivilege(csr) || (write && CsrReadOnly(csr))
+     || (csr == CSR::satp && GetMode() == SUPERVISOR && (hot.mstatus & mstatus_tvm) != 0)
+     || (xlen == 64 && (desc->flags & csr_rv32) != 0))
+  {
+    throw CPUTrapException(trap_value::IllegalInstruction);
+  }
+  if((desc->flags & csr_fp) != 0)
+  {
+    RequireFp();
+  }
+  if((desc->flags & csr_vector) != 0)
+  {
+    RequireVector();
+  }
+  if((desc->flags & csr_time) != 0)
+  {
+    RequireTimeAccess(*this, csr);
+  }
+  return desc->read != nullptr ? desc->read(*this) : ReadCsrStorage(csr);
+}
+
+void CPU::GuestWriteCsr(int csr, uint64_t val)
+{
+  const uint64_t mask = FindCsr(csr)->write_mask;
+  SetCsr(csr, (GetCsr(csr) & ~mask) | (val & mask));
+}
+
+void CPU::UpdatePmp()
+{
+  std::array<uint8_t, PMP_ENTRIES> cfg;
+  std::array<uint64_t, PMP_ENTRIES> addr;
+  for(int i = 0; i < PMP_ENTRIES; i++)
+  {
+    cfg[i] = PmpCfg(*this, i);
+    addr[i] = ReadCsrStorage(CSR::pmpaddr0 + i);
+  }
+  mmu.SetPmp(cfg, addr);
+  // Blocks specialized on bare translation must go through the checks now
+  blocks.NewGeneration();
+}
@@ -7,6 +7,7 @@
 #include <fstream>
 #include <iostream>
 #include "config.h"
+#include "memory_map.h"
 
 std::vector<uint8_t> ReadIntoVector(const std::string &file)
 {
@@ -23,56 +24,117 @@ std::vector<uint8_t> ReadIntoVector(const std::string &file)
   return binary;
 }
 
-std::unique_ptr<Elf64_Ehdr> GetHeader(std::vector<uint8_t>& binary)
+// ELF structures of either class
+template<typename Ehdr, typename Phdr, typename Shdr, typename Sym>
+struct ElfClass
+{
+  typedef Ehdr Header;
+  typedef Phdr ProgramHeader;
+  typedef Shdr SectionHeader;
+  typedef Sym Symbol;
+};
+typedef ElfClass<Elf32_Ehdr, Elf32_Phdr, Elf32_Shdr, Elf32_Sym> Elf32;
+typedef ElfClass<Elf64_Ehdr, Elf64_Phdr, Elf64_Shdr, Elf64_Sym> Elf64;
+
+// 32 or 64, the XLEN the file was built for
+static int GetXlen(const std::vector<uint8_t>& binary)
 {
   if (binary.size() < sizeof(Elf64_Ehdr) || binary[0] != ELFMAG0 || binary[1] != ELFMAG1 || binary[2] != ELFMAG2 || binary[3] != ELFMAG3)
   {
     throw std::runtime_error("Not an ELF file");
   }
-
-  auto header = std::make_unique<Elf64_Ehdr>(*reinterpret_cast<Elf64_Ehdr *>(binary.data()));
-
-  if (header->e_ident[EI_CLASS] != ELFCLASS64 || header->e_machine != EM_RISCV)
+  // e_machine is at the same offset in both classes
+  const Elf32_Ehdr* header = reinterpret_cast<const Elf32_Ehdr *>(binary.data());
+  if ((header->e_ident[EI_CLASS] != ELFCLASS32 && header->e_ident[EI_CLASS] != ELFCLASS64) || header->e_machine != EM_RISCV)
   {
-    throw std::runtime_error("Not a 64-bit RISC-V ELF file");
+    throw std::runtime_error("Not a RISC-V ELF file");
   }
-  return header;
+  return header->e_ident[EI_CLASS] == ELFCLASS32 ? 32 : 64;
 }
 
-std::vector<uint8_t> LoadSegments(const std::vector<uint8_t>& binary, std::unique_ptr<Elf64_Ehdr> header)
+// Segments go to their physical addresses, which may be in any RAM or ROM region
+template<typename Elf>
+static uint64_t LoadSegments(const std::vector<uint8_t>& binary, MemoryMap& memory)
 {
-  std::vector<uint8_t> mem(MEMORY_SIZE, 0);
-  std::vector<Elf64_Phdr> phdrs(header->e_phnum);
-  std::memcpy(phdrs.data(), &binary.at(header->e_phoff), header->e_phnum * sizeof(Elf64_Phdr));
+  typename Elf::Header header;
+  std::memcpy(&header, binary.data(), sizeof(header));
+  std::vector<typename Elf::ProgramHeader> phdrs(header.e_phnum);
+  if (header.e_phoff + phdrs.size() * sizeof(typename Elf::ProgramHeader) > binary.size())
+  {
+    throw std::runtime_error("Truncated ELF file");
+  }
+  std::memcpy(phdrs.data(), binary.data() + header.e_phoff, phdrs.size() * sizeof(typename Elf::ProgramHeader));
 
   for (const auto &segment : phdrs)
   {
     if (segment.p_type == PT_LOAD)
     {
-      auto segment_offset = segment.p_vaddr - KERNBASE;
-      if (segment_offset + segment.p_memsz > mem.size())
+      if (segment.p_offset + segment.p_filesz > binary.size())
       {
-        throw std::runtime_error("Segment too large");
+        throw std::runtime_error("Truncated ELF file");
       }
-      std::memcpy(&mem.at(segment_offset), &binary.at(segment.p_offset), segment.p_filesz);
+      // The tail up to p_memsz is bss, guest memory starts out zeroed
+      memory.Write(segment.p_paddr, binary.data() + segment.p_offset, segment.p_filesz);
     }
   }
-  return mem;
+  return header.e_entry;
 }
 
-std::vector<uint8_t> LoadELF64(const std::string &file, uint64_t &entry_point)
+template<typename Elf>
+static bool FindSymbol(const std::vector<uint8_t>& binary, const std::string &name, uint64_t& value)
 {
-  try
+  typename Elf::Header header;
+  std::memcpy(&header, binary.data(), sizeof(header));
+  std::vector<typename Elf::SectionHeader> shdrs(header.e_shnum);
+  if (header.e_shoff + shdrs.size() * sizeof(typename Elf::SectionHeader) > binary.size())
   {
-    std::vector<uint8_t> binary = ReadIntoVector(file);
-    auto header = GetHeader(binary);
-    entry_point = header->e_entry;
-    auto mem = LoadSegments(binary, std::move(header));
-    return mem;
+    throw std::runtime_error("Truncated ELF file");
   }
-  catch (const std::exception &e)
+  std::memcpy(shdrs.data(), binary.data() + header.e_shoff, shdrs.size() * sizeof(typename Elf::SectionHeader));
+
+  for (const auto &section : shdrs)
   {
-    std::cerr << e.what() << std::endl;
-    return {};
+    if (section.sh_type != SHT_SYMTAB || section.sh_link >= shdrs.size())
+    {
+      continue;
+    }
+    const auto &strtab = shdrs[section.sh_link];
+    if (section.sh_offset + section.sh_size > binary.size() || strtab.sh_offset + strtab.sh_size > binary.size())
+    {
+      throw std::runtime_error("Truncated ELF file");
+    }
+    for (uint64_t offset = 0; offset + sizeof(typename Elf::Symbol) <= section.sh_size; offset += sizeof(typename Elf::Symbol))
+    {
+      typename Elf::Symbol symbol;
+      std::memcpy(&symbol, binary.data() + section.sh_offset + offset, sizeof(symbol));
+      if (symbol.st_name >= strtab.sh_size)
+      {
+        continue;
+      }
+      const char *symbol_name = reinterpret_cast<const char *>(binary.data() + strtab.sh_offset + symbol.st_name);
+      if (strnlen(symbol_name, strtab.sh_size - symbol.st_name) == name.size() && name == symbol_name)
+      {
+        value = symbol.st_value;
+        return true;
+      }
+    }
   }
+  return false;
+}
+
+uint64_t LoadELF(const std::string &file, MemoryMap& memory)
+{
+  std::vector<uint8_t> binary = ReadIntoVector(file);
+  return GetXlen(binary) == 32 ? LoadSegments<Elf32>(binary, memory) : LoadSegments<Elf64>(binary, memory);
+}
+
+int ELFXlen(const std::string &file)
+{
+  return GetXlen(ReadIntoVector(file));
+}
+
+bool FindELFSymbol(const std::string &file, const std::string &name, uint64_t& value)
+{
+  std::vector<uint8_t> binary = ReadIntoVector(file);
+  return GetXlen(binary) == 32 ? FindSymbol<Elf32>(binary, name, value) : FindSymbol<Elf64>(binary, name, value);
 }
@@ -0,0 +1,632 @@
+#include "cpu.h"
+#include "instruction.h"
+#include "fpu.h"
+#include <limits>
+
+// F and D extensions
+//
+// Instructions run directly on the host FPU. fflags are never computed in
+// software: instructions that can raise exceptions run inside an FflagsScope,
+// which clears the host's sticky flags first and ORs whatever is set afterwards
+// into fflags. The host rounding mode is only switched for instructions whose
+// rounding mode is not RNE.
+
+// fflags bits
+static constexpr uint64_t fflags_nx = 1 << 0;
+static constexpr uint64_t fflags_uf = 1 << 1;
+static constexpr uint64_t fflags_of = 1 << 2;
+static constexpr uint64_t fflags_dz = 1 << 3;
+static constexpr uint64_t fflags_nv = 1 << 4;
+
+static inline uint64_t FflagsFromHost(uint32_t host)
+{
+  return ((host & host_inexact) ? fflags_nx : 0) | ((host & host_underflow) ? fflags_uf : 0)
+       | ((host & host_overflow) ? fflags_of : 0) | ((host & host_divbyzero) ? fflags_dz : 0)
+       | ((host & host_invalid) ? fflags_nv : 0);
+}
+
+void CPU::AccrueHostFlags(uint32_t host)
+{
+  fflags_val |= FflagsFromHost(host);
+  MarkFpDirty();
+}
+
+// HANDLERS
+
+template<typename T>
+static void FpLoad(const uint32_t instruction, CPU& cpu)
+{
+  cpu.RequireFp();
+  const InstructionFields fields = parse_instruction<'I'>(instruction);
+  uint64_t data;
+  cpu.Load(cpu.GetReg(fields.rs1) + sign_extend_12b(fields.imm), sizeof(T), data);
+  WriteFBits<T>(cpu, fields.rd, data);
+}
+
+template<typename T>
+static void FpStore(const uint32_t instruction, CPU& cpu)
+{
+  cpu.RequireFp();
+  const InstructionFields fields = parse_instruction<'S'>(instruction);
+  cpu.Store(cpu.GetReg(fields.rs1) + sign_extend_12b(fields.imm), sizeof(T), cpu.GetFReg(fields.rs2));
+}
+
+enum class FpOp { Add, Sub, Mul, Div, Sqrt };
+
+template<typename T, FpOp op>
+static void FpArith(const uint32_t instruction, CPU& cpu)
+{
+  cpu.RequireFp();
+  FflagsScope flags(cpu);
+  const InstructionFields fields = parse_instruction<'R'>(instruction);
+  const T a = ReadF<T>(cpu, fields.rs1);
+  const T b = ReadF<T>(cpu, fields.rs2);
+  T result;
+  {
+    RoundingScope scope(cpu, fields.funct3);
+    if constexpr (op == FpOp::Add)
+    {
+      result = Barrier(a) + Barrier(b);
+    }
+    else if constexpr (op == FpOp::Sub)
+    {
+      result = Barrier(a) - Barrier(b);
+    }
+    else if constexpr (op == FpOp::Mul)
+    {
+      result = Barrier(a) * Barrier(b);
+    }
+    else if constexpr (op == FpOp::Div)
+    {
+      result = Barrier(a) / Barrier(b);
+    }
+    else
+    {
+      result = std::sqrt(Barrier(a));
+    }
+    result = Barrier(result);
+  }
+  WriteF<T>(cpu, fields.rd, result);
+}
+
+// FMADD, FMSUB, FNMSUB, FNMADD
+template<typename T, bool negate_product, bool negate_addend>
+static void FpFusedMulAdd(const uint32_t instruction, CPU& cpu)
+{
+  cpu.RequireFp();
+  FflagsScope flags(cpu);
+  const InstructionFields fields = parse_instruction<'R'>(instruction);
+  const uint32_t rs3 = mask<27, 31>(instruction);
+  const T a = ReadF<T>(cpu, fields.rs1);
+  const T b = ReadF<T>(cpu, fields.rs2);
+  const T c = ReadF<T>(cpu, rs3);
+  // inf * 0 is invalid even when the addend is a quiet NaN
+  if((std::isinf(a) && b == 0) || (a == 0 && std::isinf(b)))
+  {
+    RaiseInvalid();
+  }
+  T result;
+  {
+    RoundingScope scope(cpu, fields.funct3);
+    result = std::fma(Barrier(negate_product ? -a : a), Barrier(b), Barrier(negate_addend ? -c : c));
+    result = Barrier(result);
+  }
+  WriteF<T>(cpu, fields.rd, result);
+}
+
+// FSGNJ, FSGNJN, FSGNJX work on the bits and keep NaN payloads
+template<typename T>
+static void FpSignInject(const uint32_t instruction, CPU& cpu)
+{
+  cpu.RequireFp();
+  const InstructionFields fields = parse_instruction<'R'>(instruction);
+  using Bits = typename FpTraits<T>::Bits;
+  constexpr Bits sign = FpTraits<T>::sign_bit;
+  const Bits a = ReadFBits<T>(cpu, fields.rs1);
+  const Bits b = ReadFBits<T>(cpu, fields.rs2);
+  Bits result;
+  switch(fields.funct3)
+  {
+    case 0:
+      result = (a & ~sign) | (b & sign);
+      break;
+    case 1:
+      result = (a & ~sign) | (~b & sign);
+      break;
+    case 2:
+      result = a ^ (b & sign);
+      break;
+    default:
+      throw CPUTrapException(trap_value::IllegalInstruction);
+  }
+  WriteFBits<T>(cpu, fields.rd, result);
+}
+
+// FMIN, FMAX
+template<typename T>
+static void FpMinMax(const uint32_t instruction, CPU& cpu)
+{
+  cpu.RequireFp();
+  FflagsScope flags(cpu);
+  const InstructionFields fields = parse_instruction<'R'>(instruction);
+  const T a = ReadF<T>(cpu, fields.rs1);
+  const T b = ReadF<T>(cpu, fields.rs2);
+  WriteF<T>(cpu, fields.rd, MinMax(a, b, fields.funct3 == 1));
+}
+
+// FEQ is a quiet comparison, FLT and FLE signal on any NaN
+template<typename T>
+static void FpCompare(const uint32_t instruction, CPU& cpu)
+{
+  cpu.RequireFp();
+  FflagsScope flags(cpu);
+  const InstructionFields fields = parse_instruction<'R'>(instruction);
+  const T a = ReadF<T>(cpu, fields.rs1);
+  const T b = ReadF<T>(cpu, fields.rs2);
+  if(std::isnan(a) || std::isnan(b))
+  {
+    if(fields.funct3 != 2 || IsSignaling(a) || IsSignaling(b))
+    {
+      RaiseInvalid();
+    }
+    cpu.SetReg(fields.rd, 0);
+    return;
+  }
+  switch(fields.funct3)
+  {
+    case 0:
+      cpu.SetReg(fields.rd, a <= b);
+      break;
+    case 1:
+      cpu.SetReg(fields.rd, a < b);
+      break;
+    case 2:
+      cpu.SetReg(fields.rd, a == b);
+      break;
+    default:
+      throw CPUTrapException(trap_value::IllegalInstruction);
+  }
+}
+
+template<typename T>
+static void FpClass(const uint32_t instruction, CPU& cpu)
+{
+  cpu.RequireFp();
+  const InstructionFields fields = parse_instruction<'R'>(instruction);
+  const T a = ReadF<T>(cpu, fields.rs1);
+  const bool negative = std::signbit(a);
+  uint64_t result;
+  switch(std::fpclassify(a))
+  {
+    case FP_INFINITE:
+      result = negative ? 1 << 0 : 1 << 7;
+      break;
+    case FP_NORMAL:
+      result = negative ? 1 << 1 : 1 << 6;
+      break;
+    case FP_SUBNORMAL:
+      result = negative ? 1 << 2 : 1 << 5;
+      break;
+    case FP_ZERO:
+      result = negative ? 1 << 3 : 1 << 4;
+      break;
+    default:
+      result = IsSignaling(a) ? 1 << 8 : 1 << 9;
+      break;
+  }
+  cpu.SetReg(fields.rd, result);
+}
+
+// Rounds with the host rounding mode, out of range values and NaN saturate and only raise NV
+template<typename I, typename T>
+static I ConvertToInt(T val)
+{
+  constexpr int bits = std::numeric_limits<I>::digits + std::is_signed_v<I>;
+  const T upper = std::ldexp(T(1), std::is_signed_v<I> ? bits - 1 : bits);
+  const T lower = std::is_signed_v<I> ? -upper : T(-1);
+  if(std::isnan(val))
+  {
+    RaiseInvalid();
+    return std::numeric_limits<I>::max();
+  }
+  const uint32_t flags = GetHostFlags();
+  const T rounded = Barrier(std::rint(Barrier(val)));
+  const bool in_range = (std::is_signed_v<I> ? rounded >= lower : rounded > lower) && rounded < upper;
+  if(!in_range)
+  {
+    SetHostFlags(flags | host_invalid);
+    return val < 0 ? std::numeric_limits<I>::min() : std::numeric_limits<I>::max();
+  }
+  return static_cast<I>(rounded);
+}
+
+// FCVT.W, FCVT.WU, FCVT.L, FCVT.LU, 32-bit results are sign-extended
+template<typename T>
+static void FpToInt(const uint32_t instruction, CPU& cpu)
+{
+  cpu.RequireFp();
+  FflagsScope flags(cpu);
+  const InstructionFields fields = parse_instruction<'R'>(instruction);
+  const T a = ReadF<T>(cpu, fields.rs1);
+  uint64_t result;
+  {
+    RoundingScope scope(cpu, fields.funct3);
+    switch(fields.rs2)
+    {
+      case 0:
+        result = static_cast<int64_t>(ConvertToInt<int32_t>(a));
+        break;
+      case 1:
+        result = static_cast<int64_t>(static_cast<int32_t>(ConvertToInt<uint32_t>(a)));
+        break;
+      case 2:
+        result = ConvertToInt<int64_t>(a);
+        break;
+      case 3:
+        result = ConvertToInt<uint64_t>(a);
+        break;
+      default:
+        throw CPUTrapException(trap_value::IllegalInstruction);
+    }
+  }
+  cpu.SetReg(fields.rd, result);
+}
+
+// FCVT.S.W, FCVT.S.WU, FCVT.S.L, FCVT.S.LU and the D equivalents
+template<typename T>
+static void IntToFp(const uint32_t instruction, CPU& cpu)
+{
+  cpu.RequireFp();
+  FflagsScope flags(cpu);
+  const InstructionFields fields = parse_instruction<'R'>(instruction);
+  const uint64_t a = cpu.GetReg(fields.rs1);
+  T result;
+  {
+    RoundingScope scope(cpu, fields.funct3);
+    switch(fields.rs2)
+    {
+      case 0:
+        result = static_cast<T>(Barrier(static_cast<int32_t>(a)));
+        break;
+      case 1:
+        result = static_cast<T>(Barrier(static_cast<uint32_t>(a)));
+        break;
+      case 2:
+        result = static_cast<T>(Barrier(static_cast<int64_t>(a)));
+        break;
+      case 3:
+        result = static_cast<T>(Barrier(a));
+        break;
+      default:
+        throw CPUTrapException(trap_value::IllegalInstruction);
+    }
+    result = Barrier(result);
+  }
+  WriteF<T>(cpu, fields.rd, result);
+}
+
+// FCVT.S.D, FCVT.D.S
+template<typename To, typename From>
+static void FpConvert(const uint32_t instruction, CPU& cpu)
+{
+  cpu.RequireFp();
+  FflagsScope flags(cpu);
+  const InstructionFields fields = parse_instruction<'R'>(instruction);
+  const From a = ReadF<From>(cpu, fields.rs1);
+  To result;
+  {
+    RoundingScope scope(cpu, fields.funct3);
+    result = Barrier(static_cast<To>(Barrier(a)));
+  }
+  WriteF<To>(cpu, fields.rd, result);
+}
+
+const static Instruction fd_table[] = {
+  // RV32F / RV32D
+  // INSTRUCTIONS IN RV32F: FLW, FSW, FMADD.S, FMSUB.S, FNMSUB.S, FNMADD.S,
+  //                        FADD.S, FSUB.S, FMUL.S, FDIV.S, FSQRT.S, FSGNJ.S, FSGNJN.S, FSGNJX.S,
+  //                        FMIN.S, FMAX.S, FCVT.W.S, FCVT.WU.S, FMV.X.W, FEQ.S, FLT.S, FLE.S,
+  //                        FCLASS.S, FCVT.S.W, FCVT.S.WU, FMV.W.X
+  // INSTRUCTIONS IN RV32D: the same with .D plus FCVT.S.D, FCVT.D.S
+  // RV64F / RV64D add FCVT.L, FCVT.LU, FCVT.*.L, FCVT.*.LU, FMV.X.D, FMV.D.X
+  {
+    .name = "FLW",
+    .format = 'I',
+    .mask_field = 0x0000707f,
+    .instruction_matcher = 0x00002007,
+    .execute = FpLoad<float>
+  },
+  {
+    .name = "FLD",
+    .format = 'I',
+    .mask_field = 0x0000707f,
+    .instruction_matcher = 0x00003007,
+    .execute = FpLoad<double>
+  },
+  {
+    .name = "FSW",
+    .format = 'S',
+    .mask_field = 0x0000707f,
+    .instruction_matcher = 0x00002027,
+    .execute = FpStore<float>
+  },
+  {
+    .name = "FSD",
+    .format = 'S',
+    .mask_field = 0x0000707f,
+    .instruction_matcher = 0x00003027,
+    .execute = FpStore<double>
+  },
+  {
+    .name = "FMADD.S",
+    .format = 'R',
+    .mask_field = 0x0600007f,
+    .instruction_matcher = 0x00000043,
+    .execute = FpFusedMulAdd<float, false, false>
+  },
+  {
+    .name = "FMADD.D",
+    .format = 'R',
+    .mask_field = 0x0600007f,
+    .instruction_matcher = 0x02000043,
+    .execute = FpFusedMulAdd<double, false, false>
+  },
+  {
+    .name = "FMSUB.S",
+    .format = 'R',
+    .mask_field = 0x0600007f,
+    .instruction_matcher = 0x00000047,
+    .execute = FpFusedMulAdd<float, false, true>
+  },
+  {
+    .name = "FMSUB.D",
+    .format = 'R',
+    .mask_field = 0x0600007f,
+    .instruction_matcher = 0x02000047,
+    .execute = FpFusedMulAdd<double, false, true>
+  },
+  {
+    .name = "FNMSUB.S",
+    .format = 'R',
+    .mask_field = 0x0600007f,
+    .instruction_matcher = 0x0000004b,
+    .execute = FpFusedMulAdd<float, true, false>
+  },
+  {
+    .name = "FNMSUB.D",
+    .format = 'R',
+    .mask_field = 0x0600007f,
+    .instruction_matcher = 0x0200004b,
+    .execute = FpFusedMulAdd<double, true, false>
+  },
+  {
+    .name = "FNMADD.S",
+    .format = 'R',
+    .mask_field = 0x0600007f,
+    .instruction_matcher = 0x0000004f,
+    .execute = FpFusedMulAdd<float, true, true>
+  },
+  {
+    .name = "FNMADD.D",
+    .format = 'R',
+    .mask_field = 0x0600007f,
+    .instruction_matcher = 0x0200004f,
+    .execute = FpFusedMulAdd<double, true, true>
+  },
+  {
+    .name = "FADD.S",
+    .format = 'R',
+    .mask_field = 0xfe00007f,
+    .instruction_matcher = 0x00000053,
+    .execute = FpArith<float, FpOp::Add>
+  },
+  {
+    .name = "FADD.D",
+    .format = 'R',
+    .mask_field = 0xfe00007f,
+    .instruction_matcher = 0x02000053,
+    .execute = FpArith<double, FpOp::Add>
+  },
+  {
+    .name = "FSUB.S",
+    .format = 'R',
+    .mask_field = 0xfe00007f,
+    .instruction_matcher = 0x08000053,
+    .execute = FpArith<float, FpOp::Sub>
+  },
+  {
+    .name = "FSUB.D",
+    .format = 'R',
+    .mask_field = 0xfe00007f,
+    .instruction_matcher = 0x0a000053,
+    .execute = FpArith<double, FpOp::Sub>
+  },
+  {
+    .name = "FMUL.S",
+    .format = 'R',
+    .mask_field = 0xfe00007f,
+    .instruction_matcher = 0x10000053,
+    .execute = FpArith<float, FpOp::Mul>
+  },
+  {
+    .name = "FMUL.D",
+    .format = 'R',
+    .mask_field = 0xfe00007f,
+    .instruction_matcher = 0x12000053,
+    .execute = FpArith<double, FpOp::Mul>
+  },
+  {
+    .name = "FDIV.S",
+    .format = 'R',
+    .mask_field = 0xfe00007f,
+    .instruction_matcher = 0x18000053,
+    .execute = FpArith<float, FpOp::Div>
+  },
+  {
+    .name = "FDIV.D",
+    .format = 'R',
+    .mask_field = 0xfe00007f,
+    .instruction_matcher = 0x1a000053,
+    .execute = FpArith<double, FpOp::Div>
+  },
+  {
+    .name = "FSQRT.S",
+    .format = 'R',
+    .mask_field = 0xfff0007f,
+    .instruction_matcher = 0x58000053,
+    .execute = FpArith<float, FpOp::Sqrt>
+  },
+  {
+    .name = "FSQRT.D",
+    .format = 'R',
+    .mask_field = 0xfff0007f,
+    .instruction_matcher = 0x5a000053,
+    .execute = FpArith<double, FpOp::Sqrt>
+  },
+  {
+    .name = "FSGNJ.S",
+    .format = 'R',
+    .mask_field = 0xfe00007f,
+    .instruction_matcher = 0x20000053,
+    .execute = FpSignInject<float>
+  },
+  {
+    .name = "FSGNJ.D",
+    .format = 'R',
+    .mask_field = 0xfe00007f,
+    .instruction_matcher = 0x22000053,
+    .execute = FpSignInject<double>
+  },
+  {
+    .name = "FMINMAX.S",
+    .format = 'R',
+    .mask_field = 0xfe00607f,
+    .instruction_matcher = 0x28000053,
+    .execute = FpMinMax<float>
+  },
+  {
+    .name = "FMINMAX.D",
+    .format = 'R',
+    .mask_field = 0xfe00607f,
+    .instruction_matcher = 0x2a000053,
+    .execute = FpMinMax<double>
+  },
+  {
+    .name = "FCVT.S.D",
+    .format = 'R',
+    .mask_field = 0xfff0007f,
+    .instruction_matcher = 0x40100053,
+    .execute = FpConvert<float, double>
+  },
+  {
+    .name = "FCVT.D.S",
+    .format = 'R',
+    .mask_field = 0xfff0007f,
+    .instruction_matcher = 0x42000053,
+    .execute = FpConvert<double, float>
+  },
+  {
+    .name = "FCMP.S",
+    .format = 'R',
+    .mask_field = 0xfe00007f,
+    .instruction_matcher = 0xa0000053,
+    .execute = FpCompare<float>
+  },
+  {
+    .name = "FCMP.D",
+    .format = 'R',
+    .mask_field = 0xfe00007f,
+    .instruction_matcher = 0xa2000053,
+    .execute = FpCompare<double>
+  },
+  {
+    .name = "FCLASS.S",
+    .format = 'R',
+    .mask_field = 0xfff0707f,
+    .instruction_matcher = 0xe0001053,
+    .execute = FpClass<float>
+  },
+  {
+    .name = "FCLASS.D",
+    .format = 'R',
+    .mask_field = 0xfff0707f,
+    .instruction_matcher = 0xe2001053,
+    .execute = FpClass<double>
+  },
+  {
+    .name = "FCVT.INT.S",
+    .format = 'R',
+    .mask_field = 0xfe00007f,
+    .instruction_matcher = 0xc0000053,
+    .execute = FpToInt<float>
+  },
+  {
+    .name = "FCVT.INT.D",
+    .format = 'R',
+    .mask_field = 0xfe00007f,
+    .instruction_matcher = 0xc2000053,
+    .execute = FpToInt<double>
+  },
+  {
+    .name = "FCVT.S.INT",
+    .format = 'R',
+    .mask_field = 0xfe00007f,
+    .instruction_matcher = 0xd0000053,
+    .execute = IntToFp<float>
+  },
+  {
+    .name = "FCVT.D.INT",
+    .format = 'R',
+    .mask_field = 0xfe00007f,
+    .instruction_matcher = 0xd2000053,
+    .execute = IntToFp<double>
+  },
+  {
+    .name = "FMV.X.W",
+    .format = 'R',
+    .mask_field = 0xfff0707f,
+    .instruction_matcher = 0xe0000053,
+    .execute = [](const uint32_t instruction, CPU& cpu) {
+      cpu.RequireFp();
+      const InstructionFields fields = parse_instruction<'R'>(instruction);
+      cpu.SetReg(fields.rd, static_cast<int64_t>(static_cast<int32_t>(cpu.GetFReg(fields.rs1))));
+    }
+  },
+  {
+    .name = "FMV.X.D",
+    .format = 'R',
+    .mask_field = 0xfff0707f,
+    .instruction_matcher = 0xe2000053,
+    .execute = [](const uint32_t instruction, CPU& cpu) {
+      cpu.RequireFp();
+      const InstructionFields fields = parse_instruction<'R'>(instruction);
+      cpu.SetReg(fields.rd, cpu.GetFReg(fields.rs1));
+    }
+  },
+  {
+    .name = "FMV.W.X",
+    .format = 'R',
+    .mask_field = 0xfff0707f,
+    .instruction_matcher = 0xf0000053,
+    .execute = [](const uint32_t instruction, CPU& cpu) {
+      cpu.RequireFp();
+      const InstructionFields fields = parse_instruction<'R'>(instruction);
+      WriteFBits<float>(cpu, fields.rd, static_cast<uint32_t>(cpu.GetReg(fields.rs1)));
+    }
+  },
+  {
+    .name = "FMV.D.X",
+    .format = 'R',
+    .mask_field = 0xfff0707f,
+    .instruction_matcher = 0xf2000053,
+    .execute = [](const uint32_t instruction, CPU& cpu) {
+      cpu.RequireFp();
+      const InstructionFields fields = parse_instruction<'R'>(instruction);
+      WriteFBits<double>(cpu, fields.rd, cpu.GetReg(fields.rs1));
+    }
+  }
+  // RV32F / RV32D
+  // ----------------------------------------
+};
+
+const std::span<const Instruction> fd_instructions = fd_table;
@@ -0,0 +1,121 @@
+#include "fusion.h"
+#include "cpu.h"
+#include "instruction.h"
+
+// The pc of an AUIPC first half, always 4 bytes, the second half's length is in inst_len
+static uint64_t FirstPc(const CPU& cpu)
+{
+  return cpu.GetPc() - cpu.GetInstLen() - 4;
+}
+
+template<bool word>
+static void LoadImmediate(const uint32_t first, const uint32_t second, CPU& cpu)
+{
+  const InstructionFields lui = parse_instruction<'U'>(first);
+  const InstructionFields addi = parse_instruction<'I'>(second);
+  const uint64_t value = static_cast<uint64_t>(static_cast<int32_t>(lui.imm)) + sign_extend_12b(addi.imm);
+  cpu.SetReg(addi.rd, word ? static_cast<int64_t>(static_cast<int32_t>(value)) : value);
+}
+
+static void FarCall(const uint32_t first, const uint32_t second, CPU& cpu)
+{
+  const InstructionFields auipc = parse_instruction<'U'>(first);
+  const InstructionFields jalr = parse_instruction<'I'>(second);
+  const uint64_t base = FirstPc(cpu) + static_cast<int32_t>(auipc.imm);
+  cpu.SetReg(auipc.rd, base);
+  cpu.SetReg(jalr.rd, cpu.GetPc());
+  cpu.SetPc((base + sign_extend_12b(jalr.imm)) & ~1ULL);
+}
+
+template<int size>
+static void PcRelativeLoad(const uint32_t first, const uint32_t second, CPU& cpu)
+{
+  const InstructionFields auipc = parse_instruction<'U'>(first);
+  const InstructionFields load = parse_instruction<'I'>(second);
+  const uint64_t base = FirstPc(cpu) + static_cast<int32_t>(auipc.imm);
+  cpu.SetReg(auipc.rd, base);
+  uint64_t data;
+  cpu.Load(base + sign_extend_12b(load.imm), size, data);
+  cpu.SetReg(load.rd, size == 4 ? static_cast<int64_t>(static_cast<int32_t>(data)) : data);
+}
+
+static void ShiftPair(const uint32_t first, const uint32_t second, CPU& cpu)
+{
+  const InstructionFields slli = parse_instruction<'I'>(first);
+  const InstructionFields srli = parse_instruction<'I'>(second);
+  cpu.SetReg(srli.rd, (cpu.GetReg(slli.rs1) << (slli.imm & 0x3f)) >> (srli.imm & 0x3f));
+}
+
+// funct3 of the compare selects signed or unsigned, funct3 of the branch BEQ or BNE
+template<bool immediate>
+static void CompareBranch(const uint32_t first, const uint32_t second, CPU& cpu)
+{
+  const InstructionFields compare = immediate ? parse_instruction<'I'>(first) : parse_instruction<'R'>(first);
+  const InstructionFields branch = parse_instruction<'B'>(second);
+  const uint64_t lhs = cpu.GetReg(compare.rs1);
+  const uint64_t rhs = immediate ? static_cast<uint64_t>(static_cast<int64_t>(sign_extend_12b(compare.imm)))
+                                 : cpu.GetReg(compare.rs2);
+  const bool less = compare.funct3 == 0b011 ? lhs < rhs : static_cast<int64_t>(lhs) < static_cast<int64_t>(rhs);
+  cpu.SetReg(compare.rd, less);
+  if(less == (branch.funct3 == 0b001))
+  {
+    cpu.SetPc(cpu.GetPc() + sign_extend_13b(branch.imm) - cpu.GetInstLen());
+  }
+}
+
+FusedPair MatchFusion(uint32_t first, uint32_t second)
+{
+  const uint32_t rd = mask<7, 11>(first);
+  const uint32_t op1 = first & 0x7f, f3_1 = mask<12, 14>(first);
+  const uint32_t op2 = second & 0x7f, f3_2 = mask<12, 14>(second);
+  const uint32_t rs1 = mask<15, 19>(second), rs2 = mask<20, 24>(second);
+  if(rd == 0 || rs1 != rd)
+  {
+    return {nullptr, Fusion::None};
+  }
+  // When the second half also writes the register the first half's value is never seen and not written
+  const bool same_rd = mask<7, 11>(second) == rd;
+
+  if(op1 == 0x37 && same_rd && f3_2 == 0b000 && (op2 == 0x13 || op2 == 0x1b))
+  {
+    return {op2 == 0x13 ? LoadImmediate<false> : LoadImmediate<true>, Fusion::LoadImmediate};
+  }
+  if(op1 == 0x17 && op2 == 0x67 && f3_2 == 0b000)
+  {
+    return {FarCall, Fusion::FarCall};
+  }
+  if(op1 == 0x17 && op2 == 0x03 && (f3_2 == 0b010 || f3_2 == 0b011))
+  {
+    return {f3_2 == 0b010 ? PcRelativeLoad<4> : PcRelativeLoad<8>, Fusion::PcRelativeLoad};
+  }
+  const bool shift_immediate = mask<26, 31>(first) == 0 && mask<26, 31>(second) == 0;
+  if(op1 == 0x13 && f3_1 == 0b001 && op2 == 0x13 && f3_2 == 0b101 && shift_immediate && same_rd)
+  {
+    return {ShiftPair, Fusion::ShiftPair};
+  }
+  const bool set_less = (f3_1 == 0b010 || f3_1 == 0b011) && (op1 == 0x13 || (op1 == 0x33 && mask<25, 31>(first) == 0));
+  if(set_less && op2 == 0x63 && (f3_2 == 0b000 || f3_2 == 0b001) && rs2 == 0)
+  {
+    return {op1 == 0x13 ? CompareBranch<true> : CompareBranch<false>, Fusion::CompareBranch};
+  }
+  return {nullptr, Fusion::None};
+}
+
+const char* FusionName(Fusion kind)
+{
+  switch(kind)
+  {
+    case Fusion::LoadImmediate:
+      return "lui+addi";
+    case Fusion::FarCall:
+      return "auipc+jalr";
+    case Fusion::PcRelativeLoad:
+      return "auipc+load";
+    case Fusion::ShiftPair:
+      return "slli+srli";
+    case Fusion::CompareBranch:
+      return "slt+branch";
+    default:
+      return "none";
+  }
+}
@@ -0,0 +1,692 @@
+#include "gdb_stub.h"
+#include "instruction.h"
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <vector>
+#include <charconv>
+#include <string_view>
+#include <cstring>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// GDB numbers x0-x31 as 0-31 and the pc as 32 for riscv targets
+static constexpr int GDB_PC_REG = 32;
+static constexpr int GDB_N_REGS = 33;
+// The PacketSize advertised in qSupported, in bytes of packet data
+static constexpr uint64_t GDB_PACKET_SIZE = 0x4000;
+
+static constexpr uint32_t EBREAK = 0x00100073;
+static constexpr uint32_t C_EBREAK = 0x9002;
+
+// Stop signals reported to GDB
+static constexpr const char* STOP_TRAP = "S05";
+static constexpr const char* STOP_INT = "S02";
+static constexpr const char* STOP_SEGV = "S0b";
+
+static const char* const gdb_reg_names[GDB_N_REGS] = {
+  "zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2",
+  "fp", "s1", "a0", "a1", "a2", "a3", "a4", "a5",
+  "a6", "a7", "s2", "s3", "s4", "s5", "s6", "s7",
+  "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6",
+  "pc"
+};
+
+static std::string TargetXml(int xlen)
+{
+  std::ostringstream xml;
+  xml << "<?xml version=\"1.0\"?>"
+      << "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+      << "<target version=\"1.0\">"
+      << "<architecture>riscv:rv" << xlen << "</architecture>"
+      << "<feature name=\"org.gnu.gdb.riscv.cpu\">";
+  for(int i = 0; i < GDB_N_REGS; i++)
+  {
+    const char* type = (i == GDB_PC_REG) ? "code_ptr" : "int";
+    xml << "<reg name=\"" << gdb_reg_names[i] << "\" bitsize=\"" << xlen << "\" type=\"" << type
+        << "\" regnum=\"" << i << "\"/>";
+  }
+  xml << "</feature></target>";
+  return xml.str();
+}
+
+// hex helpers, registers and memory are sent as little-endian byte strings
+
+static std::string ToHex(uint64_t val, int bytes)
+{
+  std::ostringstream out;
+  for(int i = 0; i < bytes; i++)
+  {
+    out << std::hex << std::setw(2) << std::setfill('0') << ((val >> (8 * i)) & 0xff);
+  }
+  return out.str();
+}
+
+// A number in hex digits and nothing else, packets come from the network and may be malformed
+static bool ParseHex(std::string_view hex, uint64_t& val)
+{
+  const char* end = hex.data() + hex.size();
+  const auto result = std::from_chars(hex.data(), end, val, 16);
+  return !hex.empty() && result.ec == std::errc() && result.ptr == end;
+}
+
+// A little-endian byte string of up to 8 bytes
+static bool FromHex(std::string_view hex, uint64_t& val)
+{
+  if(hex.empty() || hex.size() % 2 != 0 || hex.size() > 16)
+  {
+    return false;
+  }
+  val = 0;
+  for(size_t i = 0; i < hex.size() / 2; i++)
+  {
+    uint64_t byte;
+    if(!ParseHex(hex.substr(2 * i, 2), byte))
+    {
+      return false;
+    }
+    val |= byte << (8 * i);
+  }
+  return true;
+}
+
+// Splits "addr,len[:data]" style arguments
+static bool ParseAddrLen(std::string_view args, uint64_t& addr, uint64_t& len, std::string* data)
+{
+  const auto comma = args.find(',');
+  if(comma == std::string_view::npos)
+  {
+    return false;
+  }
+  const auto colon = args.find(':', comma);
+  if(!ParseHex(args.substr(0, comma), addr) || !ParseHex(args.substr(comma + 1, colon - comma - 1), len))
+  {
+    return false;
+  }
+  if(data != nullptr)
+  {
+    if(colon == std::string_view::npos)
+    {
+      return false;
+    }
+    *data = args.substr(colon + 1);
+  }
+  return true;
+}
+
+GDBStub::~GDBStub()
+{
+  if(conn_fd >= 0)
+  {
+    close(conn_fd);
+  }
+  if(listen_fd >= 0)
+  {
+    close(listen_fd);
+  }
+  if(!unix_path.empty())
+  {
+    unlink(unix_path.c_str());
+  }
+}
+
+bool GDBStub::ListenTcp(uint16_t port)
+{
+  listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(listen_fd < 0)
+  {
+    std::cerr << "gdb: could not create socket" << std::endl;
+    return false;
+  }
+  int reuse = 1;
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  sockaddr_in addr {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if(bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(listen_fd, 1) < 0)
+  {
+    std::cerr << "gdb: could not listen on port " << std::dec << port << std::endl;
+    return false;
+  }
+  std::cout << "gdb: listening on localhost:" << std::dec << port << std::endl;
+  return true;
+}
+
+bool GDBStub::ListenUnix(const std::string& path)
+{
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(listen_fd < 0 || path.size() >= sizeof(sockaddr_un::sun_path))
+  {
+    std::cerr << "gdb: could not create socket" << std::endl;
+    return false;
+  }
+  sockaddr_un addr {};
+  addr.sun_family = AF_UNIX;
+  std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  unlink(path.c_str());
+  if(bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(listen_fd, 1) < 0)
+  {
+    std::cerr << "gdb: could not listen on " << path << std::endl;
+    return false;
+  }
+  unix_path = path;
+  std::cout << "gdb: listening on " << path << std::endl;
+  return true;
+}
+
+bool GDBStub::Serve()
+{
+  conn_fd = accept(listen_fd, nullptr, nullptr);
+  if(conn_fd < 0)
+  {
+    std::cerr << "gdb: accept failed" << std::endl;
+    return false;
+  }
+  int nodelay = 1;
+  setsockopt(conn_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+  cpu.SetDebugHalt(true);
+  detached = false;
+  std::string packet, reply;
+  while(ReadPacket(packet))
+  {
+    const bool more = HandlePacket(packet, reply);
+    // Only a kill goes unanswered
+    if(more || detached)
+    {
+      WritePacket(reply);
+    }
+    if(!more)
+    {
+      break;
+    }
+  }
+  cpu.SetDebugHalt(false);
+  close(conn_fd);
+  conn_fd = -1;
+  return detached;
+}
+
+// CONNECTION
+
+bool GDBStub::ReadPacket(std::string& packet)
+{
+  char c;
+  while(true)
+  {
+    // Skip acks and anything outside of a packet
+    do
+    {
+      if(recv(conn_fd, &c, 1, 0) != 1)
+      {
+        return false;
+      }
+    } while(c != '$');
+
+    packet.clear();
+    uint8_t sum = 0;
+    while(recv(conn_fd, &c, 1, 0) == 1 && c != '#')
+    {
+      packet.push_back(c);
+      sum += static_cast<uint8_t>(c);
+    }
+    char checksum[3] = {0};
+    if(recv(conn_fd, checksum, 2, MSG_WAITALL) != 2)
+    {
+      return false;
+    }
+    if(no_ack)
+    {
+      return true;
+    }
+    const bool valid = static_cast<uint8_t>(std::strtoul(checksum, nullptr, 16)) == sum;
+    send(conn_fd, valid ? "+" : "-", 1, 0);
+    if(valid)
+    {
+      return true;
+    }
+  }
+}
+
+void GDBStub::WritePacket(const std::string& packet)
+{
+  uint8_t sum = 0;
+  for(const char c : packet)
+  {
+    sum += static_cast<uint8_t>(c);
+  }
+  const std::string framed = "$" + packet + "#" + ToHex(sum, 1);
+  send(conn_fd, framed.data(), framed.size(), 0);
+  if(!no_ack)
+  {
+    char ack;
+    recv(conn_fd, &ack, 1, 0);
+  }
+}
+
+// GDB sends a raw 0x03 byte to stop a running target
+bool GDBStub::InterruptRequested()
+{
+  pollfd pfd = {.fd = conn_fd, .events = POLLIN, .revents = 0};
+  if(poll(&pfd, 1, 0) <= 0)
+  {
+    return false;
+  }
+  char c;
+  if(recv(conn_fd, &c, 1, MSG_PEEK) == 1 && c == 0x03)
+  {
+    recv(conn_fd, &c, 1, 0);
+    return true;
+  }
+  return false;
+}
+
+// PACKET HANDLERS
+
+bool GDBStub::HandlePacket(const std::string& packet, std::string& reply)
+{
+  const std::string args = packet.size() > 1 ? packet.substr(1) : "";
+  uint64_t pc;
+  // Empty reply marks the packet as unsupported
+  reply.clear();
+  switch(packet.empty() ? 0 : packet[0])
+  {
+    case '?':
+      reply = STOP_TRAP;
+      break;
+    case 'g':
+      reply = ReadRegisters();
+      break;
+    case 'G':
+      reply = WriteRegisters(args);
+      break;
+    case 'p':
+      reply = ReadRegister(args);
+      break;
+    case 'P':
+      reply = WriteRegister(args);
+      break;
+    case 'm':
+      reply = ReadMemory(args);
+      break;
+    case 'M':
+      reply = WriteMemory(args);
+      break;
+    case 'c':
+    case 's':
+      if(!args.empty() && !ParseHex(args, pc))
+      {
+        reply = "E01";
+        break;
+      }
+      if(!args.empty())
+      {
+        cpu.SetPc(pc);
+      }
+      reply = Resume(packet[0] == 's');
+      break;
+    case 'Z':
+      reply = InsertBreakpoint(args);
+      break;
+    case 'z':
+      reply = RemoveBreakpoint(args);
+      break;
+    case 'H':
+      reply = "OK";
+      break;
+    case 'q':
+    case 'Q':
+      reply = Query(packet);
+      // The OK reply to QStartNoAckMode is still acknowledged
+      no_ack = no_ack || packet == "QStartNoAckMode";
+      break;
+    case 'D':
+      for(const auto& [addr, bp] : breakpoints)
+      {
+        RestoreBreakpoint(addr, bp);
+      }
+      breakpoints.clear();
+      reply = "OK";
+      detached = true;
+      return false;
+    case 'k':
+      return false;
+    default:
+      break;
+  }
+  return true;
+}
+
+uint64_t GDBStub::GetRegister(int reg) const
+{
+  return reg == GDB_PC_REG ? cpu.GetPc() : cpu.GetReg(reg);
+}
+
+// RV32 harts keep their registers sign-extended
+void GDBStub::SetRegister(int reg, uint64_t val)
+{
+  const bool rv32 = cpu.GetXlen() == 32;
+  if(reg == GDB_PC_REG)
+  {
+    cpu.SetPc(rv32 ? xlen_address<32>(val) : val);
+  }
+  else if(reg != 0)
+  {
+    cpu.SetReg(reg, rv32 ? xlen_value<32>(val) : val);
+  }
+}
+
+// Registers are XLEN wide on the wire
+std::string GDBStub::ReadRegisters()
+{
+  const int bytes = cpu.GetXlen() / 8;
+  std::string out;
+  for(int i = 0; i < GDB_N_REGS; i++)
+  {
+    out += ToHex(GetRegister(i), bytes);
+  }
+  return out;
+}
+
+std::string GDBStub::WriteRegisters(const std::string& args)
+{
+  const size_t digits = cpu.GetXlen() / 4;
+  if(args.size() != GDB_N_REGS * digits)
+  {
+    return "E01";
+  }
+  uint64_t values[GDB_N_REGS];
+  for(int i = 0; i < GDB_N_REGS; i++)
+  {
+    if(!FromHex(std::string_view(args).substr(digits * i, digits), values[i]))
+    {
+      return "E01";
+    }
+  }
+  for(int i = 0; i < GDB_N_REGS; i++)
+  {
+    SetRegister(i, values[i]);
+  }
+  return "OK";
+}
+
+std::string GDBStub::ReadRegister(const std::string& args)
+{
+  uint64_t reg;
+  if(!ParseHex(args, reg) || reg >= GDB_N_REGS)
+  {
+    return "E01";
+  }
+  return ToHex(GetRegister(reg), cpu.GetXlen() / 8);
+}
+
+std::string GDBStub::WriteRegister(const std::string& args)
+{
+  const auto eq = args.find('=');
+  uint64_t reg, val;
+  if(eq == std::string::npos || !ParseHex(std::string_view(args).substr(0, eq), reg) || reg >= GDB_N_REGS
+     || args.size() - eq - 1 != static_cast<size_t>(cpu.GetXlen() / 4) || !FromHex(std::string_view(args).substr(eq + 1), val))
+  {
+    return "E01";
+  }
+  SetRegister(reg, val);
+  return "OK";
+}
+
+std::string GDBStub::ReadMemory(const std::string& args)
+{
+  uint64_t addr, len;
+  if(!ParseAddrLen(args, addr, len, nullptr))
+  {
+    return "E01";
+  }
+  // The reply has to fit in PacketSize, GDB asks for the rest
+  std::vector<uint8_t> data(std::min<uint64_t>(len, GDB_PACKET_SIZE / 2));
+  const uint64_t read = cpu.GetMMU().DebugRead(addr, data.data(), data.size());
+  // Partial reads are allowed as long as something was read
+  if(read == 0 && !data.empty())
+  {
+    return "E14";
+  }
+  std::string out;
+  for(uint64_t i = 0; i < read; i++)
+  {
+    out += ToHex(data[i], 1);
+  }
+  return out;
+}
+
+std::string GDBStub::WriteMemory(const std::string& args)
+{
+  uint64_t addr, len;
+  std::string hex;
+  if(!ParseAddrLen(args, addr, len, &hex) || hex.size() < 2 * len)
+  {
+    return "E01";
+  }
+  std::vector<uint8_t> data(len);
+  for(uint64_t i = 0; i < len; i++)
+  {
+    uint64_t byte;
+    if(!ParseHex(std::string_view(hex).substr(2 * i, 2), byte))
+    {
+      return "E01";
+    }
+    data[i] = byte;
+  }
+  return cpu.GetMMU().DebugWrite(addr, data.data(), len) == len ? "OK" : "E14";
+}
+
+// Z0/Z1 patch the code, Z2/Z3/Z4 arm MMU watchpoints
+std::string GDBStub::InsertBreakpoint(const std::string& args)
+{
+  uint64_t addr, kind;
+  if(args.size() < 2 || args[1] != ',' || !ParseAddrLen(args.substr(2), addr, kind, nullptr))
+  {
+    return "E01";
+  }
+  switch(args[0])
+  {
+    case '0':
+    case '1':
+    {
+      if(breakpoints.count(addr) != 0)
+      {
+        return "OK";
+      }
+      Breakpoint bp = {.kind = static_cast<int>(kind), .original = 0};
+      if(!PatchBreakpoint(addr, bp.kind, bp.original))
+      {
+        return "E14";
+      }
+      breakpoints[addr] = bp;
+      return "OK";
+    }
+    case '2':
+      cpu.GetMMU().AddWatchpoint(addr, kind, false, true);
+      return "OK";
+    case '3':
+      cpu.GetMMU().AddWatchpoint(addr, kind, true, false);
+      return "OK";
+    case '4':
+      cpu.GetMMU().AddWatchpoint(addr, kind, true, true);
+      return "OK";
+    default:
+      return "";
+  }
+}
+
+std::string GDBStub::RemoveBreakpoint(const std::string& args)
+{
+  uint64_t addr, kind;
+  if(args.size() < 2 || args[1] != ',' || !ParseAddrLen(args.substr(2), addr, kind, nullptr))
+  {
+    return "E01";
+  }
+  switch(args[0])
+  {
+    case '0':
+    case '1':
+    {
+      const auto bp = breakpoints.find(addr);
+      if(bp == breakpoints.end())
+      {
+        return "OK";
+      }
+      const bool restored = RestoreBreakpoint(addr, bp->second);
+      breakpoints.erase(bp);
+      return restored ? "OK" : "E14";
+    }
+    case '2':
+      return cpu.GetMMU().RemoveWatchpoint(addr, kind, false, true) ? "OK" : "E01";
+    case '3':
+      return cpu.GetMMU().RemoveWatchpoint(addr, kind, true, false) ? "OK" : "E01";
+    case '4':
+      return cpu.GetMMU().RemoveWatchpoint(addr, kind, true, true) ? "OK" : "E01";
+    default:
+      return "";
+  }
+}
+
+std::string GDBStub::Query(const std::string& packet)
+{
+  if(packet.rfind("qSupported", 0) == 0)
+  {
+    return "PacketSize=4000;qXfer:features:read+;QStartNoAckMode+";
+  }
+  if(packet == "QStartNoAckMode")
+  {
+    return "OK";
+  }
+  if(packet.rfind("qXfer:features:read:target.xml:", 0) == 0)
+  {
+    uint64_t offset, len;
+    if(!ParseAddrLen(packet.substr(std::strlen("qXfer:features:read:target.xml:")), offset, len, nullptr))
+    {
+      return "E01";
+    }
+    const std::string xml = TargetXml(cpu.GetXlen());
+    if(offset >= xml.size())
+    {
+      return "l";
+    }
+    const std::string chunk = xml.substr(offset, len);
+    return (offset + chunk.size() >= xml.size() ? "l" : "m") + chunk;
+  }
+  if(packet == "qAttached")
+  {
+    return "1";
+  }
+  if(packet == "qC")
+  {
+    return "QC1";
+  }
+  if(packet == "qfThreadInfo")
+  {
+    return "m1";
+  }
+  if(packet == "qsThreadInfo")
+  {
+    return "l";
+  }
+  if(packet.rfind("qSymbol", 0) == 0)
+  {
+    return "OK";
+  }
+  return "";
+}
+
+// EXECUTION CONTROL
+
+// Breakpoints go through the debugger access path, so they can be placed in
+// read-only and execute-only code
+bool GDBStub::PatchBreakpoint(uint64_t addr, int kind, uint32_t& original)
+{
+  const uint64_t size = (kind == 2) ? 2 : 4;
+  const uint32_t ebreak = (size == 2) ? C_EBREAK : EBREAK;
+  original = 0;
+  if(cpu.GetMMU().DebugRead(addr, reinterpret_cast<uint8_t*>(&original), size) != size)
+  {
+    return false;
+  }
+  return cpu.GetMMU().DebugWrite(addr, reinterpret_cast<const uint8_t*>(&ebreak), size) == size;
+}
+
+bool GDBStub::RestoreBreakpoint(uint64_t addr, const Breakpoint& bp)
+{
+  const uint64_t size = (bp.kind == 2) ? 2 : 4;
+  return cpu.GetMMU().DebugWrite(addr, reinterpret_cast<const uint8_t*>(&bp.original), size) == size;
+}
+
+// Runs the original instruction under a breakpoint at pc, then re-arms it
+void GDBStub::StepOverBreakpoint()
+{
+  const uint64_t addr = cpu.GetPc();
+  const auto bp = breakpoints.find(addr);
+  if(bp == breakpoints.end())
+  {
+    cpu.Step();
+    return;
+  }
+  RestoreBreakpoint(addr, bp->second);
+  try
+  {
+    cpu.Step();
+  }
+  catch(const CPUTrapException& e)
+  {
+    uint32_t original;
+    PatchBreakpoint(addr, bp->second.kind, original);
+    throw;
+  }
+  uint32_t original;
+  PatchBreakpoint(addr, bp->second.kind, original);
+}
+
+std::string GDBStub::Resume(bool single_step)
+{
+  MMU& mmu = cpu.GetMMU();
+  uint64_t watch_addr;
+  Watchpoint watchpoint;
+  bool watch = false;
+  uint64_t steps = 0;
+
+  cpu.ClearDebugHalt();
+  try
+  {
+    StepOverBreakpoint();
+    watch = mmu.TakeWatchHit(watch_addr, watchpoint);
+    while(!single_step && !watch && !cpu.IsDebugHalted())
+    {
+      // Only poll the socket every few thousand instructions
+      if((++steps & 0xfff) == 0 && InterruptRequested())
+      {
+        return STOP_INT;
+      }
+      cpu.Step();
+      watch = mmu.TakeWatchHit(watch_addr, watchpoint);
+    }
+  }
+  catch(const CPUTrapException& e)
+  {
+    std::cerr << "gdb: unhandled trap: " << e.what() << std::endl;
+    return STOP_SEGV;
+  }
+
+  if(watch)
+  {
+    std::ostringstream reply;
+    const char* kind = watchpoint.on_load ? (watchpoint.on_store ? "awatch" : "rwatch") : "watch";
+    reply << "T05" << kind << ":" << std::hex << watch_addr << ";";
+    return reply.str();
+  }
+  return STOP_TRAP;
+}
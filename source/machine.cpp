@@ -0,0 +1,107 @@
+#include "machine.h"
+#include "elf_parser.h"
+#include <cstring>
+#include <stdexcept>
+
+RunResult Machine::RunFor(uint64_t instructions)
+{
+  const uint64_t start = cpu.GetInstret();
+  StopReason reason = StopReason::Budget;
+  while(!exited && cpu.GetInstret() - start < instructions)
+  {
+    cpu.RunBlocks(instructions - (cpu.GetInstret() - start));
+    if(tohost != nullptr)
+    {
+      CheckTohost();
+    }
+    if(cpu.TakeIdle())
+    {
+      reason = StopReason::Idle;
+      break;
+    }
+  }
+  if(exited)
+  {
+    reason = StopReason::Exit;
+    if(!exit_reported)
+    {
+      exit_reported = true;
+      if(on_exit)
+      {
+        on_exit(*this, exit_code);
+      }
+    }
+  }
+  return RunResult{.executed = cpu.GetInstret() - start, .reason = reason};
+}
+
+// Even values are HTIF device requests, which no guest of ours makes
+void Machine::CheckTohost()
+{
+  uint64_t value;
+  std::memcpy(&value, tohost, sizeof(value));
+  if(value & 1)
+  {
+    Exit(value >> 1);
+  }
+}
+
+std::unique_ptr<Machine> MachineBuilder::Build() const
+{
+  const int hart_xlen = (has_xlen || elf.empty()) ? xlen : ELFXlen(elf);
+  std::unique_ptr<Machine> machine(new Machine(ram_size, huge_pages, hart_xlen));
+  CPU& cpu = machine->GetCpu();
+  MemoryMap& memory = machine->GetMemory();
+  for(const auto& [base, size] : roms)
+  {
+    memory.AddRegion(base, size, true, huge_pages);
+  }
+  for(const auto& [addr, bytes] : images)
+  {
+    memory.Write(addr, bytes.data(), bytes.size());
+  }
+
+  uint64_t pc = entry;
+  uint64_t exit_word = tohost;
+  bool watch_exit = has_tohost;
+  if(!elf.empty())
+  {
+    const uint64_t elf_entry = LoadELF(elf, memory);
+    pc = has_entry ? entry : elf_entry;
+    if(!has_tohost)
+    {
+      watch_exit = FindELFSymbol(elf, "tohost", exit_word);
+    }
+  }
+  cpu.SetPc(pc);
+  if(watch_exit)
+  {
+    machine->tohost = memory.HostAddress(exit_word, false);
+    if(machine->tohost == nullptr || (exit_word & 7) != 0)
+    {
+      throw std::runtime_error("tohost must be an aligned address in guest memory");
+    }
+    cpu.SetTohost(machine->tohost);
+  }
+
+  Machine* const host = machine.get();
+  for(const DeviceHooks& device : devices)
+  {
+    MmioLoadHook load;
+    MmioStoreHook store;
+    if(device.load)
+    {
+      load = [host, hook = device.load](uint64_t offset, int size) { return hook(*host, offset, size); };
+    }
+    if(device.store)
+    {
+      store = [host, hook = device.store](uint64_t offset, int size, uint64_t data) { hook(*host, offset, size, data); };
+    }
+    cpu.GetMMU().AddDevice(std::make_unique<MmioDevice>(device.base, device.size, std::move(load), std::move(store)));
+  }
+
+  cpu.GetMMU().GetClint().SetTimeMode(instruction_count ? TimeMode::InstructionCount : TimeMode::HostClock);
+  cpu.SetParkOnIdle(park_on_idle);
+  machine->on_exit = on_exit;
+  return machine;
+}
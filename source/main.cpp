@@ -1,69 +1,216 @@
 #include "config.h"
 #include "cpu.h"
 #include "elf_parser.h"
+#include "gdb_stub.h"
+#include "checkpoint.h"
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <chrono>
 
-// Parse options for loading an elf file or an xv6 image
-int ParseOptions(int argc, char** argv)
+typedef struct Options
 {
-  if(argc != 3)
+  int mode = -1;            // 0: xv6, 1: elf, 2: checkpoint
+  std::string image;
+  std::string gdb_endpoint;
+  std::string save_path;
+  uint64_t steps = 0;       // 0: interactive step mode
+  bool compress = true;
+  bool icount = false;      // mtime counts instructions instead of host time
+  uint64_t ram_size = MEMORY_SIZE;
+  int xlen = 0;             // 0: from the ELF, RV64 for checkpoints
+  std::vector<std::pair<uint64_t, uint64_t>> roms; // base, size
+} Options;
+
+void PrintUsage(const char* name)
+{
+  std::cout << "Usage: " << name << " [option]" << " <binary>" << " [flags]" << '\n';
+  std::cout << "Options: -xv6, -elf, -checkpoint" << '\n';
+  std::cout << "Flags: -gdb <port|socket path>  serve GDB remote protocol" << '\n';
+  std::cout << "       -steps <n>               run n instructions without prompting" << '\n';
+  std::cout << "       -save <file>             write a checkpoint after -steps" << '\n';
+  std::cout << "       -raw                     store checkpoint RAM uncompressed (mmap on restore)" << '\n';
+  std::cout << "       -icount                  advance mtime per instruction, WFI skips to the timer" << '\n';
+  std::cout << "       -ram <MB>                size of the RAM at 0x80000000, default 128" << '\n';
+  std::cout << "       -rom <base> <size>       add a ROM region the ELF can load into" << '\n';
+  std::cout << "       -rv32                    run an RV32 hart, needed to resume an RV32 checkpoint" << std::endl;
+}
+
+// Parse options for loading an elf file, an xv6 image or a checkpoint
+bool ParseOptions(int argc, char** argv, Options& options)
+{
+  if(argc < 3)
   {
-    std::cout << "Usage: " << argv[0] << " [option]" << " <binary>" << std::endl;
-    return -1;
+    PrintUsage(argv[0]);
+    return false;
   }
-  else if(std::string(argv[1]) == "-xv6")
+  const std::string mode = argv[1];
+  if(mode == "-xv6")
   {
-    return 0;
+    options.mode = 0;
+  }
+  else if(mode == "-elf")
+  {
+    options.mode = 1;
   }
-  else if(std::string(argv[1]) == "-elf")
+  else if(mode == "-checkpoint")
   {
-    return 1;
+    options.mode = 2;
   }
   else
   {
-    std::cout << "Usage: " << argv[0] << " [option]" << " <binary>" << '\n';
-    std::cout << "Options: -xv6, -elf" << std::endl;
-    return -1;
+    PrintUsage(argv[0]);
+    return false;
+  }
+  options.image = argv[2];
+
+  for(int i = 3; i < argc; i++)
+  {
+    const std::string flag = argv[i];
+    const bool has_value = i + 1 < argc;
+    if(flag == "-gdb" && has_value)
+    {
+      options.gdb_endpoint = argv[++i];
+    }
+    else if(flag == "-steps" && has_value)
+    {
+      options.steps = std::stoull(argv[++i]);
+    }
+    else if(flag == "-save" && has_value)
+    {
+      options.save_path = argv[++i];
+    }
+    else if(flag == "-raw")
+    {
+      options.compress = false;
+    }
+    else if(flag == "-icount")
+    {
+      options.icount = true;
+    }
+    else if(flag == "-ram" && has_value)
+    {
+      options.ram_size = std::stoull(argv[++i]) * 1024 * 1024;
+    }
+    else if(flag == "-rv32")
+    {
+      options.xlen = 32;
+    }
+    else if(flag == "-rom" && i + 2 < argc)
+    {
+      const uint64_t base = std::stoull(argv[++i], nullptr, 0);
+      options.roms.emplace_back(base, std::stoull(argv[++i], nullptr, 0));
+    }
+    else
+    {
+      PrintUsage(argv[0]);
+      return false;
+    }
   }
+  return true;
 }
 
 int main(int argc, char** argv)
 {
-
-  int option = ParseOptions(argc, argv);
-  if(option == -1)
+  Options options;
+  if(!ParseOptions(argc, argv, options))
   {
     return -1;
   }
-  else if(option == 0)
+  else if(options.mode == 0)
   {
     std::cout << "xv6 mode not implemented" << std::endl;
     return -1;
   }
-  else if(option == 1)
+
+  std::unique_ptr<CPU> cpu;
+  if(options.mode == 1)
   {
     std::cout << "ELF mode" << std::endl;
+    try
+    {
+      const int xlen = options.xlen != 0 ? options.xlen : ELFXlen(options.image);
+      cpu = std::make_unique<CPU>(std::make_shared<std::vector<uint8_t>>(), KERNBASE, options.ram_size, true, xlen);
+      MemoryMap& memory = cpu->GetMMU().GetMemory();
+      for(const auto& [base, size] : options.roms)
+      {
+        memory.AddRegion(base, size, true);
+      }
+      cpu->SetPc(LoadELF(options.image, memory));
+    }
+    catch(const std::exception& e)
+    {
+      std::cerr << e.what() << std::endl;
+      return -1;
+    }
   }
-  uint64_t entry_point;
-  auto binary = std::make_shared<std::vector<uint8_t>>(LoadELF64(argv[2], entry_point));
-  if(static_cast<uint64_t>(binary->size()) > MEMORY_SIZE)
+  else
   {
-    std::cerr << "Binary too large" << std::endl;
-    return -1;
+    std::cout << "Checkpoint mode" << std::endl;
+    cpu = std::make_unique<CPU>(std::make_shared<std::vector<uint8_t>>(), KERNBASE, MEMORY_SIZE, true,
+                                options.xlen != 0 ? options.xlen : 64);
+    try
+    {
+      RestoreCheckpoint(*cpu, options.image);
+    }
+    catch(const std::exception& e)
+    {
+      std::cerr << e.what() << std::endl;
+      return -1;
+    }
   }
-  else if(binary->empty() == true)
+
+  if(options.icount)
   {
-    std::cerr << "Failure while reading or binary empty" << std::endl;
-    return -1;
+    cpu->GetMMU().GetClint().SetTimeMode(TimeMode::InstructionCount);
   }
 
-  auto cpu = std::make_unique<CPU>(binary, entry_point);
-  if(cpu == nullptr)
+  // Debug mode, the hart only runs when GDB resumes it
+  if(!options.gdb_endpoint.empty())
   {
-    return -1;
+    GDBStub stub(*cpu);
+    const std::string& endpoint = options.gdb_endpoint;
+    const bool is_port = endpoint.find_first_not_of("0123456789") == std::string::npos;
+    if(!(is_port ? stub.ListenTcp(std::stoi(endpoint)) : stub.ListenUnix(endpoint)))
+    {
+      return -1;
+    }
+    // After a detach the guest runs on unattended
+    if(stub.Serve())
+    {
+      cpu->Run();
+    }
+    return 0;
+  }
+
+  // Batch mode, optionally followed by a checkpoint
+  if(options.steps != 0)
+  {
+    for(uint64_t done = 0; done < options.steps;)
+    {
+      try
+      {
+        done += cpu->RunBlocks(options.steps - done);
+      }
+      catch(const CPUTrapException& e)
+      {
+        std::cout << "Trap: " << e.what() << std::endl;
+      }
+    }
+    std::cout << "PC: " << std::hex << cpu->GetPc() << std::endl;
+    if(!options.save_path.empty())
+    {
+      try
+      {
+        SaveCheckpoint(*cpu, options.save_path, options.compress);
+      }
+      catch(const std::exception& e)
+      {
+        std::cerr << e.what() << std::endl;
+        return -1;
+      }
+    }
+    return 0;
   }
 
   std::chrono::time_point<std::chrono::system_clock> start, end;
@@ -0,0 +1,223 @@
+#include "memory_map.h"
+#include <algorithm>
+#include <bit>
+#include <stdexcept>
+
+RAM& MemoryMap::AddRegion(uint64_t base, uint64_t size, bool read_only, bool huge_pages)
+{
+  if(base + size < base || base + size > (1ULL << PHYS_ADDR_BITS))
+  {
+    throw std::runtime_error("Memory region outside the physical address space");
+  }
+  for(RAM& region : regions)
+  {
+    if(base < region.GetBaseAddr() + region.GetSize() && region.GetBaseAddr() < base + size)
+    {
+      throw std::runtime_error("Memory regions overlap");
+    }
+  }
+  regions.emplace_back(base, size, read_only, huge_pages);
+  RAM& region = regions.back();
+  MapRange(base, size, region.GetHostMemory(), read_only ? entry_read_only : 0);
+  return region;
+}
+
+void MemoryMap::Clear()
+{
+  regions.clear();
+  directory.clear();
+  tables.clear();
+  dirty.Reset();
+  dirty_words.clear();
+  written.Reset();
+  history.clear();
+  first_epoch = epoch;
+}
+
+RAM* MemoryMap::FindRegion(uint64_t addr)
+{
+  for(RAM& region : regions)
+  {
+    if(region.IsValidAddr(addr))
+    {
+      return &region;
+    }
+  }
+  return nullptr;
+}
+
+void MemoryMap::Write(uint64_t addr, const uint8_t* src, uint64_t len)
+{
+  while(len > 0)
+  {
+    RAM* region = FindRegion(addr);
+    if(region == nullptr)
+    {
+      throw std::runtime_error("Image does not fit in guest memory");
+    }
+    const uint64_t offset = addr - region->GetBaseAddr();
+    const uint64_t n = std::min(len, region->GetSize() - offset);
+    region->Write(offset, src, n);
+    MarkDirty(addr, n);
+    addr += n;
+    src += n;
+    len -= n;
+  }
+}
+
+// Fills in the directory for [addr, addr + size), whole 2 MB chunks get a single leaf
+void MemoryMap::MapRange(uint64_t addr, uint64_t size, uint8_t* host, uintptr_t flags)
+{
+  const uint64_t end = addr + size;
+  if(directory.size() < ((end - 1) >> 30) + 1)
+  {
+    directory.resize(((end - 1) >> 30) + 1);
+  }
+  while(addr < end)
+  {
+    auto& chunks = directory[addr >> 30];
+    if(chunks == nullptr)
+    {
+      chunks = std::make_unique<Table>();
+    }
+    uintptr_t& chunk = (*chunks)[(addr >> 21) & 0x1ff];
+    const uint64_t chunk_end = (addr | (HUGE_PAGE_SIZE - 1)) + 1;
+    const bool whole_chunk = addr % HUGE_PAGE_SIZE == 0 && end >= chunk_end
+                             && reinterpret_cast<uintptr_t>(host) % HUGE_PAGE_SIZE == 0;
+    if(whole_chunk)
+    {
+      chunk = reinterpret_cast<uintptr_t>(host) | flags;
+      addr += HUGE_PAGE_SIZE;
+      host += HUGE_PAGE_SIZE;
+      continue;
+    }
+    if(chunk == 0)
+    {
+      tables.push_back(std::make_unique<Table>());
+      chunk = reinterpret_cast<uintptr_t>(tables.back().get()) | entry_table;
+    }
+    auto& pages = *reinterpret_cast<Table*>(chunk & ~entry_flags);
+    for(; addr < std::min(end, chunk_end); addr += PAGE_SIZE, host += PAGE_SIZE)
+    {
+      pages[(addr >> 12) & 0x1ff] = reinterpret_cast<uintptr_t>(host) | flags;
+    }
+  }
+}
+
+void MemoryMap::MarkDirty(uint64_t addr, uint64_t len)
+{
+  if(len == 0)
+  {
+    return;
+  }
+  for(uint64_t page = addr >> 12; page <= (addr + len - 1) >> 12; page++)
+  {
+    SetDirty(page);
+  }
+}
+
+uint64_t MemoryMap::AdvanceEpoch()
+{
+  // Page lists are kept in ascending order for IsDirty
+  std::sort(dirty_words.begin(), dirty_words.end());
+  std::vector<uint64_t> pages;
+  for(const uint64_t i : dirty_words)
+  {
+    uint64_t& word = dirty.Word(i);
+    written.Word(i) |= word;
+    for(uint64_t bits = word; bits != 0; bits &= bits - 1)
+    {
+      pages.push_back(i * 64 + std::countr_zero(bits));
+    }
+    word = 0;
+  }
+  dirty_words.clear();
+  history.push_back(std::move(pages));
+  epoch++;
+  DropHistory();
+  return epoch;
+}
+
+std::vector<uint64_t> MemoryMap::DirtyPages(uint64_t since) const
+{
+  std::vector<uint64_t> pages;
+  if(since < first_epoch)
+  {
+    // Only the bitmaps still know what dropped epochs wrote
+    for(uint64_t i = 0; i < BitmapWords(); i++)
+    {
+      for(uint64_t word = dirty.Word(i) | written.Word(i); word != 0; word &= word - 1)
+      {
+        pages.push_back(i * 64 + std::countr_zero(word));
+      }
+    }
+    return pages;
+  }
+  for(const uint64_t i : dirty_words)
+  {
+    for(uint64_t word = dirty.Word(i); word != 0; word &= word - 1)
+    {
+      pages.push_back(i * 64 + std::countr_zero(word));
+    }
+  }
+  for(uint64_t e = since; e < epoch; e++)
+  {
+    const auto& closed = history[e - first_epoch];
+    pages.insert(pages.end(), closed.begin(), closed.end());
+  }
+  std::sort(pages.begin(), pages.end());
+  pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+  return pages;
+}
+
+bool MemoryMap::IsDirty(uint64_t addr, uint64_t since) const
+{
+  const uint64_t page = addr >> 12;
+  if(page >= BitmapWords() * 64)
+  {
+    return false;
+  }
+  if(dirty.Test(page))
+  {
+    return true;
+  }
+  if(since < first_epoch)
+  {
+    return written.Test(page);
+  }
+  for(uint64_t e = since; e < epoch; e++)
+  {
+    const auto& closed = history[e - first_epoch];
+    if(std::binary_search(closed.begin(), closed.end(), page))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+void MemoryMap::HoldEpoch(uint64_t since)
+{
+  held.insert(since);
+}
+
+void MemoryMap::ReleaseEpoch(uint64_t since)
+{
+  const auto it = held.find(since);
+  if(it != held.end())
+  {
+    held.erase(it);
+  }
+  DropHistory();
+}
+
+void MemoryMap::DropHistory()
+{
+  const uint64_t before = std::min(held.empty() ? epoch : *held.begin(), epoch);
+  if(before <= first_epoch)
+  {
+    return;
+  }
+  history.erase(history.begin(), history.begin() + (before - first_epoch));
+  first_epoch = before;
+}
@@ -1,172 +1,518 @@
 #include <mmu.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <iostream>
+#include <type_traits>
 #include "trap.h"
 
-void MMU::Load(uint64_t addr, int size, uint64_t& data)
+void MMU::LoadDevice(uint64_t physical_addr, int size, uint64_t& data)
 {
-  uint64_t physical_addr = Translate(addr);
-  if(ram.IsValidAddr(physical_addr))
+  if(uart.IsValidAddr(physical_addr))
   {
-    ram.Load(physical_addr, size, data);
+    uart.Load(physical_addr, size, data);
     return;
   }
-  else
+  else if(virtio.IsValidAddr(physical_addr))
+  {
+    virtio.Load(physical_addr, size, data);
+    return;
+  }
+  else if(clint.IsValidAddr(physical_addr))
+  {
+    clint.Load(physical_addr, size, data);
+    return;
+  }
+  else if(plic.IsValidAddr(physical_addr))
+  {
+    plic.Load(physical_addr, size, data);
+    return;
+  }
+  for(const auto& device : devices)
   {
-    if(uart.IsValidAddr(physical_addr))
+    if(device->IsValidAddr(physical_addr))
     {
-      uart.Load(physical_addr, size, data);
+      device->Load(physical_addr, size, data);
       return;
     }
-    else if(virtio.IsValidAddr(physical_addr))
+  }
+  throw CPUTrapException(trap_value::LoadAccessFault);
+}
+
+void MMU::StoreDevice(uint64_t physical_addr, int size, uint64_t data)
+{
+  if(uart.IsValidAddr(physical_addr))
+  {
+    uart.Store(physical_addr, size, data);
+    return;
+  }
+  else if(virtio.IsValidAddr(physical_addr))
+  {
+    virtio.Store(physical_addr, size, data);
+    return;
+  }
+  else if(clint.IsValidAddr(physical_addr))
+  {
+    clint.Store(physical_addr, size, data);
+    return;
+  }
+  else if(plic.IsValidAddr(physical_addr))
+  {
+    plic.Store(physical_addr, size, data);
+    return;
+  }
+  for(const auto& device : devices)
+  {
+    if(device->IsValidAddr(physical_addr))
     {
-      virtio.Load(physical_addr, size, data);
+      device->Store(physical_addr, size, data);
       return;
     }
-    else if(clint.IsValidAddr(physical_addr))
+  }
+  throw CPUTrapException(trap_value::StoreAMOAccessFault);
+}
+
+void MMU::AddDevice(std::unique_ptr<BaseDevice> device)
+{
+  const uint64_t base = device->GetBaseAddr();
+  const uint64_t end = base + device->GetSize();
+  const auto overlaps = [&](uint64_t other_base, uint64_t other_size)
+  {
+    return base < other_base + other_size && other_base < end;
+  };
+  bool taken = false;
+  for(RAM& region : memory.GetRegions())
+  {
+    taken |= overlaps(region.GetBaseAddr(), region.GetSize());
+  }
+  for(BaseDevice* other : GetDevices())
+  {
+    taken |= overlaps(other->GetBaseAddr(), other->GetSize());
+  }
+  for(const auto& other : devices)
+  {
+    taken |= overlaps(other->GetBaseAddr(), other->GetSize());
+  }
+  if(end <= base || taken)
+  {
+    throw std::runtime_error("Device overlaps memory or another device");
+  }
+  devices.push_back(std::move(device));
+}
+
+// Bulk accesses bypass the per-access watchpoint checks, so they are refused while any is armed
+uint8_t* MMU::GetHostPage(uint64_t addr, AccessType type)
+{
+  if(watch_enabled)
+  {
+    return nullptr;
+  }
+  const uint64_t physical_page = Translate(addr, type) & ~static_cast<uint64_t>(PAGE_SIZE - 1);
+  uint8_t* host = memory.HostAddress(physical_page, type == AccessType::Store);
+  if(host != nullptr && type == AccessType::Store)
+  {
+    memory.MarkDirty(physical_page, PAGE_SIZE);
+  }
+  return host;
+}
+
+void MMU::AddWatchpoint(uint64_t addr, uint64_t len, bool on_load, bool on_store)
+{
+  watchpoints.push_back(Watchpoint{.addr = addr, .len = len, .on_load = on_load, .on_store = on_store});
+  watch_enabled = true;
+}
+
+bool MMU::RemoveWatchpoint(uint64_t addr, uint64_t len, bool on_load, bool on_store)
+{
+  for(auto it = watchpoints.begin(); it != watchpoints.end(); it++)
+  {
+    if(it->addr == addr && it->len == len && it->on_load == on_load && it->on_store == on_store)
     {
-      clint.Load(physical_addr, size, data);
-      return;
+      watchpoints.erase(it);
+      watch_enabled = !watchpoints.empty();
+      return true;
     }
-    else if(plic.IsValidAddr(physical_addr))
+  }
+  return false;
+}
+
+bool MMU::TakeWatchHit(uint64_t& addr, Watchpoint& watchpoint)
+{
+  if(!watch_hit)
+  {
+    return false;
+  }
+  addr = watch_hit_addr;
+  watchpoint = watch_hit_point;
+  watch_hit = false;
+  return true;
+}
+
+// Records the hit and lets the access complete, the debugger reports it after the step
+void MMU::CheckWatchpoints(uint64_t addr, int size, AccessType type)
+{
+  for(const auto& wp : watchpoints)
+  {
+    const bool matches_type = (type == AccessType::Load) ? wp.on_load : wp.on_store;
+    if(matches_type && addr < wp.addr + wp.len && wp.addr < addr + size)
     {
-      plic.Load(physical_addr, size, data);
+      watch_hit = true;
+      watch_hit_addr = addr;
+      watch_hit_point = wp;
       return;
     }
-    else if(virtio.IsValidAddr(physical_addr))
+  }
+}
+
+void MMU::SetAccessControl(PrivilegeMode mode, PrivilegeMode data_mode, bool sum, bool mxr)
+{
+  privilege_mode = mode;
+  data_privilege_mode = data_mode;
+  UpdatePhysical();
+  // U-mode only reaches user pages, S-mode only the others unless SUM opens user pages to its loads and stores
+  const auto owner = [sum](PrivilegeMode access_mode, bool data) -> uint16_t
+  {
+    switch(access_mode)
     {
-      virtio.Load(physical_addr, size, data);
-      return;
+      case USER:
+        return pte_user;
+      case SUPERVISOR:
+        return (data && sum) ? 0 : pte_supervisor;
+      default:
+        return 0;
     }
-  throw CPUTrapException(trap_value::LoadAccessFault);
+  };
+  required[AccessType::Execute] = pte_execute | pte_accessed | owner(mode, false)
+                                  | (mode == MACHINE ? pmp_machine_execute : pmp_execute);
+  required[AccessType::Load] = (mxr ? pte_mxr_readable : pte_read) | pte_accessed | owner(data_mode, true)
+                               | (data_mode == MACHINE ? pmp_machine_read : pmp_read);
+  required[AccessType::Store] = pte_write | pte_accessed | pte_dirty | owner(data_mode, true)
+                                | (data_mode == MACHINE ? pmp_machine_write : pmp_write);
+}
+
+void MMU::UpdatePhysical()
+{
+  physical[AccessType::Execute] = paging_mode == Bare || privilege_mode == MACHINE;
+  physical[AccessType::Load] = paging_mode == Bare || data_privilege_mode == MACHINE;
+  physical[AccessType::Store] = physical[AccessType::Load];
+}
+
+uint64_t MMU::Translate(uint64_t virtual_addr, AccessType type)
+{
+  switch(type)
+  {
+    case AccessType::Execute:
+      return Translate<Translation::Dynamic, AccessType::Execute>(virtual_addr);
+    case AccessType::Store:
+      return Translate<Translation::Dynamic, AccessType::Store>(virtual_addr);
+    default:
+      return Translate<Translation::Dynamic, AccessType::Load>(virtual_addr);
   }
 }
 
-void MMU::Store(uint64_t addr, int size, uint64_t data)
+static trap_value PageFault(AccessType type)
 {
-  uint64_t physical_addr = Translate(addr);
-  if(ram.IsValidAddr(physical_addr))
+  return type == AccessType::Execute ? InstructionPageFault : (type == AccessType::Load ? LoadPageFault : StoreAMOPageFault);
+}
+
+static trap_value AccessFault(AccessType type)
+{
+  return type == AccessType::Execute ? InstructionAccessFault
+                                     : (type == AccessType::Load ? LoadAccessFault : StoreAMOAccessFault);
+}
+
+uint64_t MMU::MapPhysical(uint64_t physical_addr, AccessType type)
+{
+  // Every page table bit, so only the PMP grant decides
+  constexpr uint16_t identity = pte_valid | pte_read | pte_write | pte_execute | pte_user | pte_accessed | pte_dirty
+                                | pte_supervisor | pte_mxr_readable;
+  bool uniform;
+  const uint16_t grant = CheckPmp(physical_addr, 12, type, uniform);
+  if(uniform)
   {
-    ram.Store(physical_addr, size, data);
-    return;
+    tlb.Insert(physical_addr, physical_addr, 0, identity | grant);
   }
-  else
+  return physical_addr;
+}
+
+uint64_t MMU::CheckPhysical(uint64_t physical_addr, AccessType type) const
+{
+  bool uniform;
+  CheckPmp(physical_addr, 12, type, uniform);
+  return physical_addr;
+}
+
+uint16_t MMU::CheckPmp(uint64_t physical_addr, int shift, AccessType type, bool& uniform) const
+{
+  const uint16_t grant = pmp.Grant(physical_addr, shift, uniform);
+  if((grant & required[type] & pmp_all) != (required[type] & pmp_all))
+  {
+    throw CPUTrapException(AccessFault(type));
+  }
+  return grant;
+}
+
+void MMU::CheckTablePmp(uint64_t physical_addr, uint16_t grant, AccessType type) const
+{
+  bool uniform;
+  if((pmp.Grant(physical_addr, 12, uniform) & grant) == 0)
+  {
+    throw CPUTrapException(AccessFault(type));
+  }
+}
+
+// Sets bits in the PTE at pte_addr with a compare and swap, so harts walking the
+// same tables concurrently never lose each other's updates or a store by the
+// kernel. False if the PTE no longer holds pte. PTEs in ROM take an access fault.
+template<typename T>
+bool MMU::UpdateAccessedDirty(uint64_t pte_addr, T pte, T bits, AccessType type)
+{
+  uint8_t* host = memory.HostAddress(pte_addr, true);
+  if(host == nullptr)
+  {
+    throw CPUTrapException(AccessFault(type));
+  }
+  CheckTablePmp(pte_addr, pmp_write, type);
+  if(!std::atomic_ref<T>(*reinterpret_cast<T*>(host)).compare_exchange_strong(pte, pte | bits))
+  {
+    return false;
+  }
+  memory.MarkDirty(pte_addr, sizeof(T));
+  return true;
+}
+
+// Page table geometry of the paging modes the walker is instantiated for
+typedef struct PageTableFormat
+{
+  int levels;
+  int vpn_bits;      // virtual page number bits per level
+  int pte_size;      // bytes
+  uint64_t ppn_mask; // of the PTE shifted right by 10
+} PageTableFormat;
+
+static constexpr PageTableFormat FormatOf(PagingMode mode)
+{
+  switch(mode)
   {
-    if(uart.IsValidAddr(physical_addr))
+    case Sv32:
+      return PageTableFormat{.levels = 2, .vpn_bits = 10, .pte_size = 4, .ppn_mask = (1ULL << 22) - 1};
+    case Sv48:
+      return PageTableFormat{.levels = 4, .vpn_bits = 9, .pte_size = 8, .ppn_mask = (1ULL << 44) - 1};
+    case Sv57:
+      return PageTableFormat{.levels = 5, .vpn_bits = 9, .pte_size = 8, .ppn_mask = (1ULL << 44) - 1};
+    default:
+      return PageTableFormat{.levels = 3, .vpn_bits = 9, .pte_size = 8, .ppn_mask = (1ULL << 44) - 1};
+  }
+}
+
+uint64_t MMU::Walk(uint64_t virtual_addr, AccessType type)
+{
+  switch(paging_mode)
+  {
+    case Bare:
+      return MapPhysical(virtual_addr, type);
+    case Sv32:
+      return Walk<Sv32>(virtual_addr, type);
+    case Sv39:
+      return Walk<Sv39>(virtual_addr, type);
+    case Sv48:
+      return Walk<Sv48>(virtual_addr, type);
+    default:
+      return Walk<Sv57>(virtual_addr, type);
+  }
+}
+
+// Implements the Virtual Address Translation Algorithm from RISC-V Privileged ISA Manual
+template<PagingMode mode>
+uint64_t MMU::Walk(uint64_t virtual_addr, AccessType type)
+{
+  constexpr PageTableFormat format = FormatOf(mode);
+  if constexpr(mode != Sv32)
+  {
+    // The bits above the translated ones must all equal the highest of them
+    const int64_t upper = static_cast<int64_t>(virtual_addr) >> (11 + format.levels * format.vpn_bits);
+    if(upper != 0 && upper != -1)
     {
-      uart.Store(physical_addr, size, data);
-      return;
+      throw CPUTrapException(PageFault(type), virtual_addr);
     }
-    else if(virtio.IsValidAddr(physical_addr))
+  }
+  return ResumeWalk<mode, 0>(virtual_addr, type);
+}
+
+// Starts at the lowest table the walk cache holds for the address, at the root when it holds none
+template<PagingMode mode, int level>
+uint64_t MMU::ResumeWalk(uint64_t virtual_addr, AccessType type)
+{
+  constexpr PageTableFormat format = FormatOf(mode);
+  if constexpr(level == format.levels - 1)
+  {
+    uint8_t* root = memory.HostAddress(root_page_table << 12, false);
+    if(root == nullptr)
     {
-      virtio.Store(physical_addr, size, data);
-      return;
+      throw CPUTrapException(AccessFault(type));
     }
-    else if(clint.IsValidAddr(physical_addr))
+    CheckTablePmp(root_page_table << 12, pmp_read, type);
+    return WalkLevel<mode, level>(virtual_addr, root_page_table << 12, root, type);
+  }
+  else
+  {
+    const WalkCacheEntry* cached = walk_cache.Lookup(level, virtual_addr >> (12 + format.vpn_bits * (level + 1)));
+    if(cached != nullptr)
     {
-      clint.Store(physical_addr, size, data);
-      return;
+      return WalkLevel<mode, level>(virtual_addr, cached->table_addr, cached->table, type);
     }
-    else if(plic.IsValidAddr(physical_addr))
+    return ResumeWalk<mode, level + 1>(virtual_addr, type);
+  }
+}
+
+// One level per instantiation, so the walk unrolls into straight-line code.
+// Superpage leaves go into the TLB as single entries covering the whole page, an
+// Sv32 4 MB megapage as 2 MB entries for the half that was accessed.
+template<PagingMode mode, int level>
+uint64_t MMU::WalkLevel(uint64_t virtual_addr, uint64_t table_addr, uint8_t* table, AccessType type)
+{
+  constexpr PageTableFormat format = FormatOf(mode);
+  constexpr int shift = 12 + format.vpn_bits * level;
+  const uint64_t vpn = (virtual_addr >> shift) & ((1ULL << format.vpn_bits) - 1);
+  // Page tables live in physical memory, the walk itself is never translated. Other
+  // harts may update the entry concurrently, so it is read atomically.
+  typedef std::conditional_t<format.pte_size == 8, uint64_t, uint32_t> Pte;
+  Pte* const entry = reinterpret_cast<Pte*>(table + vpn * format.pte_size);
+  const uint64_t pte = std::atomic_ref<Pte>(*entry).load(std::memory_order_relaxed);
+  // Bits 63:54 are reserved without Svpbmt and Svnapot
+  const bool reserved = format.pte_size == 8 && (pte >> 54) != 0;
+  if((pte & pte_valid) == 0 || (pte & (pte_read | pte_write)) == pte_write || reserved)
+  {
+    throw CPUTrapException(PageFault(type), virtual_addr);
+  }
+  const uint64_t page_base = ((pte >> 10) & format.ppn_mask) << 12;
+  if((pte & (pte_read | pte_execute)) == 0)
+  {
+    // A, D and U are reserved in pointers to the next level
+    if constexpr(level == 0)
     {
-      plic.Store(physical_addr, size, data);
-      return;
+      throw CPUTrapException(PageFault(type), virtual_addr);
     }
-    else if(virtio.IsValidAddr(physical_addr))
+    else
     {
-      virtio.Store(physical_addr, size, data);
-      return;
+      if((pte & (pte_accessed | pte_dirty | pte_user)) != 0)
+      {
+        throw CPUTrapException(PageFault(type), virtual_addr);
+      }
+      uint8_t* next = memory.HostAddress(page_base, false);
+      if(next == nullptr)
+      {
+        throw CPUTrapException(AccessFault(type));
+      }
+      CheckTablePmp(page_base, pmp_read, type);
+      walk_cache.Insert(level - 1, virtual_addr >> shift, page_base, next);
+      return WalkLevel<mode, level - 1>(virtual_addr, page_base, next, type);
     }
-  throw CPUTrapException(trap_value::StoreAMOAccessFault);
   }
-}
 
-Sv39PageTableEntry MMU::ParsePageTableEntry(uint64_t pte)
-{
-  Sv39PageTableEntry entry;
-  entry.v = (pte >> 0) & 0x1;
-  entry.r = (pte >> 1) & 0x1;
-  entry.w = (pte >> 2) & 0x1;
-  entry.x = (pte >> 3) & 0x1;
-  entry.u = (pte >> 4) & 0x1;
-  entry.g = (pte >> 5) & 0x1;
-  entry.a = (pte >> 6) & 0x1;
-  entry.d = (pte >> 7) & 0x1;
-  entry.rsw = (pte >> 8) & 0x3;
-  entry.ppn0 = (pte >> 10) & 0x1FF;
-  entry.ppn1 = (pte >> 19) & 0x1FF;
-  entry.ppn2 = (pte >> 28) & 0x3FFFFFF;
-  entry.reserved = (pte >> 54) & 0x3FF;
-  return entry;
+  // A superpage leaf keeps the low VPN fields of the virtual address and must be aligned to its size
+  constexpr uint64_t page_mask = (1ULL << shift) - 1;
+  // Every leaf has R or X, so MXR makes any of them readable
+  uint16_t flags = (pte & 0xff) | ((pte & pte_user) ? 0 : pte_supervisor) | pte_mxr_readable;
+  const uint16_t missing = required[type] & ~flags;
+  if((page_base & page_mask) != 0 || (missing & ~(pte_accessed | pte_dirty | pmp_all)) != 0)
+  {
+    throw CPUTrapException(PageFault(type), virtual_addr);
+  }
+  const uint64_t physical_addr = page_base | (virtual_addr & page_mask);
+  // A superpage that PMP ranges split is cached as the 4 KB page that was used, and not at all if that is split too
+  bool uniform;
+  uint16_t grant = CheckPmp(physical_addr, shift, type, uniform);
+  int cached_level = level;
+  if(!uniform && level > 0)
+  {
+    grant = pmp.Grant(physical_addr, 12, uniform);
+    cached_level = 0;
+  }
+  // The access is allowed, A and D are set by hardware. Only then is the PTE written, and if it
+  // changed since it was read the level is walked again with the new value.
+  if((missing & (pte_accessed | pte_dirty)) != 0)
+  {
+    const Pte bits = pte_accessed | (type == AccessType::Store ? pte_dirty : 0);
+    if(!UpdateAccessedDirty<Pte>(table_addr + vpn * format.pte_size, static_cast<Pte>(pte), bits, type))
+    {
+      return WalkLevel<mode, level>(virtual_addr, table_addr, table, type);
+    }
+    flags |= bits;
+  }
+  if(uniform)
+  {
+    tlb.Insert(virtual_addr, physical_addr, cached_level, flags | grant);
+  }
+  return physical_addr;
 }
 
-// Implements the Virtual Address Translation Algorithm from RISC-V Privileged ISA Manual
-uint64_t MMU::Translate(uint64_t virtual_addr)
+// Walks the tables the way WalkLevel does but only follows them, whatever the
+// permissions, reserved bits or alignment of the leaf
+bool MMU::DebugTranslate(uint64_t virtual_addr, uint64_t& physical_addr) const
 {
-  if(paging_mode == Bare)
+  if(physical[AccessType::Execute])
   {
-    return virtual_addr;
+    physical_addr = virtual_addr;
+    return true;
   }
-  else if(paging_mode != Sv39)
+  const PageTableFormat format = FormatOf(paging_mode);
+  uint64_t table_addr = root_page_table << 12;
+  for(int level = format.levels - 1; level >= 0; level--)
   {
-    throw CPUTrapException(trap_value::InstructionPageFault);
+    const int shift = 12 + format.vpn_bits * level;
+    const uint64_t vpn = (virtual_addr >> shift) & ((1ULL << format.vpn_bits) - 1);
+    uint64_t pte = 0;
+    if(!memory.Load(table_addr + vpn * format.pte_size, format.pte_size, pte) || (pte & pte_valid) == 0)
+    {
+      return false;
+    }
+    const uint64_t page_base = ((pte >> 10) & format.ppn_mask) << 12;
+    if((pte & (pte_read | pte_execute)) != 0)
+    {
+      const uint64_t page_mask = (1ULL << shift) - 1;
+      physical_addr = (page_base & ~page_mask) | (virtual_addr & page_mask);
+      return true;
+    }
+    table_addr = page_base;
   }
+  return false;
+}
 
-  switch(privilege_mode)
+uint64_t MMU::DebugRead(uint64_t addr, uint8_t* dst, uint64_t len) const
+{
+  uint64_t done = 0;
+  while(done < len)
   {
-    case MACHINE: // TODO(jrola): implement machine mode memory protection
-    case SUPERVISOR:
-    case USER:
+    const uint64_t n = std::min(len - done, PAGE_SIZE - ((addr + done) & (PAGE_SIZE - 1)));
+    uint64_t physical_addr;
+    const uint8_t* host = DebugTranslate(addr + done, physical_addr) ? memory.HostAddress(physical_addr, false) : nullptr;
+    if(host == nullptr)
     {
-      std::array<uint64_t, 3> vpn = {
-        (virtual_addr >> 12) & 0x1FF,
-        (virtual_addr >> 21) & 0x1FF,
-        (virtual_addr >> 30) & 0x1FF
-      };
-      uint64_t offset = virtual_addr & 0xFFF;
-      int levels = vpn.size();
-      int i = levels - 1;
-
-      uint64_t a = root_page_table * page_size;
-      uint64_t pte_raw = 0;
-      Sv39PageTableEntry pte;
-
-      for(; i >= 0; i--)
-      {
-        Load(a + vpn[i] * 8, 8, pte_raw);
-        pte = ParsePageTableEntry(pte_raw);
-        if(pte.v == 0 || (pte.r == 0 && pte.w == 1))
-        {
-          throw CPUTrapException(trap_value::InstructionPageFault);
-        }
-        if(pte.r == 1 || pte.x == 1) // leaf page TODO(jrola): implement memory protection
-        {
-          break;
-        }
-        else if(i == 0) // no leaf page found
-        {
-          throw CPUTrapException(trap_value::InstructionPageFault);
-        }
-        a = (pte.ppn2 << 30) | (pte.ppn1 << 21) | (pte.ppn0 << 12) * page_size;
-      }
-      switch(i)
-      {
-        case 0:
-          return pte.ppn0 << 12 | offset;
-          break;
-        case 1:
-          return pte.ppn2 << 30 | (pte.ppn1 << 21) | (vpn[0] << 12) | offset;
-          break;
-        case 2:
-          return pte.ppn2 << 30 | (vpn[1] << 21) | (vpn[0] << 12) | offset;
-          break;
-        default:
-          throw CPUTrapException(trap_value::InstructionPageFault);
-          break;
-      }
-    }
       break;
-    default:
-      throw CPUTrapException(trap_value::InstructionPageFault);
+    }
+    std::memcpy(dst + done, host, n);
+    done += n;
+  }
+  return done;
+}
+
+uint64_t MMU::DebugWrite(uint64_t addr, const uint8_t* src, uint64_t len)
+{
+  uint64_t done = 0;
+  while(done < len)
+  {
+    const uint64_t n = std::min(len - done, PAGE_SIZE - ((addr + done) & (PAGE_SIZE - 1)));
+    uint64_t physical_addr;
+    uint8_t* host = DebugTranslate(addr + done, physical_addr) ? memory.HostAddress(physical_addr, false) : nullptr;
+    if(host == nullptr)
+    {
       break;
+    }
+    std::memcpy(host, src + done, n);
+    // Tracked like a guest store, so the block cache sees the new code
+    memory.MarkDirty(physical_addr, n);
+    done += n;
   }
+  return done;
 }
@@ -0,0 +1,85 @@
+#include "pmp.h"
+#include <bit>
+
+void Pmp::Update(const std::array<uint8_t, PMP_ENTRIES>& cfg, const std::array<uint64_t, PMP_ENTRIES>& addr)
+{
+  regions.clear();
+  active = false;
+  for(int i = 0; i < PMP_ENTRIES; i++)
+  {
+    uint64_t base = 0, end = 0;
+    switch((cfg[i] & pmpcfg_a) >> 3)
+    {
+      case pmp_off:
+        continue;
+      case pmp_tor:
+        base = i == 0 ? 0 : addr[i - 1] << 2;
+        end = addr[i] << 2;
+        break;
+      case pmp_na4:
+        base = addr[i] << 2;
+        end = base + 4;
+        break;
+      default:
+      {
+        // The trailing ones of pmpaddr give the size, 8 bytes for none
+        const int size_bits = std::countr_one(addr[i]) + 3;
+        base = (addr[i] << 2) & ~((1ULL << size_bits) - 1);
+        end = base + (1ULL << size_bits);
+        break;
+      }
+    }
+    active = true;
+    if(base < end)
+    {
+      regions.push_back(PmpRegion{.base = base, .end = end, .cfg = cfg[i]});
+    }
+  }
+}
+
+// M-mode is only held to locked entries, S/U-mode to all of them, and to no access where none matches
+uint16_t Pmp::GrantOf(const PmpRegion* region)
+{
+  if(region == nullptr)
+  {
+    return pmp_machine_read | pmp_machine_write | pmp_machine_execute;
+  }
+  const uint16_t grant = ((region->cfg & pmpcfg_r) ? pmp_read : 0) | ((region->cfg & pmpcfg_w) ? pmp_write : 0)
+                         | ((region->cfg & pmpcfg_x) ? pmp_execute : 0);
+  const uint16_t machine = (region->cfg & pmpcfg_l) ? grant << 3
+                                                     : pmp_machine_read | pmp_machine_write | pmp_machine_execute;
+  return grant | machine;
+}
+
+uint16_t Pmp::Grant(uint64_t addr, int shift, bool& uniform) const
+{
+  uniform = true;
+  if(!active)
+  {
+    return pmp_all;
+  }
+  const uint64_t block = addr & ~((1ULL << shift) - 1);
+  const uint64_t block_end = block + (1ULL << shift);
+  for(const PmpRegion& region : regions)
+  {
+    if(region.base >= block_end || region.end <= block)
+    {
+      continue;
+    }
+    // The first range reaching into the block decides for all of it only if it covers it
+    if(region.base <= block && region.end >= block_end)
+    {
+      return GrantOf(&region);
+    }
+    uniform = false;
+    for(const PmpRegion& at : regions)
+    {
+      if(addr >= at.base && addr < at.end)
+      {
+        return GrantOf(&at);
+      }
+    }
+    return GrantOf(nullptr);
+  }
+  return GrantOf(nullptr);
+}
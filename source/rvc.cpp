@@ -0,0 +1,302 @@
+#include "rvc.h"
+#include "trap.h"
+
+// Base opcodes the compressed instructions expand into
+enum Opcode : uint32_t
+{
+  LOAD = 0x03,
+  LOAD_FP = 0x07,
+  OP_IMM = 0x13,
+  OP_IMM_32 = 0x1b,
+  STORE = 0x23,
+  STORE_FP = 0x27,
+  OP = 0x33,
+  LUI = 0x37,
+  OP_32 = 0x3b,
+  BRANCH = 0x63,
+  JALR = 0x67,
+  JAL = 0x6f,
+  SYSTEM = 0x73
+};
+
+// Extracts instruction bits [hi:lo] and places them at dest
+static constexpr uint32_t bits(uint32_t instruction, int hi, int lo, int dest = 0)
+{
+  return ((instruction >> lo) & ((1U << (hi - lo + 1)) - 1)) << dest;
+}
+
+static constexpr int32_t sign_extend(uint32_t val, int width)
+{
+  return static_cast<int32_t>(val << (32 - width)) >> (32 - width);
+}
+
+// 32-bit encoders
+
+static constexpr uint32_t EncodeR(uint32_t opcode, uint32_t rd, uint32_t funct3, uint32_t rs1, uint32_t rs2, uint32_t funct7)
+{
+  return (funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+
+static constexpr uint32_t EncodeI(uint32_t opcode, uint32_t rd, uint32_t funct3, uint32_t rs1, int32_t imm)
+{
+  return ((static_cast<uint32_t>(imm) & 0xfff) << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+
+static constexpr uint32_t EncodeS(uint32_t opcode, uint32_t funct3, uint32_t rs1, uint32_t rs2, int32_t imm)
+{
+  const auto u = static_cast<uint32_t>(imm);
+  return bits(u, 11, 5, 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | bits(u, 4, 0, 7) | opcode;
+}
+
+static constexpr uint32_t EncodeB(uint32_t funct3, uint32_t rs1, uint32_t rs2, int32_t imm)
+{
+  const auto u = static_cast<uint32_t>(imm);
+  return bits(u, 12, 12, 31) | bits(u, 10, 5, 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12)
+       | bits(u, 4, 1, 8) | bits(u, 11, 11, 7) | BRANCH;
+}
+
+static constexpr uint32_t EncodeU(uint32_t opcode, uint32_t rd, int32_t imm)
+{
+  return (static_cast<uint32_t>(imm) & 0xfffff000) | (rd << 7) | opcode;
+}
+
+static constexpr uint32_t EncodeJ(uint32_t rd, int32_t imm)
+{
+  const auto u = static_cast<uint32_t>(imm);
+  return bits(u, 20, 20, 31) | bits(u, 10, 1, 21) | bits(u, 11, 11, 20) | bits(u, 19, 12, 12) | (rd << 7) | JAL;
+}
+
+[[noreturn]] static void Illegal()
+{
+  throw CPUTrapException(trap_value::IllegalInstruction);
+}
+
+// Quadrant 0: stack-pointer based addi and register-based loads and stores on x8-x15
+template<int xlen>
+static uint32_t ExpandQuadrant0(uint32_t c)
+{
+  const uint32_t rd = bits(c, 4, 2) + 8;
+  const uint32_t rs1 = bits(c, 9, 7) + 8;
+  const uint32_t rs2 = rd;
+  const uint32_t offset_w = bits(c, 12, 10, 3) | bits(c, 6, 6, 2) | bits(c, 5, 5, 6);
+  const uint32_t offset_d = bits(c, 12, 10, 3) | bits(c, 6, 5, 6);
+
+  switch(bits(c, 15, 13))
+  {
+    case 0b000: // C.ADDI4SPN
+    {
+      const uint32_t imm = bits(c, 12, 11, 4) | bits(c, 10, 7, 6) | bits(c, 6, 6, 2) | bits(c, 5, 5, 3);
+      if(imm == 0)
+      {
+        Illegal();
+      }
+      return EncodeI(OP_IMM, rd, 0b000, 2, imm);
+    }
+    case 0b001: // C.FLD
+      return EncodeI(LOAD_FP, rd, 0b011, rs1, offset_d);
+    case 0b010: // C.LW
+      return EncodeI(LOAD, rd, 0b010, rs1, offset_w);
+    case 0b011: // C.LD, C.FLW on RV32 where there is no F
+      if(xlen == 32)
+      {
+        Illegal();
+      }
+      return EncodeI(LOAD, rd, 0b011, rs1, offset_d);
+    case 0b101: // C.FSD
+      return EncodeS(STORE_FP, 0b011, rs1, rs2, offset_d);
+    case 0b110: // C.SW
+      return EncodeS(STORE, 0b010, rs1, rs2, offset_w);
+    case 0b111: // C.SD, C.FSW on RV32
+      if(xlen == 32)
+      {
+        Illegal();
+      }
+      return EncodeS(STORE, 0b011, rs1, rs2, offset_d);
+    default:
+      Illegal();
+  }
+}
+
+// Quadrant 1: immediates, arithmetic on x8-x15, jumps and branches
+template<int xlen>
+static uint32_t ExpandQuadrant1(uint32_t c)
+{
+  const uint32_t rd = bits(c, 11, 7);
+  const uint32_t rd_c = bits(c, 9, 7) + 8;
+  const uint32_t rs2_c = bits(c, 4, 2) + 8;
+  const int32_t imm6 = sign_extend(bits(c, 12, 12, 5) | bits(c, 6, 2), 6);
+  const uint32_t shamt = bits(c, 12, 12, 5) | bits(c, 6, 2);
+  const int32_t jump_offset = sign_extend(bits(c, 12, 12, 11) | bits(c, 11, 11, 4) | bits(c, 10, 9, 8)
+                                          | bits(c, 8, 8, 10) | bits(c, 7, 7, 6) | bits(c, 6, 6, 7)
+                                          | bits(c, 5, 3, 1) | bits(c, 2, 2, 5), 12);
+
+  switch(bits(c, 15, 13))
+  {
+    case 0b000: // C.ADDI, C.NOP
+      return EncodeI(OP_IMM, rd, 0b000, rd, imm6);
+    case 0b001: // C.ADDIW, C.JAL on RV32
+      if(xlen == 32)
+      {
+        return EncodeJ(1, jump_offset);
+      }
+      if(rd == 0)
+      {
+        Illegal();
+      }
+      return EncodeI(OP_IMM_32, rd, 0b000, rd, imm6);
+    case 0b010: // C.LI
+      return EncodeI(OP_IMM, rd, 0b000, 0, imm6);
+    case 0b011:
+    {
+      if(rd == 2) // C.ADDI16SP
+      {
+        const int32_t imm = sign_extend(bits(c, 12, 12, 9) | bits(c, 6, 6, 4) | bits(c, 5, 5, 6)
+                                        | bits(c, 4, 3, 7) | bits(c, 2, 2, 5), 10);
+        if(imm == 0)
+        {
+          Illegal();
+        }
+        return EncodeI(OP_IMM, 2, 0b000, 2, imm);
+      }
+      // C.LUI
+      if(imm6 == 0)
+      {
+        Illegal();
+      }
+      return EncodeU(LUI, rd, imm6 << 12);
+    }
+    case 0b100:
+    {
+      switch(bits(c, 11, 10))
+      {
+        case 0b00: // C.SRLI
+          return EncodeI(OP_IMM, rd_c, 0b101, rd_c, shamt);
+        case 0b01: // C.SRAI
+          return EncodeI(OP_IMM, rd_c, 0b101, rd_c, 0x400 | shamt);
+        case 0b10: // C.ANDI
+          return EncodeI(OP_IMM, rd_c, 0b111, rd_c, imm6);
+        default:
+          break;
+      }
+      const uint32_t op = bits(c, 6, 5);
+      if(bits(c, 12, 12) == 0)
+      {
+        switch(op)
+        {
+          case 0b00: // C.SUB
+            return EncodeR(OP, rd_c, 0b000, rd_c, rs2_c, 0x20);
+          case 0b01: // C.XOR
+            return EncodeR(OP, rd_c, 0b100, rd_c, rs2_c, 0x00);
+          case 0b10: // C.OR
+            return EncodeR(OP, rd_c, 0b110, rd_c, rs2_c, 0x00);
+          default: // C.AND
+            return EncodeR(OP, rd_c, 0b111, rd_c, rs2_c, 0x00);
+        }
+      }
+      switch(op)
+      {
+        case 0b00: // C.SUBW
+          return EncodeR(OP_32, rd_c, 0b000, rd_c, rs2_c, 0x20);
+        case 0b01: // C.ADDW
+          return EncodeR(OP_32, rd_c, 0b000, rd_c, rs2_c, 0x00);
+        default:
+          Illegal();
+      }
+    }
+    case 0b101: // C.J
+      return EncodeJ(0, jump_offset);
+    default: // C.BEQZ, C.BNEZ
+    {
+      const int32_t offset = sign_extend(bits(c, 12, 12, 8) | bits(c, 11, 10, 3) | bits(c, 6, 5, 6)
+                                         | bits(c, 4, 3, 1) | bits(c, 2, 2, 5), 9);
+      return EncodeB(bits(c, 13, 13), rd_c, 0, offset);
+    }
+  }
+}
+
+// Quadrant 2: stack-pointer based loads and stores, register moves, jumps
+template<int xlen>
+static uint32_t ExpandQuadrant2(uint32_t c)
+{
+  const uint32_t rd = bits(c, 11, 7);
+  const uint32_t rs1 = rd;
+  const uint32_t rs2 = bits(c, 6, 2);
+  const uint32_t shamt = bits(c, 12, 12, 5) | bits(c, 6, 2);
+  const uint32_t offset_lwsp = bits(c, 12, 12, 5) | bits(c, 6, 4, 2) | bits(c, 3, 2, 6);
+  const uint32_t offset_ldsp = bits(c, 12, 12, 5) | bits(c, 6, 5, 3) | bits(c, 4, 2, 6);
+  const uint32_t offset_swsp = bits(c, 12, 9, 2) | bits(c, 8, 7, 6);
+  const uint32_t offset_sdsp = bits(c, 12, 10, 3) | bits(c, 9, 7, 6);
+
+  switch(bits(c, 15, 13))
+  {
+    case 0b000: // C.SLLI
+      return EncodeI(OP_IMM, rd, 0b001, rd, shamt);
+    case 0b001: // C.FLDSP
+      return EncodeI(LOAD_FP, rd, 0b011, 2, offset_ldsp);
+    case 0b010: // C.LWSP
+      if(rd == 0)
+      {
+        Illegal();
+      }
+      return EncodeI(LOAD, rd, 0b010, 2, offset_lwsp);
+    case 0b011: // C.LDSP, C.FLWSP on RV32
+      if(rd == 0 || xlen == 32)
+      {
+        Illegal();
+      }
+      return EncodeI(LOAD, rd, 0b011, 2, offset_ldsp);
+    case 0b100:
+    {
+      if(bits(c, 12, 12) == 0)
+      {
+        if(rs2 == 0) // C.JR
+        {
+          if(rs1 == 0)
+          {
+            Illegal();
+          }
+          return EncodeI(JALR, 0, 0b000, rs1, 0);
+        }
+        return EncodeR(OP, rd, 0b000, 0, rs2, 0x00); // C.MV
+      }
+      if(rs2 == 0)
+      {
+        if(rs1 == 0) // C.EBREAK
+        {
+          return EncodeI(SYSTEM, 0, 0b000, 0, 1);
+        }
+        return EncodeI(JALR, 1, 0b000, rs1, 0); // C.JALR
+      }
+      return EncodeR(OP, rd, 0b000, rd, rs2, 0x00); // C.ADD
+    }
+    case 0b101: // C.FSDSP
+      return EncodeS(STORE_FP, 0b011, 2, rs2, offset_sdsp);
+    case 0b110: // C.SWSP
+      return EncodeS(STORE, 0b010, 2, rs2, offset_swsp);
+    default: // C.SDSP, C.FSWSP on RV32
+      if(xlen == 32)
+      {
+        Illegal();
+      }
+      return EncodeS(STORE, 0b011, 2, rs2, offset_sdsp);
+  }
+}
+
+template<int xlen>
+uint32_t ExpandCompressed(uint16_t instruction)
+{
+  switch(instruction & 0x3)
+  {
+    case 0b00:
+      return ExpandQuadrant0<xlen>(instruction);
+    case 0b01:
+      return ExpandQuadrant1<xlen>(instruction);
+    case 0b10:
+      return ExpandQuadrant2<xlen>(instruction);
+    default:
+      Illegal();
+  }
+}
+
+template uint32_t ExpandCompressed<32>(uint16_t instruction);
+template uint32_t ExpandCompressed<64>(uint16_t instruction);
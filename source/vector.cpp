@@ -0,0 +1,1400 @@
+#include "cpu.h"
+#include "instruction.h"
+#include "fpu.h"
+#include "vector.h"
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// V extension
+//
+// Arithmetic works on whole register groups. Unmasked operations starting at
+// element 0 run through AVX2 kernels when the host supports them; masked
+// elements, a non-zero vstart and widths without an AVX2 instruction fall back
+// to scalar loops. Tail and inactive elements are left undisturbed, which is a
+// valid implementation of both the agnostic and undisturbed policies.
+// Unit-stride accesses copy straight between host RAM and the register file
+// one page at a time, strided accesses reuse the host page between elements.
+
+// VTYPE AND OPERANDS
+
+static inline uint64_t Sew(const VectorState& v) { return 8ULL << ((v.vtype >> 3) & 0x7); }
+
+// log2(LMUL), -3 to 3
+static inline int LmulLog2(uint64_t vtype)
+{
+  const int vlmul = vtype & 0x7;
+  return vlmul < 4 ? vlmul : vlmul - 8;
+}
+
+// VLMAX for a vtype, 0 when the vtype is unsupported
+static uint64_t Vlmax(uint64_t vtype)
+{
+  const int vsew = (vtype >> 3) & 0x7;
+  const int lmul = LmulLog2(vtype);
+  if((vtype >> 8) != 0 || vsew > 3 || (vtype & 0x7) == 4)
+  {
+    return 0;
+  }
+  // SEW may not exceed LMUL * ELEN
+  if(3 + vsew > 6 + std::min(lmul, 0))
+  {
+    return 0;
+  }
+  return (static_cast<uint64_t>(VLEN) << (lmul + 3)) >> (vsew + 6);
+}
+
+[[noreturn]] static void Illegal()
+{
+  throw CPUTrapException(trap_value::IllegalInstruction);
+}
+
+static inline uint8_t* Group(VectorState& v, uint32_t reg) { return v.regs + reg * VLENB; }
+
+static inline bool MaskBit(const VectorState& v, uint64_t i) { return (v.regs[i / 8] >> (i % 8)) & 1; }
+
+template<typename T>
+static inline T Elem(const uint8_t* group, uint64_t i)
+{
+  T val;
+  std::memcpy(&val, group + i * sizeof(T), sizeof(T));
+  return val;
+}
+
+template<typename T>
+static inline void SetElem(uint8_t* group, uint64_t i, T val)
+{
+  std::memcpy(group + i * sizeof(T), &val, sizeof(T));
+}
+
+// Scalar operands arrive as raw register bits
+template<typename T>
+static inline T FromBits(uint64_t bits)
+{
+  if constexpr (std::is_same_v<T, float>)
+  {
+    return std::bit_cast<float>(static_cast<uint32_t>(bits));
+  }
+  else if constexpr (std::is_same_v<T, double>)
+  {
+    return std::bit_cast<double>(bits);
+  }
+  else
+  {
+    return static_cast<T>(bits);
+  }
+}
+
+// Register groups must be aligned to their EMUL
+static inline void CheckGroup(uint32_t reg, int emul_log2)
+{
+  if(emul_log2 > 0 && (reg & ((1U << emul_log2) - 1)) != 0)
+  {
+    Illegal();
+  }
+}
+
+typedef struct VFields
+{
+  uint32_t vd;
+  uint32_t vs1;
+  uint32_t vs2;
+  uint32_t funct6;
+  bool masked;
+} VFields;
+
+static inline VFields ParseV(const uint32_t instruction)
+{
+  return VFields{.vd = mask<7, 11>(instruction),
+                 .vs1 = mask<15, 19>(instruction),
+                 .vs2 = mask<20, 24>(instruction),
+                 .funct6 = mask<26, 31>(instruction),
+                 .masked = mask<25, 25>(instruction) == 0};
+}
+
+// Second operand, a register group or a scalar broadcast to every element when group is null
+typedef struct VSource
+{
+  const uint8_t* group;
+  uint64_t scalar;
+} VSource;
+
+static VectorState& BeginOp(CPU& cpu)
+{
+  cpu.RequireVector();
+  VectorState& v = cpu.GetVector();
+  if(v.vtype & vtype_vill)
+  {
+    Illegal();
+  }
+  cpu.MarkVectorDirty();
+  return v;
+}
+
+// ELEMENT OPERATIONS
+
+enum class VOp
+{
+  Add, Sub, RSub, And, Or, Xor, MinU, Min, MaxU, Max, Sll, Srl, Sra, Mul,
+  FAdd, FSub, FRSub, FMul, FDiv, FRDiv, FMin, FMax, FMacc, FNMacc, FMsac, FNMsac
+};
+
+enum class VCmp { Eq, Ne, LtU, Lt, LeU, Le, GtU, Gt };
+
+// a is the vs2 element, b the vs1 element or scalar, c the old vd element
+template<typename T, VOp op>
+static inline T ScalarOp(T a, T b, T c)
+{
+  if constexpr (std::is_floating_point_v<T>)
+  {
+    T result;
+    if constexpr (op == VOp::FAdd)
+    {
+      result = a + b;
+    }
+    else if constexpr (op == VOp::FSub)
+    {
+      result = a - b;
+    }
+    else if constexpr (op == VOp::FRSub)
+    {
+      result = b - a;
+    }
+    else if constexpr (op == VOp::FMul)
+    {
+      result = a * b;
+    }
+    else if constexpr (op == VOp::FDiv)
+    {
+      result = a / b;
+    }
+    else if constexpr (op == VOp::FRDiv)
+    {
+      result = b / a;
+    }
+    else if constexpr (op == VOp::FMin || op == VOp::FMax)
+    {
+      result = MinMax(a, b, op == VOp::FMax);
+    }
+    else if constexpr (op == VOp::FMacc)
+    {
+      result = std::fma(b, a, c);
+    }
+    else if constexpr (op == VOp::FNMacc)
+    {
+      result = std::fma(-b, a, -c);
+    }
+    else if constexpr (op == VOp::FMsac)
+    {
+      result = std::fma(b, a, -c);
+    }
+    else if constexpr (op == VOp::FNMsac)
+    {
+      result = std::fma(-b, a, c);
+    }
+    else
+    {
+      static_assert(op != op, "not a floating point operation");
+    }
+    return std::isnan(result) ? std::bit_cast<T>(FpTraits<T>::canonical_nan) : result;
+  }
+  else
+  {
+    using S = std::make_signed_t<T>;
+    constexpr T shift_mask = sizeof(T) * 8 - 1;
+    if constexpr (op == VOp::Add)
+    {
+      return static_cast<T>(a + b);
+    }
+    else if constexpr (op == VOp::Sub)
+    {
+      return static_cast<T>(a - b);
+    }
+    else if constexpr (op == VOp::RSub)
+    {
+      return static_cast<T>(b - a);
+    }
+    else if constexpr (op == VOp::And)
+    {
+      return a & b;
+    }
+    else if constexpr (op == VOp::Or)
+    {
+      return a | b;
+    }
+    else if constexpr (op == VOp::Xor)
+    {
+      return a ^ b;
+    }
+    else if constexpr (op == VOp::MinU)
+    {
+      return std::min(a, b);
+    }
+    else if constexpr (op == VOp::Min)
+    {
+      return static_cast<T>(std::min(static_cast<S>(a), static_cast<S>(b)));
+    }
+    else if constexpr (op == VOp::MaxU)
+    {
+      return std::max(a, b);
+    }
+    else if constexpr (op == VOp::Max)
+    {
+      return static_cast<T>(std::max(static_cast<S>(a), static_cast<S>(b)));
+    }
+    else if constexpr (op == VOp::Sll)
+    {
+      return static_cast<T>(a << (b & shift_mask));
+    }
+    else if constexpr (op == VOp::Srl)
+    {
+      return static_cast<T>(a >> (b & shift_mask));
+    }
+    else if constexpr (op == VOp::Sra)
+    {
+      return static_cast<T>(static_cast<S>(a) >> (b & shift_mask));
+    }
+    else if constexpr (op == VOp::Mul)
+    {
+      return static_cast<T>(static_cast<uint64_t>(a) * b);
+    }
+    else
+    {
+      static_assert(op != op, "not an integer operation");
+    }
+  }
+}
+
+// AVX2 KERNELS
+
+#if defined(__x86_64__)
+#define VECTOR_SIMD 1
+#define AVX2 __attribute__((target("avx2,fma")))
+
+static bool HostHasAvx2()
+{
+  static const bool supported = [] {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  }();
+  return supported;
+}
+
+// Whether AVX2 has an instruction for op at this element width
+template<typename T, VOp op>
+static constexpr bool HasAvx2Kernel()
+{
+  constexpr size_t w = sizeof(T);
+  if constexpr (std::is_floating_point_v<T>)
+  {
+    return op == VOp::FAdd || op == VOp::FSub || op == VOp::FRSub || op == VOp::FMul || op == VOp::FDiv
+        || op == VOp::FRDiv || op == VOp::FMacc || op == VOp::FNMacc || op == VOp::FMsac || op == VOp::FNMsac;
+  }
+  else
+  {
+    switch(op)
+    {
+      case VOp::Add:
+      case VOp::Sub:
+      case VOp::RSub:
+      case VOp::And:
+      case VOp::Or:
+      case VOp::Xor:
+        return true;
+      case VOp::MinU:
+      case VOp::Min:
+      case VOp::MaxU:
+      case VOp::Max:
+        return w < 8;
+      case VOp::Sll:
+      case VOp::Srl:
+        return w >= 4;
+      case VOp::Sra:
+        return w == 4;
+      case VOp::Mul:
+        return w == 2 || w == 4;
+      default:
+        return false;
+    }
+  }
+}
+
+template<size_t w>
+AVX2 static inline __m256i Avx2Add(__m256i a, __m256i b)
+{
+  if constexpr (w == 1) { return _mm256_add_epi8(a, b); }
+  else if constexpr (w == 2) { return _mm256_add_epi16(a, b); }
+  else if constexpr (w == 4) { return _mm256_add_epi32(a, b); }
+  else { return _mm256_add_epi64(a, b); }
+}
+
+template<size_t w>
+AVX2 static inline __m256i Avx2Sub(__m256i a, __m256i b)
+{
+  if constexpr (w == 1) { return _mm256_sub_epi8(a, b); }
+  else if constexpr (w == 2) { return _mm256_sub_epi16(a, b); }
+  else if constexpr (w == 4) { return _mm256_sub_epi32(a, b); }
+  else { return _mm256_sub_epi64(a, b); }
+}
+
+template<size_t w, bool is_signed, bool is_max>
+AVX2 static inline __m256i Avx2MinMax(__m256i a, __m256i b)
+{
+  if constexpr (w == 1)
+  {
+    if constexpr (is_signed) { return is_max ? _mm256_max_epi8(a, b) : _mm256_min_epi8(a, b); }
+    else { return is_max ? _mm256_max_epu8(a, b) : _mm256_min_epu8(a, b); }
+  }
+  else if constexpr (w == 2)
+  {
+    if constexpr (is_signed) { return is_max ? _mm256_max_epi16(a, b) : _mm256_min_epi16(a, b); }
+    else { return is_max ? _mm256_max_epu16(a, b) : _mm256_min_epu16(a, b); }
+  }
+  else
+  {
+    if constexpr (is_signed) { return is_max ? _mm256_max_epi32(a, b) : _mm256_min_epi32(a, b); }
+    else { return is_max ? _mm256_max_epu32(a, b) : _mm256_min_epu32(a, b); }
+  }
+}
+
+template<VOp op>
+AVX2 static inline __m256 Avx2FloatOp(__m256 a, __m256 b, __m256 c)
+{
+  __m256 result;
+  if constexpr (op == VOp::FAdd) { result = _mm256_add_ps(a, b); }
+  else if constexpr (op == VOp::FSub) { result = _mm256_sub_ps(a, b); }
+  else if constexpr (op == VOp::FRSub) { result = _mm256_sub_ps(b, a); }
+  else if constexpr (op == VOp::FMul) { result = _mm256_mul_ps(a, b); }
+  else if constexpr (op == VOp::FDiv) { result = _mm256_div_ps(a, b); }
+  else if constexpr (op == VOp::FRDiv) { result = _mm256_div_ps(b, a); }
+  else if constexpr (op == VOp::FMacc) { result = _mm256_fmadd_ps(b, a, c); }
+  else if constexpr (op == VOp::FNMacc) { result = _mm256_fnmsub_ps(b, a, c); }
+  else if constexpr (op == VOp::FMsac) { result = _mm256_fmsub_ps(b, a, c); }
+  else { result = _mm256_fnmadd_ps(b, a, c); }
+  const __m256 nan = _mm256_cmp_ps(result, result, _CMP_UNORD_Q);
+  return _mm256_blendv_ps(result, _mm256_castsi256_ps(_mm256_set1_epi32(FpTraits<float>::canonical_nan)), nan);
+}
+
+template<VOp op>
+AVX2 static inline __m256d Avx2DoubleOp(__m256d a, __m256d b, __m256d c)
+{
+  __m256d result;
+  if constexpr (op == VOp::FAdd) { result = _mm256_add_pd(a, b); }
+  else if constexpr (op == VOp::FSub) { result = _mm256_sub_pd(a, b); }
+  else if constexpr (op == VOp::FRSub) { result = _mm256_sub_pd(b, a); }
+  else if constexpr (op == VOp::FMul) { result = _mm256_mul_pd(a, b); }
+  else if constexpr (op == VOp::FDiv) { result = _mm256_div_pd(a, b); }
+  else if constexpr (op == VOp::FRDiv) { result = _mm256_div_pd(b, a); }
+  else if constexpr (op == VOp::FMacc) { result = _mm256_fmadd_pd(b, a, c); }
+  else if constexpr (op == VOp::FNMacc) { result = _mm256_fnmsub_pd(b, a, c); }
+  else if constexpr (op == VOp::FMsac) { result = _mm256_fmsub_pd(b, a, c); }
+  else { result = _mm256_fnmadd_pd(b, a, c); }
+  const __m256d nan = _mm256_cmp_pd(result, result, _CMP_UNORD_Q);
+  return _mm256_blendv_pd(result, _mm256_castsi256_pd(_mm256_set1_epi64x(FpTraits<double>::canonical_nan)), nan);
+}
+
+// a is vs2, b is vs1 or the broadcast scalar, c is the old vd
+template<typename T, VOp op>
+AVX2 static inline __m256i Avx2Op(__m256i a, __m256i b, __m256i c)
+{
+  constexpr size_t w = sizeof(T);
+  if constexpr (std::is_same_v<T, float>)
+  {
+    return _mm256_castps_si256(Avx2FloatOp<op>(_mm256_castsi256_ps(a), _mm256_castsi256_ps(b), _mm256_castsi256_ps(c)));
+  }
+  else if constexpr (std::is_same_v<T, double>)
+  {
+    return _mm256_castpd_si256(Avx2DoubleOp<op>(_mm256_castsi256_pd(a), _mm256_castsi256_pd(b), _mm256_castsi256_pd(c)));
+  }
+  else if constexpr (op == VOp::Add) { return Avx2Add<w>(a, b); }
+  else if constexpr (op == VOp::Sub) { return Avx2Sub<w>(a, b); }
+  else if constexpr (op == VOp::RSub) { return Avx2Sub<w>(b, a); }
+  else if constexpr (op == VOp::And) { return _mm256_and_si256(a, b); }
+  else if constexpr (op == VOp::Or) { return _mm256_or_si256(a, b); }
+  else if constexpr (op == VOp::Xor) { return _mm256_xor_si256(a, b); }
+  else if constexpr (op == VOp::MinU) { return Avx2MinMax<w, false, false>(a, b); }
+  else if constexpr (op == VOp::Min) { return Avx2MinMax<w, true, false>(a, b); }
+  else if constexpr (op == VOp::MaxU) { return Avx2MinMax<w, false, true>(a, b); }
+  else if constexpr (op == VOp::Max) { return Avx2MinMax<w, true, true>(a, b); }
+  else if constexpr (op == VOp::Sll && w == 4) { return _mm256_sllv_epi32(a, _mm256_and_si256(b, _mm256_set1_epi32(31))); }
+  else if constexpr (op == VOp::Sll) { return _mm256_sllv_epi64(a, _mm256_and_si256(b, _mm256_set1_epi64x(63))); }
+  else if constexpr (op == VOp::Srl && w == 4) { return _mm256_srlv_epi32(a, _mm256_and_si256(b, _mm256_set1_epi32(31))); }
+  else if constexpr (op == VOp::Srl) { return _mm256_srlv_epi64(a, _mm256_and_si256(b, _mm256_set1_epi64x(63))); }
+  else if constexpr (op == VOp::Sra) { return _mm256_srav_epi32(a, _mm256_and_si256(b, _mm256_set1_epi32(31))); }
+  else if constexpr (op == VOp::Mul && w == 2) { return _mm256_mullo_epi16(a, b); }
+  else { return _mm256_mullo_epi32(a, b); }
+}
+
+// Fills the unused upper half of a 16-byte block, 1.0 keeps FP lanes from raising flags
+template<typename T>
+AVX2 static inline __m256i Avx2Filler()
+{
+  if constexpr (std::is_same_v<T, float>)
+  {
+    return _mm256_castps_si256(_mm256_set1_ps(1.0f));
+  }
+  else if constexpr (std::is_same_v<T, double>)
+  {
+    return _mm256_castpd_si256(_mm256_set1_pd(1.0));
+  }
+  else
+  {
+    return _mm256_setzero_si256();
+  }
+}
+
+template<typename T>
+AVX2 static inline __m256i Avx2LoadHalf(const uint8_t* src)
+{
+  return _mm256_inserti128_si256(Avx2Filler<T>(), _mm_loadu_si128(reinterpret_cast<const __m128i*>(src)), 0);
+}
+
+// Processes 32-byte blocks and a trailing 16-byte block, returns the number of bytes done
+template<typename T, VOp op>
+AVX2 static size_t Avx2Binary(uint8_t* vd, const uint8_t* vs2, const uint8_t* vs1, size_t bytes)
+{
+  size_t i = 0;
+  for(; i + 32 <= bytes; i += 32)
+  {
+    const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(vs2 + i));
+    const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(vs1 + i));
+    const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(vd + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(vd + i), Avx2Op<T, op>(a, b, c));
+  }
+  if(i + 16 <= bytes)
+  {
+    const __m256i result = Avx2Op<T, op>(Avx2LoadHalf<T>(vs2 + i), Avx2LoadHalf<T>(vs1 + i), Avx2LoadHalf<T>(vd + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(vd + i), _mm256_castsi256_si128(result));
+    i += 16;
+  }
+  return i;
+}
+
+// Folds 32-byte blocks lane-wise into one block and then into acc, returns the number of bytes done
+template<typename T, VOp op>
+AVX2 static size_t Avx2Reduce(const uint8_t* vs2, size_t bytes, T& acc)
+{
+  if(bytes < 32)
+  {
+    return 0;
+  }
+  __m256i lanes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(vs2));
+  size_t i = 32;
+  for(; i + 32 <= bytes; i += 32)
+  {
+    lanes = Avx2Op<T, op>(lanes, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(vs2 + i)), lanes);
+  }
+  alignas(32) uint8_t block[32];
+  _mm256_store_si256(reinterpret_cast<__m256i*>(block), lanes);
+  for(size_t j = 0; j < 32 / sizeof(T); j++)
+  {
+    acc = ScalarOp<T, op>(acc, Elem<T>(block, j), acc);
+  }
+  return i;
+}
+#endif
+
+// ARITHMETIC
+
+template<typename T, VOp op>
+static void Binary(VectorState& v, const VFields& f, const VSource& src)
+{
+  const uint64_t vl = v.vl;
+  uint8_t* vd = Group(v, f.vd);
+  const uint8_t* vs2 = Group(v, f.vs2);
+  const uint8_t* vs1 = src.group;
+  alignas(32) uint8_t splat[VLEN];
+  if(vs1 == nullptr)
+  {
+    const T scalar = FromBits<T>(src.scalar);
+    for(uint64_t i = v.vstart; i < vl; i++)
+    {
+      SetElem<T>(splat, i, scalar);
+    }
+    vs1 = splat;
+  }
+  uint64_t i = v.vstart;
+#if defined(VECTOR_SIMD)
+  if constexpr (HasAvx2Kernel<T, op>())
+  {
+    if(!f.masked && i == 0 && HostHasAvx2())
+    {
+      i = Avx2Binary<T, op>(vd, vs2, vs1, vl * sizeof(T)) / sizeof(T);
+    }
+  }
+#endif
+  for(; i < vl; i++)
+  {
+    if(!f.masked || MaskBit(v, i))
+    {
+      SetElem<T>(vd, i, ScalarOp<T, op>(Elem<T>(vs2, i), Elem<T>(vs1, i), Elem<T>(vd, i)));
+    }
+  }
+  v.vstart = 0;
+}
+
+// A masked destination may not overlap the mask in v0
+static inline void CheckDest(const VectorState& v, const VFields& f)
+{
+  CheckGroup(f.vd, LmulLog2(v.vtype));
+  if(f.masked && f.vd == 0)
+  {
+    Illegal();
+  }
+}
+
+template<VOp op>
+static void IntBinary(VectorState& v, const VFields& f, const VSource& src)
+{
+  CheckDest(v, f);
+  switch(Sew(v))
+  {
+    case 8:
+      Binary<uint8_t, op>(v, f, src);
+      break;
+    case 16:
+      Binary<uint16_t, op>(v, f, src);
+      break;
+    case 32:
+      Binary<uint32_t, op>(v, f, src);
+      break;
+    default:
+      Binary<uint64_t, op>(v, f, src);
+      break;
+  }
+}
+
+// Vector FP uses the dynamic rounding mode in frm
+template<VOp op>
+static void FpBinary(CPU& cpu, VectorState& v, const VFields& f, const VSource& src)
+{
+  CheckDest(v, f);
+  RoundingScope scope(cpu, 7);
+  switch(Sew(v))
+  {
+    case 32:
+      Binary<float, op>(v, f, src);
+      break;
+    case 64:
+      Binary<double, op>(v, f, src);
+      break;
+    default:
+      Illegal();
+  }
+  cpu.MarkFpDirty();
+}
+
+// vmv.v.* when unmasked, vmerge.v*m takes the second operand where v0 is set and vs2 elsewhere
+template<typename T>
+static void Merge(VectorState& v, const VFields& f, const VSource& src)
+{
+  uint8_t* vd = Group(v, f.vd);
+  const uint8_t* vs2 = Group(v, f.vs2);
+  if(!f.masked && src.group != nullptr && v.vstart == 0)
+  {
+    std::memmove(vd, src.group, v.vl * sizeof(T));
+    return;
+  }
+  const T scalar = static_cast<T>(src.scalar);
+  for(uint64_t i = v.vstart; i < v.vl; i++)
+  {
+    const T val = src.group != nullptr ? Elem<T>(src.group, i) : scalar;
+    SetElem<T>(vd, i, (!f.masked || MaskBit(v, i)) ? val : Elem<T>(vs2, i));
+  }
+  v.vstart = 0;
+}
+
+static void IntMerge(VectorState& v, const VFields& f, const VSource& src)
+{
+  CheckGroup(f.vd, LmulLog2(v.vtype));
+  if(f.masked && f.vd == 0)
+  {
+    Illegal();
+  }
+  switch(Sew(v))
+  {
+    case 8:
+      Merge<uint8_t>(v, f, src);
+      break;
+    case 16:
+      Merge<uint16_t>(v, f, src);
+      break;
+    case 32:
+      Merge<uint32_t>(v, f, src);
+      break;
+    default:
+      Merge<uint64_t>(v, f, src);
+      break;
+  }
+  v.vstart = 0;
+}
+
+// Integer compares write one mask bit per element into vd
+template<typename T>
+static void Compare(VectorState& v, const VFields& f, const VSource& src, VCmp cmp)
+{
+  using S = std::make_signed_t<T>;
+  uint8_t* vd = Group(v, f.vd);
+  const uint8_t* vs2 = Group(v, f.vs2);
+  for(uint64_t i = v.vstart; i < v.vl; i++)
+  {
+    if(f.masked && !MaskBit(v, i))
+    {
+      continue;
+    }
+    const T a = Elem<T>(vs2, i);
+    const T b = src.group != nullptr ? Elem<T>(src.group, i) : static_cast<T>(src.scalar);
+    bool result;
+    switch(cmp)
+    {
+      case VCmp::Eq:
+        result = a == b;
+        break;
+      case VCmp::Ne:
+        result = a != b;
+        break;
+      case VCmp::LtU:
+        result = a < b;
+        break;
+      case VCmp::Lt:
+        result = static_cast<S>(a) < static_cast<S>(b);
+        break;
+      case VCmp::LeU:
+        result = a <= b;
+        break;
+      case VCmp::Le:
+        result = static_cast<S>(a) <= static_cast<S>(b);
+        break;
+      case VCmp::GtU:
+        result = a > b;
+        break;
+      default:
+        result = static_cast<S>(a) > static_cast<S>(b);
+        break;
+    }
+    vd[i / 8] = (vd[i / 8] & ~(1 << (i % 8))) | (result << (i % 8));
+  }
+  v.vstart = 0;
+}
+
+static void IntCompare(VectorState& v, const VFields& f, const VSource& src, VCmp cmp)
+{
+  switch(Sew(v))
+  {
+    case 8:
+      Compare<uint8_t>(v, f, src, cmp);
+      break;
+    case 16:
+      Compare<uint16_t>(v, f, src, cmp);
+      break;
+    case 32:
+      Compare<uint32_t>(v, f, src, cmp);
+      break;
+    default:
+      Compare<uint64_t>(v, f, src, cmp);
+      break;
+  }
+}
+
+// REDUCTIONS
+
+// vd[0] = vs1[0] op vs2[0..vl), ordered reductions never use the lane-parallel kernel
+template<typename T, VOp op>
+static void Reduce(VectorState& v, const VFields& f, bool ordered)
+{
+  if(v.vstart != 0)
+  {
+    Illegal();
+  }
+  if(v.vl == 0)
+  {
+    return;
+  }
+  const uint8_t* vs2 = Group(v, f.vs2);
+  T acc = Elem<T>(Group(v, f.vs1), 0);
+  uint64_t i = 0;
+#if defined(VECTOR_SIMD)
+  if constexpr (HasAvx2Kernel<T, op>())
+  {
+    if(!ordered && !f.masked && HostHasAvx2())
+    {
+      i = Avx2Reduce<T, op>(vs2, v.vl * sizeof(T), acc) / sizeof(T);
+    }
+  }
+#endif
+  for(; i < v.vl; i++)
+  {
+    if(!f.masked || MaskBit(v, i))
+    {
+      acc = ScalarOp<T, op>(acc, Elem<T>(vs2, i), acc);
+    }
+  }
+  SetElem<T>(Group(v, f.vd), 0, acc);
+}
+
+template<VOp op>
+static void IntReduce(VectorState& v, const VFields& f)
+{
+  switch(Sew(v))
+  {
+    case 8:
+      Reduce<uint8_t, op>(v, f, false);
+      break;
+    case 16:
+      Reduce<uint16_t, op>(v, f, false);
+      break;
+    case 32:
+      Reduce<uint32_t, op>(v, f, false);
+      break;
+    default:
+      Reduce<uint64_t, op>(v, f, false);
+      break;
+  }
+}
+
+template<VOp op>
+static void FpReduce(CPU& cpu, VectorState& v, const VFields& f, bool ordered)
+{
+  RoundingScope scope(cpu, 7);
+  switch(Sew(v))
+  {
+    case 32:
+      Reduce<float, op>(v, f, ordered);
+      break;
+    case 64:
+      Reduce<double, op>(v, f, ordered);
+      break;
+    default:
+      Illegal();
+  }
+  cpu.MarkFpDirty();
+}
+
+// MEMORY
+
+// Accesses evl elements from vstart, stride is in bytes. Contiguous unmasked runs are
+// copied a page at a time, other elements reuse the host page of the previous element.
+// Devices and page-crossing elements go through the regular load and store path.
+template<typename T, bool store>
+static void Access(CPU& cpu, VectorState& v, uint8_t* group, uint64_t base, int64_t stride, uint64_t evl,
+                   bool masked, bool fault_first)
+{
+  MMU& mmu = cpu.GetMMU();
+  const AccessType type = store ? AccessType::Store : AccessType::Load;
+  const bool contiguous = !masked && stride == static_cast<int64_t>(sizeof(T));
+  uint64_t cached_page = ~0ULL;
+  uint8_t* host_page = nullptr;
+  uint64_t i = v.vstart;
+  try
+  {
+    while(i < evl)
+    {
+      if(masked && !MaskBit(v, i))
+      {
+        i++;
+        continue;
+      }
+      const uint64_t addr = base + i * stride;
+      const uint64_t offset = addr % PAGE_SIZE;
+      if(offset + sizeof(T) <= PAGE_SIZE)
+      {
+        if(addr - offset != cached_page)
+        {
+          host_page = mmu.GetHostPage(addr, type);
+          cached_page = addr - offset;
+        }
+        if(host_page != nullptr)
+        {
+          const uint64_t n = contiguous ? std::min<uint64_t>(evl - i, (PAGE_SIZE - offset) / sizeof(T)) : 1;
+          if(store)
+          {
+            std::memcpy(host_page + offset, group + i * sizeof(T), n * sizeof(T));
+          }
+          else
+          {
+            std::memcpy(group + i * sizeof(T), host_page + offset, n * sizeof(T));
+          }
+          i += n;
+          continue;
+        }
+      }
+      if(store)
+      {
+        cpu.Store(addr, sizeof(T), Elem<T>(group, i));
+      }
+      else
+      {
+        uint64_t data;
+        cpu.Load(addr, sizeof(T), data);
+        SetElem<T>(group, i, static_cast<T>(data));
+      }
+      i++;
+    }
+  }
+  catch(const CPUTrapException&)
+  {
+    // Fault-only-first loads trim vl instead of trapping past element 0
+    if(fault_first && i > 0)
+    {
+      v.vl = i;
+      v.vstart = 0;
+      return;
+    }
+    v.vstart = i;
+    throw;
+  }
+  v.vstart = 0;
+}
+
+// Unit-stride, strided, whole register and mask loads and stores for one EEW.
+// Indexed and segment accesses are not implemented and raise illegal instruction.
+template<typename T, bool store>
+static void LoadStore(const uint32_t instruction, CPU& cpu)
+{
+  const uint32_t vd = mask<7, 11>(instruction);
+  const uint32_t rs1 = mask<15, 19>(instruction);
+  const uint32_t rs2 = mask<20, 24>(instruction);
+  const bool masked = mask<25, 25>(instruction) == 0;
+  const uint32_t mop = mask<26, 27>(instruction);
+  const uint32_t mew = mask<28, 28>(instruction);
+  const uint32_t nf = mask<29, 31>(instruction);
+  cpu.RequireVector();
+  VectorState& v = cpu.GetVector();
+  const uint64_t base = cpu.GetReg(rs1);
+  if(mew != 0 || (mop & 1) != 0)
+  {
+    Illegal();
+  }
+
+  // Whole register, independent of vtype and vl
+  if(mop == 0 && rs2 == 0b01000)
+  {
+    const uint32_t count = nf + 1;
+    if((count & (count - 1)) != 0 || masked || (vd & (count - 1)) != 0)
+    {
+      Illegal();
+    }
+    if(!store)
+    {
+      cpu.MarkVectorDirty();
+    }
+    Access<T, store>(cpu, v, Group(v, vd), base, sizeof(T), count * VLENB / sizeof(T), false, false);
+    return;
+  }
+
+  if((v.vtype & vtype_vill) != 0 || nf != 0)
+  {
+    Illegal();
+  }
+  if(!store)
+  {
+    cpu.MarkVectorDirty();
+  }
+
+  // vlm.v and vsm.v, one bit per element
+  if(mop == 0 && rs2 == 0b01011)
+  {
+    if(sizeof(T) != 1 || masked)
+    {
+      Illegal();
+    }
+    Access<T, store>(cpu, v, Group(v, vd), base, 1, (v.vl + 7) / 8, false, false);
+    return;
+  }
+
+  constexpr int eew_log2 = std::countr_zero(sizeof(T) * 8);
+  const int emul_log2 = eew_log2 - static_cast<int>(3 + ((v.vtype >> 3) & 0x7)) + LmulLog2(v.vtype);
+  if(emul_log2 < -3 || emul_log2 > 3)
+  {
+    Illegal();
+  }
+  CheckGroup(vd, emul_log2);
+  if(masked && vd == 0 && !store)
+  {
+    Illegal();
+  }
+  if(mop == 0)
+  {
+    const bool fault_first = rs2 == 0b10000 && !store;
+    if(rs2 != 0 && !fault_first)
+    {
+      Illegal();
+    }
+    Access<T, store>(cpu, v, Group(v, vd), base, sizeof(T), v.vl, masked, fault_first);
+  }
+  else
+  {
+    Access<T, store>(cpu, v, Group(v, vd), base, static_cast<int64_t>(cpu.GetReg(rs2)), v.vl, masked, false);
+  }
+}
+
+// CONFIGURATION
+
+// Shared AVL rules: an explicit AVL, VLMAX when requested, or the current vl kept within the new VLMAX
+static void SetVectorConfig(CPU& cpu, uint32_t rd, uint64_t avl, bool use_vlmax, bool keep_vl, uint64_t vtype)
+{
+  cpu.RequireVector();
+  VectorState& v = cpu.GetVector();
+  const uint64_t vlmax = Vlmax(vtype);
+  if(vlmax == 0)
+  {
+    v.vtype = vtype_vill;
+    v.vl = 0;
+  }
+  else
+  {
+    v.vtype = vtype;
+    v.vl = use_vlmax ? vlmax : std::min(keep_vl ? v.vl : avl, vlmax);
+  }
+  v.vstart = 0;
+  cpu.SetReg(rd, v.vl);
+  cpu.MarkVectorDirty();
+}
+
+// OPCODE GROUPS
+
+// OPIVV, OPIVX and OPIVI share funct6 assignments, form is 'V', 'X' or 'I'
+static void IntegerOp(CPU& cpu, const VFields& f, const VSource& src, char form)
+{
+  VectorState& v = BeginOp(cpu);
+  const int lmul = LmulLog2(v.vtype);
+  CheckGroup(f.vs2, lmul);
+  if(form == 'V')
+  {
+    CheckGroup(f.vs1, lmul);
+  }
+  const bool has_v = form == 'V';
+  const bool has_i = form == 'I';
+  switch(f.funct6)
+  {
+    case 0b000000:
+      IntBinary<VOp::Add>(v, f, src);
+      break;
+    case 0b000010:
+      has_i ? Illegal() : IntBinary<VOp::Sub>(v, f, src);
+      break;
+    case 0b000011:
+      has_v ? Illegal() : IntBinary<VOp::RSub>(v, f, src);
+      break;
+    case 0b000100:
+      has_i ? Illegal() : IntBinary<VOp::MinU>(v, f, src);
+      break;
+    case 0b000101:
+      has_i ? Illegal() : IntBinary<VOp::Min>(v, f, src);
+      break;
+    case 0b000110:
+      has_i ? Illegal() : IntBinary<VOp::MaxU>(v, f, src);
+      break;
+    case 0b000111:
+      has_i ? Illegal() : IntBinary<VOp::Max>(v, f, src);
+      break;
+    case 0b001001:
+      IntBinary<VOp::And>(v, f, src);
+      break;
+    case 0b001010:
+      IntBinary<VOp::Or>(v, f, src);
+      break;
+    case 0b001011:
+      IntBinary<VOp::Xor>(v, f, src);
+      break;
+    case 0b010111:
+      IntMerge(v, f, src);
+      break;
+    case 0b011000:
+      IntCompare(v, f, src, VCmp::Eq);
+      break;
+    case 0b011001:
+      IntCompare(v, f, src, VCmp::Ne);
+      break;
+    case 0b011010:
+      has_i ? Illegal() : IntCompare(v, f, src, VCmp::LtU);
+      break;
+    case 0b011011:
+      has_i ? Illegal() : IntCompare(v, f, src, VCmp::Lt);
+      break;
+    case 0b011100:
+      IntCompare(v, f, src, VCmp::LeU);
+      break;
+    case 0b011101:
+      IntCompare(v, f, src, VCmp::Le);
+      break;
+    case 0b011110:
+      has_v ? Illegal() : IntCompare(v, f, src, VCmp::GtU);
+      break;
+    case 0b011111:
+      has_v ? Illegal() : IntCompare(v, f, src, VCmp::Gt);
+      break;
+    case 0b100101:
+      IntBinary<VOp::Sll>(v, f, src);
+      break;
+    case 0b101000:
+      IntBinary<VOp::Srl>(v, f, src);
+      break;
+    case 0b101001:
+      IntBinary<VOp::Sra>(v, f, src);
+      break;
+    default:
+      Illegal();
+  }
+}
+
+// OPFVV and OPFVF, form is 'V' or 'F'
+static void FloatOp(CPU& cpu, const VFields& f, const VSource& src, char form)
+{
+  cpu.RequireFp();
+  FflagsScope flags(cpu);
+  VectorState& v = BeginOp(cpu);
+  const int lmul = LmulLog2(v.vtype);
+  CheckGroup(f.vs2, lmul);
+  if(form == 'V')
+  {
+    CheckGroup(f.vs1, lmul);
+  }
+  const bool has_v = form == 'V';
+  switch(f.funct6)
+  {
+    case 0b000000:
+      FpBinary<VOp::FAdd>(cpu, v, f, src);
+      break;
+    case 0b000001:
+      has_v ? FpReduce<VOp::FAdd>(cpu, v, f, false) : Illegal();
+      break;
+    case 0b000010:
+      FpBinary<VOp::FSub>(cpu, v, f, src);
+      break;
+    case 0b000011:
+      has_v ? FpReduce<VOp::FAdd>(cpu, v, f, true) : Illegal();
+      break;
+    case 0b000100:
+      FpBinary<VOp::FMin>(cpu, v, f, src);
+      break;
+    case 0b000101:
+      has_v ? FpReduce<VOp::FMin>(cpu, v, f, false) : Illegal();
+      break;
+    case 0b000110:
+      FpBinary<VOp::FMax>(cpu, v, f, src);
+      break;
+    case 0b000111:
+      has_v ? FpReduce<VOp::FMax>(cpu, v, f, false) : Illegal();
+      break;
+    case 0b010111:
+      has_v || Sew(v) < 32 ? Illegal() : IntMerge(v, f, src);
+      break;
+    case 0b100000:
+      FpBinary<VOp::FDiv>(cpu, v, f, src);
+      break;
+    case 0b100001:
+      has_v ? Illegal() : FpBinary<VOp::FRDiv>(cpu, v, f, src);
+      break;
+    case 0b100100:
+      FpBinary<VOp::FMul>(cpu, v, f, src);
+      break;
+    case 0b100111:
+      has_v ? Illegal() : FpBinary<VOp::FRSub>(cpu, v, f, src);
+      break;
+    case 0b101100:
+      FpBinary<VOp::FMacc>(cpu, v, f, src);
+      break;
+    case 0b101101:
+      FpBinary<VOp::FNMacc>(cpu, v, f, src);
+      break;
+    case 0b101110:
+      FpBinary<VOp::FMsac>(cpu, v, f, src);
+      break;
+    case 0b101111:
+      FpBinary<VOp::FNMsac>(cpu, v, f, src);
+      break;
+    default:
+      Illegal();
+  }
+}
+
+// OPMVV and OPMVX, form is 'V' or 'X'
+static void MaskOp(CPU& cpu, const VFields& f, const VSource& src, char form)
+{
+  VectorState& v = BeginOp(cpu);
+  const int lmul = LmulLog2(v.vtype);
+  CheckGroup(f.vs2, lmul);
+  const bool has_v = form == 'V';
+  if(has_v && f.funct6 <= 0b000111)
+  {
+    switch(f.funct6)
+    {
+      case 0b000000:
+        IntReduce<VOp::Add>(v, f);
+        break;
+      case 0b000001:
+        IntReduce<VOp::And>(v, f);
+        break;
+      case 0b000010:
+        IntReduce<VOp::Or>(v, f);
+        break;
+      case 0b000011:
+        IntReduce<VOp::Xor>(v, f);
+        break;
+      case 0b000100:
+        IntReduce<VOp::MinU>(v, f);
+        break;
+      case 0b000101:
+        IntReduce<VOp::Min>(v, f);
+        break;
+      case 0b000110:
+        IntReduce<VOp::MaxU>(v, f);
+        break;
+      default:
+        IntReduce<VOp::Max>(v, f);
+        break;
+    }
+    return;
+  }
+  if(f.funct6 == 0b100101)
+  {
+    if(has_v)
+    {
+      CheckGroup(f.vs1, lmul);
+    }
+    IntBinary<VOp::Mul>(v, f, src);
+    return;
+  }
+  Illegal();
+}
+
+// vmv.x.s, vmv.s.x, vfmv.f.s and vfmv.s.f move element 0 regardless of LMUL
+static uint64_t ReadElement0(const VectorState& v, uint32_t reg)
+{
+  const uint8_t* group = v.regs + reg * VLENB;
+  switch(Sew(v))
+  {
+    case 8:
+      return static_cast<int64_t>(static_cast<int8_t>(group[0]));
+    case 16:
+      return static_cast<int64_t>(Elem<int16_t>(group, 0));
+    case 32:
+      return static_cast<int64_t>(Elem<int32_t>(group, 0));
+    default:
+      return Elem<uint64_t>(group, 0);
+  }
+}
+
+static void WriteElement0(VectorState& v, uint32_t reg, uint64_t val)
+{
+  if(v.vstart < v.vl)
+  {
+    std::memcpy(v.regs + reg * VLENB, &val, Sew(v) / 8);
+  }
+  v.vstart = 0;
+}
+
+const static Instruction vector_table[] = {
+  // RVV 1.0
+  // CONFIGURATION: VSETVLI, VSETIVLI, VSETVL
+  // ARITHMETIC: OPIVV, OPFVV, OPMVV, OPIVI, OPIVX, OPFVF, OPMVX, dispatched on funct6
+  // MEMORY: unit-stride, strided, whole register and mask loads and stores, one entry per EEW
+  {
+    .name = "VSETVLI",
+    .format = 'I',
+    .mask_field = 0x8000707f,
+    .instruction_matcher = 0x00007057,
+    .execute = [](const uint32_t instruction, CPU& cpu) {
+      const InstructionFields fields = parse_instruction<'I'>(instruction);
+      SetVectorConfig(cpu, fields.rd, cpu.GetReg(fields.rs1), fields.rs1 == 0 && fields.rd != 0,
+                      fields.rs1 == 0 && fields.rd == 0, mask<20, 30>(instruction));
+    }
+  },
+  {
+    .name = "VSETIVLI",
+    .format = 'I',
+    .mask_field = 0xc000707f,
+    .instruction_matcher = 0xc0007057,
+    .execute = [](const uint32_t instruction, CPU& cpu) {
+      const InstructionFields fields = parse_instruction<'I'>(instruction);
+      SetVectorConfig(cpu, fields.rd, fields.rs1, false, false, mask<20, 29>(instruction));
+    }
+  },
+  {
+    .name = "VSETVL",
+    .format = 'R',
+    .mask_field = 0xfe00707f,
+    .instruction_matcher = 0x80007057,
+    .execute = [](const uint32_t instruction, CPU& cpu) {
+      const InstructionFields fields = parse_instruction<'R'>(instruction);
+      SetVectorConfig(cpu, fields.rd, cpu.GetReg(fields.rs1), fields.rs1 == 0 && fields.rd != 0,
+                      fields.rs1 == 0 && fields.rd == 0, cpu.GetReg(fields.rs2));
+    }
+  },
+  {
+    .name = "OPIVV",
+    .format = 'R',
+    .mask_field = 0x0000707f,
+    .instruction_matcher = 0x00000057,
+    .execute = [](const uint32_t instruction, CPU& cpu) {
+      const VFields f = ParseV(instruction);
+      IntegerOp(cpu, f, VSource{.group = Group(cpu.GetVector(), f.vs1), .scalar = 0}, 'V');
+    }
+  },
+  {
+    .name = "OPIVX",
+    .format = 'R',
+    .mask_field = 0x0000707f,
+    .instruction_matcher = 0x00004057,
+    .execute = [](const uint32_t instruction, CPU& cpu) {
+      const VFields f = ParseV(instruction);
+      IntegerOp(cpu, f, VSource{.group = nullptr, .scalar = cpu.GetReg(f.vs1)}, 'X');
+    }
+  },
+  {
+    .name = "OPIVI",
+    .format = 'R',
+    .mask_field = 0x0000707f,
+    .instruction_matcher = 0x00003057,
+    .execute = [](const uint32_t instruction, CPU& cpu) {
+      const VFields f = ParseV(instruction);
+      // Shift amounts are unsigned, every other immediate is sign-extended
+      const bool is_shift = f.funct6 == 0b100101 || f.funct6 == 0b101000 || f.funct6 == 0b101001;
+      const uint64_t imm = is_shift ? f.vs1 : static_cast<int64_t>(static_cast<int32_t>(f.vs1 << 27) >> 27);
+      IntegerOp(cpu, f, VSource{.group = nullptr, .scalar = imm}, 'I');
+    }
+  },
+  {
+    .name = "OPFVV",
+    .format = 'R',
+    .mask_field = 0x0000707f,
+    .instruction_matcher = 0x00001057,
+    .execute = [](const uint32_t instruction, CPU& cpu) {
+      const VFields f = ParseV(instruction);
+      if(f.funct6 == 0b010000 && f.vs1 == 0) // vfmv.f.s
+      {
+        cpu.RequireFp();
+        VectorState& v = BeginOp(cpu);
+        switch(Sew(v))
+        {
+          case 32:
+            WriteFBits<float>(cpu, f.vd, static_cast<uint32_t>(ReadElement0(v, f.vs2)));
+            break;
+          case 64:
+            WriteFBits<double>(cpu, f.vd, ReadElement0(v, f.vs2));
+            break;
+          default:
+            Illegal();
+        }
+        return;
+      }
+      FloatOp(cpu, f, VSource{.group = Group(cpu.GetVector(), f.vs1), .scalar = 0}, 'V');
+    }
+  },
+  {
+    .name = "OPFVF",
+    .format = 'R',
+    .mask_field = 0x0000707f,
+    .instruction_matcher = 0x00005057,
+    .execute = [](const uint32_t instruction, CPU& cpu) {
+      const VFields f = ParseV(instruction);
+      cpu.RequireFp();
+      const uint64_t scalar = Sew(cpu.GetVector()) == 32 ? ReadFBits<float>(cpu, f.vs1) : ReadFBits<double>(cpu, f.vs1);
+      if(f.funct6 == 0b010000 && f.vs2 == 0) // vfmv.s.f
+      {
+        VectorState& v = BeginOp(cpu);
+        if(Sew(v) < 32)
+        {
+          Illegal();
+        }
+        WriteElement0(v, f.vd, scalar);
+        return;
+      }
+      FloatOp(cpu, f, VSource{.group = nullptr, .scalar = scalar}, 'F');
+    }
+  },
+  {
+    .name = "OPMVV",
+    .format = 'R',
+    .mask_field = 0x0000707f,
+    .instruction_matcher = 0x00002057,
+    .execute = [](const uint32_t instruction, CPU& cpu) {
+      const VFields f = ParseV(instruction);
+      if(f.funct6 == 0b010000 && f.vs1 == 0) // vmv.x.s
+      {
+        cpu.SetReg(f.vd, ReadElement0(BeginOp(cpu), f.vs2));
+        return;
+      }
+      MaskOp(cpu, f, VSource{.group = Group(cpu.GetVector(), f.vs1), .scalar = 0}, 'V');
+    }
+  },
+  {
+    .name = "OPMVX",
+    .format = 'R',
+    .mask_field = 0x0000707f,
+    .instruction_matcher = 0x00006057,
+    .execute = [](const uint32_t instruction, CPU& cpu) {
+      const VFields f = ParseV(instruction);
+      if(f.funct6 == 0b010000 && f.vs2 == 0) // vmv.s.x
+      {
+        WriteElement0(BeginOp(cpu), f.vd, cpu.GetReg(f.vs1));
+        return;
+      }
+      MaskOp(cpu, f, VSource{.group = nullptr, .scalar = cpu.GetReg(f.vs1)}, 'X');
+    }
+  },
+  {
+    .name = "VLE8",
+    .format = 'I',
+    .mask_field = 0x0000707f,
+    .instruction_matcher = 0x00000007,
+    .execute = LoadStore<uint8_t, false>
+  },
+  {
+    .name = "VLE16",
+    .format = 'I',
+    .mask_field = 0x0000707f,
+    .instruction_matcher = 0x00005007,
+    .execute = LoadStore<uint16_t, false>
+  },
+  {
+    .name = "VLE32",
+    .format = 'I',
+    .mask_field = 0x0000707f,
+    .instruction_matcher = 0x00006007,
+    .execute = LoadStore<uint32_t, false>
+  },
+  {
+    .name = "VLE64",
+    .format = 'I',
+    .mask_field = 0x0000707f,
+    .instruction_matcher = 0x00007007,
+    .execute = LoadStore<uint64_t, false>
+  },
+  {
+    .name = "VSE8",
+    .format = 'S',
+    .mask_field = 0x0000707f,
+    .instruction_matcher = 0x00000027,
+    .execute = LoadStore<uint8_t, true>
+  },
+  {
+    .name = "VSE16",
+    .format = 'S',
+    .mask_field = 0x0000707f,
+    .instruction_matcher = 0x00005027,
+    .execute = LoadStore<uint16_t, true>
+  },
+  {
+    .name = "VSE32",
+    .format = 'S',
+    .mask_field = 0x0000707f,
+    .instruction_matcher = 0x00006027,
+    .execute = LoadStore<uint32_t, true>
+  },
+  {
+    .name = "VSE64",
+    .format = 'S',
+    .mask_field = 0x0000707f,
+    .instruction_matcher = 0x00007027,
+    .execute = LoadStore<uint64_t, true>
+  }
+  // RVV 1.0
+  // ----------------------------------------
+};
+
+const std::span<const Instruction> vector_instructions = vector_table;
@@ -0,0 +1,83 @@
+#include "gtest/gtest.h"
+#include "cpu.h"
+#include "config.h"
+
+// Register fields on top of an instruction's fixed bits
+static uint32_t Encode(uint32_t matcher, uint32_t rd, uint32_t rs1, uint32_t rs2)
+{
+  return matcher | (rs2 << 20) | (rs1 << 15) | (rd << 7);
+}
+
+static std::unique_ptr<CPU> MakeCpu()
+{
+  return std::make_unique<CPU>(std::make_shared<std::vector<uint8_t>>(4, 0), KERNBASE);
+}
+
+// Runs a register-register instruction with rs1 = a (x5) and rs2 = b (x6), returning rd (x7)
+static uint64_t RunOp(CPU& cpu, uint32_t matcher, uint64_t a, uint64_t b)
+{
+  cpu.SetReg(5, a);
+  cpu.SetReg(6, b);
+  cpu.RunInstruction(Encode(matcher, 7, 5, 6));
+  return cpu.GetReg(7);
+}
+
+// Single-source and immediate forms keep their shamt in the matcher
+static uint64_t RunOp(CPU& cpu, uint32_t matcher, uint64_t a)
+{
+  cpu.SetReg(5, a);
+  cpu.RunInstruction(Encode(matcher, 7, 5, 0));
+  return cpu.GetReg(7);
+}
+
+TEST(BitmanipTest, Decode)
+{
+  auto cpu = MakeCpu();
+  EXPECT_EQ(cpu->Decode(0x20a5c533).name, "SH2ADD"); // sh2add a0, a1, a0
+  EXPECT_EQ(cpu->Decode(0x60051513).name, "CLZ");    // clz a0, a0
+  EXPECT_EQ(cpu->Decode(0x6b855513).name, "REV8");   // rev8 a0, a0
+  EXPECT_EQ(cpu->Decode(0x60455513).name, "RORI");   // rori a0, a0, 4
+  EXPECT_EQ(cpu->Decode(0x40455513).name, "SRAI");   // srai a0, a0, 4
+  EXPECT_EQ(cpu->Decode(0x2855513).name, "SRLI");    // srli a0, a0, 40
+}
+
+TEST(BitmanipTest, Zba)
+{
+  auto cpu = MakeCpu();
+  EXPECT_EQ(RunOp(*cpu, 0x20006033, 3, 100), 124);                  // sh3add
+  EXPECT_EQ(RunOp(*cpu, 0x0800003b, 0xffffffff80000000, 1), 0x80000001); // add.uw
+  EXPECT_EQ(RunOp(*cpu, 0x2000403b, 0x1ffffffff, 0), 0x3fffffffcULL);  // sh2add.uw
+  EXPECT_EQ(RunOp(*cpu, 0x0800101b | (4 << 20), 0xf0000000f), 0xf0); // slli.uw 4
+}
+
+TEST(BitmanipTest, Zbb)
+{
+  auto cpu = MakeCpu();
+  EXPECT_EQ(RunOp(*cpu, 0x60001013, 0), 64);                        // clz
+  EXPECT_EQ(RunOp(*cpu, 0x60001013, 1ULL << 40), 23);
+  EXPECT_EQ(RunOp(*cpu, 0x6000101b, 0xff00000000), 32);             // clzw
+  EXPECT_EQ(RunOp(*cpu, 0x60101013, 0), 64);                        // ctz
+  EXPECT_EQ(RunOp(*cpu, 0x6010101b, 1ULL << 40), 32);               // ctzw
+  EXPECT_EQ(RunOp(*cpu, 0x60201013, 0xf0f0f0f0f0f0f0f1), 33);       // cpop
+  EXPECT_EQ(RunOp(*cpu, 0x6020101b, 0xffffffff00000003), 2);        // cpopw
+  EXPECT_EQ(RunOp(*cpu, 0x0a004033, -5, 3), static_cast<uint64_t>(-5)); // min
+  EXPECT_EQ(RunOp(*cpu, 0x0a005033, -5, 3), 3);                     // minu
+  EXPECT_EQ(RunOp(*cpu, 0x60401013, 0x80), 0xffffffffffffff80);     // sext.b
+  EXPECT_EQ(RunOp(*cpu, 0x0800403b, 0x12345678), 0x5678);           // zext.h
+  EXPECT_EQ(RunOp(*cpu, 0x40007033, 0xff, 0x0f), 0xf0);             // andn
+  EXPECT_EQ(RunOp(*cpu, 0x60001033, 0x8000000000000001, 1), 3);     // rol
+  EXPECT_EQ(RunOp(*cpu, 0x6000503b, 1, 1), 0xffffffff80000000);     // rorw
+  EXPECT_EQ(RunOp(*cpu, 0x6000501b | (8 << 20), 0x12345678), 0x78123456); // roriw 8
+  EXPECT_EQ(RunOp(*cpu, 0x28705013, 0x0100800000000002), 0xff00ff00000000ff); // orc.b
+  EXPECT_EQ(RunOp(*cpu, 0x6b805013, 0x0102030405060708), 0x0807060504030201); // rev8
+}
+
+TEST(BitmanipTest, Zbs)
+{
+  auto cpu = MakeCpu();
+  EXPECT_EQ(RunOp(*cpu, 0x28001033, 0, 63), 1ULL << 63);          // bset
+  EXPECT_EQ(RunOp(*cpu, 0x48001033, ~0ULL, 64 + 3), ~8ULL);       // bclr uses rs2 mod 64
+  EXPECT_EQ(RunOp(*cpu, 0x68001013 | (1 << 20), 3), 1);           // binvi 1
+  EXPECT_EQ(RunOp(*cpu, 0x48005013 | (33 << 20), 1ULL << 33), 1); // bexti 33
+  EXPECT_EQ(RunOp(*cpu, 0x48005033, 0xfe, 0), 0);                 // bext
+}
@@ -0,0 +1,177 @@
+#include "gtest/gtest.h"
+#include "cpu.h"
+#include "config.h"
+
+static constexpr uint32_t addi_t1_1 = 0x00130313;   // addi t1, t1, 1
+static constexpr uint32_t addi_t1_5 = 0x00530313;   // addi t1, t1, 5
+static constexpr uint32_t bne_t1_t2_back = 0xfe731ee3; // bne t1, t2, -4
+static constexpr uint32_t bltu_t1_t3_skip = 0x01c36463; // bltu t1, t3, +8
+static constexpr uint32_t addi_t4_1 = 0x001e8e93;   // addi t4, t4, 1
+static constexpr uint32_t addi_t5_1 = 0x001f0f13;   // addi t5, t5, 1
+static constexpr uint32_t bne_t1_t2_loop = 0xfe7318e3; // bne t1, t2, -16
+static constexpr uint32_t ld_t1_t0 = 0x0002b303;    // ld t1, 0(t0)
+static constexpr uint32_t loop = 0x0000006f;        // j .
+static constexpr uint32_t fence_i = 0x0000100f;
+static constexpr int t0 = 5, t1 = 6, t2 = 7, t3 = 28, t4 = 29, t5 = 30;
+
+static std::unique_ptr<CPU> MakeCpu(const std::vector<uint32_t>& program)
+{
+  auto binary = std::make_shared<std::vector<uint8_t>>(program.size() * 4);
+  std::memcpy(binary->data(), program.data(), binary->size());
+  return std::make_unique<CPU>(binary, KERNBASE);
+}
+
+// The loop's branch links its block to itself, after the first pass it never leaves the chain
+TEST(BlockCacheTest, LoopStaysChained)
+{
+  auto cpu = MakeCpu({addi_t1_1, bne_t1_t2_back, loop});
+  cpu->SetReg(t2, 1000);
+  EXPECT_EQ(cpu->RunBlocks(200), 200);
+  const BlockStats warm = cpu->GetBlocks().GetStats();
+  EXPECT_EQ(cpu->RunBlocks(1800), 1800);
+  EXPECT_EQ(cpu->GetReg(t1), 1000);
+  EXPECT_EQ(cpu->GetPc(), KERNBASE + 8);
+  const BlockStats& stats = cpu->GetBlocks().GetStats();
+  EXPECT_EQ(stats.built, warm.built);
+  EXPECT_EQ(stats.lookups, warm.lookups + 1); // entering RunBlocks
+  EXPECT_EQ(stats.chained, warm.chained + 899);
+}
+
+// The budget is exact even when it runs out in the middle of a block
+TEST(BlockCacheTest, ExactBudget)
+{
+  auto cpu = MakeCpu({addi_t1_1, addi_t1_1, addi_t1_1, addi_t1_1, loop});
+  EXPECT_EQ(cpu->RunBlocks(3), 3);
+  EXPECT_EQ(cpu->GetReg(t1), 3);
+  EXPECT_EQ(cpu->GetPc(), KERNBASE + 12);
+  EXPECT_EQ(cpu->RunBlocks(1), 1);
+  EXPECT_EQ(cpu->GetReg(t1), 4);
+}
+
+// Code written by the guest runs once FENCE.I has been executed
+TEST(BlockCacheTest, FenceIDropsWrittenBlocks)
+{
+  auto cpu = MakeCpu({addi_t1_1, loop});
+  cpu->RunBlocks(2);
+  EXPECT_EQ(cpu->GetReg(t1), 1);
+  cpu->Store(KERNBASE, 4, addi_t1_5);
+  cpu->SetPc(KERNBASE);
+  cpu->RunBlocks(1);
+  EXPECT_EQ(cpu->GetReg(t1), 2);
+
+  cpu->RunInstruction(fence_i);
+  cpu->SetPc(KERNBASE);
+  cpu->RunBlocks(1);
+  EXPECT_EQ(cpu->GetReg(t1), 7);
+  EXPECT_GE(cpu->GetBlocks().GetStats().invalidated, 1);
+}
+
+// The code cache keeps its own place in the epoch history, a FENCE.I closes an
+// epoch but leaves the page lists other clients hold
+TEST(BlockCacheTest, FenceIKeepsHeldHistory)
+{
+  auto cpu = MakeCpu({addi_t1_1, loop});
+  MemoryMap& memory = cpu->GetMMU().GetMemory();
+  const uint64_t since = memory.AdvanceEpoch();
+  memory.HoldEpoch(since);
+  cpu->Store(KERNBASE + 0x3000, 8, 1);
+  const std::vector<uint64_t> before = memory.DirtyPages(since);
+  EXPECT_EQ(before, (std::vector<uint64_t>{(KERNBASE >> 12) + 3}));
+
+  for(int i = 0; i < 3; i++)
+  {
+    cpu->RunInstruction(fence_i);
+    cpu->SetPc(KERNBASE);
+    cpu->RunBlocks(1);
+  }
+  EXPECT_EQ(memory.DirtyPages(since), before);
+  EXPECT_FALSE(memory.IsDirty(KERNBASE + 0x4000, since));
+  memory.ReleaseEpoch(since);
+}
+
+// A timer interrupt lands on the same instruction whether the hart steps or runs blocks
+TEST(BlockCacheTest, InterruptMatchesStep)
+{
+  auto run = [](bool blocks)
+  {
+    auto cpu = MakeCpu({addi_t1_1, bne_t1_t2_back, loop});
+    cpu->GetMMU().GetClint().SetTimeMode(TimeMode::InstructionCount);
+    cpu->GetMMU().GetClint().SetTime(0);
+    cpu->SetReg(t2, 1000);
+    cpu->SetCsr(CSR::mtvec, KERNBASE + 8);
+    cpu->SetCsr(CSR::mie, MIP::mtip);
+    cpu->SetCsr(CSR::mstatus, cpu->GetCsr(CSR::mstatus) | mstatus_mie);
+    cpu->Store(CLINT_BASE + clint_mtimecmp, 8, 101);
+    if(blocks)
+    {
+      cpu->RunBlocks(150);
+    }
+    else
+    {
+      for(int i = 0; i < 150; i++)
+      {
+        cpu->Step();
+      }
+    }
+    return std::make_tuple(cpu->GetPc(), cpu->GetReg(t1), cpu->GetCsr(CSR::mepc), cpu->GetInstret());
+  };
+  const auto stepped = run(false);
+  EXPECT_EQ(run(true), stepped);
+  EXPECT_EQ(std::get<0>(stepped), KERNBASE + 8);
+}
+
+// The loop's inner branch goes one way for its first 499 iterations, so the loop
+// becomes a trace through that direction. Once the branch turns the trace is left
+// early and new ones form along the other path, and the hart still matches Step.
+TEST(BlockCacheTest, TraceSideExit)
+{
+  auto run = [](bool blocks)
+  {
+    auto cpu = MakeCpu({addi_t1_1, bltu_t1_t3_skip, addi_t4_1, addi_t5_1, bne_t1_t2_loop, loop});
+    cpu->SetReg(t2, 1000);
+    cpu->SetReg(t3, 500);
+    if(blocks)
+    {
+      EXPECT_EQ(cpu->RunBlocks(5000), 5000);
+      const BlockStats& stats = cpu->GetBlocks().GetStats();
+      EXPECT_GE(stats.traces, 1);
+      EXPECT_GE(stats.trace_blocks, 2 * stats.traces);
+      EXPECT_GE(stats.side_exits, 1);
+    }
+    else
+    {
+      for(int i = 0; i < 5000; i++)
+      {
+        cpu->Step();
+      }
+    }
+    return std::make_tuple(cpu->GetPc(), cpu->GetReg(t1), cpu->GetReg(t4), cpu->GetReg(t5), cpu->GetInstret());
+  };
+  const auto stepped = run(false);
+  EXPECT_EQ(run(true), stepped);
+  EXPECT_EQ(stepped, std::make_tuple(KERNBASE + 20, 1000, 501, 1000, 5000));
+}
+
+// A block built with untranslated loads is rebuilt once satp turns paging on, M-mode
+// loads are translated through MPRV
+TEST(BlockCacheTest, LoadsFollowPagingMode)
+{
+  auto cpu = MakeCpu({ld_t1_t0, loop});
+  const uint64_t root_table = KERNBASE + 0x10000;
+  const uint64_t pte_vrwxad = 0xcf;
+  MemoryMap& memory = cpu->GetMMU().GetMemory();
+  memory.Store(root_table + 1 * 8, 8, ((KERNBASE >> 12) << 10) | pte_vrwxad); // 0x40000000 -> KERNBASE
+  memory.Store(root_table + 2 * 8, 8, ((KERNBASE >> 12) << 10) | pte_vrwxad); // 0x80000000 -> KERNBASE
+  cpu->SetReg(t0, KERNBASE + 4);
+  cpu->RunBlocks(1);
+  EXPECT_EQ(cpu->GetReg(t1), loop);
+
+  cpu->SetCsr(CSR::satp, (8ULL << 60) | (root_table >> 12));
+  cpu->SetCsr(CSR::mstatus, mstatus_mprv | (1ULL << 11)); // MPP = S
+  cpu->SetPc(KERNBASE);
+  cpu->SetReg(t0, 0x40000000 + 4);
+  cpu->SetReg(t1, 0);
+  cpu->RunBlocks(1);
+  EXPECT_EQ(cpu->GetReg(t1), loop);
+  EXPECT_EQ(cpu->GetCsr(CSR::mcause), 0);
+}
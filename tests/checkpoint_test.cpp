@@ -0,0 +1,125 @@
+#include "gtest/gtest.h"
+#include "cpu.h"
+#include "config.h"
+#include "checkpoint.h"
+#include <cstdio>
+
+static constexpr uint64_t run_base = KERNBASE + 0x20000; // three adjacent pages, one MapFile run when raw
+static constexpr uint64_t lone_page = KERNBASE + 0x40000;
+static constexpr uint64_t zeroed_page = KERNBASE + 0x50000;
+static constexpr uint64_t root_table = KERNBASE + 0x60000;
+static constexpr uint64_t satp_sv39 = (8ULL << 60) | (root_table >> 12);
+static constexpr uint64_t timecmp = 0x123456;
+
+static std::unique_ptr<CPU> MakeCpu()
+{
+  return std::make_unique<CPU>(std::make_shared<std::vector<uint8_t>>(4, 0), KERNBASE);
+}
+
+static uint64_t Pattern(uint64_t addr)
+{
+  return addr * 0x9e3779b97f4a7c15ULL;
+}
+
+static uint64_t Peek(CPU& cpu, uint64_t addr)
+{
+  uint64_t data = 0;
+  EXPECT_TRUE(cpu.GetMMU().GetMemory().Load(addr, 8, data));
+  return data;
+}
+
+static void Poke(CPU& cpu, uint64_t addr, uint64_t data)
+{
+  EXPECT_TRUE(cpu.GetMMU().GetMemory().Store(addr, 8, data));
+}
+
+static std::unique_ptr<CPU> MakeSaved()
+{
+  auto cpu = MakeCpu();
+  cpu->Store(CLINT_BASE + clint_mtimecmp, 8, timecmp);
+  for(uint64_t addr = run_base; addr < run_base + 3 * PAGE_SIZE; addr += 0x100)
+  {
+    Poke(*cpu, addr, Pattern(addr));
+  }
+  Poke(*cpu, lone_page + 0x18, Pattern(lone_page));
+  Poke(*cpu, zeroed_page, 1);
+  Poke(*cpu, zeroed_page, 0);
+
+  for(int i = 1; i < 32; i++)
+  {
+    cpu->SetReg(i, Pattern(i));
+    cpu->SetFReg(i, Pattern(i + 32));
+  }
+  cpu->SetFflags(0x15);
+  cpu->SetFrm(0x3);
+  cpu->SetCsr(CSR::mscratch, 0xabcdef);
+  cpu->SetCsr(CSR::mtvec, KERNBASE + 0x100);
+  cpu->SetCsr(CSR::stvec, KERNBASE + 0x200);
+  cpu->SetCsr(CSR::medeleg, 1 << 8);
+  cpu->SetCsr(CSR::mie, MIP::stip | MIP::seip);
+  cpu->SetCsr(CSR::sscratch, 0x5555);
+  cpu->SetCsr(CSR::satp, satp_sv39);
+  cpu->SetPc(KERNBASE + 0x1234);
+  cpu->SetMode(SUPERVISOR);
+  return cpu;
+}
+
+static void ExpectRestored(CPU& cpu)
+{
+  EXPECT_EQ(cpu.GetPc(), KERNBASE + 0x1234);
+  EXPECT_EQ(cpu.GetMode(), SUPERVISOR);
+  for(int i = 1; i < 32; i++)
+  {
+    EXPECT_EQ(cpu.GetReg(i), Pattern(i)) << i;
+    EXPECT_EQ(cpu.GetFReg(i), Pattern(i + 32)) << i;
+  }
+  EXPECT_EQ(cpu.GetFflags(), 0x15);
+  EXPECT_EQ(cpu.GetFrm(), 0x3);
+  EXPECT_EQ(cpu.GetCsr(CSR::mscratch), 0xabcdef);
+  EXPECT_EQ(cpu.GetCsr(CSR::mtvec), KERNBASE + 0x100);
+  EXPECT_EQ(cpu.GetCsr(CSR::stvec), KERNBASE + 0x200);
+  EXPECT_EQ(cpu.GetCsr(CSR::medeleg), 1 << 8);
+  EXPECT_EQ(cpu.GetCsr(CSR::mie), MIP::stip | MIP::seip);
+  EXPECT_EQ(cpu.GetCsr(CSR::sscratch), 0x5555);
+  EXPECT_EQ(cpu.GetCsr(CSR::satp), satp_sv39);
+  EXPECT_EQ(cpu.GetMMU().GetPagingMode(), Sv39);
+  EXPECT_EQ(cpu.GetMMU().GetRootPageTable(), root_table >> 12);
+  EXPECT_EQ(cpu.GetMMU().GetClint().GetTimecmp(), timecmp);
+
+  for(uint64_t addr = run_base; addr < run_base + 3 * PAGE_SIZE; addr += 0x100)
+  {
+    EXPECT_EQ(Peek(cpu, addr), Pattern(addr)) << std::hex << addr;
+    EXPECT_EQ(Peek(cpu, addr + 8), 0) << std::hex << addr;
+  }
+  EXPECT_EQ(Peek(cpu, lone_page + 0x18), Pattern(lone_page));
+  EXPECT_EQ(Peek(cpu, lone_page), 0);
+  EXPECT_EQ(Peek(cpu, zeroed_page), 0);
+  EXPECT_EQ(Peek(cpu, run_base + 3 * PAGE_SIZE), 0);
+}
+
+class CheckpointTest : public testing::TestWithParam<bool> {};
+
+TEST_P(CheckpointTest, RoundTrip)
+{
+  const std::string path = testing::TempDir() + "checkpoint_test.ckpt";
+  SaveCheckpoint(*MakeSaved(), path, GetParam());
+
+  auto restored = MakeCpu();
+  Poke(*restored, run_base + PAGE_SIZE, 0xdead);
+  RestoreCheckpoint(*restored, path);
+  ExpectRestored(*restored);
+
+  // Restored pages stay writable, and writes never reach the checkpoint file
+  for(uint64_t addr = run_base; addr < run_base + 3 * PAGE_SIZE; addr += PAGE_SIZE)
+  {
+    Poke(*restored, addr + 8, 0xfeed);
+    EXPECT_EQ(Peek(*restored, addr + 8), 0xfeed);
+  }
+  auto again = MakeCpu();
+  RestoreCheckpoint(*again, path);
+  std::remove(path.c_str());
+  ExpectRestored(*again);
+}
+
+INSTANTIATE_TEST_SUITE_P(Pages, CheckpointTest, testing::Values(true, false),
+                         [](const testing::TestParamInfo<bool>& info) { return info.param ? "Compressed" : "Raw"; });
@@ -0,0 +1,188 @@
+#include "gtest/gtest.h"
+#include "cpu.h"
+#include "config.h"
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <thread>
+
+static constexpr uint32_t nop = 0x00000013;
+static constexpr uint32_t wfi = 0x10500073;
+
+static std::unique_ptr<CPU> MakeCpu(std::vector<uint32_t> program = std::vector<uint32_t>(16, nop))
+{
+  auto binary = std::make_shared<std::vector<uint8_t>>(program.size() * 4);
+  std::memcpy(binary->data(), program.data(), binary->size());
+  auto cpu = std::make_unique<CPU>(binary, KERNBASE);
+  cpu->SetCsr(CSR::mtvec, KERNBASE + 0x100);
+  return cpu;
+}
+
+static uint64_t LoadClint(CPU& cpu, uint64_t offset, int size = 8)
+{
+  uint64_t data;
+  cpu.Load(CLINT_BASE + offset, size, data);
+  return data;
+}
+
+TEST(ClintTest, Registers)
+{
+  auto cpu = MakeCpu();
+  cpu->GetMMU().GetClint().SetTimeMode(TimeMode::InstructionCount);
+  cpu->Store(CLINT_BASE + clint_mtimecmp, 8, 0x1122334455667788);
+  EXPECT_EQ(LoadClint(*cpu, clint_mtimecmp), 0x1122334455667788);
+  cpu->Store(CLINT_BASE + clint_mtimecmp + 4, 4, 0xaabbccdd); // RV32 style high half
+  EXPECT_EQ(LoadClint(*cpu, clint_mtimecmp), 0xaabbccdd55667788);
+  EXPECT_EQ(LoadClint(*cpu, clint_mtimecmp, 4), 0x55667788);
+
+  // mtime counts retired instructions
+  cpu->Store(CLINT_BASE + clint_mtime, 8, 100);
+  cpu->Step();
+  cpu->Step();
+  EXPECT_EQ(LoadClint(*cpu, clint_mtime), 102);
+
+  cpu->Store(CLINT_BASE + clint_msip, 4, 1);
+  EXPECT_EQ(cpu->GetCsr(CSR::mip), MIP::msip);
+  cpu->Store(CLINT_BASE + clint_msip, 4, 0);
+  EXPECT_EQ(cpu->GetCsr(CSR::mip), 0);
+}
+
+TEST(ClintTest, TimerDeadline)
+{
+  auto cpu = MakeCpu();
+  auto& clint = cpu->GetMMU().GetClint();
+  clint.SetTimeMode(TimeMode::InstructionCount);
+  cpu->Store(CLINT_BASE + clint_mtimecmp, 8, clint.GetTime() + 3);
+  cpu->Step();
+  cpu->Step();
+  EXPECT_EQ(cpu->GetCsr(CSR::mip), 0);
+  cpu->Step();
+  EXPECT_EQ(cpu->GetCsr(CSR::mip), MIP::mtip);
+
+  // Writing mtimecmp is what clears the timer interrupt
+  cpu->Store(CLINT_BASE + clint_mtimecmp, 8, mtimecmp_disarmed);
+  EXPECT_EQ(cpu->GetCsr(CSR::mip), 0);
+}
+
+TEST(ClintTest, WfiSkipsToDeadline)
+{
+  auto cpu = MakeCpu({wfi, nop});
+  auto& clint = cpu->GetMMU().GetClint();
+  clint.SetTimeMode(TimeMode::InstructionCount);
+  cpu->SetCsr(CSR::mie, MIP::mtip);
+  cpu->Store(CLINT_BASE + clint_mtimecmp, 8, 1000000000);
+
+  const auto start = std::chrono::steady_clock::now();
+  cpu->Step();
+  EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(1));
+  EXPECT_GE(clint.GetTime(), 1000000000);
+  EXPECT_EQ(cpu->GetCsr(CSR::mip), MIP::mtip);
+  EXPECT_EQ(cpu->GetPc(), KERNBASE + 4); // mstatus.MIE is clear, so WFI just retires
+}
+
+TEST(ClintTest, WfiSleepsUntilDeadline)
+{
+  auto cpu = MakeCpu({wfi, nop});
+  auto& clint = cpu->GetMMU().GetClint();
+  cpu->SetCsr(CSR::mie, MIP::mtip);
+  cpu->SetCsr(CSR::mstatus, cpu->GetCsr(CSR::mstatus) | mstatus_mie);
+  cpu->Store(CLINT_BASE + clint_mtimecmp, 8, clint.GetTime() + TIMEBASE_FREQ / 50); // 20 ms
+
+  // The hart sleeps instead of spinning, so it burns almost no CPU time
+  const auto start = std::chrono::steady_clock::now();
+  const std::clock_t start_cpu = std::clock();
+  cpu->Step();
+  EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(19));
+  EXPECT_LT(std::clock() - start_cpu, CLOCKS_PER_SEC / 200);
+  EXPECT_EQ(cpu->GetCsr(CSR::mcause), MachineTimerInterrupt);
+  EXPECT_EQ(cpu->GetPc(), KERNBASE + 0x100);
+}
+
+TEST(ClintTest, WfiWakesOnExternalInterrupt)
+{
+  auto cpu = MakeCpu({wfi, nop});
+  cpu->SetCsr(CSR::mie, MIP::meip);
+  std::thread device([&cpu] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    cpu->RaiseInterrupt(MIP::meip);
+  });
+  cpu->Step();
+  device.join();
+  EXPECT_EQ(cpu->GetPc(), KERNBASE + 4);
+  EXPECT_EQ(cpu->GetCsr(CSR::mip), MIP::meip);
+}
+
+TEST(ClintTest, WfiTrapsWithTw)
+{
+  auto cpu = MakeCpu();
+  cpu->SetMode(SUPERVISOR);
+  cpu->SetCsr(CSR::mstatus, cpu->GetCsr(CSR::mstatus) | mstatus_tw);
+  EXPECT_THROW(cpu->RunInstruction(wfi), CPUTrapException);
+}
+
+// Sstc, stimecmp drives STIP directly once menvcfg.STCE is set
+TEST(ClintTest, SupervisorTimer)
+{
+  auto cpu = MakeCpu();
+  auto& clint = cpu->GetMMU().GetClint();
+  clint.SetTimeMode(TimeMode::InstructionCount);
+  cpu->SetCsr(CSR::stimecmp, clint.GetTime() + 2);
+  cpu->Step();
+  cpu->Step();
+  EXPECT_EQ(cpu->GetCsr(CSR::mip), 0);
+
+  cpu->SetCsr(CSR::menvcfg, menvcfg_stce);
+  cpu->SetCsr(CSR::stimecmp, clint.GetTime() + 2);
+  cpu->Step();
+  EXPECT_EQ(cpu->GetCsr(CSR::mip), 0);
+  cpu->Step();
+  EXPECT_EQ(cpu->GetCsr(CSR::mip), MIP::stip);
+  // STIP is read-only, only a later deadline clears it
+  cpu->GuestWriteCsr(CSR::mip, 0);
+  EXPECT_EQ(cpu->GetCsr(CSR::mip), MIP::stip);
+  cpu->SetCsr(CSR::stimecmp, mtimecmp_disarmed);
+  EXPECT_EQ(cpu->GetCsr(CSR::mip), 0);
+  cpu->GuestWriteCsr(CSR::mip, MIP::stip);
+  EXPECT_EQ(cpu->GetCsr(CSR::mip), 0);
+}
+
+TEST(ClintTest, SupervisorTimerInterrupt)
+{
+  auto cpu = MakeCpu({wfi, nop});
+  cpu->GetMMU().GetClint().SetTimeMode(TimeMode::InstructionCount);
+  cpu->SetCsr(CSR::menvcfg, menvcfg_stce);
+  cpu->SetCsr(CSR::mcounteren, counteren_tm);
+  cpu->SetCsr(CSR::mideleg, MIP::stip);
+  cpu->SetCsr(CSR::mie, MIP::stip);
+  cpu->SetCsr(CSR::stvec, KERNBASE + 0x200);
+  cpu->SetCsr(CSR::sstatus, mstatus_sie);
+  cpu->SetMode(SUPERVISOR);
+  cpu->GuestWriteCsr(CSR::stimecmp, cpu->GuestReadCsr(CSR::time_csr, false) + 1000000);
+
+  // WFI skips ahead to the deadline and the interrupt goes straight to S-mode
+  cpu->Step();
+  EXPECT_EQ(cpu->GetCsr(CSR::scause), SupervisorTimerInterrupt);
+  EXPECT_EQ(cpu->GetPc(), KERNBASE + 0x200);
+  EXPECT_EQ(cpu->GetMode(), SUPERVISOR);
+}
+
+// Below M-mode stimecmp needs mcounteren.TM and menvcfg.STCE, time needs the TM bits
+TEST(ClintTest, SupervisorTimerAccess)
+{
+  auto cpu = MakeCpu();
+  cpu->SetMode(SUPERVISOR);
+  EXPECT_THROW(cpu->GuestReadCsr(CSR::stimecmp, false), CPUTrapException);
+  EXPECT_THROW(cpu->GuestReadCsr(CSR::time_csr, false), CPUTrapException);
+  cpu->SetCsr(CSR::mcounteren, counteren_tm);
+  EXPECT_THROW(cpu->GuestReadCsr(CSR::stimecmp, false), CPUTrapException);
+  EXPECT_NO_THROW(cpu->GuestReadCsr(CSR::time_csr, false));
+  cpu->SetCsr(CSR::menvcfg, menvcfg_stce);
+  EXPECT_NO_THROW(cpu->GuestReadCsr(CSR::stimecmp, true));
+  // The high halves only exist on RV32
+  EXPECT_THROW(cpu->GuestReadCsr(CSR::stimecmph, false), CPUTrapException);
+
+  cpu->SetMode(USER);
+  EXPECT_THROW(cpu->GuestReadCsr(CSR::time_csr, false), CPUTrapException);
+  cpu->SetCsr(CSR::scounteren, counteren_tm);
+  EXPECT_NO_THROW(cpu->GuestReadCsr(CSR::time_csr, false));
+}
@@ -1,11 +1,5 @@
 #include "gtest/gtest.h"
 #include "cpu.h"
-#include "mmu.h"
-#include "ram.h"
-#include "virtio.h"
-#include "uart.h"
-#include "clint.h"
-#include "plic.h"
 #include "config.h"
 
 class CPUTest : public ::testing::Test
@@ -13,16 +7,9 @@ class CPUTest : public ::testing::Test
 protected:
     void SetUp() override
     {
-        mmu = std::make_unique<MMU>();
-        mmu->add_device(std::make_unique<RAM>(0, MEMORY_SIZE));
-        mmu->add_device(std::make_unique<UART>(UART_BASE, UART_SIZE));
-        mmu->add_device(std::make_unique<VIRTIO>(VIRTIO_BASE, VIRTIO_SIZE));
-        mmu->add_device(std::make_unique<CLINT>(CLINT_BASE, CLINT_SIZE));
-        mmu->add_device(std::make_unique<PLIC>(PLIC_BASE, PLIC_SIZE));
-        cpu = std::make_unique<CPU>(std::move(mmu));
+        cpu = std::make_unique<CPU>(std::make_shared<std::vector<uint8_t>>(), KERNBASE);
     }
 
-    std::unique_ptr<MMU> mmu;
     std::unique_ptr<CPU> cpu;
 };
 
@@ -30,15 +17,17 @@ TEST_F(CPUTest, InstructionTestADDI)
 {
   cpu->RunInstruction(0x00400093); // addi x1, x0, 0x004
   cpu->RunInstruction(0x00408093); // addi x1, x1, 0x004
+  EXPECT_EQ(cpu->GetReg(1), 8);
 }
 
 TEST_F(CPUTest, InstructionTestStore)
 {
   cpu->RunInstruction(0x00400093); // addi x1, x0, 0x004
   cpu->RunInstruction(0x00408093); // addi x1, x1, 0x004
+  cpu->SetReg(3, KERNBASE);
   // Store
-  cpu->RunInstruction(0x10102023); // sw x1, 0x100
+  cpu->RunInstruction(0x1011a023); // sw x1, 0x100(x3)
   // Load
-  cpu->RunInstruction(0x10002103); // lw x2, 0x100
-
-}
\ No newline at end of file
+  cpu->RunInstruction(0x1001a103); // lw x2, 0x100(x3)
+  EXPECT_EQ(cpu->GetReg(2), 8);
+}
@@ -0,0 +1,98 @@
+#include "gtest/gtest.h"
+#include "cpu.h"
+#include "config.h"
+
+// Zicsr encoding, funct3 1-3 are CSRRW/CSRRS/CSRRC and 5-7 their immediate forms
+static uint32_t CsrOp(uint32_t funct3, uint32_t rd, uint32_t rs1, uint32_t csr)
+{
+  return (csr << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | 0x73;
+}
+
+static std::unique_ptr<CPU> MakeCpu(std::vector<uint8_t> binary = std::vector<uint8_t>(4, 0))
+{
+  return std::make_unique<CPU>(std::make_shared<std::vector<uint8_t>>(binary), KERNBASE);
+}
+
+TEST(CsrTest, ReadWriteIsFullWidth)
+{
+  auto cpu = MakeCpu();
+  cpu->SetReg(5, 0x123456789abcdef0);
+  cpu->RunInstruction(CsrOp(1, 0, 5, CSR::mscratch)); // csrw mscratch, t0
+  cpu->RunInstruction(CsrOp(2, 6, 0, CSR::mscratch)); // csrr t1, mscratch
+  EXPECT_EQ(cpu->GetReg(6), 0x123456789abcdef0);
+  cpu->RunInstruction(CsrOp(7, 6, 0x10, CSR::mscratch)); // csrrci t1, mscratch, 16
+  EXPECT_EQ(cpu->GetCsr(CSR::mscratch), 0x123456789abcdee0);
+}
+
+TEST(CsrTest, AccessChecks)
+{
+  auto cpu = MakeCpu();
+  EXPECT_THROW(cpu->RunInstruction(CsrOp(2, 5, 0, 0x7c0)), CPUTrapException); // unimplemented
+  EXPECT_THROW(cpu->RunInstruction(CsrOp(1, 5, 6, CSR::mhartid)), CPUTrapException); // read-only
+  cpu->RunInstruction(CsrOp(2, 5, 0, CSR::mhartid)); // csrr does not write, so it is allowed
+  EXPECT_EQ(cpu->GetReg(5), 0);
+
+  cpu->SetMode(SUPERVISOR);
+  EXPECT_THROW(cpu->RunInstruction(CsrOp(2, 5, 0, CSR::mstatus)), CPUTrapException);
+  cpu->RunInstruction(CsrOp(2, 5, 0, CSR::sstatus));
+  cpu->SetCsr(CSR::mstatus, cpu->GetCsr(CSR::mstatus) | mstatus_tvm);
+  EXPECT_THROW(cpu->RunInstruction(CsrOp(2, 5, 0, CSR::satp)), CPUTrapException);
+}
+
+TEST(CsrTest, WarlMasks)
+{
+  auto cpu = MakeCpu();
+  cpu->SetReg(5, ~0ULL);
+  cpu->RunInstruction(CsrOp(1, 0, 5, CSR::mstatus)); // csrw mstatus, -1
+  const uint64_t status = cpu->GetCsr(CSR::mstatus);
+  EXPECT_EQ(status & mstatus_mpp, mstatus_mpp);
+  EXPECT_EQ(status & (mstatus_uxl | mstatus_sxl), mstatus_xlen64);
+  EXPECT_NE(status & mstatus_sd, 0);
+
+  // MPP = 2 is reserved and leaves the field unchanged
+  cpu->SetReg(5, 2ULL << 11);
+  cpu->RunInstruction(CsrOp(1, 0, 5, CSR::mstatus));
+  EXPECT_EQ(cpu->GetCsr(CSR::mstatus) & mstatus_mpp, mstatus_mpp);
+
+  cpu->SetReg(5, ~0ULL);
+  cpu->RunInstruction(CsrOp(1, 0, 5, CSR::mtvec));
+  EXPECT_EQ(cpu->GetCsr(CSR::mtvec), ~0x2ULL);
+  cpu->RunInstruction(CsrOp(1, 0, 5, CSR::medeleg));
+  EXPECT_EQ(cpu->GetCsr(CSR::medeleg) & (1 << 11), 0); // ecall from M-mode is never delegated
+
+  // Unsupported satp modes are ignored as a whole
+  cpu->SetReg(5, (5ULL << 60) | 0x1234);
+  cpu->RunInstruction(CsrOp(1, 0, 5, CSR::satp));
+  EXPECT_EQ(cpu->GetCsr(CSR::satp), 0);
+}
+
+TEST(CsrTest, SupervisorViews)
+{
+  auto cpu = MakeCpu();
+  cpu->SetReg(5, mstatus_sie | mstatus_mie);
+  cpu->RunInstruction(CsrOp(2, 0, 5, CSR::sstatus)); // csrs sstatus, t0
+  EXPECT_EQ(cpu->GetCsr(CSR::mstatus) & (mstatus_sie | mstatus_mie), mstatus_sie);
+
+  cpu->SetCsr(CSR::mideleg, MIP::stip);
+  cpu->SetReg(5, MIP::stip | MIP::ssip);
+  cpu->RunInstruction(CsrOp(1, 0, 5, CSR::sie)); // csrw sie, t0
+  EXPECT_EQ(cpu->GetCsr(CSR::mie), MIP::stip);
+  cpu->SetCsr(CSR::mie, cpu->GetCsr(CSR::mie) | MIP::mtip);
+  EXPECT_EQ(cpu->GetCsr(CSR::sie), MIP::stip);
+}
+
+// Enabling an already pending interrupt with a CSR write makes it taken after that instruction
+TEST(CsrTest, WritesArmInterrupts)
+{
+  const uint32_t program[] = {CsrOp(2, 0, 5, CSR::mie), CsrOp(1, 0, 0, CSR::mscratch)};
+  std::vector<uint8_t> binary(sizeof(program));
+  std::memcpy(binary.data(), program, sizeof(program));
+  auto cpu = MakeCpu(binary);
+  cpu->SetCsr(CSR::mtvec, KERNBASE + 0x100);
+  cpu->SetCsr(CSR::mip, MIP::msip);
+  cpu->SetCsr(CSR::mstatus, cpu->GetCsr(CSR::mstatus) | mstatus_mie);
+  cpu->SetReg(5, MIP::msip);
+  cpu->Step(); // csrs mie, t0
+  EXPECT_EQ(cpu->GetPc(), KERNBASE + 0x100);
+  EXPECT_EQ(cpu->GetCsr(CSR::mcause), MachineSoftwareInterrupt);
+}
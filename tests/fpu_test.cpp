@@ -0,0 +1,137 @@
+#include "gtest/gtest.h"
+#include "cpu.h"
+#include "config.h"
+#include <bit>
+
+// OP-FP encoding, fmt 0 is single and 1 is double precision
+static uint32_t OpFp(uint32_t funct5, uint32_t fmt, uint32_t rd, uint32_t rs1, uint32_t rs2, uint32_t rm)
+{
+  return (funct5 << 27) | (fmt << 25) | (rs2 << 20) | (rs1 << 15) | (rm << 12) | (rd << 7) | 0x53;
+}
+
+static std::unique_ptr<CPU> MakeCpu()
+{
+  return std::make_unique<CPU>(std::make_shared<std::vector<uint8_t>>(4, 0), KERNBASE);
+}
+
+TEST(FPUTest, DoubleArithmeticAndFlags)
+{
+  auto cpu = MakeCpu();
+  cpu->SetFReg(1, std::bit_cast<uint64_t>(1.0));
+  cpu->SetFReg(2, std::bit_cast<uint64_t>(3.0));
+  cpu->SetCsr(CSR::fflags, 0);
+
+  cpu->RunInstruction(OpFp(0x00, 1, 3, 1, 2, 0)); // fadd.d f3, f1, f2
+  EXPECT_EQ(std::bit_cast<double>(cpu->GetFReg(3)), 4.0);
+  EXPECT_EQ(cpu->GetCsr(CSR::fflags), 0);
+
+  cpu->RunInstruction(OpFp(0x03, 1, 4, 1, 2, 0)); // fdiv.d f4, f1, f2
+  EXPECT_EQ(std::bit_cast<double>(cpu->GetFReg(4)), 1.0 / 3.0);
+  EXPECT_EQ(cpu->GetCsr(CSR::fflags), 0x1); // NX
+
+  cpu->SetFReg(5, 0);
+  cpu->RunInstruction(OpFp(0x03, 1, 6, 1, 5, 0)); // fdiv.d f6, f1, f5
+  EXPECT_EQ(cpu->GetCsr(CSR::fflags), 0x9); // NX | DZ
+  EXPECT_EQ(cpu->GetCsr(CSR::fcsr), 0x9);
+
+  cpu->SetCsr(CSR::fflags, 0);
+  EXPECT_EQ(cpu->GetCsr(CSR::fflags), 0);
+  EXPECT_EQ(cpu->GetCsr(CSR::mstatus) & mstatus_fs, mstatus_fs);
+}
+
+// Host flags raised outside guest FP instructions never reach fflags
+TEST(FPUTest, HostFlagsStayOut)
+{
+  auto cpu = MakeCpu();
+  cpu->SetFReg(1, std::bit_cast<uint64_t>(1.0));
+  cpu->SetFReg(2, std::bit_cast<uint64_t>(3.0));
+  volatile double host = 1.0;
+  host = host / 3.0; // raises inexact on the host
+  EXPECT_EQ(cpu->GetCsr(CSR::fflags), 0);
+  cpu->RunInstruction(OpFp(0x00, 1, 3, 1, 2, 0)); // fadd.d f3, f1, f2
+  EXPECT_EQ(cpu->GetCsr(CSR::fflags), 0);
+  host = host / 3.0;
+  EXPECT_EQ(cpu->GetCsr(CSR::fflags), 0);
+}
+
+TEST(FPUTest, NanBoxing)
+{
+  auto cpu = MakeCpu();
+  cpu->SetReg(1, std::bit_cast<uint32_t>(1.5f));
+  cpu->RunInstruction(0xf0008153); // fmv.w.x f2, x1
+  EXPECT_EQ(cpu->GetFReg(2), 0xffffffff00000000 | std::bit_cast<uint32_t>(1.5f));
+
+  cpu->RunInstruction(OpFp(0x00, 0, 3, 2, 2, 0)); // fadd.s f3, f2, f2
+  EXPECT_EQ(cpu->GetFReg(3), 0xffffffff00000000 | std::bit_cast<uint32_t>(3.0f));
+
+  // A double in a single precision operand is not boxed and reads as the canonical NaN
+  cpu->SetFReg(4, std::bit_cast<uint64_t>(1.0));
+  cpu->RunInstruction(OpFp(0x00, 0, 5, 4, 2, 0)); // fadd.s f5, f4, f2
+  EXPECT_EQ(cpu->GetFReg(5), 0xffffffff7fc00000);
+}
+
+TEST(FPUTest, ConversionRoundingAndSaturation)
+{
+  auto cpu = MakeCpu();
+  cpu->SetFReg(1, std::bit_cast<uint64_t>(2.5));
+  cpu->SetFReg(2, std::bit_cast<uint64_t>(-2.5));
+
+  cpu->RunInstruction(OpFp(0x18, 1, 10, 1, 0, 0)); // fcvt.w.d a0, f1, rne
+  EXPECT_EQ(cpu->GetReg(10), 2);
+  cpu->RunInstruction(OpFp(0x18, 1, 10, 1, 0, 3)); // fcvt.w.d a0, f1, rup
+  EXPECT_EQ(cpu->GetReg(10), 3);
+  cpu->RunInstruction(OpFp(0x18, 1, 10, 2, 0, 1)); // fcvt.w.d a0, f2, rtz
+  EXPECT_EQ(cpu->GetReg(10), static_cast<uint64_t>(-2));
+  cpu->SetCsr(CSR::frm, 2);
+  cpu->RunInstruction(OpFp(0x18, 1, 10, 1, 0, 7)); // fcvt.w.d a0, f1, dyn (rdn)
+  EXPECT_EQ(cpu->GetReg(10), 2);
+  cpu->RunInstruction(OpFp(0x18, 1, 10, 2, 0, 7)); // fcvt.w.d a0, f2, dyn (rdn)
+  EXPECT_EQ(cpu->GetReg(10), static_cast<uint64_t>(-3));
+  EXPECT_EQ(cpu->GetCsr(CSR::fcsr), (2 << 5) | 0x1);
+
+  // Out of range values saturate and only raise NV
+  cpu->SetCsr(CSR::fcsr, 0);
+  cpu->SetFReg(3, std::bit_cast<uint64_t>(1e20));
+  cpu->RunInstruction(OpFp(0x18, 1, 10, 3, 0, 0)); // fcvt.w.d a0, f3
+  EXPECT_EQ(cpu->GetReg(10), 0x7fffffff);
+  EXPECT_EQ(cpu->GetCsr(CSR::fflags), 0x10);
+  cpu->RunInstruction(OpFp(0x18, 1, 10, 2, 1, 0)); // fcvt.wu.d a0, f2
+  EXPECT_EQ(cpu->GetReg(10), 0);
+
+  // Reserved rounding modes are illegal
+  EXPECT_THROW(cpu->RunInstruction(OpFp(0x00, 1, 3, 1, 2, 5)), CPUTrapException);
+}
+
+TEST(FPUTest, CompareAndClassify)
+{
+  auto cpu = MakeCpu();
+  cpu->SetFReg(1, std::bit_cast<uint64_t>(-0.0));
+  cpu->SetFReg(2, std::bit_cast<uint64_t>(0.0));
+  cpu->SetFReg(3, 0x7ff8000000000000); // quiet NaN
+
+  cpu->RunInstruction(OpFp(0x14, 1, 10, 1, 2, 2)); // feq.d a0, f1, f2
+  EXPECT_EQ(cpu->GetReg(10), 1);
+  cpu->RunInstruction(OpFp(0x05, 1, 4, 1, 2, 0)); // fmin.d f4, f1, f2
+  EXPECT_EQ(cpu->GetFReg(4), std::bit_cast<uint64_t>(-0.0));
+  cpu->RunInstruction(OpFp(0x05, 1, 4, 3, 2, 1)); // fmax.d f4, f3, f2
+  EXPECT_EQ(cpu->GetFReg(4), std::bit_cast<uint64_t>(0.0));
+
+  cpu->SetCsr(CSR::fflags, 0);
+  cpu->RunInstruction(OpFp(0x14, 1, 10, 3, 2, 2)); // feq.d a0, f3, f2
+  EXPECT_EQ(cpu->GetReg(10), 0);
+  EXPECT_EQ(cpu->GetCsr(CSR::fflags), 0);
+  cpu->RunInstruction(OpFp(0x14, 1, 10, 3, 2, 1)); // flt.d a0, f3, f2
+  EXPECT_EQ(cpu->GetCsr(CSR::fflags), 0x10);
+
+  cpu->RunInstruction(OpFp(0x1c, 1, 10, 1, 0, 1)); // fclass.d a0, f1
+  EXPECT_EQ(cpu->GetReg(10), 1 << 3);
+  cpu->RunInstruction(OpFp(0x1c, 1, 10, 3, 0, 1)); // fclass.d a0, f3
+  EXPECT_EQ(cpu->GetReg(10), 1 << 9);
+}
+
+TEST(FPUTest, DisabledUnitTraps)
+{
+  auto cpu = MakeCpu();
+  cpu->SetCsr(CSR::mstatus, 0);
+  EXPECT_THROW(cpu->RunInstruction(OpFp(0x00, 1, 3, 1, 2, 0)), CPUTrapException);
+}
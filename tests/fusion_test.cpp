@@ -0,0 +1,119 @@
+#include "gtest/gtest.h"
+#include "cpu.h"
+#include "config.h"
+
+static constexpr uint32_t t0 = 5, t1 = 6, t2 = 7, a0 = 10, a1 = 11, a2 = 12, a3 = 13, ra = 1;
+
+static uint32_t U(uint32_t imm20, uint32_t rd, uint32_t opcode) { return (imm20 << 12) | (rd << 7) | opcode; }
+static uint32_t I(int32_t imm, uint32_t rs1, uint32_t funct3, uint32_t rd, uint32_t opcode)
+{
+  return ((static_cast<uint32_t>(imm) & 0xfff) << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+static uint32_t Branch(uint32_t funct3, uint32_t rs1, int32_t offset)
+{
+  const uint32_t imm = static_cast<uint32_t>(offset);
+  return (((imm >> 12) & 1) << 31) | (((imm >> 5) & 0x3f) << 25) | (rs1 << 15) | (funct3 << 12)
+       | (((imm >> 1) & 0xf) << 8) | (((imm >> 11) & 1) << 7) | 0x63;
+}
+
+static constexpr uint32_t loop = 0x0000006f; // j .
+
+// Every fusable pair once, with the negative offsets and sign extensions the halves have to agree on
+static const std::vector<uint32_t> program = {
+  U(0x12345, a0, 0x37), I(-1, a0, 0b000, a0, 0x1b),      // lui a0, 0x12345; addiw a0, a0, -1
+  U(0x80000, a1, 0x37), I(0x7ff, a1, 0b000, a1, 0x13),   // lui a1, 0x80000; addi a1, a1, 2047
+  U(0, t0, 0x17), I(0x100 - 16, t0, 0b011, t1, 0x03),     // auipc t0, 0; ld t1, 240(t0)
+  U(1, t0, 0x17), I(-0x7f8, t0, 0b010, t2, 0x03),        // auipc t0, 1; lw t2, -2040(t0)
+  I(32, a1, 0b001, a2, 0x13), I(32, a2, 0b101, a2, 0x13), // slli a2, a1, 32; srli a2, a2, 32
+  I(0, a1, 0b010, a3, 0x13), Branch(0b001, a3, 8),        // slti a3, a1, 0; bnez a3, +8
+  loop,
+  U(0, ra, 0x17), I(12, ra, 0b000, ra, 0x67),             // auipc ra, 0; jalr ra, 12(ra)
+  loop,
+  I(7, a0, 0b011, a3, 0x13), Branch(0b000, a3, 8),        // sltiu a3, a0, 7; beqz a3, +8
+  loop,
+  loop,
+};
+
+static std::unique_ptr<CPU> MakeCpu()
+{
+  auto binary = std::make_shared<std::vector<uint8_t>>(0x828);
+  std::memcpy(binary->data(), program.data(), program.size() * 4);
+  const uint64_t doubleword = 0xfedcba9876543210;
+  const uint32_t word = 0x89abcdef;
+  std::memcpy(binary->data() + 0x100, &doubleword, sizeof(doubleword));
+  std::memcpy(binary->data() + 0x820, &word, sizeof(word));
+  return std::make_unique<CPU>(binary, KERNBASE);
+}
+
+static auto State(CPU& cpu)
+{
+  std::vector<uint64_t> state = {cpu.GetPc(), cpu.GetInstret(), cpu.GetCsr(CSR::mepc), cpu.GetCsr(CSR::mcause)};
+  for(int reg = 0; reg < 32; reg++)
+  {
+    state.push_back(cpu.GetReg(reg));
+  }
+  return state;
+}
+
+TEST(FusionTest, MatchesStep)
+{
+  auto stepped = MakeCpu();
+  for(int i = 0; i < 20; i++)
+  {
+    stepped->Step();
+  }
+  auto fused = MakeCpu();
+  EXPECT_EQ(fused->RunBlocks(20), 20);
+  EXPECT_EQ(State(*fused), State(*stepped));
+
+  EXPECT_EQ(fused->GetReg(a0), 0x12344fff);
+  EXPECT_EQ(fused->GetReg(a1), 0xffffffff800007ff);
+  EXPECT_EQ(fused->GetReg(t1), 0xfedcba9876543210);
+  EXPECT_EQ(fused->GetReg(t2), 0xffffffff89abcdef);
+  EXPECT_EQ(fused->GetReg(a2), 0x800007ff);
+  EXPECT_EQ(fused->GetPc(), KERNBASE + 0x4c);
+  for(size_t kind = 1; kind < FUSION_KINDS; kind++)
+  {
+    EXPECT_GE(fused->GetBlocks().GetStats().fused[kind], 1) << FusionName(static_cast<Fusion>(kind));
+  }
+}
+
+// A fault in the second half leaves the first retired and the trap on the load
+TEST(FusionTest, TrapInSecondHalf)
+{
+  auto run = [](bool blocks)
+  {
+    auto cpu = MakeCpu();
+    cpu->SetCsr(CSR::mtvec, KERNBASE + 0x30); // the first j .
+    cpu->Store(KERNBASE, 4, U(0, t0, 0x17));
+    cpu->Store(KERNBASE + 4, 4, I(-8, t0, 0b011, t1, 0x03)); // ld t1, -8(t0), below RAM
+    if(blocks)
+    {
+      cpu->RunBlocks(3);
+    }
+    else
+    {
+      for(int i = 0; i < 3; i++)
+      {
+        cpu->Step();
+      }
+    }
+    return State(*cpu);
+  };
+  const auto stepped = run(false);
+  EXPECT_EQ(run(true), stepped);
+  EXPECT_EQ(stepped[2], KERNBASE + 4);
+  EXPECT_EQ(stepped[4 + t0], KERNBASE);
+}
+
+// A timer deadline between the halves splits the pair
+TEST(FusionTest, DeadlineSplitsPair)
+{
+  auto cpu = MakeCpu();
+  EXPECT_EQ(cpu->RunBlocks(1), 1);
+  EXPECT_EQ(cpu->GetPc(), KERNBASE + 4);
+  EXPECT_EQ(cpu->GetReg(a0), 0x12345000);
+  EXPECT_EQ(cpu->RunBlocks(1), 1);
+  EXPECT_EQ(cpu->GetReg(a0), 0x12344fff);
+  EXPECT_EQ(cpu->GetBlocks().GetStats().fused[static_cast<size_t>(Fusion::LoadImmediate)], 0);
+}
@@ -0,0 +1,165 @@
+#include "gtest/gtest.h"
+#include "cpu.h"
+#include "config.h"
+#include "gdb_stub.h"
+#include <cstring>
+
+static constexpr uint32_t addi_t1_1 = 0x00130313; // addi t1, t1, 1
+static constexpr uint32_t ld_t1_t0 = 0x0002b303;  // ld t1, 0(t0)
+static constexpr uint32_t ebreak = 0x00100073;
+static constexpr uint32_t loop = 0x0000006f;      // j .
+static constexpr uint64_t data_addr = KERNBASE + 0x100;
+
+static std::unique_ptr<CPU> MakeCpu(int xlen = 64)
+{
+  const std::vector<uint32_t> program = {addi_t1_1, ld_t1_t0, ebreak, loop};
+  auto binary = std::make_shared<std::vector<uint8_t>>(program.size() * 4);
+  std::memcpy(binary->data(), program.data(), binary->size());
+  auto cpu = std::make_unique<CPU>(binary, KERNBASE, MEMORY_SIZE, true, xlen);
+  cpu->SetDebugHalt(true);
+  return cpu;
+}
+
+// Serve's view of the session, one reply per packet
+class Session
+{
+  public:
+    Session(CPU& cpu) : stub(cpu) {}
+
+    std::string operator()(const std::string& packet)
+    {
+      std::string reply;
+      open = stub.HandlePacket(packet, reply);
+      return reply;
+    }
+
+    GDBStub stub;
+    bool open = true;
+};
+
+TEST(GDBStubTest, Registers)
+{
+  auto cpu = MakeCpu();
+  Session gdb(*cpu);
+  cpu->SetReg(6, 0x1122334455667788);
+  const std::string regs = gdb("g");
+  ASSERT_EQ(regs.size(), 33u * 16);
+  EXPECT_EQ(regs.substr(6 * 16, 16), "8877665544332211");
+  EXPECT_EQ(regs.substr(32 * 16), "0000008000000000");
+  EXPECT_EQ(gdb("p6"), "8877665544332211");
+  EXPECT_EQ(gdb("P7=0100000000000000"), "OK");
+  EXPECT_EQ(cpu->GetReg(7), 1);
+  EXPECT_EQ(gdb("P0=0100000000000000"), "OK");
+  EXPECT_EQ(cpu->GetReg(0), 0);
+
+  std::string all = regs;
+  all.replace(7 * 16, 16, "0200000000000000");
+  EXPECT_EQ(gdb("G" + all), "OK");
+  EXPECT_EQ(cpu->GetReg(7), 2);
+  EXPECT_EQ(cpu->GetReg(6), 0x1122334455667788);
+
+  // Malformed packets are refused and change nothing
+  for(const char* bad : {"p", "pzz", "p21", "P7", "P7=", "P7=01", "Pq=0100000000000000", "G00", "G"})
+  {
+    EXPECT_EQ(gdb(bad), "E01") << bad;
+  }
+  all.replace(7 * 16, 2, "xy");
+  EXPECT_EQ(gdb("G" + all), "E01");
+  EXPECT_EQ(cpu->GetReg(7), 2);
+  EXPECT_TRUE(gdb.open);
+}
+
+TEST(GDBStubTest, Memory)
+{
+  auto cpu = MakeCpu();
+  Session gdb(*cpu);
+  EXPECT_EQ(gdb("m80000000,4"), "13031300");
+  EXPECT_EQ(gdb("M80000100,3:aabbcc"), "OK");
+  EXPECT_EQ(gdb("m80000100,4"), "aabbcc00");
+  // Nothing reads the devices
+  EXPECT_EQ(gdb("m10000000,4"), "E14");
+
+  for(const char* bad : {"m", "m,4", "m80000000", "m80000000,", "mxyz,4", "m80000000,4z", "M80000100,2",
+                         "M80000100,2:aa", "M80000100,1:zz", "M,1:aa"})
+  {
+    EXPECT_EQ(gdb(bad), "E01") << bad;
+  }
+  EXPECT_EQ(gdb("m80000100,4"), "aabbcc00");
+}
+
+TEST(GDBStubTest, Breakpoints)
+{
+  auto cpu = MakeCpu();
+  Session gdb(*cpu);
+  EXPECT_EQ(gdb("Z0,80000004,4"), "OK");
+  EXPECT_EQ(gdb("m80000004,4"), "73001000");
+  EXPECT_EQ(gdb("c"), "S05");
+  EXPECT_EQ(cpu->GetPc(), KERNBASE + 4);
+  EXPECT_EQ(cpu->GetReg(6), 1);
+  EXPECT_EQ(gdb("z0,80000004,4"), "OK");
+  EXPECT_EQ(gdb("m80000004,4"), "03b30200");
+
+  for(const char* bad : {"Z0", "Z0,", "Z0,xyz,4", "Z0x80000004,4", "z0,80000004"})
+  {
+    EXPECT_EQ(gdb(bad), "E01") << bad;
+  }
+  EXPECT_EQ(gdb("Z9,80000004,4"), "");
+}
+
+TEST(GDBStubTest, Watchpoints)
+{
+  auto cpu = MakeCpu();
+  Session gdb(*cpu);
+  cpu->SetReg(5, data_addr);
+  EXPECT_EQ(gdb("Z2,80000100,8"), "OK");
+  EXPECT_EQ(gdb("Z3,80000100,8"), "OK");
+  EXPECT_EQ(gdb("z2,80000100,8"), "OK");
+  EXPECT_EQ(gdb("z2,80000100,8"), "E01");
+  EXPECT_EQ(gdb("z3,80000100,8"), "OK");
+
+  // A debugger read of the watched address is not a hit
+  EXPECT_EQ(gdb("Z4,80000100,8"), "OK");
+  EXPECT_EQ(gdb("m80000100,8"), "0000000000000000");
+  EXPECT_EQ(gdb("c"), "T05awatch:80000100;");
+  EXPECT_EQ(cpu->GetPc(), KERNBASE + 8);
+  EXPECT_EQ(gdb("z4,80000100,8"), "OK");
+}
+
+TEST(GDBStubTest, StepAndContinue)
+{
+  auto cpu = MakeCpu();
+  Session gdb(*cpu);
+  cpu->SetReg(5, data_addr);
+  EXPECT_EQ(gdb("s"), "S05");
+  EXPECT_EQ(cpu->GetPc(), KERNBASE + 4);
+  EXPECT_EQ(gdb("s80000000"), "S05");
+  EXPECT_EQ(cpu->GetPc(), KERNBASE + 4);
+  EXPECT_EQ(cpu->GetReg(6), 2);
+  EXPECT_EQ(gdb("sXYZ"), "E01");
+  EXPECT_EQ(gdb("c80000000z"), "E01");
+  EXPECT_EQ(cpu->GetPc(), KERNBASE + 4);
+  EXPECT_EQ(gdb("c"), "S05");
+  EXPECT_EQ(cpu->GetPc(), KERNBASE + 8);
+
+  EXPECT_EQ(gdb("X"), "");
+  EXPECT_TRUE(gdb.open);
+  EXPECT_EQ(gdb("D"), "OK");
+  EXPECT_FALSE(gdb.open);
+}
+
+TEST(GDBStubTest, Rv32Layout)
+{
+  auto cpu = MakeCpu(32);
+  Session gdb(*cpu);
+  const std::string xml = gdb("qXfer:features:read:target.xml:0,1000");
+  EXPECT_NE(xml.find("riscv:rv32"), std::string::npos);
+  EXPECT_NE(xml.find("bitsize=\"32\""), std::string::npos);
+  EXPECT_EQ(xml.find("bitsize=\"64\""), std::string::npos);
+  EXPECT_EQ(gdb("qXfer:features:read:target.xml:zz"), "E01");
+
+  EXPECT_EQ(gdb("g").size(), 33u * 8);
+  EXPECT_EQ(gdb("p20"), "00000080");
+  EXPECT_EQ(gdb("P6=ffffffff"), "OK");
+  EXPECT_EQ(cpu->GetReg(6), ~0ULL);
+  EXPECT_EQ(gdb("P6=0100000000000000"), "E01");
+}
@@ -0,0 +1,124 @@
+#include "gtest/gtest.h"
+#include "cpu.h"
+#include "config.h"
+#include "checkpoint.h"
+#include <cstdio>
+#include <chrono>
+#include <thread>
+
+static std::unique_ptr<CPU> MakeCpu()
+{
+  auto cpu = std::make_unique<CPU>(std::make_shared<std::vector<uint8_t>>(4, 0), KERNBASE);
+  cpu->SetCsr(CSR::mtvec, KERNBASE + 0x100);
+  cpu->SetCsr(CSR::stvec, KERNBASE + 0x200);
+  cpu->SetCsr(CSR::mie, MIP::ssip | MIP::msip | MIP::stip | MIP::mtip | MIP::seip | MIP::meip);
+  return cpu;
+}
+
+TEST(InterruptTest, Priority)
+{
+  auto cpu = MakeCpu();
+  cpu->SetMode(USER);
+  cpu->SetCsr(CSR::mip, MIP::mtip | MIP::msip | MIP::seip);
+  cpu->HandleInterrupts();
+  EXPECT_EQ(cpu->GetCsr(CSR::mcause), MachineSoftwareInterrupt);
+  EXPECT_EQ(cpu->GetPc(), KERNBASE + 0x100);
+
+  // Pending bits are level, the handler clears the source
+  cpu->SetMode(USER);
+  cpu->SetCsr(CSR::mip, MIP::mtip | MIP::seip);
+  cpu->HandleInterrupts();
+  EXPECT_EQ(cpu->GetCsr(CSR::mcause), MachineTimerInterrupt);
+  cpu->SetMode(USER);
+  cpu->SetCsr(CSR::mip, MIP::seip);
+  cpu->HandleInterrupts();
+  EXPECT_EQ(cpu->GetCsr(CSR::mcause), SupervisorExternalInterrupt);
+}
+
+TEST(InterruptTest, Delegation)
+{
+  auto cpu = MakeCpu();
+  cpu->SetCsr(CSR::mideleg, MIP::stip);
+  cpu->SetCsr(CSR::mip, MIP::stip);
+
+  // Never taken in M-mode, even with MIE set
+  cpu->SetCsr(CSR::mstatus, cpu->GetCsr(CSR::mstatus) | mstatus_mie);
+  cpu->HandleInterrupts();
+  EXPECT_EQ(cpu->GetPc(), KERNBASE);
+
+  // In S-mode only with SIE set
+  cpu->SetMode(SUPERVISOR);
+  cpu->HandleInterrupts();
+  EXPECT_EQ(cpu->GetPc(), KERNBASE);
+  cpu->SetCsr(CSR::sstatus, mstatus_sie);
+  cpu->HandleInterrupts();
+  EXPECT_EQ(cpu->GetMode(), SUPERVISOR);
+  EXPECT_EQ(cpu->GetCsr(CSR::scause), SupervisorTimerInterrupt);
+  EXPECT_EQ(cpu->GetPc(), KERNBASE + 0x200);
+
+  // Interrupts for M-mode go first regardless of their priority
+  cpu->SetCsr(CSR::sstatus, mstatus_sie);
+  cpu->SetCsr(CSR::mip, MIP::stip | MIP::ssip);
+  cpu->HandleInterrupts();
+  EXPECT_EQ(cpu->GetMode(), MACHINE);
+  EXPECT_EQ(cpu->GetCsr(CSR::mcause), SupervisorSoftwareInterrupt);
+}
+
+TEST(InterruptTest, DeviceLines)
+{
+  auto cpu = MakeCpu();
+  cpu->RaiseInterrupt(MIP::seip);
+  EXPECT_EQ(cpu->GetCsr(CSR::mip), MIP::seip);
+
+  // A read-modify-write of mip must not latch the line
+  cpu->GuestWriteCsr(CSR::mip, cpu->GuestReadCsr(CSR::mip, true) | MIP::ssip);
+  cpu->LowerInterrupt(MIP::seip);
+  EXPECT_EQ(cpu->GetCsr(CSR::mip), MIP::ssip);
+}
+
+// Lines are rebuilt from their sources on restore and never latched into mip
+TEST(InterruptTest, CheckpointKeepsLinesOut)
+{
+  const std::string path = testing::TempDir() + "interrupt_test.ckpt";
+  auto cpu = MakeCpu();
+  cpu->Store(CLINT_BASE + clint_mtimecmp, 8, 0);
+  cpu->RaiseInterrupt(MIP::meip);
+  cpu->SetCsr(CSR::mip, MIP::ssip);
+  EXPECT_EQ(cpu->GetCsr(CSR::mip), MIP::ssip | MIP::mtip | MIP::meip);
+  SaveCheckpoint(*cpu, path, false);
+
+  auto restored = MakeCpu();
+  RestoreCheckpoint(*restored, path);
+  std::remove(path.c_str());
+  EXPECT_EQ(restored->GetCsr(CSR::mip), MIP::ssip | MIP::mtip);
+  restored->Store(CLINT_BASE + clint_mtimecmp, 8, mtimecmp_disarmed);
+  EXPECT_EQ(restored->GetCsr(CSR::mip), MIP::ssip);
+}
+
+TEST(InterruptTest, RaiseWakesParkedHart)
+{
+  auto cpu = MakeCpu();
+  cpu->HandleInterrupts(); // consume the initial check
+  std::thread device([&cpu] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    cpu->RaiseInterrupt(MIP::meip);
+  });
+  cpu->WaitForInterrupt();
+  device.join();
+  cpu->SetMode(SUPERVISOR);
+  cpu->HandleInterrupts();
+  EXPECT_EQ(cpu->GetCsr(CSR::mcause), MachineExternalInterrupt);
+}
+
+TEST(InterruptTest, StopWakesParkedHart)
+{
+  auto cpu = MakeCpu();
+  std::thread host([&cpu] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    cpu->RequestStop();
+  });
+  cpu->WaitForInterrupt();
+  host.join();
+  // The stop is still pending for RunBlocks
+  EXPECT_EQ(cpu->RunBlocks(100), 0u);
+}
@@ -0,0 +1,131 @@
+#include "gtest/gtest.h"
+#include "machine.h"
+#include "config.h"
+#include <cstring>
+#include <thread>
+
+static constexpr uint64_t device_base = 0x40000000;
+
+static std::vector<uint8_t> Program(const std::vector<uint32_t>& instructions)
+{
+  std::vector<uint8_t> bytes(instructions.size() * 4);
+  std::memcpy(bytes.data(), instructions.data(), bytes.size());
+  return bytes;
+}
+
+static uint32_t AddiT1(uint32_t imm)
+{
+  return (imm << 20) | (6 << 7) | 0x13; // addi t1, zero, imm
+}
+
+static constexpr uint32_t loop = 0x0000006f;            // j .
+static constexpr uint32_t wfi = 0x10500073;
+static constexpr uint32_t lui_t2_device = 0x400003b7;   // lui t2, 0x40000
+static constexpr uint32_t sw_t1_t2 = 0x0063a023;        // sw t1, 0(t2)
+static constexpr uint32_t lw_t3_t2 = 0x0003ae03;        // lw t3, 0(t2)
+static constexpr uint32_t auipc_t0_page = 0x00001297;   // auipc t0, 0x1
+static constexpr uint32_t sd_t1_t0 = 0x0062b023;        // sd t1, 0(t0)
+
+TEST(MachineTest, RunForBudget)
+{
+  auto machine = MachineBuilder().Ram(0x200000).Image(KERNBASE, Program({loop})).Build();
+  RunResult run = machine->RunFor(100);
+  EXPECT_EQ(run.executed, 100);
+  EXPECT_EQ(run.reason, StopReason::Budget);
+  run = machine->RunFor(50);
+  EXPECT_EQ(run.executed, 50);
+  EXPECT_EQ(machine->GetCpu().GetInstret(), 150);
+}
+
+// An odd tohost value exits with value >> 1 at the end of the block that wrote it,
+// and the exit hook runs once
+TEST(MachineTest, ExitThroughTohost)
+{
+  int exits = 0;
+  uint64_t code = 0;
+  auto machine = MachineBuilder()
+                   .Ram(0x200000)
+                   .Image(KERNBASE, Program({auipc_t0_page, AddiT1(7), sd_t1_t0, loop}))
+                   .Tohost(KERNBASE + 0x1000)
+                   .OnExit([&](Machine&, uint64_t exit_code) { exits++; code = exit_code; })
+                   .Build();
+  RunResult run = machine->RunFor(1000);
+  EXPECT_EQ(run.executed, 4);
+  EXPECT_EQ(run.reason, StopReason::Exit);
+  EXPECT_EQ(code, 3);
+  run = machine->RunFor(1000);
+  EXPECT_EQ(run.executed, 0);
+  EXPECT_EQ(run.reason, StopReason::Exit);
+  EXPECT_EQ(exits, 1);
+}
+
+TEST(MachineTest, MmioHooks)
+{
+  uint64_t stored = 0;
+  auto machine = MachineBuilder()
+                   .Ram(0x200000)
+                   .Image(KERNBASE, Program({lui_t2_device, AddiT1(42), sw_t1_t2, lw_t3_t2, loop}))
+                   .Device(device_base, 0x1000,
+                           [](Machine&, uint64_t offset, int size) { return offset + size; },
+                           [&](Machine&, uint64_t offset, int size, uint64_t data) { stored = data; })
+                   .Build();
+  machine->RunFor(4);
+  EXPECT_EQ(stored, 42);
+  EXPECT_EQ(machine->GetCpu().GetReg(28), 4);
+
+  // A hook can end the run
+  auto exiting = MachineBuilder()
+                   .Ram(0x200000)
+                   .Image(KERNBASE, Program({lui_t2_device, AddiT1(42), sw_t1_t2, loop}))
+                   .Device(device_base, 0x1000, nullptr,
+                           [](Machine& machine, uint64_t offset, int size, uint64_t data) { machine.Exit(data); })
+                   .Build();
+  const RunResult run = exiting->RunFor(1000);
+  EXPECT_EQ(run.executed, 3);
+  EXPECT_EQ(exiting->GetExitCode(), 42);
+
+  EXPECT_THROW(MachineBuilder().Ram(0x200000).Device(KERNBASE, 0x1000, nullptr, nullptr).Build(), std::runtime_error);
+  EXPECT_THROW(MachineBuilder().Ram(0x200000).Device(CLINT_BASE, 0x1000, nullptr, nullptr).Build(), std::runtime_error);
+}
+
+// WFI hands the thread back instead of parking it
+TEST(MachineTest, IdleReturns)
+{
+  auto machine = MachineBuilder().Ram(0x200000).Image(KERNBASE, Program({wfi, loop})).Build();
+  const RunResult run = machine->RunFor(1000);
+  EXPECT_EQ(run.executed, 1);
+  EXPECT_EQ(run.reason, StopReason::Idle);
+}
+
+TEST(MachineTest, ConcurrentMachines)
+{
+  constexpr int count = 64;
+  std::vector<std::unique_ptr<Machine>> machines;
+  for(int i = 0; i < count; i++)
+  {
+    machines.push_back(MachineBuilder()
+                         .Ram(0x200000)
+                         .Image(KERNBASE, Program({auipc_t0_page, AddiT1(2 * i + 1), sd_t1_t0, loop}))
+                         .Tohost(KERNBASE + 0x1000)
+                         .Build());
+  }
+  std::vector<std::thread> workers;
+  for(int t = 0; t < 4; t++)
+  {
+    workers.emplace_back([&, t]
+    {
+      for(int i = t; i < count; i += 4)
+      {
+        machines[i]->RunFor(1000);
+      }
+    });
+  }
+  for(auto& worker : workers)
+  {
+    worker.join();
+  }
+  for(int i = 0; i < count; i++)
+  {
+    EXPECT_EQ(machines[i]->GetExitCode(), i);
+  }
+}
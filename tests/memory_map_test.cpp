@@ -0,0 +1,103 @@
+#include "gtest/gtest.h"
+#include "memory_map.h"
+#include "cpu.h"
+#include "config.h"
+
+TEST(MemoryMapTest, Regions)
+{
+  MemoryMap memory;
+  memory.AddRegion(0x1000, 0x10000, true);
+  memory.AddRegion(KERNBASE, 0x400000);
+  EXPECT_THROW(memory.AddRegion(KERNBASE + 0x200000, 0x1000), std::runtime_error); // overlap
+  EXPECT_THROW(memory.AddRegion(0x20000, 0x800), std::runtime_error);              // not page sized
+
+  uint64_t data;
+  EXPECT_TRUE(memory.Store(KERNBASE + 0x3ffff8, 8, 0x1122334455667788));
+  EXPECT_TRUE(memory.Load(KERNBASE + 0x3ffff8, 8, data));
+  EXPECT_EQ(data, 0x1122334455667788);
+  EXPECT_FALSE(memory.Load(KERNBASE + 0x3ffffc, 8, data)); // runs off the end of the region
+  EXPECT_FALSE(memory.Load(0x0, 8, data));
+
+  // ROM only takes images
+  const uint32_t image = 0x00000013;
+  memory.Write(0x1000, reinterpret_cast<const uint8_t*>(&image), sizeof(image));
+  EXPECT_TRUE(memory.Load(0x1000, 4, data));
+  EXPECT_EQ(data, image);
+  EXPECT_FALSE(memory.Store(0x1000, 4, 0));
+  EXPECT_EQ(memory.HostAddress(0x1000, true), nullptr);
+}
+
+// A region that starts and ends inside 2 MB chunks mixes 4 KB tables and 2 MB leaves
+TEST(MemoryMapTest, PartialChunks)
+{
+  MemoryMap memory;
+  const uint64_t base = KERNBASE + 0x1ff000;
+  RAM& region = memory.AddRegion(base, 0x602000);
+  uint8_t* host = region.GetHostMemory();
+  for(uint64_t offset = 0; offset < region.GetSize(); offset += 0x1000)
+  {
+    ASSERT_EQ(memory.HostAddress(base + offset + 8, false), host + offset + 8);
+  }
+  EXPECT_EQ(memory.HostAddress(base - 1, false), nullptr);
+  EXPECT_EQ(memory.HostAddress(base + 0x602000, false), nullptr);
+
+  // An access crossing the chunk boundary stays inside the region
+  uint64_t data;
+  EXPECT_TRUE(memory.Store(KERNBASE + 0x1ffffc, 8, 0xaabbccdd11223344));
+  EXPECT_TRUE(memory.Load(KERNBASE + 0x1ffffc, 8, data));
+  EXPECT_EQ(data, 0xaabbccdd11223344);
+}
+
+// Untouched guest memory costs no host memory, so a large guest is cheap to create
+TEST(MemoryMapTest, LargeGuest)
+{
+  auto cpu = std::make_unique<CPU>(std::make_shared<std::vector<uint8_t>>(4, 0), KERNBASE, 16ULL << 30);
+  const uint64_t last = KERNBASE + (16ULL << 30) - 8;
+  cpu->Store(last, 8, 0x5a5a5a5a5a5a5a5a);
+  uint64_t data;
+  cpu->Load(last, 8, data);
+  EXPECT_EQ(data, 0x5a5a5a5a5a5a5a5a);
+  EXPECT_THROW(cpu->Load(last + 8, 8, data), CPUTrapException);
+}
+
+TEST(MemoryMapTest, DirtyEpochs)
+{
+  MemoryMap memory;
+  memory.AddRegion(KERNBASE, 0x400000);
+  const uint64_t page = KERNBASE >> 12;
+  memory.HoldEpoch(0);
+  memory.Store(KERNBASE + 0x1000, 8, 1);
+  memory.Store(KERNBASE + 0x2ffc, 8, 1); // crosses into the next page
+  EXPECT_EQ(memory.DirtyPages(0), (std::vector<uint64_t>{page + 1, page + 2, page + 3}));
+
+  EXPECT_EQ(memory.AdvanceEpoch(), 1);
+  memory.Store(KERNBASE + 0x5000, 1, 1);
+  memory.Write(KERNBASE + 0x1000, reinterpret_cast<const uint8_t*>("x"), 1);
+  EXPECT_EQ(memory.DirtyPages(1), (std::vector<uint64_t>{page + 1, page + 5}));
+  EXPECT_EQ(memory.DirtyPages(0), (std::vector<uint64_t>{page + 1, page + 2, page + 3, page + 5}));
+  EXPECT_TRUE(memory.IsDirty(KERNBASE + 0x2000, 0));
+  EXPECT_FALSE(memory.IsDirty(KERNBASE + 0x2000, 1));
+
+  // Without the history of epoch 0 the query falls back to every page ever written
+  EXPECT_EQ(memory.AdvanceEpoch(), 2);
+  memory.HoldEpoch(1);
+  memory.ReleaseEpoch(0);
+  EXPECT_EQ(memory.DirtyPages(0).size(), 4);
+  EXPECT_EQ(memory.DirtyPages(1), (std::vector<uint64_t>{page + 1, page + 5}));
+  EXPECT_TRUE(memory.DirtyPages(2).empty());
+
+  // Only the words written in the epoch are visited, in ascending order whatever the order of the writes
+  memory.Store(KERNBASE + 0x3ff000, 8, 1);
+  memory.Store(KERNBASE + 0x41000, 8, 1);
+  EXPECT_EQ(memory.DirtyPages(2), (std::vector<uint64_t>{page + 0x41, page + 0x3ff}));
+  EXPECT_EQ(memory.AdvanceEpoch(), 3);
+  EXPECT_TRUE(memory.IsDirty(KERNBASE + 0x41000, 2));
+  EXPECT_TRUE(memory.IsDirty(KERNBASE + 0x3ff000, 2));
+  EXPECT_TRUE(memory.DirtyPages(3).empty());
+
+  // Nothing is kept once no epoch is held
+  memory.ReleaseEpoch(1);
+  memory.Store(KERNBASE + 0x6000, 8, 1);
+  EXPECT_EQ(memory.AdvanceEpoch(), 4);
+  EXPECT_TRUE(memory.IsDirty(KERNBASE + 0x2000, 3)); // every page ever written
+}
@@ -0,0 +1,255 @@
+#include "gtest/gtest.h"
+#include "cpu.h"
+#include "config.h"
+#include <cstring>
+
+static constexpr uint64_t no_trap = ~0ULL;
+static constexpr uint64_t rwx = pte_read | pte_write | pte_execute, ad = pte_accessed | pte_dirty;
+static constexpr uint64_t frame = KERNBASE + 0x100000;
+
+// Page tables in guest RAM with 4 KB leaves, the tables are allocated as they are needed
+class PageTables
+{
+  public:
+    PageTables(CPU& cpu, int levels) : memory(cpu.GetMMU().GetMemory()), levels(levels)
+    {
+      cpu.SetCsr(CSR::satp, ((8ULL + levels - 3) << 60) | (root >> 12));
+    }
+
+    void Map(uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags)
+    {
+      uint64_t table = root;
+      for(int level = levels - 1; level > 0; level--)
+      {
+        const uint64_t entry = table + ((virtual_addr >> (12 + 9 * level)) & 0x1ff) * 8;
+        uint64_t pte = 0;
+        memory.Load(entry, 8, pte);
+        if(pte == 0)
+        {
+          pte = ((next >> 12) << 10) | pte_valid;
+          next += PAGE_SIZE;
+          memory.Store(entry, 8, pte);
+        }
+        table = (pte >> 10) << 12;
+      }
+      memory.Store(table + ((virtual_addr >> 12) & 0x1ff) * 8, 8, ((physical_addr >> 12) << 10) | flags);
+    }
+
+  private:
+    MemoryMap& memory;
+    const int levels;
+    const uint64_t root = KERNBASE + 0x10000;
+    uint64_t next = KERNBASE + 0x11000;
+};
+
+template<typename F>
+static uint64_t Trap(F access)
+{
+  try
+  {
+    access();
+  }
+  catch(const CPUTrapException& e)
+  {
+    return e.GetTrap();
+  }
+  return no_trap;
+}
+
+static std::unique_ptr<CPU> MakeCpu()
+{
+  return std::make_unique<CPU>(std::make_shared<std::vector<uint8_t>>(4, 0), KERNBASE);
+}
+
+TEST(PageWalkTest, FaultMatchesAccess)
+{
+  auto cpu = MakeCpu();
+  PageTables tables(*cpu, 3);
+  tables.Map(0x1000, frame, pte_valid | rwx | ad);
+  cpu->SetMode(SUPERVISOR);
+  uint64_t data;
+  EXPECT_EQ(Trap([&] { cpu->Load(0x2000, 8, data); }), LoadPageFault);
+  EXPECT_EQ(Trap([&] { cpu->Store(0x2000, 8, 0); }), StoreAMOPageFault);
+  EXPECT_EQ(Trap([&] { cpu->GetMMU().Fetch(0x2000, 4, data); }), InstructionPageFault);
+  EXPECT_EQ(Trap([&] { cpu->GetMMU().Fetch(0x1000, 4, data); }), no_trap);
+
+  // Only memory holds instructions
+  cpu->SetCsr(CSR::satp, 0);
+  EXPECT_EQ(Trap([&] { cpu->GetMMU().Fetch(UART_BASE, 4, data); }), InstructionAccessFault);
+}
+
+TEST(PageWalkTest, Permissions)
+{
+  auto cpu = MakeCpu();
+  PageTables tables(*cpu, 3);
+  tables.Map(0x1000, frame, pte_valid | pte_read | ad);
+  tables.Map(0x2000, frame, pte_valid | pte_execute | ad);
+  tables.Map(0x3000, frame, pte_valid | rwx | pte_user | ad);
+  uint64_t data;
+
+  cpu->SetMode(SUPERVISOR);
+  EXPECT_EQ(Trap([&] { cpu->Load(0x1000, 8, data); }), no_trap);
+  EXPECT_EQ(Trap([&] { cpu->Store(0x1000, 8, 0); }), StoreAMOPageFault);
+  EXPECT_EQ(Trap([&] { cpu->Load(0x2000, 8, data); }), LoadPageFault);
+  cpu->SetCsr(CSR::sstatus, mstatus_mxr);
+  EXPECT_EQ(Trap([&] { cpu->Load(0x2000, 8, data); }), no_trap);
+
+  // S-mode reaches user pages only with SUM and never executes them
+  EXPECT_EQ(Trap([&] { cpu->Load(0x3000, 8, data); }), LoadPageFault);
+  cpu->SetCsr(CSR::sstatus, mstatus_sum);
+  EXPECT_EQ(Trap([&] { cpu->Store(0x3000, 8, 0); }), no_trap);
+  EXPECT_EQ(Trap([&] { cpu->GetMMU().Fetch(0x3000, 4, data); }), InstructionPageFault);
+
+  // The TLB entries filled above are checked again after the switch to U-mode
+  cpu->SetMode(USER);
+  EXPECT_EQ(Trap([&] { cpu->Load(0x1000, 8, data); }), LoadPageFault);
+  EXPECT_EQ(Trap([&] { cpu->Store(0x3000, 8, 0); }), no_trap);
+  EXPECT_EQ(Trap([&] { cpu->GetMMU().Fetch(0x3000, 4, data); }), no_trap);
+}
+
+// M-mode accesses are physical, MPRV makes its loads and stores translate with the permissions of MPP
+TEST(PageWalkTest, ModifyPrivilege)
+{
+  auto cpu = MakeCpu();
+  PageTables tables(*cpu, 3);
+  tables.Map(0x1000, frame, pte_valid | rwx | ad);
+  uint64_t data;
+  EXPECT_EQ(Trap([&] { cpu->Load(0x1000, 8, data); }), LoadAccessFault);
+  EXPECT_EQ(Trap([&] { cpu->Load(frame, 8, data); }), no_trap);
+  cpu->SetCsr(CSR::mstatus, mstatus_mprv); // MPP = U
+  EXPECT_EQ(Trap([&] { cpu->Load(0x1000, 8, data); }), LoadPageFault);
+  cpu->SetCsr(CSR::mstatus, mstatus_mprv | (1ULL << 11)); // MPP = S
+  EXPECT_EQ(Trap([&] { cpu->Load(0x1000, 8, data); }), no_trap);
+  EXPECT_EQ(Trap([&] { cpu->GetMMU().Fetch(0x1000, 4, data); }), InstructionAccessFault);
+}
+
+// A fault taken with MPRV set leaves MPP = M, so the handler's own accesses are physical again,
+// and the trap value holds the faulting address
+TEST(PageWalkTest, TrapUnderModifyPrivilege)
+{
+  auto cpu = MakeCpu();
+  PageTables tables(*cpu, 3);
+  tables.Map(0x1000, frame, pte_valid | rwx | ad);
+  cpu->SetCsr(CSR::mtvec, KERNBASE);
+  cpu->SetCsr(CSR::mstatus, mstatus_mprv | (1ULL << 11)); // MPP = S
+  uint64_t data;
+  try
+  {
+    cpu->Load(0x5008, 8, data);
+    FAIL();
+  }
+  catch(const CPUTrapException& e)
+  {
+    cpu->HandleTrap(e.GetTrap(), e.GetTval());
+  }
+  EXPECT_EQ(cpu->GetCsr(CSR::mcause), LoadPageFault);
+  EXPECT_EQ(cpu->GetCsr(CSR::mtval), 0x5008);
+  EXPECT_EQ(Trap([&] { cpu->Load(frame, 8, data); }), no_trap);
+  EXPECT_EQ(Trap([&] { cpu->Load(0x1000, 8, data); }), LoadAccessFault);
+
+  // Delegated page faults report the address in stval
+  cpu->SetCsr(CSR::medeleg, 1ULL << StoreAMOPageFault);
+  cpu->SetMode(SUPERVISOR);
+  try
+  {
+    cpu->Store(0x7000, 8, 0);
+    FAIL();
+  }
+  catch(const CPUTrapException& e)
+  {
+    cpu->HandleTrap(e.GetTrap(), e.GetTval());
+  }
+  EXPECT_EQ(cpu->GetCsr(CSR::scause), StoreAMOPageFault);
+  EXPECT_EQ(cpu->GetCsr(CSR::stval), 0x7000);
+}
+
+static uint64_t ReadPte(CPU& cpu, uint64_t virtual_addr)
+{
+  // The leaf table PageTables allocates for mappings in the first 2 MB of a three level walk
+  uint64_t pte = 0;
+  cpu.GetMMU().GetMemory().Load(KERNBASE + 0x12000 + ((virtual_addr >> 12) & 0x1ff) * 8, 8, pte);
+  return pte;
+}
+
+// The walker sets A on any access and D on a store, an entry cached by a load takes a walk on the first store
+TEST(PageWalkTest, AccessedDirty)
+{
+  auto cpu = MakeCpu();
+  PageTables tables(*cpu, 3);
+  tables.Map(0x1000, frame, pte_valid | rwx);
+  tables.Map(0x2000, frame, pte_valid | pte_read);
+  cpu->SetMode(SUPERVISOR);
+  uint64_t data;
+  EXPECT_EQ(Trap([&] { cpu->Load(0x1000, 8, data); }), no_trap);
+  EXPECT_EQ(ReadPte(*cpu, 0x1000) & ad, pte_accessed);
+  EXPECT_EQ(Trap([&] { cpu->Store(0x1000, 8, 0); }), no_trap);
+  EXPECT_EQ(ReadPte(*cpu, 0x1000) & ad, ad);
+  EXPECT_TRUE(cpu->GetMMU().GetMemory().IsDirty(KERNBASE + 0x12000, 0));
+
+  // Nothing is set for an access that faults
+  EXPECT_EQ(Trap([&] { cpu->Store(0x2000, 8, 0); }), StoreAMOPageFault);
+  EXPECT_EQ(ReadPte(*cpu, 0x2000) & ad, 0);
+}
+
+TEST(PageWalkTest, ReservedEncodings)
+{
+  auto cpu = MakeCpu();
+  PageTables tables(*cpu, 3);
+  tables.Map(0x1000, frame, pte_valid | pte_write | ad);
+  tables.Map(0x2000, frame, pte_valid | rwx | ad | (1ULL << 60));
+  cpu->SetMode(SUPERVISOR);
+  uint64_t data;
+  EXPECT_EQ(Trap([&] { cpu->Load(0x1000, 8, data); }), LoadPageFault);
+  EXPECT_EQ(Trap([&] { cpu->Load(0x2000, 8, data); }), LoadPageFault);
+  // Bit 39 upward must copy bit 38
+  EXPECT_EQ(Trap([&] { cpu->Load(1ULL << 39, 8, data); }), LoadPageFault);
+}
+
+TEST(PageWalkTest, Sv48AndSv57)
+{
+  for(const int levels : {4, 5})
+  {
+    auto cpu = MakeCpu();
+    PageTables tables(*cpu, levels);
+    EXPECT_EQ(cpu->GetMMU().GetPagingMode(), levels == 4 ? Sv48 : Sv57);
+    const uint64_t high = 1ULL << (12 + 9 * levels - 2);
+    const uint64_t negative = ~0ULL << 30;
+    tables.Map(high, frame, pte_valid | rwx | ad);
+    tables.Map(negative, frame + PAGE_SIZE, pte_valid | rwx | ad);
+    cpu->SetMode(SUPERVISOR);
+    MMU& mmu = cpu->GetMMU();
+    EXPECT_EQ(mmu.Translate(high + 0x123), frame + 0x123);
+    EXPECT_EQ(mmu.Translate(negative + 0x456), frame + PAGE_SIZE + 0x456);
+    EXPECT_EQ(Trap([&] { mmu.Translate(high << 1); }), LoadPageFault);
+  }
+}
+
+// Debugger accesses ignore permissions and leave no trace in the PTEs or the watchpoints
+TEST(PageWalkTest, DebugAccess)
+{
+  auto cpu = MakeCpu();
+  PageTables tables(*cpu, 3);
+  tables.Map(0x1000, frame, pte_valid | pte_execute);
+  tables.Map(0x2000, frame + PAGE_SIZE, pte_valid | pte_read);
+  cpu->SetMode(SUPERVISOR);
+  MMU& mmu = cpu->GetMMU();
+  mmu.AddWatchpoint(0x1ffc, 8, true, true);
+
+  const uint8_t ebreak[] = {0x73, 0x00, 0x10, 0x00, 0x02, 0x90};
+  EXPECT_EQ(mmu.DebugWrite(0x1ffe, ebreak, sizeof(ebreak)), sizeof(ebreak));
+  uint8_t data[sizeof(ebreak)] = {};
+  EXPECT_EQ(mmu.DebugRead(0x1ffe, data, sizeof(data)), sizeof(data));
+  EXPECT_EQ(std::memcmp(data, ebreak, sizeof(data)), 0);
+  uint64_t value;
+  mmu.GetMemory().Load(frame + PAGE_SIZE - 2, 4, value);
+  EXPECT_EQ(value, 0x00100073);
+  EXPECT_EQ(ReadPte(*cpu, 0x1000) & ad, 0);
+  EXPECT_EQ(ReadPte(*cpu, 0x2000) & ad, 0);
+  Watchpoint hit;
+  EXPECT_FALSE(mmu.TakeWatchHit(value, hit));
+
+  // Stops at the first unmapped page and never reaches devices
+  EXPECT_EQ(mmu.DebugRead(0x2ffc, data, sizeof(data)), 4u);
+  cpu->SetMode(MACHINE);
+  EXPECT_EQ(mmu.DebugRead(UART_BASE, data, 1), 0u);
+}
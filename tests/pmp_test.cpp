@@ -0,0 +1,126 @@
+#include "gtest/gtest.h"
+#include "cpu.h"
+#include "config.h"
+
+static constexpr uint64_t no_trap = ~0ULL;
+static constexpr uint64_t tor = pmp_tor << 3, na4 = pmp_na4 << 3, napot = pmp_napot << 3;
+static constexpr uint64_t rwx = pmpcfg_r | pmpcfg_w | pmpcfg_x;
+
+template<typename F>
+static uint64_t Trap(F access)
+{
+  try
+  {
+    access();
+  }
+  catch(const CPUTrapException& e)
+  {
+    return e.GetTrap();
+  }
+  return no_trap;
+}
+
+static std::unique_ptr<CPU> MakeCpu()
+{
+  return std::make_unique<CPU>(std::make_shared<std::vector<uint8_t>>(4, 0), KERNBASE);
+}
+
+// pmpaddr of a naturally aligned power of two range
+static uint64_t Napot(uint64_t base, uint64_t size)
+{
+  return (base | (size / 2 - 1)) >> 2;
+}
+
+TEST(PmpTest, AddressMatching)
+{
+  auto cpu = MakeCpu();
+  cpu->SetCsr(CSR::pmpaddr0, (KERNBASE + 0x1000) >> 2);
+  cpu->SetCsr(CSR::pmpaddr0 + 1, (KERNBASE + 0x2000) >> 2);
+  cpu->SetCsr(CSR::pmpaddr0 + 2, Napot(KERNBASE + 0x4000, 0x4000));
+  cpu->SetCsr(CSR::pmpcfg0, (tor | pmpcfg_r) | ((na4 | pmpcfg_r | pmpcfg_w) << 8) | ((napot | rwx) << 16));
+  cpu->SetMode(SUPERVISOR);
+  uint64_t data;
+
+  // TOR covers everything below pmpaddr0
+  EXPECT_EQ(Trap([&] { cpu->Load(KERNBASE + 0xff8, 8, data); }), no_trap);
+  EXPECT_EQ(Trap([&] { cpu->Store(KERNBASE + 0xff8, 8, 0); }), StoreAMOAccessFault);
+  // NA4 splits its page, the 4 bytes next to it match nothing
+  EXPECT_EQ(Trap([&] { cpu->Store(KERNBASE + 0x2000, 4, 0); }), no_trap);
+  EXPECT_EQ(Trap([&] { cpu->Load(KERNBASE + 0x2004, 4, data); }), LoadAccessFault);
+  EXPECT_EQ(Trap([&] { cpu->Store(KERNBASE + 0x2000, 4, 0); }), no_trap);
+  // NAPOT
+  EXPECT_EQ(Trap([&] { cpu->GetMMU().Fetch(KERNBASE + 0x7ffc, 4, data); }), no_trap);
+  EXPECT_EQ(Trap([&] { cpu->GetMMU().Fetch(KERNBASE + 0x8000, 4, data); }), InstructionAccessFault);
+  EXPECT_EQ(Trap([&] { cpu->GetMMU().Fetch(KERNBASE + 0x800, 4, data); }), InstructionAccessFault);
+}
+
+// M-mode is only held to locked entries, and locked entries ignore writes
+TEST(PmpTest, Locking)
+{
+  auto cpu = MakeCpu();
+  cpu->SetCsr(CSR::pmpaddr0, Napot(KERNBASE + 0x1000, 0x1000));
+  cpu->SetCsr(CSR::pmpcfg0, napot | pmpcfg_r);
+  uint64_t data;
+  EXPECT_EQ(Trap([&] { cpu->Store(KERNBASE + 0x1000, 8, 0); }), no_trap);
+  EXPECT_EQ(Trap([&] { cpu->Store(KERNBASE + 0x3000, 8, 0); }), no_trap);
+
+  cpu->SetCsr(CSR::pmpcfg0, napot | pmpcfg_r | pmpcfg_l);
+  EXPECT_EQ(Trap([&] { cpu->Store(KERNBASE + 0x1000, 8, 0); }), StoreAMOAccessFault);
+  EXPECT_EQ(Trap([&] { cpu->Load(KERNBASE + 0x1000, 8, data); }), no_trap);
+  EXPECT_EQ(Trap([&] { cpu->Store(KERNBASE + 0x3000, 8, 0); }), no_trap);
+
+  cpu->SetCsr(CSR::pmpcfg0, napot | rwx);
+  cpu->SetCsr(CSR::pmpaddr0, 0);
+  EXPECT_EQ(cpu->GetCsr(CSR::pmpcfg0), napot | pmpcfg_r | pmpcfg_l);
+  EXPECT_EQ(cpu->GetCsr(CSR::pmpaddr0), Napot(KERNBASE + 0x1000, 0x1000));
+  EXPECT_EQ(Trap([&] { cpu->Store(KERNBASE + 0x1000, 8, 0); }), StoreAMOAccessFault);
+
+  // M-mode stays physical and checked while S-mode paging is on
+  cpu->SetCsr(CSR::satp, (8ULL << 60) | ((KERNBASE + 0x10000) >> 12));
+  EXPECT_EQ(Trap([&] { cpu->Store(KERNBASE + 0x1000, 8, 0); }), StoreAMOAccessFault);
+  EXPECT_EQ(Trap([&] { cpu->Store(KERNBASE + 0x3000, 8, 0); }), no_trap);
+}
+
+TEST(PmpTest, WarlFields)
+{
+  auto cpu = MakeCpu();
+  // R = 0 with W = 1 is reserved
+  cpu->SetCsr(CSR::pmpcfg0, napot | pmpcfg_w | (0x60ULL << 8));
+  EXPECT_EQ(cpu->GetCsr(CSR::pmpcfg0), napot);
+  // Only even pmpcfg registers exist on RV64
+  EXPECT_THROW(cpu->GuestReadCsr(CSR::pmpcfg0 + 1, false), CPUTrapException);
+  EXPECT_NO_THROW(cpu->GuestReadCsr(CSR::pmpcfg0 + 2, false));
+}
+
+// Page table reads and the translated address are both checked, a fault on the
+// latter is an access fault and not a page fault
+TEST(PmpTest, PagedAccesses)
+{
+  auto cpu = MakeCpu();
+  MemoryMap& memory = cpu->GetMMU().GetMemory();
+  const uint64_t root = KERNBASE + 0x10000, frame = KERNBASE + 0x100000;
+  auto pte = [](uint64_t physical_addr, uint64_t flags) { return ((physical_addr >> 12) << 10) | flags; };
+  memory.Store(root, 8, pte(root + 0x1000, pte_valid));
+  memory.Store(root + 0x1000, 8, pte(root + 0x2000, pte_valid));
+  memory.Store(root + 0x2000 + 8, 8, pte(frame, pte_valid | pte_read | pte_write | pte_accessed | pte_dirty));
+  cpu->SetCsr(CSR::satp, (8ULL << 60) | (root >> 12));
+  cpu->SetMode(SUPERVISOR);
+  uint64_t data;
+
+  cpu->SetCsr(CSR::pmpaddr0, Napot(root, 0x4000));
+  cpu->SetCsr(CSR::pmpcfg0, napot | pmpcfg_w);
+  EXPECT_EQ(Trap([&] { cpu->Load(0x1000, 8, data); }), LoadAccessFault);
+  cpu->SetCsr(CSR::pmpcfg0, napot | pmpcfg_r);
+  EXPECT_EQ(Trap([&] { cpu->Load(0x1000, 8, data); }), LoadAccessFault);
+
+  cpu->SetCsr(CSR::pmpaddr0 + 1, Napot(frame, 0x1000));
+  cpu->SetCsr(CSR::pmpcfg0, (napot | pmpcfg_r) | ((napot | pmpcfg_r) << 8));
+  EXPECT_EQ(Trap([&] { cpu->Load(0x1000, 8, data); }), no_trap);
+  EXPECT_EQ(Trap([&] { cpu->Store(0x1000, 8, 0); }), StoreAMOAccessFault);
+
+  // Reprogramming drops the permissions cached with the translation
+  cpu->SetCsr(CSR::pmpcfg0, (napot | pmpcfg_r) | ((napot | pmpcfg_r | pmpcfg_w) << 8));
+  EXPECT_EQ(Trap([&] { cpu->Store(0x1000, 8, 0); }), no_trap);
+  cpu->SetCsr(CSR::pmpcfg0, (napot | pmpcfg_r) | (napot << 8));
+  EXPECT_EQ(Trap([&] { cpu->Load(0x1000, 8, data); }), LoadAccessFault);
+}
@@ -1,5 +1,6 @@
 #include <gtest/gtest.h>
 #include <ram.h>
+#include <trap.h>
 
 TEST(RAMTest, StoreAndLoad)
 {
@@ -38,6 +39,7 @@ TEST(RAMTest, CheckException)
 {
     auto ram = std::make_unique<RAM>(0, 0x1000);
     uint64_t data;
-    EXPECT_THROW(ram->Load(0x1000, 5, data), std::runtime_error);
-    EXPECT_THROW(ram->Store(0x1000, 3, 0xAA), std::runtime_error);
+    EXPECT_THROW(ram->Load(0x1000, 5, data), CPUTrapException);
+    EXPECT_THROW(ram->Store(0x1000, 3, 0xAA), CPUTrapException);
+    EXPECT_THROW(std::make_unique<RAM>(0, 0x800), std::runtime_error);
 }
\ No newline at end of file
@@ -0,0 +1,172 @@
+#include "gtest/gtest.h"
+#include "cpu.h"
+#include "config.h"
+#include "checkpoint.h"
+#include <cstdio>
+
+static constexpr uint32_t ra = 1, a0 = 10, a1 = 11, a2 = 12, a3 = 13;
+
+static uint32_t R(uint32_t funct7, uint32_t rs2, uint32_t rs1, uint32_t funct3, uint32_t rd, uint32_t opcode)
+{
+  return (funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+static uint32_t I(int32_t imm, uint32_t rs1, uint32_t funct3, uint32_t rd, uint32_t opcode)
+{
+  return ((static_cast<uint32_t>(imm) & 0xfff) << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+
+static std::unique_ptr<CPU> MakeCpu()
+{
+  auto cpu = std::make_unique<CPU>(std::make_shared<std::vector<uint8_t>>(4, 0), KERNBASE, MEMORY_SIZE, true, 32);
+  cpu->SetCsr(CSR::mtvec, KERNBASE + 0x100);
+  return cpu;
+}
+
+// Writes the program at the pc and steps through it
+static void RunProgram(CPU& cpu, const std::vector<uint32_t>& program)
+{
+  for(size_t i = 0; i < program.size(); i++)
+  {
+    cpu.Store(KERNBASE + i * 4, 4, program[i]);
+  }
+  for(size_t i = 0; i < program.size(); i++)
+  {
+    cpu.Step();
+  }
+}
+
+TEST(Rv32Test, ResultsWrapAtXlen)
+{
+  auto cpu = MakeCpu();
+  EXPECT_EQ(cpu->GetXlen(), 32);
+  cpu->SetReg(a0, 0x7fffffff);
+  cpu->SetReg(a1, 1);
+  RunProgram(*cpu, {
+    R(0, a1, a0, 0b000, a0, 0x33),      // add a0, a0, a1
+    I(4, a0, 0b101, a2, 0x13),          // srli a2, a0, 4
+    I(0x400 | 4, a0, 0b101, a3, 0x13),  // srai a3, a0, 4
+  });
+  // Registers hold 32-bit values sign-extended
+  EXPECT_EQ(cpu->GetReg(a0), 0xffffffff80000000);
+  EXPECT_EQ(cpu->GetReg(a2), 0x08000000);
+  EXPECT_EQ(cpu->GetReg(a3), 0xfffffffff8000000);
+
+  cpu = MakeCpu();
+  cpu->SetReg(a0, 0xffffffffffffffff);
+  cpu->SetReg(a1, 0xffffffffffffffff);
+  RunProgram(*cpu, {R(1, a1, a0, 0b011, a2, 0x33)}); // mulhu a2, a0, a1
+  EXPECT_EQ(cpu->GetReg(a2), 0xfffffffffffffffe);
+}
+
+TEST(Rv32Test, JumpLinks)
+{
+  auto cpu = MakeCpu();
+  RunProgram(*cpu, {0x008000ef}); // jal ra, 8
+  EXPECT_EQ(cpu->GetReg(ra), 0xffffffff80000004);
+  EXPECT_EQ(cpu->GetPc(), KERNBASE + 8);
+
+  cpu = MakeCpu();
+  cpu->SetReg(a0, 0xffffffff80000010);
+  RunProgram(*cpu, {I(4, a0, 0b000, ra, 0x67)}); // jalr ra, 4(a0)
+  EXPECT_EQ(cpu->GetPc(), KERNBASE + 0x14);
+
+  // c.jal exists only on RV32, RV64 has c.addiw in its place
+  cpu = MakeCpu();
+  cpu->Store(KERNBASE, 2, 0x2021); // c.jal 8
+  cpu->Step();
+  EXPECT_EQ(cpu->GetReg(ra), 0xffffffff80000002);
+  EXPECT_EQ(cpu->GetPc(), KERNBASE + 8);
+}
+
+TEST(Rv32Test, Rv64OnlyInstructionsAreIllegal)
+{
+  for(const uint32_t instruction : {I(0, a1, 0b011, a0, 0x03),   // ld a0, 0(a1)
+                                    I(1, a0, 0b000, a0, 0x1b),   // addiw a0, a0, 1
+                                    0x02050053u})                // fadd.d f0, f10, f0
+  {
+    auto cpu = MakeCpu();
+    cpu->SetReg(a1, KERNBASE);
+    RunProgram(*cpu, {instruction});
+    EXPECT_EQ(cpu->GetCsr(CSR::mcause), IllegalInstruction) << std::hex << instruction;
+    EXPECT_EQ(cpu->GetPc(), KERNBASE + 0x100);
+  }
+
+  auto cpu = MakeCpu();
+  cpu->SetReg(a1, KERNBASE);
+  cpu->Store(KERNBASE, 2, 0x6188); // c.ld a0, 0(a1), c.flw on RV32
+  cpu->Step();
+  EXPECT_EQ(cpu->GetCsr(CSR::mcause), IllegalInstruction);
+}
+
+TEST(Rv32Test, Atomics)
+{
+  auto cpu = MakeCpu();
+  const uint64_t word = KERNBASE + 0x1000;
+  cpu->Store(word, 4, 0x7fffffff);
+  cpu->SetReg(a0, word);
+  cpu->SetReg(a1, 1);
+  RunProgram(*cpu, {
+    R(0b0000000, a1, a0, 0b010, a2, 0x2f), // amoadd.w a2, a1, (a0)
+    R(0b0001000, 0, a0, 0b010, a3, 0x2f),  // lr.w a3, (a0)
+    R(0b0001100, a1, a0, 0b010, a1, 0x2f), // sc.w a1, a1, (a0)
+  });
+  EXPECT_EQ(cpu->GetReg(a2), 0x7fffffff);
+  EXPECT_EQ(cpu->GetReg(a3), 0xffffffff80000000);
+  EXPECT_EQ(cpu->GetReg(a1), 0);
+  uint64_t data;
+  cpu->Load(word, 4, data);
+  EXPECT_EQ(data, 1);
+}
+
+TEST(Rv32Test, Sv32)
+{
+  auto cpu = MakeCpu();
+  static constexpr uint64_t root_table = KERNBASE + 0x10000, level0_table = KERNBASE + 0x11000;
+  static constexpr uint64_t pte_v = 1 << 0, pte_rwx = 7 << 1, pte_ad = 3 << 6;
+  auto pte = [](uint64_t physical_addr, uint64_t flags) { return ((physical_addr >> 12) << 10) | flags; };
+  MemoryMap& memory = cpu->GetMMU().GetMemory();
+  // VA 0x00400000 is a 4 MB megapage, 0x40001000 a 4 KB page
+  memory.Store(root_table + 1 * 4, 4, pte(KERNBASE + 0x400000, pte_v | pte_rwx | pte_ad));
+  memory.Store(root_table + 0x100 * 4, 4, pte(level0_table, pte_v));
+  memory.Store(level0_table + 1 * 4, 4, pte(KERNBASE + 0x7000, pte_v | pte_rwx | pte_ad));
+  cpu->SetCsr(CSR::satp, (1ULL << 31) | (root_table >> 12));
+  cpu->SetMode(SUPERVISOR);
+
+  MMU& mmu = cpu->GetMMU();
+  EXPECT_EQ(mmu.Translate(0x00400000 + 0x3fffff), KERNBASE + 0x400000 + 0x3fffff);
+  EXPECT_EQ(mmu.Translate(0x40001000 + 0x123), KERNBASE + 0x7000 + 0x123);
+  EXPECT_THROW(mmu.Translate(0x40002000), CPUTrapException);
+}
+
+TEST(Rv32Test, Csrs)
+{
+  auto cpu = MakeCpu();
+  EXPECT_EQ(cpu->GuestReadCsr(CSR::misa, true) >> 30, 1);
+
+  // The interrupt bit of mcause is bit 31
+  cpu->SetCsr(CSR::mie, MIP::meip);
+  cpu->SetCsr(CSR::mstatus, mstatus_mie);
+  cpu->RaiseInterrupt(MIP::meip);
+  cpu->HandleInterrupts();
+  EXPECT_EQ(cpu->GetCsr(CSR::mcause), 0x8000000b);
+
+  // 64-bit CSRs are split in halves, Sstc is enabled through menvcfgh
+  cpu->GuestWriteCsr(CSR::menvcfgh, 0xffffffffffffffff);
+  EXPECT_EQ(cpu->GetCsr(CSR::menvcfgh), 0x80000000);
+  EXPECT_EQ(cpu->GetCsr(CSR::menvcfg), 0);
+  cpu->GuestWriteCsr(CSR::stimecmp, 0xffffffff80000000);
+  cpu->GuestWriteCsr(CSR::stimecmph, 0x12);
+  EXPECT_EQ(cpu->GetCsr(CSR::stimecmp), 0x80000000);
+  EXPECT_EQ(cpu->GetCsr(CSR::stimecmph), 0x12);
+}
+
+TEST(Rv32Test, CheckpointXlenMismatch)
+{
+  const std::string path = testing::TempDir() + "rv32_test.ckpt";
+  auto cpu = MakeCpu();
+  SaveCheckpoint(*cpu, path, false);
+  auto rv64 = std::make_unique<CPU>(std::make_shared<std::vector<uint8_t>>(4, 0), KERNBASE);
+  EXPECT_THROW(RestoreCheckpoint(*rv64, path), std::runtime_error);
+  EXPECT_NO_THROW(RestoreCheckpoint(*MakeCpu(), path));
+  std::remove(path.c_str());
+}
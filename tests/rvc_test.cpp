@@ -0,0 +1,53 @@
+#include "gtest/gtest.h"
+#include "cpu.h"
+#include "rvc.h"
+#include "config.h"
+
+TEST(RVCTest, ExpandCompressed)
+{
+  EXPECT_EQ(ExpandCompressed(0x0001), 0x00000013); // c.nop         -> addi x0, x0, 0
+  EXPECT_EQ(ExpandCompressed(0x4505), 0x00100513); // c.li a0, 1     -> addi a0, x0, 1
+  EXPECT_EQ(ExpandCompressed(0x1141), 0xff010113); // c.addi sp, -16 -> addi sp, sp, -16
+  EXPECT_EQ(ExpandCompressed(0xe406), 0x00113423); // c.sdsp ra, 8   -> sd ra, 8(sp)
+  EXPECT_EQ(ExpandCompressed(0x60a2), 0x00813083); // c.ldsp ra, 8   -> ld ra, 8(sp)
+  EXPECT_EQ(ExpandCompressed(0x8082), 0x00008067); // c.jr ra        -> jalr x0, 0(ra)
+  EXPECT_EQ(ExpandCompressed(0x852e), 0x00b00533); // c.mv a0, a1    -> add a0, x0, a1
+  EXPECT_EQ(ExpandCompressed(0x952e), 0x00b50533); // c.add a0, a1   -> add a0, a0, a1
+  EXPECT_EQ(ExpandCompressed(0x9002), 0x00100073); // c.ebreak       -> ebreak
+  EXPECT_EQ(ExpandCompressed(0x4188), 0x0005a503); // c.lw a0, 0(a1) -> lw a0, 0(a1)
+  EXPECT_EQ(ExpandCompressed(0xc188), 0x00a5a023); // c.sw a0, 0(a1) -> sw a0, 0(a1)
+  EXPECT_EQ(ExpandCompressed(0x0808), 0x01010513); // c.addi4spn a0, sp, 16 -> addi a0, sp, 16
+  EXPECT_EQ(ExpandCompressed(0x6505), 0x00001537); // c.lui a0, 1    -> lui a0, 1
+  EXPECT_EQ(ExpandCompressed(0x0506), 0x00151513); // c.slli a0, 1   -> slli a0, a0, 1
+}
+
+TEST(RVCTest, ReservedEncodings)
+{
+  EXPECT_THROW(ExpandCompressed(0x0000), CPUTrapException); // all zero instruction
+  EXPECT_THROW(ExpandCompressed(0x6101), CPUTrapException); // c.addi16sp with zero immediate
+  EXPECT_THROW(ExpandCompressed(0x8002), CPUTrapException); // c.jr x0
+}
+
+TEST(RVCTest, MixedLengthLoop)
+{
+  // li a0, 3; li a1, 0; loop: addi a1, a1, 2; addi a0, a0, -1; bnez a0, loop; auipc a2, 0; jal a3, +4
+  const std::vector<uint8_t> program = {
+    0x0d, 0x45,             // c.li a0, 3
+    0x81, 0x45,             // c.li a1, 0
+    0x93, 0x85, 0x25, 0x00, // addi a1, a1, 2
+    0x7d, 0x15,             // c.addi a0, -1
+    0x6d, 0xfd,             // c.bnez a0, -6
+    0x17, 0x06, 0x00, 0x00, // auipc a2, 0
+    0xef, 0x06, 0x40, 0x00, // jal a3, +4
+  };
+  auto cpu = std::make_unique<CPU>(std::make_shared<std::vector<uint8_t>>(program), KERNBASE);
+  for(int i = 0; i < 2 + 3 * 3 + 2; i++)
+  {
+    cpu->Step();
+  }
+  EXPECT_EQ(cpu->GetReg(10), 0);
+  EXPECT_EQ(cpu->GetReg(11), 6);
+  EXPECT_EQ(cpu->GetReg(12), KERNBASE + 12);
+  EXPECT_EQ(cpu->GetReg(13), KERNBASE + 20);
+  EXPECT_EQ(cpu->GetPc(), KERNBASE + 20);
+}
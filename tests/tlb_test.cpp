@@ -0,0 +1,107 @@
+#include "gtest/gtest.h"
+#include "cpu.h"
+#include "config.h"
+
+static constexpr uint64_t root_table = KERNBASE + 0x10000;
+static constexpr uint64_t level1_table = KERNBASE + 0x11000;
+static constexpr uint64_t level0_table = KERNBASE + 0x12000;
+static constexpr uint64_t pte_v = 1 << 0, pte_rwx = 7 << 1, pte_ad = 3 << 6;
+
+static uint64_t Pte(uint64_t physical_addr, uint64_t flags)
+{
+  return ((physical_addr >> 12) << 10) | flags;
+}
+
+// Page tables are written physically, the tests translate from S-mode as M-mode accesses are physical
+static void WritePte(CPU& cpu, uint64_t addr, uint64_t pte)
+{
+  cpu.GetMMU().GetMemory().Store(addr, 8, pte);
+}
+
+// VA 0xc0000000 is a gigapage over RAM, 0x40200000 a megapage and 0x40001000 a 4 KB page
+static std::unique_ptr<CPU> MakeCpu()
+{
+  auto cpu = std::make_unique<CPU>(std::make_shared<std::vector<uint8_t>>(4, 0), KERNBASE);
+  WritePte(*cpu, root_table + 3 * 8, Pte(KERNBASE, pte_v | pte_rwx | pte_ad));
+  WritePte(*cpu, root_table + 1 * 8, Pte(level1_table, pte_v));
+  WritePte(*cpu, level1_table + 1 * 8, Pte(KERNBASE + 0x400000, pte_v | pte_rwx | pte_ad));
+  WritePte(*cpu, level1_table + 0 * 8, Pte(level0_table, pte_v));
+  WritePte(*cpu, level0_table + 1 * 8, Pte(KERNBASE + 0x7000, pte_v | pte_rwx | pte_ad));
+  cpu->SetCsr(CSR::satp, (8ULL << 60) | (root_table >> 12));
+  cpu->SetMode(SUPERVISOR);
+  return cpu;
+}
+
+TEST(TlbTest, LeafSizes)
+{
+  auto cpu = MakeCpu();
+  MMU& mmu = cpu->GetMMU();
+  EXPECT_EQ(mmu.Translate(0xc0000000 + 0x1234567), KERNBASE + 0x1234567);
+  EXPECT_EQ(mmu.Translate(0x40200000 + 0x12345), KERNBASE + 0x400000 + 0x12345);
+  EXPECT_EQ(mmu.Translate(0x40001000 + 0x123), KERNBASE + 0x7000 + 0x123);
+  EXPECT_THROW(mmu.Translate(0x40002000), CPUTrapException);
+}
+
+// One entry serves the whole superpage until it is fenced
+TEST(TlbTest, SuperpageIsOneEntry)
+{
+  auto cpu = MakeCpu();
+  MMU& mmu = cpu->GetMMU();
+  EXPECT_EQ(mmu.Translate(0xc0000000), KERNBASE);
+  WritePte(*cpu, root_table + 3 * 8, 0);
+  EXPECT_EQ(mmu.Translate(0xc0000000 + 0x3ffff000), KERNBASE + 0x3ffff000);
+  mmu.FlushTlb(0xc0000000 + 0x3ffff000);
+  EXPECT_THROW(mmu.Translate(0xc0000000), CPUTrapException);
+}
+
+TEST(TlbTest, MisalignedSuperpage)
+{
+  auto cpu = MakeCpu();
+  WritePte(*cpu, level1_table + 2 * 8, Pte(KERNBASE + 0x401000, pte_v | pte_rwx | pte_ad));
+  EXPECT_THROW(cpu->GetMMU().Translate(0x40400000), CPUTrapException);
+}
+
+TEST(TlbTest, SfenceVma)
+{
+  auto cpu = MakeCpu();
+  MMU& mmu = cpu->GetMMU();
+  const uint32_t sfence_vma = 0x12000073; // sfence.vma zero, zero
+  EXPECT_EQ(mmu.Translate(0x40001000), KERNBASE + 0x7000);
+  WritePte(*cpu, level0_table + 1 * 8, Pte(KERNBASE + 0x8000, pte_v | pte_rwx | pte_ad));
+  EXPECT_EQ(mmu.Translate(0x40001000), KERNBASE + 0x7000);
+  cpu->RunInstruction(sfence_vma);
+  EXPECT_EQ(mmu.Translate(0x40001000), KERNBASE + 0x8000);
+
+  cpu->SetMode(USER);
+  EXPECT_THROW(cpu->RunInstruction(sfence_vma), CPUTrapException);
+}
+
+// M-mode fetches and data accesses are physical, MPRV translates the data accesses with MPP
+TEST(TlbTest, MachineModeIsPhysical)
+{
+  auto cpu = MakeCpu();
+  MMU& mmu = cpu->GetMMU();
+  cpu->SetMode(MACHINE);
+  EXPECT_EQ(mmu.Translate(0x40001000), 0x40001000);
+  EXPECT_EQ(mmu.Translate(KERNBASE + 0x100, AccessType::Execute), KERNBASE + 0x100);
+  cpu->SetCsr(CSR::mstatus, mstatus_mprv | (1ULL << 11)); // MPP = S
+  EXPECT_EQ(mmu.Translate(0x40001000), KERNBASE + 0x7000);
+  EXPECT_EQ(mmu.Translate(0x40001000, AccessType::Execute), 0x40001000);
+}
+
+// An address fence only drops leaf translations, the cached pointers to lower tables outlive it
+TEST(TlbTest, WalkCacheGranularity)
+{
+  auto cpu = MakeCpu();
+  MMU& mmu = cpu->GetMMU();
+  EXPECT_EQ(mmu.Translate(0x40001000), KERNBASE + 0x7000);
+  WritePte(*cpu, level0_table + 2 * 8, Pte(KERNBASE + 0x9000, pte_v | pte_rwx | pte_ad));
+  WritePte(*cpu, root_table + 1 * 8, 0);
+  WritePte(*cpu, level1_table + 0 * 8, 0);
+
+  cpu->SetReg(10, 0x40002000);
+  cpu->RunInstruction(0x12050073); // sfence.vma a0, zero
+  EXPECT_EQ(mmu.Translate(0x40002000), KERNBASE + 0x9000);
+  cpu->RunInstruction(0x12000073); // sfence.vma zero, zero
+  EXPECT_THROW(mmu.Translate(0x40002000), CPUTrapException);
+}
@@ -0,0 +1,207 @@
+#include "gtest/gtest.h"
+#include "cpu.h"
+#include "config.h"
+#include <bit>
+#include <cstring>
+
+static uint32_t Vsetvli(uint32_t rd, uint32_t rs1, uint32_t vtypei)
+{
+  return (vtypei << 20) | (rs1 << 15) | (0x7 << 12) | (rd << 7) | 0x57;
+}
+
+// OP-V encoding, vm = 1 is unmasked
+static uint32_t OpV(uint32_t funct6, uint32_t vm, uint32_t vs2, uint32_t vs1, uint32_t funct3, uint32_t vd)
+{
+  return (funct6 << 26) | (vm << 25) | (vs2 << 20) | (vs1 << 15) | (funct3 << 12) | (vd << 7) | 0x57;
+}
+
+static uint32_t VMem(uint32_t opcode, uint32_t width, uint32_t mop, uint32_t vm, uint32_t rs2, uint32_t rs1, uint32_t vd)
+{
+  return (mop << 26) | (vm << 25) | (rs2 << 20) | (rs1 << 15) | (width << 12) | (vd << 7) | opcode;
+}
+
+static uint32_t Vtype(uint32_t sew, int lmul_log2)
+{
+  const uint32_t vsew = std::countr_zero(sew) - 3;
+  return (vsew << 3) | (static_cast<uint32_t>(lmul_log2) & 0x7);
+}
+
+static std::unique_ptr<CPU> MakeCpu()
+{
+  return std::make_unique<CPU>(std::make_shared<std::vector<uint8_t>>(4, 0), KERNBASE);
+}
+
+static uint8_t* Reg(CPU& cpu, int reg)
+{
+  return cpu.GetVector().regs + reg * VLENB;
+}
+
+TEST(VectorTest, Configuration)
+{
+  auto cpu = MakeCpu();
+  cpu->RunInstruction(Vsetvli(5, 0, Vtype(32, 0))); // vsetvli t0, x0, e32, m1
+  EXPECT_EQ(cpu->GetReg(5), VLEN / 32);
+  cpu->RunInstruction(Vsetvli(5, 0, Vtype(8, 3))); // vsetvli t0, x0, e8, m8
+  EXPECT_EQ(cpu->GetReg(5), VLEN);
+  cpu->SetReg(6, 3);
+  cpu->RunInstruction(Vsetvli(5, 6, Vtype(16, 1))); // vsetvli t0, t1, e16, m2
+  EXPECT_EQ(cpu->GetReg(5), 3);
+  EXPECT_EQ(cpu->GetCsr(CSR::vl), 3);
+  EXPECT_EQ(cpu->GetCsr(CSR::vlenb), VLENB);
+
+  // SEW 64 does not fit in LMUL 1/8
+  cpu->RunInstruction(Vsetvli(5, 0, Vtype(64, -3)));
+  EXPECT_EQ(cpu->GetReg(5), 0);
+  EXPECT_NE(cpu->GetCsr(CSR::vtype) & vtype_vill, 0);
+  EXPECT_THROW(cpu->RunInstruction(OpV(0b000000, 1, 2, 4, 0b000, 6)), CPUTrapException);
+}
+
+// Every kernel must agree with the scalar path that masked execution takes
+TEST(VectorTest, SimdMatchesScalar)
+{
+  const uint32_t ops[] = {0b000000, 0b000010, 0b000100, 0b000101, 0b000110, 0b000111,
+                          0b001001, 0b001010, 0b001011, 0b100101, 0b101000, 0b101001};
+  for(uint32_t sew : {8, 16, 32, 64})
+  {
+    for(uint32_t funct6 : ops)
+    {
+      auto cpu = MakeCpu();
+      cpu->RunInstruction(Vsetvli(5, 0, Vtype(sew, 1))); // LMUL 2
+      for(int i = 0; i < 2 * VLENB; i++)
+      {
+        Reg(*cpu, 2)[i] = static_cast<uint8_t>(i * 37 + 11);
+        Reg(*cpu, 4)[i] = static_cast<uint8_t>(i * 91 + 250);
+      }
+      std::memset(Reg(*cpu, 0), 0xff, VLENB);
+      cpu->RunInstruction(OpV(funct6, 1, 2, 4, 0b000, 6)); // op.vv v6, v2, v4
+      cpu->RunInstruction(OpV(funct6, 0, 2, 4, 0b000, 8)); // op.vv v8, v2, v4, v0.t
+      EXPECT_EQ(std::memcmp(Reg(*cpu, 6), Reg(*cpu, 8), 2 * VLENB), 0) << "sew " << sew << " funct6 " << funct6;
+
+      cpu->SetReg(7, 0x8000000000000003);
+      cpu->RunInstruction(OpV(funct6, 1, 2, 7, 0b100, 10)); // op.vx v10, v2, x7
+      cpu->RunInstruction(OpV(funct6, 0, 2, 7, 0b100, 12)); // op.vx v12, v2, x7, v0.t
+      EXPECT_EQ(std::memcmp(Reg(*cpu, 10), Reg(*cpu, 12), 2 * VLENB), 0) << "sew " << sew << " funct6 " << funct6;
+    }
+  }
+}
+
+TEST(VectorTest, MaskAndTailUndisturbed)
+{
+  auto cpu = MakeCpu();
+  cpu->SetReg(6, 3);
+  cpu->RunInstruction(Vsetvli(5, 6, Vtype(32, 0))); // vl = 3
+  for(int i = 0; i < 4; i++)
+  {
+    reinterpret_cast<uint32_t*>(Reg(*cpu, 2))[i] = 10 * (i + 1);
+    reinterpret_cast<uint32_t*>(Reg(*cpu, 3))[i] = 0xdead;
+  }
+  Reg(*cpu, 0)[0] = 0b101;
+  cpu->RunInstruction(OpV(0b000000, 0, 2, 1, 0b011, 3)); // vadd.vi v3, v2, 1, v0.t
+  const auto* result = reinterpret_cast<uint32_t*>(Reg(*cpu, 3));
+  EXPECT_EQ(result[0], 11);
+  EXPECT_EQ(result[1], 0xdead);
+  EXPECT_EQ(result[2], 31);
+  EXPECT_EQ(result[3], 0xdead);
+
+  cpu->RunInstruction(OpV(0b011010, 1, 2, 6, 0b100, 4)); // vmsltu.vx v4, v2, x6 (3)
+  EXPECT_EQ(Reg(*cpu, 4)[0] & 0x7, 0);
+  cpu->RunInstruction(OpV(0b011111, 1, 2, 15, 0b011, 4)); // vmsgt.vi v4, v2, 15
+  EXPECT_EQ(Reg(*cpu, 4)[0] & 0x7, 0b110);
+}
+
+TEST(VectorTest, FloatingPoint)
+{
+  auto cpu = MakeCpu();
+  cpu->RunInstruction(Vsetvli(5, 0, Vtype(32, 1)));
+  const uint64_t vl = cpu->GetReg(5);
+  auto* a = reinterpret_cast<float*>(Reg(*cpu, 2));
+  auto* b = reinterpret_cast<float*>(Reg(*cpu, 4));
+  auto* d = reinterpret_cast<float*>(Reg(*cpu, 6));
+  for(uint64_t i = 0; i < vl; i++)
+  {
+    a[i] = i + 0.5f;
+    b[i] = 2.0f;
+    d[i] = 1.0f;
+  }
+  b[1] = std::bit_cast<float>(0x7f800001U); // signaling NaN
+
+  cpu->RunInstruction(OpV(0b101100, 1, 2, 4, 0b001, 6)); // vfmacc.vv v6, v4, v2
+  EXPECT_EQ(d[0], 2.0f);
+  EXPECT_EQ(std::bit_cast<uint32_t>(d[1]), 0x7fc00000U);
+  EXPECT_EQ(d[vl - 1], (vl - 0.5f) * 2.0f + 1.0f);
+
+  cpu->SetFReg(1, 0xffffffff00000000 | std::bit_cast<uint32_t>(4.0f));
+  cpu->RunInstruction(OpV(0b100100, 1, 2, 1, 0b101, 8)); // vfmul.vf v8, v2, f1
+  EXPECT_EQ(reinterpret_cast<float*>(Reg(*cpu, 8))[3], 14.0f);
+
+  // vfredusum over v2 with v10[0] = 100
+  reinterpret_cast<float*>(Reg(*cpu, 10))[0] = 100.0f;
+  cpu->RunInstruction(OpV(0b000001, 1, 2, 10, 0b001, 11)); // vfredusum.vs v11, v2, v10
+  EXPECT_EQ(reinterpret_cast<float*>(Reg(*cpu, 11))[0], 100.0f + vl * vl / 2.0f);
+
+  cpu->RunInstruction(OpV(0b010000, 1, 11, 0, 0b001, 3)); // vfmv.f.s f3, v11
+  EXPECT_EQ(cpu->GetFReg(3), 0xffffffff00000000 | std::bit_cast<uint32_t>(100.0f + vl * vl / 2.0f));
+}
+
+TEST(VectorTest, Reductions)
+{
+  auto cpu = MakeCpu();
+  cpu->RunInstruction(Vsetvli(5, 0, Vtype(32, 2))); // e32, m4
+  const uint64_t vl = cpu->GetReg(5);
+  auto* src = reinterpret_cast<int32_t*>(Reg(*cpu, 4));
+  int64_t sum = 7;
+  int32_t max = 7;
+  for(uint64_t i = 0; i < vl; i++)
+  {
+    src[i] = (i % 3 == 0) ? -static_cast<int32_t>(i) : static_cast<int32_t>(i * 5);
+    sum += src[i];
+    max = std::max(max, src[i]);
+  }
+  reinterpret_cast<int32_t*>(Reg(*cpu, 1))[0] = 7;
+  cpu->RunInstruction(OpV(0b000000, 1, 4, 1, 0b010, 2)); // vredsum.vs v2, v4, v1
+  EXPECT_EQ(reinterpret_cast<int32_t*>(Reg(*cpu, 2))[0], sum);
+  cpu->RunInstruction(OpV(0b000111, 1, 4, 1, 0b010, 3)); // vredmax.vs v3, v4, v1
+  EXPECT_EQ(reinterpret_cast<int32_t*>(Reg(*cpu, 3))[0], max);
+
+  src[0] = -2;
+  cpu->RunInstruction(OpV(0b010000, 1, 4, 0, 0b010, 10)); // vmv.x.s a0, v4
+  EXPECT_EQ(cpu->GetReg(10), static_cast<uint64_t>(-2));
+}
+
+TEST(VectorTest, LoadsAndStores)
+{
+  auto cpu = MakeCpu();
+  const uint64_t base = KERNBASE + 0x1ff0; // crosses a page boundary
+  for(int i = 0; i < 64; i++)
+  {
+    cpu->Store(base + 4 * i, 4, 1000 + i);
+  }
+  cpu->RunInstruction(Vsetvli(5, 0, Vtype(32, 2))); // e32, m4
+  const uint64_t vl = cpu->GetReg(5);
+  cpu->SetReg(10, base);
+  cpu->RunInstruction(VMem(0x07, 0b110, 0b00, 1, 0, 10, 4)); // vle32.v v4, (a0)
+  for(uint64_t i = 0; i < vl; i++)
+  {
+    EXPECT_EQ(reinterpret_cast<uint32_t*>(Reg(*cpu, 4))[i], 1000 + i);
+  }
+
+  // Strided store of every element to every other word
+  cpu->SetReg(11, KERNBASE + 0x3000);
+  cpu->SetReg(12, 8);
+  cpu->RunInstruction(VMem(0x27, 0b110, 0b10, 1, 12, 11, 4)); // vsse32.v v4, (a1), a2
+  uint64_t data;
+  cpu->Load(KERNBASE + 0x3000 + 8 * (vl - 1), 4, data);
+  EXPECT_EQ(data, 1000 + vl - 1);
+  cpu->Load(KERNBASE + 0x3004, 4, data);
+  EXPECT_EQ(data, 0);
+
+  // Fault-only-first trims vl at the end of RAM instead of trapping
+  cpu->SetReg(10, KERNBASE + MEMORY_SIZE - 8);
+  cpu->RunInstruction(VMem(0x07, 0b110, 0b00, 1, 0b10000, 10, 8)); // vle32ff.v v8, (a0)
+  EXPECT_EQ(cpu->GetCsr(CSR::vl), 2);
+
+  // A regular load traps and records the faulting element in vstart
+  cpu->RunInstruction(Vsetvli(5, 0, Vtype(32, 2)));
+  EXPECT_THROW(cpu->RunInstruction(VMem(0x07, 0b110, 0b00, 1, 0, 10, 8)), CPUTrapException);
+  EXPECT_EQ(cpu->GetCsr(CSR::vstart), 2);
+}
@@ -0,0 +1,237 @@
+#include "machine.h"
+#include "elf_parser.h"
+#include "config.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Runs the riscv-tests ISA suites, each test in its own Machine on a pool of
+// host threads. A test reports through the tohost symbol: 1 is a pass,
+// any other odd value is a failure of test case tohost >> 1.
+//
+// Usage: my-emu_riscv_tests <riscv-tests/isa> [-j threads] [-v] [-limit instructions] [-filter text]
+
+// Suites the emulator implements for both XLENs, rv<xlen><suite>-p-* run bare,
+// rv<xlen><suite>-v-* under virtual memory. The machine takes its XLEN from the ELF.
+static const std::vector<std::string> suites = {"ui", "um", "ua", "si", "mi"};
+static const std::vector<std::string> xlens = {"rv32", "rv64"};
+
+enum class Outcome
+{
+  Pass,
+  Fail,
+  Timeout,
+  Error
+};
+
+typedef struct TestResult
+{
+  std::string name;
+  Outcome outcome = Outcome::Error;
+  uint64_t failed_case = 0;
+  uint64_t instructions = 0;
+  double milliseconds = 0;
+  std::string error;
+} TestResult;
+
+typedef struct RunnerOptions
+{
+  std::filesystem::path dir;
+  unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+  bool virtual_memory = false;
+  uint64_t limit = 10'000'000;
+  std::string filter;
+} RunnerOptions;
+
+static bool IsElf(const std::filesystem::path& path)
+{
+  std::ifstream in(path, std::ios::binary);
+  char magic[4] = {};
+  in.read(magic, sizeof(magic));
+  return in && magic[0] == 0x7f && magic[1] == 'E' && magic[2] == 'L' && magic[3] == 'F';
+}
+
+static std::vector<std::filesystem::path> Discover(const RunnerOptions& options)
+{
+  std::vector<std::filesystem::path> tests;
+  for(const auto& entry : std::filesystem::directory_iterator(options.dir))
+  {
+    const std::string name = entry.path().filename().string();
+    bool in_suite = false;
+    for(const std::string& xlen : xlens)
+    {
+      in_suite |= std::any_of(suites.begin(), suites.end(), [&](const std::string& suite)
+      {
+        return name.starts_with(xlen + suite + "-p-") || (options.virtual_memory && name.starts_with(xlen + suite + "-v-"));
+      });
+    }
+    if(in_suite && entry.is_regular_file() && !entry.path().has_extension()
+       && name.find(options.filter) != std::string::npos && IsElf(entry.path()))
+    {
+      tests.push_back(entry.path());
+    }
+  }
+  std::sort(tests.begin(), tests.end());
+  return tests;
+}
+
+static TestResult RunTest(const std::filesystem::path& path, uint64_t limit)
+{
+  TestResult result;
+  result.name = path.filename().string();
+  const auto start = std::chrono::steady_clock::now();
+  try
+  {
+    uint64_t tohost;
+    if(!FindELFSymbol(path.string(), "tohost", tohost))
+    {
+      throw std::runtime_error("No tohost symbol");
+    }
+    // Guest time follows the instruction count, so runs are reproducible
+    auto machine = MachineBuilder().Elf(path.string()).Tohost(tohost).InstructionCount(true).Build();
+    const RunResult run = machine->RunFor(limit);
+    result.instructions = run.executed;
+    if(run.reason != StopReason::Exit)
+    {
+      result.outcome = Outcome::Timeout;
+    }
+    else
+    {
+      result.outcome = machine->GetExitCode() == 0 ? Outcome::Pass : Outcome::Fail;
+      result.failed_case = machine->GetExitCode();
+    }
+  }
+  catch(const std::exception& e)
+  {
+    result.outcome = Outcome::Error;
+    result.error = e.what();
+  }
+  result.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  return result;
+}
+
+static void PrintResult(const TestResult& result)
+{
+  std::cout << std::left << std::setw(28) << result.name;
+  switch(result.outcome)
+  {
+    case Outcome::Pass:
+      std::cout << std::setw(22) << "PASS";
+      break;
+    case Outcome::Fail:
+      std::cout << std::setw(22) << ("FAIL (case " + std::to_string(result.failed_case) + ")");
+      break;
+    case Outcome::Timeout:
+      std::cout << std::setw(22) << "TIMEOUT";
+      break;
+    case Outcome::Error:
+      std::cout << std::setw(22) << "ERROR";
+      break;
+  }
+  std::cout << std::right << std::setw(12) << result.instructions << " insns" << std::fixed << std::setprecision(2)
+            << std::setw(10) << result.milliseconds << " ms";
+  if(result.outcome == Outcome::Error)
+  {
+    std::cout << "  " << result.error;
+  }
+  std::cout << '\n';
+}
+
+static bool ParseOptions(int argc, char** argv, RunnerOptions& options)
+{
+  if(argc < 2)
+  {
+    return false;
+  }
+  options.dir = argv[1];
+  for(int i = 2; i < argc; i++)
+  {
+    const std::string arg = argv[i];
+    if(arg == "-v")
+    {
+      options.virtual_memory = true;
+    }
+    else if(arg == "-j" && i + 1 < argc)
+    {
+      options.threads = std::max(1, std::stoi(argv[++i]));
+    }
+    else if(arg == "-limit" && i + 1 < argc)
+    {
+      options.limit = std::stoull(argv[++i]);
+    }
+    else if(arg == "-filter" && i + 1 < argc)
+    {
+      options.filter = argv[++i];
+    }
+    else
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char** argv)
+{
+  RunnerOptions options;
+  if(!ParseOptions(argc, argv, options))
+  {
+    std::cout << "Usage: " << argv[0] << " <riscv-tests/isa> [-j threads] [-v] [-limit instructions] [-filter text]" << '\n';
+    return -1;
+  }
+
+  std::vector<std::filesystem::path> tests;
+  try
+  {
+    tests = Discover(options);
+  }
+  catch(const std::exception& e)
+  {
+    std::cerr << e.what() << std::endl;
+    return -1;
+  }
+  if(tests.empty())
+  {
+    std::cerr << "No riscv-tests found in " << options.dir << std::endl;
+    return -1;
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<TestResult> results(tests.size());
+  std::atomic<size_t> next = 0;
+  std::vector<std::thread> workers;
+  for(unsigned i = 0; i < std::min<size_t>(options.threads, tests.size()); i++)
+  {
+    workers.emplace_back([&]
+    {
+      for(size_t test = next++; test < tests.size(); test = next++)
+      {
+        results[test] = RunTest(tests[test], options.limit);
+      }
+    });
+  }
+  for(auto& worker : workers)
+  {
+    worker.join();
+  }
+  const double wall = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+  size_t passed = 0;
+  uint64_t instructions = 0;
+  for(const TestResult& result : results)
+  {
+    PrintResult(result);
+    passed += result.outcome == Outcome::Pass;
+    instructions += result.instructions;
+  }
+  std::cout << passed << "/" << results.size() << " passed, " << instructions << " instructions in "
+            << std::fixed << std::setprecision(2) << wall << " ms on " << workers.size() << " threads" << '\n';
+  return passed == results.size() ? 0 : 1;
+}